@@ -0,0 +1,98 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdalign.h>
+
+#define LOG_MODULE "fcft/arena"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+struct arena_block {
+    struct arena_block *prev;
+    size_t size;
+    alignas(max_align_t) unsigned char data[];
+};
+
+static const size_t arena_min_block_size = 4096;
+
+void *
+arena_alloc(struct arena *arena, size_t count, size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size)
+        return NULL;
+
+    const size_t align = alignof(max_align_t);
+    const size_t bytes = (count * size + align - 1) & ~(align - 1);
+
+    if (bytes < count * size)
+        return NULL;
+
+    struct arena_block *block = arena->block;
+
+    if (block == NULL || bytes > block->size - arena->used) {
+        size_t block_size = block != NULL
+            ? 2 * block->size : arena_min_block_size;
+
+        while (block_size < bytes)
+            block_size *= 2;
+
+        struct arena_block *new_block = malloc(sizeof(*new_block) + block_size);
+        if (new_block == NULL)
+            return NULL;
+
+        LOG_DBG("new %zu byte block", block_size);
+
+        new_block->prev = block;
+        new_block->size = block_size;
+
+        arena->block = block = new_block;
+        arena->used = 0;
+    }
+
+    void *ptr = &block->data[arena->used];
+    arena->used += bytes;
+    return ptr;
+}
+
+static void
+free_blocks(struct arena_block *block)
+{
+    while (block != NULL) {
+        struct arena_block *prev = block->prev;
+        free(block);
+        block = prev;
+    }
+}
+
+void
+arena_reset(struct arena *arena)
+{
+    if (arena->block != NULL) {
+        free_blocks(arena->block->prev);
+        arena->block->prev = NULL;
+    }
+
+    arena->used = 0;
+}
+
+void
+arena_destroy(struct arena *arena)
+{
+    free_blocks(arena->block);
+    arena->block = NULL;
+    arena->used = 0;
+}
+
+size_t
+arena_size(const struct arena *arena)
+{
+    size_t size = 0;
+    for (const struct arena_block *block = arena->block;
+         block != NULL;
+         block = block->prev)
+    {
+        size += block->size;
+    }
+    return size;
+}
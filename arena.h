@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Bump allocator, for short-lived scratch memory. Allocations cannot
+ * be free:d individually; all of them are released at once, with
+ * arena_reset() or arena_destroy().
+ *
+ * Memory is allocated in blocks, each one (at least) twice as large
+ * as the previous one. arena_reset() keeps the largest block, so an
+ * arena that is reset and re-used settles at a single block.
+ *
+ * Zero-initialize with {0}.
+ */
+struct arena_block;
+
+struct arena {
+    struct arena_block *block;  /* Current, and largest, block */
+    size_t used;                /* Bytes used in the current block */
+};
+
+/* Room for ‘count’ elements of ‘size’ bytes, suitably aligned for any
+ * type. Not zeroed. Returns NULL on failure */
+void *arena_alloc(struct arena *arena, size_t count, size_t size);
+
+/* Releases all allocations, but keeps the current block */
+void arena_reset(struct arena *arena);
+
+void arena_destroy(struct arena *arena);
+
+/* Total size of the arena’s blocks, in bytes */
+size_t arena_size(const struct arena *arena);
@@ -0,0 +1,287 @@
+#include "disk-cache.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOG_MODULE "fcft/disk-cache"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+struct disk_cache_writer {
+    FILE *file;
+    char *path;
+    char *tmp_path;
+    size_t offset;
+    bool failed;
+};
+
+/*
+ * Returns the (malloc:ed) path of the cache directory, optionally
+ * creating it. Returns NULL if there is no cache directory.
+ */
+static char *
+cache_dir(bool create)
+{
+    const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    char *base = NULL;
+    if (xdg_cache_home != NULL && xdg_cache_home[0] == '/')
+        base = strdup(xdg_cache_home);
+    else if (home != NULL && home[0] == '/') {
+        size_t len = strlen(home) + strlen("/.cache") + 1;
+        if ((base = malloc(len)) != NULL)
+            snprintf(base, len, "%s/.cache", home);
+    }
+
+    if (base == NULL)
+        return NULL;
+
+    size_t len = strlen(base) + strlen("/fcft") + 1;
+    char *dir = malloc(len);
+    if (dir == NULL) {
+        free(base);
+        return NULL;
+    }
+
+    snprintf(dir, len, "%s/fcft", base);
+
+    if (create) {
+        if ((mkdir(base, 0700) < 0 && errno != EEXIST) ||
+            (mkdir(dir, 0700) < 0 && errno != EEXIST))
+        {
+            LOG_ERRNO("%s: failed to create cache directory", dir);
+            free(base);
+            free(dir);
+            return NULL;
+        }
+    }
+
+    free(base);
+    return dir;
+}
+
+static char *
+cache_path(const char *name, bool create_dir)
+{
+    char *dir = cache_dir(create_dir);
+    if (dir == NULL)
+        return NULL;
+
+    size_t len = strlen(dir) + 1 + strlen(name) + 1;
+    char *path = malloc(len);
+    if (path != NULL)
+        snprintf(path, len, "%s/%s", dir, name);
+
+    free(dir);
+    return path;
+}
+
+struct disk_cache_map *
+disk_cache_open(const char *name)
+{
+    char *path = cache_path(name, false);
+    if (path == NULL)
+        return NULL;
+
+    struct disk_cache_map *map = NULL;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            LOG_ERRNO("%s: failed to open", path);
+        goto out;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        LOG_ERRNO("%s: failed to stat", path);
+        goto out;
+    }
+
+    if (st.st_size == 0)
+        goto out;
+
+    /* Writable, so that bitmaps in it can be handed out as-is */
+    void *data = mmap(
+        NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    if (data == MAP_FAILED) {
+        LOG_ERRNO("%s: failed to mmap", path);
+        goto out;
+    }
+
+    if ((map = malloc(sizeof(*map))) == NULL) {
+        munmap(data, st.st_size);
+        goto out;
+    }
+
+    map->data = data;
+    map->size = st.st_size;
+    atomic_init(&map->ref_counter, 1);
+
+    LOG_DBG("%s: mapped %zu bytes", path, map->size);
+
+out:
+    if (fd >= 0)
+        close(fd);
+    free(path);
+    return map;
+}
+
+void
+disk_cache_map_ref(struct disk_cache_map *map)
+{
+    atomic_fetch_add_explicit(&map->ref_counter, 1, memory_order_relaxed);
+}
+
+void
+disk_cache_map_unref(struct disk_cache_map *map)
+{
+    if (map == NULL)
+        return;
+
+    if (atomic_fetch_sub_explicit(&map->ref_counter, 1, memory_order_acq_rel) == 1) {
+        munmap(map->data, map->size);
+        free(map);
+    }
+}
+
+struct disk_cache_writer *
+disk_cache_writer_create(const char *name)
+{
+    char *path = cache_path(name, true);
+    if (path == NULL)
+        return NULL;
+
+    size_t len = strlen(path) + strlen(".XXXXXX") + 1;
+    char *tmp_path = malloc(len);
+    if (tmp_path == NULL) {
+        free(path);
+        return NULL;
+    }
+
+    snprintf(tmp_path, len, "%s.XXXXXX", path);
+
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERRNO("%s: failed to create temporary file", path);
+        free(tmp_path);
+        free(path);
+        return NULL;
+    }
+
+    FILE *file = fdopen(fd, "wb");
+    struct disk_cache_writer *writer = malloc(sizeof(*writer));
+
+    if (file == NULL || writer == NULL) {
+        if (file != NULL)
+            fclose(file);
+        else
+            close(fd);
+
+        unlink(tmp_path);
+        free(writer);
+        free(tmp_path);
+        free(path);
+        return NULL;
+    }
+
+    *writer = (struct disk_cache_writer){
+        .file = file,
+        .path = path,
+        .tmp_path = tmp_path,
+    };
+    return writer;
+}
+
+void
+disk_cache_write(struct disk_cache_writer *writer, const void *data, size_t size)
+{
+    if (writer->failed || size == 0)
+        return;
+
+    if (fwrite(data, 1, size, writer->file) != size)
+        writer->failed = true;
+    else
+        writer->offset += size;
+}
+
+void
+disk_cache_write_align(struct disk_cache_writer *writer, size_t alignment)
+{
+    static const char zeroes[64] = {0};
+
+    while (writer->offset % alignment != 0) {
+        size_t count = alignment - writer->offset % alignment;
+        disk_cache_write(
+            writer, zeroes, count < sizeof(zeroes) ? count : sizeof(zeroes));
+
+        if (writer->failed)
+            break;
+    }
+}
+
+size_t
+disk_cache_writer_offset(const struct disk_cache_writer *writer)
+{
+    return writer->offset;
+}
+
+static void
+writer_free(struct disk_cache_writer *writer)
+{
+    free(writer->tmp_path);
+    free(writer->path);
+    free(writer);
+}
+
+bool
+disk_cache_writer_commit(struct disk_cache_writer *writer)
+{
+    bool ok = !writer->failed;
+
+    if (fclose(writer->file) != 0)
+        ok = false;
+
+    if (ok && rename(writer->tmp_path, writer->path) < 0) {
+        LOG_ERRNO("%s: failed to rename temporary file", writer->path);
+        ok = false;
+    }
+
+    if (!ok) {
+        LOG_WARN("%s: failed to write cache file", writer->path);
+        unlink(writer->tmp_path);
+    } else
+        LOG_DBG("%s: wrote %zu bytes", writer->path, writer->offset);
+
+    writer_free(writer);
+    return ok;
+}
+
+void
+disk_cache_writer_abort(struct disk_cache_writer *writer)
+{
+    fclose(writer->file);
+    unlink(writer->tmp_path);
+    writer_free(writer);
+}
+
+uint64_t
+disk_cache_hash(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
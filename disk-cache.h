@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/*
+ * Persistent caches, stored in $XDG_CACHE_HOME/fcft (or
+ * ~/.cache/fcft, if XDG_CACHE_HOME is not set).
+ *
+ * Files are written to a temporary file, which is then renamed into
+ * place. Thus, readers never see partially written files, and files
+ * already mapped by other processes are not affected when a cache
+ * file is replaced.
+ *
+ * The files are native-endian, and are not meant to be shared
+ * between machines. Callers must validate all data read from them.
+ */
+
+/* A (private, copy-on-write) mapping of a cache file */
+struct disk_cache_map {
+    void *data;
+    size_t size;
+    _Atomic size_t ref_counter;
+};
+
+/* Returns NULL if ‘name’ does not exist, or could not be mapped */
+struct disk_cache_map *disk_cache_open(const char *name);
+
+void disk_cache_map_ref(struct disk_cache_map *map);
+void disk_cache_map_unref(struct disk_cache_map *map);
+
+struct disk_cache_writer;
+
+/* Opens a new, temporary, file that replaces ‘name’ when committed */
+struct disk_cache_writer *disk_cache_writer_create(const char *name);
+
+/* Errors are sticky, and reported by disk_cache_writer_commit() */
+void disk_cache_write(
+    struct disk_cache_writer *writer, const void *data, size_t size);
+
+/* Pads the file with zeroes, up to a multiple of ‘alignment’ */
+void disk_cache_write_align(struct disk_cache_writer *writer, size_t alignment);
+
+/* Current file offset, i.e. number of bytes written */
+size_t disk_cache_writer_offset(const struct disk_cache_writer *writer);
+
+/* Both free ‘writer’. Commit fails if any write failed */
+bool disk_cache_writer_commit(struct disk_cache_writer *writer);
+void disk_cache_writer_abort(struct disk_cache_writer *writer);
+
+/* FNV-1a. Use DISK_CACHE_HASH_INIT as the initial ‘hash’ */
+#define DISK_CACHE_HASH_INIT 0xcbf29ce484222325ull
+uint64_t disk_cache_hash(uint64_t hash, const void *data, size_t size);
@@ -144,18 +144,13 @@ render_chars(const char32_t *text, size_t text_len,
     long kern[text_len];
     int text_width = 0;
 
+    fcft_rasterize_chars_utf32(font, text_len, text, subpixel_mode, glyphs);
+    fcft_kerning_run(font, text_len, text, kern);
+
     for (size_t i = 0; i < text_len; i++) {
-        glyphs[i] = fcft_rasterize_char_utf32(font, text[i], subpixel_mode);
         if (glyphs[i] == NULL)
             continue;
 
-        kern[i] = 0;
-        if (i > 0) {
-            long x_kern;
-            if (fcft_kerning(font, text[i - 1], text[i], &x_kern, NULL))
-                kern[i] = x_kern;
-        }
-
         text_width += kern[i] + glyphs[i]->advance.x;
     }
 
@@ -3,14 +3,16 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <math.h>
 #include <assert.h>
 #include <threads.h>
+#include <stdatomic.h>
 #include <locale.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
 
-#include <wchar.h>  /* TODO: remove */
-
-#include <pthread.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -34,8 +36,12 @@
 #define LOG_ENABLE_DBG 0
 #include "log.h"
 #include "fcft/stride.h"
+#include "thread-pool.h"
+#include "disk-cache.h"
+#include "utf8.h"
+#include "arena.h"
 
-#include "emoji-data.h"
+#include "unicode-props.h"
 #include "unicode-compose-table.h"
 #include "version.h"
 
@@ -54,29 +60,107 @@ static FT_Library ft_lib = NULL;
 static mtx_t ft_lock;
 static bool can_set_lcd_filter = false;
 static enum fcft_scaling_filter scaling_filter = FCFT_SCALING_FILTER_CUBIC;
+static bool disk_cache_enabled = false;
 
-static const size_t glyph_cache_initial_size = 256;
-#if defined(FCFT_HAVE_HARFBUZZ)
-static const size_t grapheme_cache_initial_size = 256;
-#endif
+/* Lazily created; see get_thread_pool() */
+static struct thread_pool *thread_pool = NULL;
+static size_t thread_pool_size = SIZE_MAX;  /* SIZE_MAX: one per CPU */
+static mtx_t thread_pool_lock;
 
-#if defined(_DEBUG)
-static size_t glyph_cache_lookups = 0;
-static size_t glyph_cache_collisions = 0;
+/* In-flight fcft_from_name_async() loads; waited for by fcft_fini() */
+static size_t font_requests_running = 0;
+static mtx_t font_requests_lock;
+static cnd_t font_requests_cond;
 
+static const size_t glyph_cache_initial_size = 256;
+#define GLYPH_DIRECT_CACHE_SIZE 256  /* See font_priv::glyph_direct */
+static const size_t slab_size = 64 * 1024;
+static const size_t disk_cache_max_bitmap_bytes = 16 * 1024 * 1024;
 #if defined(FCFT_HAVE_HARFBUZZ)
-static size_t grapheme_cache_lookups = 0;
-static size_t grapheme_cache_collisions = 0;
+static const size_t grapheme_cache_initial_size = 256;
 #endif
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+static const size_t shaped_word_cache_initial_size = 256;
+static const size_t shaped_word_cache_max_count = 4096;
+static const size_t parallel_shaping_min_length = 1024;  /* Characters */
 #endif
 
 void fcft_log_init(enum fcft_log_colorize _colorize, bool _do_syslog,
                    enum fcft_log_class _log_level);
 
+/*
+ * Glyph records, and glyph bitmaps, are carved out of large slabs,
+ * rather than being malloc:ed one by one. Each font has one current
+ * slab per kind, with bitmaps of the same pixel format packed
+ * together.
+ *
+ * Slabs are reference counted; each record, or bitmap, allocated from
+ * a slab holds a reference, as does the font, for its current
+ * slabs. Thus, a slab outlives the font if e.g. a text-run still
+ * references its glyphs.
+ *
+ * Memory is never re-used within a slab; it is free:d when the last
+ * reference is dropped. Fonts with a cache budget therefore do not
+ * share slabs between entries. See slab_alloc().
+ */
+struct slab {
+    _Atomic size_t ref_counter;
+    size_t size;
+    size_t used;
+    _Alignas(16) uint8_t data[];
+};
+
+enum slab_kind {
+    SLAB_GLYPHS,        /* struct glyph_priv */
+    SLAB_A1,
+    SLAB_A8,
+    SLAB_X8R8G8B8,      /* Subpixel antialiased glyphs */
+    SLAB_A8R8G8B8,      /* Color glyphs */
+    SLAB_KIND_COUNT,
+};
+
 struct glyph_priv {
     struct fcft_glyph public;
     enum fcft_subpixel subpixel;
     bool valid;
+
+    struct slab *slab;  /* The slab this record was allocated from */
+
+    /* Set on cache hits, cleared by the eviction “clock”. See cache_evict() */
+    _Atomic bool referenced;
+
+    /*
+     * Glyph index cache entry whose bitmap (public.pix) this glyph
+     * uses, or NULL if the glyph owns its bitmap (i.e. it *is* a
+     * glyph index cache entry). See font_priv::glyph_index_cache.
+     */
+    struct glyph_priv *bitmap;
+
+    /* Glyph index cache entries only */
+    const struct instance *inst;
+    uint32_t index;
+    _Atomic size_t ref_counter;  /* The cache, plus one per user */
+    bool loaded;  /* From the disk cache; see glyph_disk_cache_load() */
+};
+
+/*
+ * A text-run. The run owns its glyph records; the first ‘records’
+ * entries in public.glyphs. Only the first public.count of them are
+ * in use (i.e. reference a bitmap). When a run is re-used (see
+ * fcft_rasterize_text_run_utf32_into()), its records, and arrays,
+ * are recycled instead of being free:d and allocated again.
+ *
+ * Glyph records are allocated from font slabs, but are not tied to
+ * the font; a run may be re-used with any font.
+ */
+struct text_run_priv {
+    struct fcft_text_run public;  /* Must be first */
+    size_t size;     /* Allocated length of public.glyphs and public.cluster */
+    size_t records;
+
+    /* Codepoints, and byte offsets; see fcft_rasterize_text_run_utf8_into() */
+    uint32_t *utf8_scratch;
+    size_t utf8_scratch_size;
 };
 
 struct grapheme_priv {
@@ -87,14 +171,34 @@ struct grapheme_priv {
 
     enum fcft_subpixel subpixel;
     bool valid;
+
+    _Atomic bool referenced;  /* See glyph_priv */
 };
 
 struct instance {
     char *name;
     char *path;
-    FT_Face face;
+    FT_Face face;  /* Must only be used while font->lock is held */
     int load_flags;
 
+    /*
+     * Additional FreeType faces, used to rasterize glyphs without
+     * holding font->lock (FreeType faces are not thread safe). Each
+     * face is used by one thread at a time. See instance_face_get().
+     */
+    struct {
+        mtx_t lock;
+        FT_Face *idle;
+        size_t count;
+        size_t size;
+
+        /* What we need to re-create ‘face’ */
+        int index;
+        FT_UInt pixel_size;
+        bool has_matrix;
+        FT_Matrix matrix;
+    } faces;
+
 #if defined(FCFT_HAVE_HARFBUZZ)
     hb_font_t *hb_font;
     hb_buffer_t *hb_buf;
@@ -114,56 +218,401 @@ struct instance {
     bool pixel_fixup_estimated;
     bool bgr;  /* True for FC_RGBA_BGR and FC_RGBA_VBGR */
 
+    /* See glyph_disk_cache_open(). Immutable */
+    struct {
+        char *name;  /* Cache file name, or NULL if disabled */
+        char *key;
+        struct disk_cache_map *map;
+        const struct disk_glyph *glyphs;  /* Sorted on index, subpixel */
+        size_t count;
+    } disk;
+
     struct fcft_font metrics;
 };
 
 struct fallback {
     FcPattern *pattern;
+    bool prepared;      /* False if ‘pattern’ is fontconfig’s, see fallback_instantiate() */
     FcCharSet *charset;
     FcLangSet *langset;
+    bool has_lang_emoji;
     struct instance *font;
+    bool failed;        /* Failed to instantiate; never used */
 
     /* User-requested size(s) - i.e. sizes from *base* pattern */
     double req_pt_size;
     double req_px_size;
 };
 
+/*
+ * Glyph and grapheme cache tables.
+ *
+ * Lookups are lock-free: readers load the current table, and its
+ * entries, with acquire semantics. Writers (holding font->lock)
+ * fully initialize an entry before publishing it with a release
+ * store, and never modify it afterwards.
+ *
+ * When a cache is resized, the new table is published atomically,
+ * and the old one is moved to a “retired” list, since there may
+ * still be readers probing it. See struct retired_entry. Since each
+ * new table is (at most) twice the size of the previous one, the
+ * retired tables never use much more memory than the current one.
+ *
+ * Evicted entries (see cache_evict()) are replaced with a tombstone,
+ * and the entry itself is retired the same way.
+ */
+struct glyph_cache_table {
+    size_t size;
+    _Atomic(struct glyph_priv *) entries[];
+};
+
+struct grapheme_cache_table {
+    size_t size;
+    _Atomic(struct grapheme_priv *) entries[];
+};
+
+#define GLYPH_TOMBSTONE ((struct glyph_priv *)(uintptr_t)-1)
+#define GRAPHEME_TOMBSTONE ((struct grapheme_priv *)(uintptr_t)-1)
+
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+/* Not lock-free; only accessed while font->lock is held */
+struct shaped_word_cache_table {
+    size_t size;
+    struct shaped_word *entries[];
+};
+
+#define SHAPED_WORD_TOMBSTONE ((struct shaped_word *)(uintptr_t)-1)
+#endif
+
+/*
+ * Kerning of pairs of printable ASCII characters. Each entry is a
+ * packed kerning value (see kerning_pack()), or 0 if not yet looked
+ * up. Read without locking.
+ */
+#define KERNING_ASCII_FIRST 0x20
+#define KERNING_ASCII_COUNT 0x60
+
+struct kerning_ascii_table {
+    _Atomic uint64_t pairs[KERNING_ASCII_COUNT][KERNING_ASCII_COUNT];
+};
+
+/* Not lock-free; only accessed while font->lock is held */
+struct kerning_pair {
+    uint32_t left;   /* KERNING_EMPTY if unused */
+    uint32_t right;
+    int32_t x;
+    int32_t y;
+    bool valid;      /* False if the font has no kerning for the pair */
+};
+
+struct kerning_cache_table {
+    size_t size;
+    size_t count;
+    struct kerning_pair entries[];
+};
+
+#define KERNING_EMPTY UINT32_MAX
+#define KERNING_CACHE_MAX_SIZE 16384
+
+/*
+ * Memory that may still be referenced by lock-free readers (old cache
+ * tables, and evicted glyphs and graphemes).
+ *
+ * ‘epoch’ is the font’s cache epoch in which the memory was
+ * unlinked. Without a cache budget, retired memory is free:d when the
+ * font is destroyed. With a budget, it is free:d as soon as all
+ * threads have announced they are past ‘epoch’. See cache_reclaim().
+ */
+struct retired_entry {
+    void *ptr;
+    void (*destroy)(void *ptr);
+    uint64_t epoch;
+};
+
+/*
+ * Cache lookup statistics. See fcft_font_stats().
+ *
+ * Each thread counts in its own struct reader, to avoid contention on
+ * the hot path. The counters are atomic only because
+ * fcft_font_stats() may read them concurrently; there is only ever
+ * one writer. See counter_inc().
+ */
+struct cache_counters {
+    _Atomic size_t hits;
+    _Atomic size_t misses;
+    _Atomic size_t probe_lengths[8];
+};
+
 struct font_priv {
     /* Must be first */
     struct fcft_font public;
 
     mtx_t lock;
-    pthread_rwlock_t glyph_cache_lock;
     struct {
-        struct glyph_priv **table;
-        size_t size;
+        _Atomic(struct glyph_cache_table *) table;
         size_t count;
+        size_t tombstones;
+        size_t hand;  /* Eviction clock hand */
     } glyph_cache;
 
 #if defined(FCFT_HAVE_HARFBUZZ)
-    pthread_rwlock_t grapheme_cache_lock;
     struct {
-        struct grapheme_priv **table;
-        size_t size;
+        _Atomic(struct grapheme_cache_table *) table;
         size_t count;
+        size_t tombstones;
+        size_t hand;  /* Eviction clock hand */
     } grapheme_cache;
 #endif
 
-    tll(struct fallback) fallbacks;
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+    /* See struct shaped_word. Only accessed while font->lock is held */
+    struct {
+        struct shaped_word_cache_table *table;  /* Lazily created */
+        size_t count;
+        size_t tombstones;
+        size_t hand;  /* Eviction clock hand */
+    } shaped_word_cache;
+
+    /*
+     * Scratch memory for shaping text-runs (see text_run_shape()). Only
+     * accessed while font->lock is held. Reset, but not free:d, after
+     * each text-run, so that re-rasterizing cached text does not
+     * allocate.
+     */
+    struct arena text_run_arena;
+#endif
+
+    /*
+     * Directly indexed (by subpixel mode and codepoint) view of the
+     * glyph cache, for codepoints below GLYPH_DIRECT_CACHE_SIZE
+     * (i.e. ASCII and Latin-1). Lookups are a single load, without
+     * any hashing or probing.
+     *
+     * The glyphs are owned by glyph_cache; entries are added when
+     * inserted in glyph_cache, and cleared when evicted from it.
+     */
+    _Atomic(struct glyph_priv *) glyph_direct
+        [FCFT_SUBPIXEL_VERTICAL_BGR + 1][GLYPH_DIRECT_CACHE_SIZE];
+
+    /*
+     * Rasterized glyphs, keyed on font instance, glyph index and
+     * subpixel mode. The glyph and grapheme caches, and text-runs,
+     * all reference the bitmaps cached here, rather than rasterizing
+     * their own copies. Thus, a glyph is only rasterized once, even if
+     * it is used by e.g. both a grapheme and a text-run.
+     *
+     * Only accessed while font->lock is held; the entries are
+     * reference counted (see glyph_unref()), and evicted entries are
+     * free:d immediately.
+     */
+    struct {
+        struct glyph_cache_table *table;
+        size_t count;
+        size_t tombstones;
+        size_t hand;  /* Eviction clock hand */
+    } glyph_index_cache;
+
+    /* Current slabs. See slab_alloc() */
+    mtx_t slab_lock;
+    struct slab *slabs[SLAB_KIND_COUNT];
+
+    /*
+     * Glyphs currently being rasterized, without holding font->lock
+     * (hash_value_for_cp() keys). Other threads asking for the same
+     * glyph wait for ‘done’ to be signalled, instead of rasterizing it
+     * a second time. Threads asking for other glyphs are not blocked.
+     */
+    struct {
+        tll(uint32_t) keys;
+        cnd_t done;
+    } glyph_reservations;
+
+    /* Statistics not kept per thread. See fcft_font_stats() */
+    struct {
+        struct cache_counters glyph_cache;     /* From exited threads */
+        struct cache_counters grapheme_cache;  /* From exited threads */
+        _Atomic size_t glyphs_rasterized;
+
+        /* Protected by font->lock */
+        size_t glyphs_loaded;
+        struct cache_counters glyph_index_cache;
+        struct cache_counters shaped_word_cache;
+        size_t glyph_evictions;
+        size_t grapheme_evictions;
+        size_t glyph_index_evictions;
+        size_t shaped_word_evictions;
+        size_t bitmap_bytes[SLAB_KIND_COUNT];  /* Cached bitmaps */
+        size_t fallbacks_instantiated;
+    } stats;
+
+    struct {
+        _Atomic size_t budget;  /* Max bytes, 0 means unlimited */
+        size_t bytes;           /* Bytes used by cached glyphs and graphemes */
+        _Atomic uint64_t epoch;
+        tll(struct retired_entry) retired;
+    } cache;
+
+    /*
+     * Kerning pairs, from the primary font. See fcft_kerning(). The
+     * ASCII matrix is published atomically, and read without locking;
+     * the hash table (all other pairs) is only accessed while
+     * font->lock is held. Both are lazily created.
+     */
+    struct {
+        bool supported;  /* FT_HAS_KERNING(), for the primary font */
+        _Atomic(struct kerning_ascii_table *) ascii;
+        struct kerning_cache_table *table;
+    } kerning;
+
+    /*
+     * The primary font, followed by the fallback fonts. Fallbacks are
+     * never removed, thus indices are stable
+     */
+    struct {
+        struct fallback *arr;
+        size_t count;
+        size_t size;
+    } fallbacks;
+
+    /*
+     * Codepoint coverage index; a two-level page table, mapping
+     * codepoints to the index of the first fallback that has
+     * them. See coverage_lookup()
+     */
+    struct coverage_page **coverage;
+
+    /*
+     * The primary font’s font set, from FcFontSort(). Fallbacks are
+     * added from it, in order, when no fallback in ‘fallbacks’ has a
+     * codepoint. See fallbacks_extend()
+     */
+    struct {
+        FcPattern *base_pattern;
+        FcFontSet *set;
+        size_t next;
+    } fc_fallbacks;
+
     enum fcft_emoji_presentation emoji_presentation;
     size_t ref_counter;
+
+    /* Unique, never re-used, font ID. See glyph_tls_cache */
+    uint64_t id;
+
+    struct font_cache_entry *cache_entry;
+};
+
+/*
+ * Per-thread, direct mapped, front-end to the fonts’ glyph caches.
+ *
+ * Hits touch no shared memory at all (except the font’s ID, which is
+ * constant). Entries are keyed on the font ID rather than the font
+ * pointer, since a destroyed font’s memory may be re-used by a new
+ * font. Thus, entries belonging to destroyed fonts can never match,
+ * and no explicit invalidation is necessary.
+ */
+struct glyph_tls_entry {
+    uint64_t font_id;
+    uint32_t key;    /* hash_value_for_cp() */
+    uint64_t epoch;  /* font->cache.epoch; evictions invalidate the entry */
+    struct glyph_priv *glyph;
+};
+
+static thread_local struct glyph_tls_entry glyph_tls_cache[256];
+static _Atomic uint64_t next_font_id = 1;  /* 0 marks unused TLS entries */
+
+/*
+ * Cache readers, used to determine when evicted glyphs and graphemes
+ * can be free:d (quiescent state based reclamation), and to collect
+ * per-thread cache statistics.
+ *
+ * Each thread that rasterizes from a font registers a reader for that
+ * font. With a cache budget, every glyph and grapheme rasterization
+ * call then announces the font epoch the thread has seen. Since the
+ * thread no longer references anything it got from earlier calls,
+ * memory retired in, or before, that epoch can be free:d once *all*
+ * the font’s readers have moved past it.
+ *
+ * Readers are removed when their thread exits (with their statistics
+ * folded into the font), or when the font is destroyed.
+ */
+struct reader {
+    const void *owner;  /* Owning thread’s reader_tls */
+    struct font_priv *font;
+    uint64_t font_id;
+    _Atomic uint64_t epoch;
+
+    struct cache_counters glyph_cache;
+    struct cache_counters grapheme_cache;
+};
+
+struct reader_tls_entry {
+    uint64_t font_id;
+    struct reader *reader;
+};
+
+static thread_local struct reader_tls_entry reader_tls[64];
+static tll(struct reader *) readers = tll_init();
+static mtx_t readers_lock;
+static tss_t readers_tss;  /* Removes the thread’s readers on exit */
+
+/*
+ * Coverage index entries, per codepoint. One for each kind of font
+ * search: any font, and fonts suitable for text and emoji
+ * presentation.
+ */
+enum coverage_kind {
+    COVERAGE_ANY,
+    COVERAGE_TEXT,
+    COVERAGE_EMOJI,
+    COVERAGE_KIND_COUNT,
+};
+
+#define COVERAGE_UNKNOWN 0        /* Not yet looked up */
+#define COVERAGE_MISSING 0xffff   /* No fallback has the codepoint */
+
+struct coverage_page {
+    /* Fallback index + 1, COVERAGE_UNKNOWN or COVERAGE_MISSING */
+    uint16_t entries[256][COVERAGE_KIND_COUNT];
 };
 
-/* Global font cache */
-struct fcft_font_cache_entry {
+/*
+ * Global font cache, keyed on the names and attributes passed to
+ * fcft_from_name(). Each bucket has its own lock, which also protects
+ * the waiters and condition variables of its entries.
+ */
+struct font_cache_entry {
+    struct font_cache_entry *next;
     uint64_t hash;
+    char *key;          /* See font_cache_key() */
+    size_t key_len;
+
+    /* NULL if instantiation failed, -1 while being instantiated */
     struct font_priv *font;
 
     int waiters;
     cnd_t cond;
 };
-static tll(struct fcft_font_cache_entry) font_cache = tll_init();
-static mtx_t font_cache_lock;
+
+static struct font_cache_bucket {
+    mtx_t lock;
+    struct font_cache_entry *entries;
+} font_cache[256];
+static _Atomic size_t font_cache_count;
+
+static struct font_cache_bucket *
+font_cache_bucket_for(uint64_t hash)
+{
+    return &font_cache[hash % ALEN(font_cache)];
+}
+
+static void
+font_cache_entry_destroy(struct font_cache_entry *e)
+{
+    cnd_destroy(&e->cond);
+    free(e->key);
+    free(e);
+    atomic_fetch_sub(&font_cache_count, 1);
+}
 
 FCFT_EXPORT enum fcft_capabilities
 fcft_capabilities(void)
@@ -195,6 +644,56 @@ ft_error_string(FT_Error err)
     return "unknown error";
 }
 
+static void
+counter_inc(_Atomic size_t *counter)
+{
+    /* Single writer; avoid the cost of an atomic read-modify-write */
+    atomic_store_explicit(
+        counter,
+        atomic_load_explicit(counter, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+}
+
+static void
+cache_counters_add(struct cache_counters *dst, struct cache_counters *src)
+{
+    atomic_fetch_add_explicit(
+        &dst->hits,
+        atomic_load_explicit(&src->hits, memory_order_relaxed),
+        memory_order_relaxed);
+    atomic_fetch_add_explicit(
+        &dst->misses,
+        atomic_load_explicit(&src->misses, memory_order_relaxed),
+        memory_order_relaxed);
+
+    for (size_t i = 0; i < ALEN(dst->probe_lengths); i++) {
+        atomic_fetch_add_explicit(
+            &dst->probe_lengths[i],
+            atomic_load_explicit(&src->probe_lengths[i], memory_order_relaxed),
+            memory_order_relaxed);
+    }
+}
+
+static void
+readers_thread_exit(void *owner)
+{
+    mtx_lock(&readers_lock);
+    tll_foreach(readers, it) {
+        struct reader *reader = it->item;
+
+        if (reader->owner != owner)
+            continue;
+
+        /* Font is still alive, since fcft_destroy() removes its readers */
+        cache_counters_add(&reader->font->stats.glyph_cache, &reader->glyph_cache);
+        cache_counters_add(&reader->font->stats.grapheme_cache, &reader->grapheme_cache);
+
+        free(reader);
+        tll_remove(readers, it);
+    }
+    mtx_unlock(&readers_lock);
+}
+
 FCFT_EXPORT bool
 fcft_init(enum fcft_log_colorize colorize, bool do_syslog,
           enum fcft_log_class log_level)
@@ -262,36 +761,70 @@ fcft_init(enum fcft_log_colorize colorize, bool do_syslog,
     hb_language_get_default();
 #endif
 
+    if (tss_create(&readers_tss, &readers_thread_exit) != thrd_success) {
+        LOG_ERR("failed to create thread-specific storage");
+        FT_Done_FreeType(ft_lib);
+        return false;
+    }
+
     mtx_init(&ft_lock, mtx_plain);
-    mtx_init(&font_cache_lock, mtx_plain);
+    for (size_t i = 0; i < ALEN(font_cache); i++)
+        mtx_init(&font_cache[i].lock, mtx_plain);
+    mtx_init(&readers_lock, mtx_plain);
+    mtx_init(&thread_pool_lock, mtx_plain);
+    mtx_init(&font_requests_lock, mtx_plain);
+    cnd_init(&font_requests_cond);
     return true;
 }
 
 FCFT_EXPORT void
 fcft_fini(void)
 {
-    while (tll_length(font_cache) > 0) {
-        if (tll_front(font_cache).font == NULL)
-            tll_pop_front(font_cache);
-        else
-            fcft_destroy(&tll_front(font_cache).font->public);
+    /*
+     * Loaders may still be signalling completion, or running the
+     * user’s callback, even though the font has been handed out
+     */
+    mtx_lock(&font_requests_lock);
+    while (font_requests_running > 0)
+        cnd_wait(&font_requests_cond, &font_requests_lock);
+    mtx_unlock(&font_requests_lock);
+    cnd_destroy(&font_requests_cond);
+    mtx_destroy(&font_requests_lock);
+
+    /* Must be done first; pending tasks may reference fonts */
+    thread_pool_destroy(thread_pool);
+    thread_pool = NULL;
+    thread_pool_size = SIZE_MAX;
+    mtx_destroy(&thread_pool_lock);
+
+    for (size_t i = 0; i < ALEN(font_cache); i++) {
+        struct font_cache_bucket *bucket = &font_cache[i];
+
+        while (bucket->entries != NULL) {
+            struct font_cache_entry *e = bucket->entries;
+
+            if (e->font == NULL) {
+                bucket->entries = e->next;
+                font_cache_entry_destroy(e);
+            } else
+                fcft_destroy(&e->font->public);
+        }
     }
 
-    assert(tll_length(font_cache) == 0);
+    assert(font_cache_count == 0);
+    disk_cache_enabled = false;
 
-    mtx_destroy(&font_cache_lock);
+    /* Readers of fonts not destroyed by the user */
+    tll_free_and_free(readers, free);
+    tss_delete(readers_tss);
+
+    mtx_destroy(&readers_lock);
+    for (size_t i = 0; i < ALEN(font_cache); i++)
+        mtx_destroy(&font_cache[i].lock);
     mtx_destroy(&ft_lock);
 
     FT_Done_FreeType(ft_lib);
     FcFini();
-
-    LOG_DBG("glyph cache: lookups=%zu, collisions=%zu",
-            glyph_cache_lookups, glyph_cache_collisions);
-
-#if defined(FCFT_HAVE_HARFBUZZ)
-    LOG_DBG("grapheme cache: lookups=%zu, collisions=%zu",
-            grapheme_cache_lookups, grapheme_cache_collisions);
-#endif
 }
 
 static bool
@@ -307,15 +840,10 @@ is_assertions_enabled(void)
 static void
 log_version_information(void)
 {
-    static bool has_already_logged = false;
+    static atomic_bool has_already_logged = false;
 
-    mtx_lock(&font_cache_lock);
-    if (has_already_logged) {
-        mtx_unlock(&font_cache_lock);
+    if (atomic_exchange(&has_already_logged, true))
         return;
-    }
-    has_already_logged = true;
-    mtx_unlock(&font_cache_lock);
 
     enum fcft_capabilities caps = fcft_capabilities();
 
@@ -393,2298 +921,6349 @@ fcft_set_scaling_filter(enum fcft_scaling_filter filter)
     return false;
 }
 
-static void
-glyph_destroy_private(struct glyph_priv *glyph)
+FCFT_EXPORT bool
+fcft_set_disk_cache(bool enable)
 {
-    if (glyph->valid) {
-        void *image = pixman_image_get_data(glyph->public.pix);
-        pixman_image_unref(glyph->public.pix);
-        free(image);
-    }
+    /*
+     * Fonts are added to the font cache with their bucket locked;
+     * lock all buckets, so that no font can be instantiated between
+     * the check and the store.
+     */
+    for (size_t i = 0; i < ALEN(font_cache); i++)
+        mtx_lock(&font_cache[i].lock);
+
+    bool ret = atomic_load(&font_cache_count) == 0;
+    if (ret)
+        disk_cache_enabled = enable;
+    else
+        LOG_ERR("cannot change the disk cache setting after instantiating fonts");
 
-    free(glyph);
+    for (size_t i = 0; i < ALEN(font_cache); i++)
+        mtx_unlock(&font_cache[i].lock);
+
+    return ret;
 }
 
-static void
-glyph_destroy(const struct fcft_glyph *glyph)
+FCFT_EXPORT bool
+fcft_set_thread_pool_size(size_t count)
 {
-    glyph_destroy_private((struct glyph_priv *)glyph);
+    bool ret = false;
+
+    mtx_lock(&thread_pool_lock);
+    if (thread_pool == NULL) {
+        thread_pool_size = count;
+        ret = true;
+    } else
+        LOG_ERR("thread pool already started");
+    mtx_unlock(&thread_pool_lock);
+
+    return ret;
 }
 
-static void
-instance_destroy(struct instance *inst)
+/* Returns NULL if the pool could not be created, in which case
+ * everything is done in the calling thread. */
+static struct thread_pool *
+get_thread_pool(void)
 {
-    if (inst == NULL)
-        return;
+    mtx_lock(&thread_pool_lock);
 
-#if defined(FCFT_HAVE_HARFBUZZ)
-    hb_font_destroy(inst->hb_font);
-    hb_buffer_destroy(inst->hb_buf);
-#endif
+    if (thread_pool == NULL) {
+        size_t count = thread_pool_size;
 
-    mtx_lock(&ft_lock);
-    FT_Done_Face(inst->face);
-    mtx_unlock(&ft_lock);
+        if (count == SIZE_MAX) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-    free(inst->path);
-    free(inst->name);
-    free(inst);
+            /* The calling thread participates too */
+            count = cpus > 1 ? cpus - 1 : 0;
+        }
+
+        thread_pool = thread_pool_create(count);
+        if (thread_pool == NULL)
+            LOG_WARN("failed to create thread pool");
+    }
+
+    struct thread_pool *pool = thread_pool;
+    mtx_unlock(&thread_pool_lock);
+
+    return pool;
 }
 
-static void
-fallback_destroy(struct fallback *fallback)
+static struct slab *
+slab_create(size_t size)
 {
-    FcPatternDestroy(fallback->pattern);
-    FcCharSetDestroy(fallback->charset);
-    if (fallback->langset != NULL)
-        FcLangSetDestroy(fallback->langset);
-    instance_destroy(fallback->font);
+    struct slab *slab = malloc(sizeof(*slab) + size);
+    if (slab == NULL)
+        return NULL;
+
+    atomic_init(&slab->ref_counter, 1);
+    slab->size = size;
+    slab->used = 0;
+    return slab;
 }
 
 static void
-underline_strikeout_metrics(FT_Face ft_face, struct fcft_font *font)
+slab_unref(struct slab *slab)
 {
-    double y_scale = ft_face->size->metrics.y_scale / 65536.;
-    double ascent = ft_face->size->metrics.ascender / 64.;
-    double descent = ft_face->size->metrics.descender / 64.;
+    if (atomic_fetch_sub_explicit(&slab->ref_counter, 1, memory_order_acq_rel) == 1)
+        free(slab);
+}
 
-    double underline_position = ft_face->underline_position * y_scale / 64.;
-    double underline_thickness = ft_face->underline_thickness * y_scale / 64.;
+/*
+ * Thread safe; takes font->slab_lock (may be called with, or without,
+ * font->lock held).
+ *
+ * Allocates ‘size’ bytes (16-byte aligned) from the font’s current
+ * slab of the specified kind. The slab the memory was allocated from
+ * is returned in ‘slab’, with its reference counter incremented; call
+ * slab_unref() to release the memory.
+ */
+static void *
+slab_alloc(struct font_priv *font, enum slab_kind kind, size_t size,
+           struct slab **slab)
+{
+    size = (size + 15) & ~(size_t)15;
 
-    if (underline_position == 0.) {
-        LOG_DBG("estimating underline position and thickness");
-        underline_thickness = fabs(descent / 5.);
+    if (size > slab_size / 4 ||
+        atomic_load_explicit(&font->cache.budget, memory_order_relaxed) != 0)
+    {
+        /*
+         * Large bitmaps (e.g. color emojis) get a slab of their
+         * own. So does everything in fonts with a cache budget, or
+         * slabs kept alive by a few surviving entries would make
+         * memory usage grow past the budget.
+         */
+        struct slab *large = slab_create(size);
+        if (large == NULL)
+            return NULL;
 
-        //underline_position = descent / 2.;           /* Alacritty's algorithm */
-        underline_position = -2 * underline_thickness; /* My own */
+        large->used = size;
+        *slab = large;
+        return large->data;
     }
 
-    /*
-     * Position refers to the line's center, thus we need to take the
-     * thickness into account to determine the line top.
-     *
-     * Since a *negative* number means the position is *under* the
-     * baseline, we need to *add* half the width to adjust the
-     * position "upwards".
-     *
-     * When rounding the thickness, take care not go below 1.0 as that
-     * would make it invisible.
-     */
-    font->underline.position = trunc(underline_position + underline_thickness / 2.);
-    font->underline.thickness = round(max(1., underline_thickness));
+    mtx_lock(&font->slab_lock);
 
-    LOG_DBG("underline: pos=%f, thick=%f -> pos=%f, pos=%d, thick=%d",
-            underline_position, underline_thickness,
-            underline_position + underline_thickness / 2.,
-            font->underline.position, font->underline.thickness);
+    struct slab *current = font->slabs[kind];
 
-    double strikeout_position = 0., strikeout_thickness = 0.;
-    TT_OS2 *os2 = FT_Get_Sfnt_Table(ft_face, ft_sfnt_os2);
-    if (os2 != NULL) {
-        strikeout_position = os2->yStrikeoutPosition * y_scale / 64.;
-        strikeout_thickness = os2->yStrikeoutSize * y_scale / 64.;
-    }
+    if (current == NULL || current->size - current->used < size) {
+        struct slab *new_slab = slab_create(slab_size);
+        if (new_slab == NULL) {
+            mtx_unlock(&font->slab_lock);
+            return NULL;
+        }
 
-    if (strikeout_position == 0.) {
-        LOG_DBG("estimating strikeout position and thickness");
-        strikeout_thickness = underline_thickness;
+        if (current != NULL)
+            slab_unref(current);
 
-        //strikeout_position = height / 2. + descent;                     /* Alacritty's algorithm */
-        strikeout_position = 3. * ascent / 8. - underline_thickness / 2.; /* xterm's algorithm */
+        font->slabs[kind] = current = new_slab;
     }
 
-    font->strikeout.position = trunc(strikeout_position + strikeout_thickness / 2.);
-    font->strikeout.thickness = round(max(1., strikeout_thickness));
+    void *ptr = &current->data[current->used];
+    current->used += size;
 
-    LOG_DBG("strikeout: pos=%f, thick=%f -> pos=%f, pos=%d, thick=%d",
-            strikeout_position, strikeout_thickness,
-            strikeout_position + strikeout_thickness / 2.,
-            font->strikeout.position, font->strikeout.thickness);
+    atomic_fetch_add_explicit(&current->ref_counter, 1, memory_order_relaxed);
+    mtx_unlock(&font->slab_lock);
+
+    *slab = current;
+    return ptr;
 }
 
-static FcPattern *
-base_pattern_from_name(const char *name, FcFontSet **set)
+static void
+slab_image_destroy(pixman_image_t *pix, void *slab)
 {
-    /* Fontconfig fails to parse floating point values unless locale
-     * is e.g C, or en_US.UTF-8 */
-    assert(strcmp(setlocale(LC_NUMERIC, NULL), "C") == 0);
-    FcPattern *pattern = FcNameParse((const unsigned char *)name);
+    slab_unref(slab);
+}
 
-    if (pattern == NULL) {
-        LOG_ERR("%s: failed to lookup font", name);
-        return NULL;
+static enum slab_kind
+slab_kind(pixman_format_code_t format)
+{
+    switch (format) {
+    case PIXMAN_a1:
+        return SLAB_A1;
+
+    case PIXMAN_a8:
+        return SLAB_A8;
+
+    case PIXMAN_x8r8g8b8:
+        return SLAB_X8R8G8B8;
+
+    case PIXMAN_a8r8g8b8:
+        return SLAB_A8R8G8B8;
+
+    default:
+        abort();
     }
+}
 
-    if (!FcConfigSubstitute(NULL, pattern, FcMatchPattern)) {
-        LOG_ERR("%s: failed to do config substitution", name);
-        FcPatternDestroy(pattern);
+static pixman_image_t *
+slab_image_create(struct font_priv *font, pixman_format_code_t format,
+                  int width, int height, int stride)
+{
+    struct slab *slab;
+    uint32_t *data = slab_alloc(
+        font, slab_kind(format), (size_t)height * stride, &slab);
+    if (data == NULL)
         return NULL;
-    }
 
-    FcDefaultSubstitute(pattern);
+    pixman_image_t *pix = pixman_image_create_bits_no_clear(
+        format, width, height, data, stride);
 
-    FcResult result;
-    *set = FcFontSort(NULL, pattern, FcTrue, NULL, &result);
-    if (result != FcResultMatch) {
-        LOG_ERR("%s: failed to match font", name);
-        FcPatternDestroy(pattern);
+    if (pix == NULL) {
+        slab_unref(slab);
         return NULL;
     }
 
-    return pattern;
+    pixman_image_set_destroy_function(pix, &slab_image_destroy, slab);
+    return pix;
 }
 
-static FcPattern *
-pattern_from_font_set(FcPattern *base_pattern, FcFontSet *set, size_t idx)
+static struct glyph_priv *
+glyph_alloc(struct font_priv *font)
 {
-    FcPattern *pattern = FcFontRenderPrepare(NULL, base_pattern, set->fonts[idx]);
-    if (pattern == NULL) {
-        LOG_ERR("failed to prepare 'final' pattern");
+    struct slab *slab;
+    struct glyph_priv *glyph = slab_alloc(
+        font, SLAB_GLYPHS, sizeof(*glyph), &slab);
+
+    if (glyph == NULL)
         return NULL;
-    }
 
-    return pattern;
+    glyph->slab = slab;
+    glyph->valid = false;
+    glyph->bitmap = NULL;
+    glyph->loaded = false;
+    atomic_init(&glyph->ref_counter, 1);
+    return glyph;
 }
 
-static bool
-instantiate_pattern(FcPattern *pattern, double req_pt_size, double req_px_size,
-                    struct instance *font)
+static void glyph_unref(struct glyph_priv *glyph);
+
+static void
+glyph_destroy_private(struct glyph_priv *glyph)
 {
-    FcChar8 *face_file = NULL;
-    if (FcPatternGetString(pattern, FC_FT_FACE, 0, &face_file) != FcResultMatch &&
-        FcPatternGetString(pattern, FC_FILE, 0, &face_file) != FcResultMatch)
-    {
-        LOG_ERR("no face file path in pattern");
-        return false;
-    }
+    if (glyph->bitmap != NULL)
+        glyph_unref(glyph->bitmap);
+    else if (glyph->valid)
+        pixman_image_unref(glyph->public.pix);
 
-    double dpi;
-    if (FcPatternGetDouble(pattern, FC_DPI, 0, &dpi) != FcResultMatch)
-        dpi = 75;
+    slab_unref(glyph->slab);
+}
 
-    double size;
-    if (FcPatternGetDouble(pattern, FC_SIZE, 0, &size) != FcResultMatch)
-        LOG_WARN("%s: failed to get size", face_file);
+/*
+ * Lock-free. Drops a reference to a glyph index cache entry. Since
+ * text-runs may outlive the font, this must not touch the font.
+ */
+static void
+glyph_unref(struct glyph_priv *glyph)
+{
+    if (atomic_fetch_sub_explicit(&glyph->ref_counter, 1, memory_order_acq_rel) == 1)
+        glyph_destroy_private(glyph);
+}
 
-    double pixel_size;
-    if (FcPatternGetDouble(pattern, FC_PIXEL_SIZE, 0, &pixel_size) != FcResultMatch) {
-        LOG_ERR("%s: failed to get pixel size", face_file);
-        return false;
-    }
+/*
+ * Lock-free. Turns ‘glyph’ into a copy of the glyph index cache entry
+ * ‘bitmap’, sharing its bitmap. Takes over the caller’s reference to
+ * ‘bitmap’.
+ */
+static void
+glyph_share_bitmap(struct glyph_priv *glyph, struct glyph_priv *bitmap)
+{
+    assert(bitmap->valid);
+    assert(bitmap->bitmap == NULL);
 
-    int face_index;
-    if (FcPatternGetInteger(pattern, FC_INDEX, 0, &face_index) != FcResultMatch) {
-        LOG_WARN("%s: failed to get face index", face_file);
-        face_index = 0;
-    }
+    glyph->public = bitmap->public;
+    glyph->subpixel = bitmap->subpixel;
+    glyph->valid = true;
+    glyph->bitmap = bitmap;
+}
 
-    FcChar8 *full_name = NULL;
-    if (FcPatternGetString(pattern, FC_FULLNAME, face_index, &full_name) != FcResultMatch)
-        LOG_WARN("failed to get full font name");
+static void
+glyph_destroy(const struct fcft_glyph *glyph)
+{
+    glyph_destroy_private((struct glyph_priv *)glyph);
+}
 
-    mtx_lock(&ft_lock);
-    FT_Face ft_face;
-    FT_Error ft_err = FT_New_Face(ft_lib, (const char *)face_file, face_index, &ft_face);
-    mtx_unlock(&ft_lock);
-    if (ft_err != FT_Err_Ok) {
-        LOG_ERR("%s: failed to create FreeType face; %s",
-                face_file, ft_error_string(ft_err));
-        return false;
-    }
+static void
+glyph_destroy_retired(void *glyph)
+{
+    glyph_destroy_private(glyph);
+}
 
-    if ((ft_err = FT_Set_Pixel_Sizes(ft_face, 0, round(pixel_size))) != FT_Err_Ok) {
-        LOG_ERR("%s: failed to set character size: %s",
-                face_file, ft_error_string(ft_err));
-        goto err_done_face;
-    }
+static void
+glyph_unref_retired(void *glyph)
+{
+    glyph_unref(glyph);
+}
 
-    FcBool scalable;
-    if (FcPatternGetBool(pattern, FC_SCALABLE, 0, &scalable) != FcResultMatch)
-        scalable = FcTrue;
+/*
+ * Releases the run’s glyphs’ bitmaps, but keeps the glyph records
+ * (now invalid, and without a bitmap), and the arrays, for re-use.
+ */
+static void
+text_run_reset(struct text_run_priv *run)
+{
+    assert(run->public.count <= run->records);
 
-    FcBool outline;
-    if (FcPatternGetBool(pattern, FC_OUTLINE, 0, &outline) != FcResultMatch)
-        outline = FcTrue;
+    for (size_t i = 0; i < run->public.count; i++) {
+        struct glyph_priv *glyph = (struct glyph_priv *)run->public.glyphs[i];
 
-    FcBool is_color;
-    if (FcPatternGetBool(pattern, FC_COLOR, 0, &is_color) != FcResultMatch)
-        is_color = FcFalse;
+        assert(glyph->bitmap != NULL);
+        glyph_unref(glyph->bitmap);
+        glyph->bitmap = NULL;
+        glyph->valid = false;
+    }
 
-    double pixel_fixup = 1.;
-    bool fixup_estimated = false;
-    if (FcPatternGetDouble(pattern, "pixelsizefixupfactor", 0, &pixel_fixup) != FcResultMatch) {
-        /*
-         * Force a fixup factor on scalable bitmap fonts (typically
-         * emoji fonts). The fixup factor is
-         *   requested-pixel-size / actual-pixels-size
-         */
-        if (scalable && !outline) {
-            if (req_px_size < 0.)
-                req_px_size = req_pt_size * dpi / 72.;
+    run->public.count = 0;
+}
 
-            pixel_fixup = req_px_size / ft_face->size->metrics.y_ppem;
-            fixup_estimated = true;
-            LOG_DBG("estimated pixel fixup factor to %f (from pixel size: %f)",
-                    pixel_fixup, req_px_size);
-        } else
-            pixel_fixup = 1.;
+#if defined(FCFT_HAVE_HARFBUZZ)
+static void
+grapheme_destroy_private(struct grapheme_priv *grapheme)
+{
+    for (size_t i = 0; i < grapheme->public.count; i++) {
+        assert(grapheme->public.glyphs[i] != NULL);
+        glyph_destroy(grapheme->public.glyphs[i]);
     }
 
-#if 0
-    LOG_DBG("FIXED SIZES: %d", ft_face->num_fixed_sizes);
-    for (int i = 0; i < ft_face->num_fixed_sizes; i++)
-        LOG_DBG("  #%d: height=%d, y_ppem=%f", i, ft_face->available_sizes[i].height, ft_face->available_sizes[i].y_ppem / 64.);
+    free(grapheme->public.glyphs);
+    free(grapheme->cluster);
+    free(grapheme);
+}
+
+static void
+grapheme_destroy_retired(void *grapheme)
+{
+    grapheme_destroy_private(grapheme);
+}
 #endif
 
-    FcBool fc_hinting;
-    if (FcPatternGetBool(pattern, FC_HINTING,0,  &fc_hinting) != FcResultMatch)
-        fc_hinting = FcTrue;
+/*
+ * Persistent glyph cache (see fcft_set_disk_cache()).
+ *
+ * Each font instance has its own cache file, named after a hash of a
+ * key that describes everything that affects the rasterized bitmaps:
+ * the font file (path, size, mtime), face index, pixel size, load and
+ * render flags etc, and the fcft and FreeType versions. The key is
+ * also stored in the file, and compared when it is loaded.
+ *
+ * The file consists of a header, the key, a sorted array of glyph
+ * records, and the bitmaps. The file is mapped, and bitmaps are
+ * handed out without copying them; each pixman image holds a
+ * reference to the mapping.
+ *
+ * New glyphs are written back when the font is destroyed.
+ */
+struct disk_glyph_header {
+    char magic[8];
+    uint32_t byte_order;  /* disk_glyph_byte_order, in native byte order */
+    uint32_t key_len;     /* Key follows header, padded to 8 bytes */
+    uint64_t count;       /* Number of struct disk_glyph, following the key */
+};
 
-    FcBool fc_antialias;
-    if (FcPatternGetBool(pattern, FC_ANTIALIAS, 0, &fc_antialias) != FcResultMatch)
-        fc_antialias = FcTrue;
+struct disk_glyph {
+    uint32_t index;
+    uint32_t subpixel;
+    uint32_t format;           /* pixman_format_code_t */
+    uint32_t component_alpha;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+    int32_t stride;
+    int32_t advance_x;
+    int32_t advance_y;
+    uint32_t reserved;
+    uint64_t offset;           /* Of the bitmap, from the start of the file */
+};
 
-    int fc_hintstyle;
-    if (FcPatternGetInteger(pattern, FC_HINT_STYLE, 0, &fc_hintstyle) != FcResultMatch)
-        fc_hintstyle = FC_HINT_SLIGHT;
+static const char disk_glyph_magic[8] = "fcftglc1";
+static const uint32_t disk_glyph_byte_order = 0x01020304;
 
-    int fc_rgba;
-    if (FcPatternGetInteger(pattern, FC_RGBA, 0, &fc_rgba) != FcResultMatch)
-        fc_rgba = FC_RGBA_UNKNOWN;
+static size_t
+align_up(size_t v, size_t alignment)
+{
+    return (v + alignment - 1) / alignment * alignment;
+}
 
-    int load_flags = FT_LOAD_DEFAULT;
-    int load_target = FT_LOAD_TARGET_NORMAL;
+static int
+disk_glyph_cmp(uint32_t index_a, uint32_t subpixel_a,
+               uint32_t index_b, uint32_t subpixel_b)
+{
+    if (index_a != index_b)
+        return index_a < index_b ? -1 : 1;
+    if (subpixel_a != subpixel_b)
+        return subpixel_a < subpixel_b ? -1 : 1;
+    return 0;
+}
 
-    if (!fc_antialias) {
-        if (!fc_hinting || fc_hintstyle == FC_HINT_NONE)
-            load_flags |= FT_LOAD_NO_HINTING;
-        else
-            load_target = FT_LOAD_TARGET_MONO;
+static bool
+disk_glyph_is_valid(const struct disk_glyph *glyph, size_t file_size)
+{
+    switch (glyph->format) {
+    case PIXMAN_a1:
+    case PIXMAN_a8:
+    case PIXMAN_x8r8g8b8:
+    case PIXMAN_a8r8g8b8:
+        break;
 
-        load_flags |= FT_LOAD_MONOCHROME;
+    default:
+        return false;
     }
 
-    else {
-        if (!fc_hinting || fc_hintstyle == FC_HINT_NONE)
-            load_flags |= FT_LOAD_NO_HINTING;
+    if (glyph->width < 0 || glyph->height < 0 || glyph->stride < 0 ||
+        glyph->stride % 4 != 0 || glyph->offset % 16 != 0 ||
+        glyph->stride < stride_for_format_and_width(glyph->format, glyph->width))
+    {
+        return false;
+    }
 
-        else if (fc_hintstyle == FC_HINT_SLIGHT)
-            load_target = FT_LOAD_TARGET_LIGHT;
+    size_t bytes = (size_t)glyph->height * glyph->stride;
+    return glyph->offset <= file_size && bytes <= file_size - glyph->offset;
+}
 
-        else if (fc_hintstyle == FC_HINT_MEDIUM)
-            ;
+/*
+ * Builds the cache key, and maps the instance’s cache file, if there
+ * is one. Failing to do so is not an error; the instance simply
+ * won’t use the disk cache.
+ */
+static void
+glyph_disk_cache_open(struct instance *inst)
+{
+    inst->disk.name = NULL;
+    inst->disk.key = NULL;
+    inst->disk.map = NULL;
+    inst->disk.glyphs = NULL;
+    inst->disk.count = 0;
 
-        else if (fc_rgba == FC_RGBA_RGB || fc_rgba == FC_RGBA_BGR)
-            load_target = FT_LOAD_TARGET_LCD;
+    if (!disk_cache_enabled)
+        return;
 
-        else if (fc_rgba == FC_RGBA_VRGB || fc_rgba == FC_RGBA_VBGR)
-            load_target = FT_LOAD_TARGET_LCD_V;
+    struct stat st;
+    if (stat(inst->path, &st) < 0)
+        return;
+
+    FT_Int ft_major, ft_minor, ft_patch;
+    FT_Library_Version(ft_lib, &ft_major, &ft_minor, &ft_patch);
+
+    const FT_Matrix matrix = inst->faces.has_matrix
+        ? inst->faces.matrix : (FT_Matrix){0};
+
+    char key[1024];
+    int key_len = snprintf(
+        key, sizeof(key),
+        "fcft %s; freetype %d.%d.%d; %s; size=%lld; mtime=%lld.%09ld; "
+        "index=%d; px=%u; matrix=%d:%ld,%ld,%ld,%ld; load=%#x; "
+        "render=%#x,%#x; aa=%d; embolden=%d; lcd-filter=%d; bgr=%d; "
+        "fixup=%a,%d; filter=%d",
+        FCFT_VERSION, ft_major, ft_minor, ft_patch, inst->path,
+        (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+        inst->faces.index, inst->faces.pixel_size, inst->faces.has_matrix,
+        matrix.xx, matrix.xy, matrix.yx, matrix.yy,
+        inst->load_flags, inst->render_flags_normal,
+        inst->render_flags_subpixel, inst->antialias, inst->embolden,
+        inst->lcd_filter, inst->bgr, inst->pixel_size_fixup,
+        inst->pixel_fixup_estimated, scaling_filter);
+
+    if (key_len < 0 || key_len >= sizeof(key))
+        return;
+
+    char name[32];
+    snprintf(name, sizeof(name), "glyphs-%016llx",
+             (unsigned long long)disk_cache_hash(
+                 DISK_CACHE_HASH_INIT, key, key_len));
+
+    inst->disk.name = strdup(name);
+    inst->disk.key = strdup(key);
+
+    if (inst->disk.name == NULL || inst->disk.key == NULL) {
+        free(inst->disk.name);
+        free(inst->disk.key);
+        inst->disk.name = inst->disk.key = NULL;
+        return;
     }
 
-    FcBool fc_embeddedbitmap;
-    if (FcPatternGetBool(pattern, FC_EMBEDDED_BITMAP, 0, &fc_embeddedbitmap) != FcResultMatch)
-        fc_embeddedbitmap = FcTrue;
+    struct disk_cache_map *map = disk_cache_open(name);
+    if (map == NULL)
+        return;
 
-    if (!fc_embeddedbitmap && outline)
-        load_flags |= FT_LOAD_NO_BITMAP;
+    const struct disk_glyph_header *hdr = map->data;
+    const size_t glyphs_offset = align_up(sizeof(*hdr) + key_len, 8);
 
-    FcBool fc_autohint;
-    if (FcPatternGetBool(pattern, FC_AUTOHINT, 0, &fc_autohint) != FcResultMatch)
-        fc_autohint = FcFalse;
+    if (map->size < sizeof(*hdr) ||
+        memcmp(hdr->magic, disk_glyph_magic, sizeof(hdr->magic)) != 0 ||
+        hdr->byte_order != disk_glyph_byte_order ||
+        hdr->key_len != key_len ||
+        map->size < glyphs_offset ||
+        memcmp(hdr + 1, key, key_len) != 0 ||
+        hdr->count > (map->size - glyphs_offset) / sizeof(struct disk_glyph))
+    {
+        goto invalid;
+    }
 
-    if (fc_autohint)
-        load_flags |= FT_LOAD_FORCE_AUTOHINT;
+    const struct disk_glyph *glyphs =
+        (const struct disk_glyph *)((const char *)map->data + glyphs_offset);
 
-    int render_flags_normal, render_flags_subpixel;
-    if (!fc_antialias)
-        render_flags_normal = render_flags_subpixel = FT_RENDER_MODE_MONO;
+    for (size_t i = 0; i < hdr->count; i++) {
+        if (!disk_glyph_is_valid(&glyphs[i], map->size))
+            goto invalid;
 
-    else {
-        if (fc_rgba == FC_RGBA_RGB || fc_rgba == FC_RGBA_BGR) {
-            render_flags_subpixel = FT_RENDER_MODE_LCD;
-            render_flags_normal = FT_RENDER_MODE_NORMAL;
+        /* Must be sorted, for glyph_disk_cache_load() */
+        if (i > 0 && disk_glyph_cmp(
+                glyphs[i - 1].index, glyphs[i - 1].subpixel,
+                glyphs[i].index, glyphs[i].subpixel) >= 0)
+        {
+            goto invalid;
         }
+    }
 
-        else if (fc_rgba == FC_RGBA_VRGB || fc_rgba == FC_RGBA_VBGR) {
-            render_flags_subpixel = FT_RENDER_MODE_LCD_V;
-            render_flags_normal = FT_RENDER_MODE_NORMAL;
-        }
+    inst->disk.map = map;
+    inst->disk.glyphs = glyphs;
+    inst->disk.count = hdr->count;
 
-        else
-            render_flags_normal = render_flags_subpixel = FT_RENDER_MODE_NORMAL;
-    }
+    LOG_DBG("%s: %zu glyphs in disk cache (%s)",
+            inst->path, inst->disk.count, name);
+    return;
 
-    int fc_lcdfilter;
-    if (FcPatternGetInteger(pattern, FC_LCD_FILTER, 0, &fc_lcdfilter) != FcResultMatch)
-        fc_lcdfilter = FC_LCD_DEFAULT;
+invalid:
+    LOG_WARN("%s: ignoring invalid glyph cache file", name);
+    disk_cache_map_unref(map);
+}
 
-    switch (fc_lcdfilter) {
-    case FC_LCD_NONE:    font->lcd_filter = FT_LCD_FILTER_NONE; break;
-    case FC_LCD_DEFAULT: font->lcd_filter = FT_LCD_FILTER_DEFAULT; break;
-    case FC_LCD_LIGHT:   font->lcd_filter = FT_LCD_FILTER_LIGHT; break;
-    case FC_LCD_LEGACY:  font->lcd_filter = FT_LCD_FILTER_LEGACY; break;
-    }
+static void
+disk_cache_image_destroy(pixman_image_t *pix, void *map)
+{
+    disk_cache_map_unref(map);
+}
 
-    FcBool fc_embolden;
-    if (FcPatternGetBool(pattern, FC_EMBOLDEN, 0, &fc_embolden) != FcResultMatch)
-        fc_embolden = FcFalse;
+/*
+ * Lock-free (but see glyph_index_cache_ref()).
+ *
+ * Creates a glyph index cache entry from the instance’s disk cache,
+ * if the glyph is in it. Returns NULL otherwise.
+ */
+static struct glyph_priv *
+glyph_disk_cache_load(struct font_priv *font, const struct instance *inst,
+                      uint32_t index, enum fcft_subpixel subpixel)
+{
+    const struct disk_glyph *found = NULL;
 
-    FcMatrix *fc_matrix;
-    if (FcPatternGetMatrix(pattern, FC_MATRIX, 0, &fc_matrix) == FcResultMatch) {
-        FT_Matrix m = {
-            .xx = fc_matrix->xx * 0x10000,
-            .xy = fc_matrix->xy * 0x10000,
-            .yx = fc_matrix->yx * 0x10000,
-            .yy = fc_matrix->yy * 0x10000,
-        };
-        FT_Set_Transform(ft_face, &m, NULL);
-    }
-
-    font->name = full_name != NULL ? strdup((char *)full_name) : NULL;
-    font->path = strdup((char *)face_file);
-    if (font->path == NULL) {
-        free(font->name);
-        free(font->path);
-        goto err_done_face;
-    }
-
-    font->face = ft_face;
-    font->load_flags = load_target | load_flags | FT_LOAD_COLOR;
-    font->antialias = fc_antialias;
-    font->embolden = fc_embolden;
-    font->is_color = is_color;
-    font->render_flags_normal = render_flags_normal;
-    font->render_flags_subpixel = render_flags_subpixel;
-    font->pixel_size_fixup = pixel_fixup;
-    font->pixel_fixup_estimated = fixup_estimated;
-    font->bgr = fc_rgba == FC_RGBA_BGR || fc_rgba == FC_RGBA_VBGR;
-
-    /* For logging: e.g. "+ss01 -dlig" */
-    char features[256] = {0};
-
-#if defined(FCFT_HAVE_HARFBUZZ)
-    font->hb_font = hb_ft_font_create_referenced(ft_face);
-    if (font->hb_font == NULL) {
-        LOG_ERR("%s: failed to instantiate harfbuzz font", face_file);
-        goto err_free_path;
-    }
-
-    font->hb_buf = hb_buffer_create();
-    if (font->hb_buf == NULL) {
-        LOG_ERR("%s: failed to instantiate harfbuzz buffer", face_file);
-        goto err_hb_font_destroy;
-    }
+    for (size_t lo = 0, hi = inst->disk.count; lo < hi; ) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct disk_glyph *g = &inst->disk.glyphs[mid];
 
-    for (font->hb_feats_count = 0; font->hb_feats_count < ALEN(font->hb_feats); ) {
-        FcChar8 *fc_feat;
-        if (FcPatternGetString(
-                pattern, FC_FONT_FEATURES,
-                font->hb_feats_count, &fc_feat) != FcResultMatch)
-        {
+        int cmp = disk_glyph_cmp(index, subpixel, g->index, g->subpixel);
+        if (cmp == 0) {
+            found = g;
             break;
-        }
-
-        hb_feature_t *feat = &font->hb_feats[font->hb_feats_count];
-
-        if (hb_feature_from_string((const char *)fc_feat, -1, feat)) {
-            const char tag[4] = {
-                (feat->tag >> 24) & 0xff,
-                (feat->tag >> 16) & 0xff,
-                (feat->tag >> 8) & 0xff,
-                (feat->tag >> 0) & 0xff,
-            };
-
-            size_t ofs = font->hb_feats_count * 6;
-            snprintf(&features[ofs], sizeof(features) - ofs,
-                     " %c%.4s", feat->value ? '+' : '-', tag);
-
-            LOG_DBG("feature: %.4s=%s", tag, feat->value ? "on" : "off");
-            font->hb_feats_count++;
-        }
+        } else if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
     }
-#endif
-
-    double max_x_advance = ft_face->size->metrics.max_advance / 64.;
-    double max_y_advance = ft_face->size->metrics.height / 64.;
-    double height = ft_face->size->metrics.height / 64.;
-    double descent = ft_face->size->metrics.descender / 64.;
-    double ascent = ft_face->size->metrics.ascender / 64.;
-
-    font->metrics.height = ceil(height * font->pixel_size_fixup);
-    font->metrics.descent = ceil(-descent * font->pixel_size_fixup);
-    font->metrics.ascent = ceil(ascent * font->pixel_size_fixup);
-    font->metrics.max_advance.x = ceil(max_x_advance * font->pixel_size_fixup);
-    font->metrics.max_advance.y = ceil(max_y_advance * font->pixel_size_fixup);
-    font->metrics.antialias = fc_antialias;
-    font->metrics.subpixel = !fc_antialias
-        ? FCFT_SUBPIXEL_NONE
-        : (fc_rgba == FC_RGBA_RGB ? FCFT_SUBPIXEL_HORIZONTAL_RGB :
-           fc_rgba == FC_RGBA_BGR ? FCFT_SUBPIXEL_HORIZONTAL_BGR :
-           fc_rgba == FC_RGBA_VRGB ? FCFT_SUBPIXEL_VERTICAL_RGB :
-           fc_rgba == FC_RGBA_VBGR ? FCFT_SUBPIXEL_VERTICAL_BGR :
-           FCFT_SUBPIXEL_NONE);
-    font->metrics.name = font->name;
 
-    underline_strikeout_metrics(ft_face, &font->metrics);
+    if (found == NULL)
+        return NULL;
 
-#if defined(LOG_ENABLE_DBG) && LOG_ENABLE_DBG
-    LOG_DBG("%s: size=%.2fpt/%.2fpx, dpi=%.2f, fixup-factor: %.4f, "
-            "line-height: %dpx, ascent: %dpx, descent: %dpx, "
-            "x-advance (max): %dpx, features:%s",
-            font->path, size, pixel_size, dpi, font->pixel_size_fixup,
-            font->metrics.height, font->metrics.ascent, font->metrics.descent,
-            font->metrics.max_advance.x, features);
-#else
-    LOG_INFO("%s: size=%.2fpt/%dpx, dpi=%.2f%s",
-             font->path, size, (int)round(pixel_size), dpi, features);
-#endif
+    struct glyph_priv *glyph = glyph_alloc(font);
+    if (glyph == NULL)
+        return NULL;
 
-    return true;
+    struct disk_cache_map *map = inst->disk.map;
+    pixman_image_t *pix = pixman_image_create_bits_no_clear(
+        found->format, found->width, found->height,
+        (uint32_t *)((char *)map->data + found->offset), found->stride);
 
-#if defined(FCFT_HAVE_HARFBUZZ)
-err_hb_font_destroy:
-    hb_font_destroy(font->hb_font);
-err_free_path:
-    free(font->path);
-    free(font->name);
-#endif
+    if (pix == NULL) {
+        glyph_destroy_private(glyph);
+        return NULL;
+    }
 
-err_done_face:
-    mtx_lock(&ft_lock);
-    FT_Done_Face(ft_face);
-    mtx_unlock(&ft_lock);
-    return false;
+    disk_cache_map_ref(map);
+    pixman_image_set_destroy_function(pix, &disk_cache_image_destroy, map);
+    pixman_image_set_component_alpha(pix, found->component_alpha);
+
+    glyph->public = (struct fcft_glyph){
+        .font_name = inst->name,
+        .pix = pix,
+        .x = found->x,
+        .y = found->y,
+        .advance = {
+            .x = found->advance_x,
+            .y = found->advance_y,
+        },
+        .width = found->width,
+        .height = found->height,
+    };
+    glyph->subpixel = subpixel;
+    glyph->valid = true;
+    glyph->loaded = true;
+    return glyph;
 }
 
-static uint64_t
-sdbm_hash(const char *s)
+/* Bitmaps that are scaled at composition time (i.e. by a pixman
+ * transform) cannot be restored from a plain bitmap */
+static bool
+glyph_disk_cache_can_store(const struct instance *inst,
+                           const struct glyph_priv *glyph)
 {
-    uint64_t hash = 0;
+    pixman_image_t *pix = glyph->public.pix;
 
-    for (; *s != '\0'; s++) {
-        int c = *s;
-        hash = c + (hash << 6) + (hash << 16) - hash;
-    }
+    return glyph->valid &&
+        (inst->pixel_size_fixup == 1. ||
+         pixman_image_get_format(pix) == PIXMAN_a8r8g8b8) &&
+        pixman_image_get_width(pix) == glyph->public.width &&
+        pixman_image_get_height(pix) == glyph->public.height;
+}
 
-    return hash;
+struct disk_glyph_source {
+    struct disk_glyph glyph;
+    const void *data;
+};
+
+static int
+disk_glyph_source_cmp(const void *_a, const void *_b)
+{
+    const struct disk_glyph_source *a = _a;
+    const struct disk_glyph_source *b = _b;
+    return disk_glyph_cmp(
+        a->glyph.index, a->glyph.subpixel, b->glyph.index, b->glyph.subpixel);
 }
 
-static uint64_t
-font_hash(size_t count, const char *names[static count], const char *attributes)
+/*
+ * Must only be called while font->lock is held (or when the font is
+ * being destroyed).
+ *
+ * Writes a new cache file for ‘inst’, if it has rasterized glyphs
+ * that are not already in the current cache file. The new file
+ * contains both the old, and the new glyphs.
+ */
+static void
+glyph_disk_cache_save(struct font_priv *font, const struct instance *inst)
 {
-    uint64_t hash = 0;
-    for (size_t i = 0; i < count; i++)
-        hash ^= sdbm_hash(names[i]);
+    if (inst->disk.name == NULL)
+        return;
 
-    if (attributes != NULL)
-        hash ^= sdbm_hash(attributes);
+    const struct glyph_cache_table *table = font->glyph_index_cache.table;
 
-    return hash;
-}
+    size_t new_count = 0;
+    for (size_t i = 0; i < table->size; i++) {
+        const struct glyph_priv *entry = atomic_load_explicit(
+            &table->entries[i], memory_order_relaxed);
 
-FCFT_EXPORT struct fcft_font *
-fcft_from_name(size_t count, const char *names[static count],
-               const char *attributes)
-{
-    if (ft_lib == NULL) {
-        LOG_ERR("fcft_init() not called");
-        return NULL;
-    }
+        if (entry == NULL || entry == GLYPH_TOMBSTONE ||
+            entry->inst != inst || entry->loaded ||
+            !glyph_disk_cache_can_store(inst, entry))
+        {
+            continue;
+        }
 
-    log_version_information();
+        new_count++;
+    }
 
-    if (count == 0)
-        return NULL;
+    if (new_count == 0)
+        return;
 
-    uint64_t hash = font_hash(count, names, attributes);
-    struct fcft_font_cache_entry *cache_entry = NULL;
+    struct disk_glyph_source *sources = malloc(
+        (inst->disk.count + new_count) * sizeof(sources[0]));
+    if (sources == NULL)
+        return;
 
-    mtx_lock(&font_cache_lock);
-    tll_foreach(font_cache, it) {
-        if (it->item.hash != hash)
-            continue;
+    size_t count = 0;
+    size_t bitmap_bytes = 0;
 
-        struct fcft_font_cache_entry *e = &it->item;
+    for (size_t i = 0; i < inst->disk.count; i++) {
+        const struct disk_glyph *g = &inst->disk.glyphs[i];
 
-        if (e->font != (void *)(uintptr_t)-1) {
-            /* Font has already been fully initialized */
+        sources[count++] = (struct disk_glyph_source){
+            .glyph = *g,
+            .data = (const char *)inst->disk.map->data + g->offset,
+        };
+        bitmap_bytes += align_up((size_t)g->height * g->stride, 16);
+    }
 
-            if (e->font != NULL) {
-                mtx_lock(&e->font->lock);
-                e->font->ref_counter++;
-                mtx_unlock(&e->font->lock);
-            }
+    for (size_t i = 0; i < table->size; i++) {
+        const struct glyph_priv *entry = atomic_load_explicit(
+            &table->entries[i], memory_order_relaxed);
 
-            mtx_unlock(&font_cache_lock);
-            return e->font != NULL ? &e->font->public : NULL;
+        if (entry == NULL || entry == GLYPH_TOMBSTONE ||
+            entry->inst != inst || entry->loaded ||
+            !glyph_disk_cache_can_store(inst, entry))
+        {
+            continue;
         }
 
-        /*
-         * Cache entry is only a reservation - font hasn't yet
-         * been initialized.
-         */
+        pixman_image_t *pix = entry->public.pix;
+        const int stride = pixman_image_get_stride(pix);
+        const size_t bytes = (size_t)entry->public.height * stride;
 
-        /* Let instantiating thread know (yet) another thread
-         * wants a reference to it */
-        e->waiters++;
+        if (bitmap_bytes + bytes > disk_cache_max_bitmap_bytes)
+            continue;
 
-        while (e->font == (void *)(uintptr_t)-1)
-            cnd_wait(&e->cond, &font_cache_lock);
-        mtx_unlock(&font_cache_lock);
-        return e->font == NULL ? NULL : &e->font->public;
+        sources[count++] = (struct disk_glyph_source){
+            .glyph = {
+                .index = entry->index,
+                .subpixel = entry->subpixel,
+                .format = pixman_image_get_format(pix),
+                .component_alpha = pixman_image_get_component_alpha(pix),
+                .x = entry->public.x,
+                .y = entry->public.y,
+                .width = entry->public.width,
+                .height = entry->public.height,
+                .stride = stride,
+                .advance_x = entry->public.advance.x,
+                .advance_y = entry->public.advance.y,
+            },
+            .data = pixman_image_get_data(pix),
+        };
+        bitmap_bytes += align_up(bytes, 16);
     }
 
-    /* Pre-allocate entry */
-    tll_push_back(
-        font_cache,
-        ((struct fcft_font_cache_entry){.hash = hash, .font = (void *)(uintptr_t)-1}));
+    qsort(sources, count, sizeof(sources[0]), &disk_glyph_source_cmp);
 
-    cache_entry = &tll_back(font_cache);
+    /* The same glyph may have been rasterized by another process,
+     * after we loaded the cache file */
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique > 0 && disk_glyph_source_cmp(
+                &sources[unique - 1], &sources[i]) == 0)
+        {
+            continue;
+        }
+        sources[unique++] = sources[i];
+    }
+    count = unique;
 
-    if (cnd_init(&cache_entry->cond) != thrd_success) {
-        LOG_ERR("%s: failed to instantiate font cache condition variable", names[0]);
-        tll_pop_back(font_cache);
-        mtx_unlock(&font_cache_lock);
-        return NULL;
+    struct disk_cache_writer *writer = disk_cache_writer_create(inst->disk.name);
+    if (writer == NULL) {
+        free(sources);
+        return;
     }
-    mtx_unlock(&font_cache_lock);
 
-    struct font_priv *font = NULL;
+    const size_t key_len = strlen(inst->disk.key);
+    struct disk_glyph_header hdr = {
+        .byte_order = disk_glyph_byte_order,
+        .key_len = key_len,
+        .count = count,
+    };
+    memcpy(hdr.magic, disk_glyph_magic, sizeof(hdr.magic));
 
-    bool have_attrs = attributes != NULL && strlen(attributes) > 0;
-    size_t attr_len = have_attrs ? strlen(attributes) + 1 : 0;
+    disk_cache_write(writer, &hdr, sizeof(hdr));
+    disk_cache_write(writer, inst->disk.key, key_len);
+    disk_cache_write_align(writer, 8);
 
-    tll(struct fallback) fc_fallbacks = tll_init();
+    size_t offset = align_up(
+        disk_cache_writer_offset(writer) + count * sizeof(struct disk_glyph), 16);
 
-    bool first = true;
     for (size_t i = 0; i < count; i++) {
-        const char *base_name = names[i];
-
-        char name[strlen(base_name) + attr_len + 1];
-        strcpy(name, base_name);
-        if (have_attrs) {
-            strcat(name, ":");
-            strcat(name, attributes);
-        }
+        struct disk_glyph *g = &sources[i].glyph;
+        g->offset = offset;
+        offset += align_up((size_t)g->height * g->stride, 16);
+        disk_cache_write(writer, g, sizeof(*g));
+    }
 
-        FcFontSet *set;
-        FcPattern *base_pattern = base_pattern_from_name(name, &set);
-        if (base_pattern == NULL)
-            break;
+    for (size_t i = 0; i < count; i++) {
+        const struct disk_glyph *g = &sources[i].glyph;
+        disk_cache_write_align(writer, 16);
+        disk_cache_write(writer, sources[i].data, (size_t)g->height * g->stride);
+    }
 
-        FcPattern *pattern = pattern_from_font_set(base_pattern, set, 0);
-        if (pattern == NULL)
-            break;
+    free(sources);
 
-        FcCharSet *charset;
-        if (FcPatternGetCharSet(base_pattern, FC_CHARSET, 0, &charset) != FcResultMatch &&
-            FcPatternGetCharSet(pattern, FC_CHARSET, 0, &charset) != FcResultMatch)
-        {
-            LOG_ERR("%s: failed to get charset", name);
-            FcPatternDestroy(pattern);
-            FcPatternDestroy(base_pattern);
-            FcFontSetDestroy(set);
-            break;
-        }
+    if (disk_cache_writer_commit(writer))
+        LOG_DBG("%s: wrote %zu glyphs to disk cache", inst->path, count);
+}
 
-        FcLangSet *langset;
-        if (FcPatternGetLangSet(pattern, FC_LANG, 0, &langset) != FcResultMatch)
-            langset = NULL;
+static void
+instance_destroy(struct instance *inst)
+{
+    if (inst == NULL)
+        return;
 
-        double req_px_size = -1., req_pt_size = -1.;
-        FcPatternGetDouble(base_pattern, FC_PIXEL_SIZE, 0, &req_px_size);
-        FcPatternGetDouble(base_pattern, FC_SIZE, 0, &req_pt_size);
+#if defined(FCFT_HAVE_HARFBUZZ)
+    hb_font_destroy(inst->hb_font);
+    hb_buffer_destroy(inst->hb_buf);
+#endif
 
-        if (first) {
-            first = false;
+    mtx_lock(&ft_lock);
+    FT_Done_Face(inst->face);
+    for (size_t i = 0; i < inst->faces.count; i++)
+        FT_Done_Face(inst->faces.idle[i]);
+    mtx_unlock(&ft_lock);
 
-            bool lock_failed = true;
-            bool glyph_cache_lock_failed = true;
-            bool grapheme_cache_lock_failed = true;
-            bool pattern_failed = true;
+    free(inst->faces.idle);
+    mtx_destroy(&inst->faces.lock);
+    disk_cache_map_unref(inst->disk.map);
+    free(inst->disk.name);
+    free(inst->disk.key);
+    free(inst->path);
+    free(inst->name);
+    free(inst);
+}
 
-            mtx_t lock;
-            if (mtx_init(&lock, mtx_plain) != thrd_success)
-                LOG_WARN("%s: failed to instantiate mutex", name);
-            else
-                lock_failed = false;
+static void
+fallback_destroy(struct fallback *fallback)
+{
+    FcPatternDestroy(fallback->pattern);
+    FcCharSetDestroy(fallback->charset);
+    if (fallback->langset != NULL)
+        FcLangSetDestroy(fallback->langset);
+    instance_destroy(fallback->font);
+}
 
-            pthread_rwlock_t glyph_cache_lock;
-            if (pthread_rwlock_init(&glyph_cache_lock, NULL) != 0)
-                LOG_WARN("%s: failed to instantiate glyph cache rwlock", name);
-            else
-                glyph_cache_lock_failed = false;
+static void
+underline_strikeout_metrics(FT_Face ft_face, struct fcft_font *font)
+{
+    double y_scale = ft_face->size->metrics.y_scale / 65536.;
+    double ascent = ft_face->size->metrics.ascender / 64.;
+    double descent = ft_face->size->metrics.descender / 64.;
 
-            struct instance *primary = malloc(sizeof(*primary));
-            if (primary == NULL ||
-                !instantiate_pattern(pattern, req_pt_size, req_px_size, primary))
-            {
-                ;
-            } else
-                pattern_failed = false;
+    double underline_position = ft_face->underline_position * y_scale / 64.;
+    double underline_thickness = ft_face->underline_thickness * y_scale / 64.;
 
-            font = calloc(1, sizeof(*font));
-            struct glyph_priv **glyph_cache_table = calloc(
-                glyph_cache_initial_size, sizeof(glyph_cache_table[0]));
+    if (underline_position == 0.) {
+        LOG_DBG("estimating underline position and thickness");
+        underline_thickness = fabs(descent / 5.);
 
-#if defined(FCFT_HAVE_HARFBUZZ)
-            pthread_rwlock_t grapheme_cache_lock;
-            if (pthread_rwlock_init(&grapheme_cache_lock, NULL) != 0)
-                LOG_WARN("%s: failed to instantiate grapheme cache rwlock", name);
-            else
-                grapheme_cache_lock_failed = false;
-
-            struct grapheme_priv **grapheme_cache_table = calloc(
-                grapheme_cache_initial_size, sizeof(grapheme_cache_table[0]));
-#else
-            struct grapheme_priv **grapheme_cache_table = NULL;
-            grapheme_cache_lock_failed = false;
-#endif
+        //underline_position = descent / 2.;           /* Alacritty's algorithm */
+        underline_position = -2 * underline_thickness; /* My own */
+    }
 
-            /* Handle failure(s) */
-            if (lock_failed || glyph_cache_lock_failed ||
-                grapheme_cache_lock_failed || pattern_failed ||
-                font == NULL || glyph_cache_table == NULL
-#if defined(FCFT_HAVE_HARFBUZZ)
-                || grapheme_cache_table == NULL
-#endif
-                )
-            {
-                if (!lock_failed)
-                    mtx_destroy(&lock);
-                if (!glyph_cache_lock_failed)
-                    pthread_rwlock_destroy(&glyph_cache_lock);
-#if defined(FCFT_HAVE_HARFBUZZ)
-                if (!grapheme_cache_lock_failed)
-                    pthread_rwlock_destroy(&grapheme_cache_lock);
-#endif
-                if (!pattern_failed)
-                    free(primary);
-                free(font);
-                free(glyph_cache_table);
-                free(grapheme_cache_table);
-                if (langset != NULL)
-                    FcLangSetDestroy(langset);
-                FcCharSetDestroy(charset);
-                FcPatternDestroy(pattern);
-                FcPatternDestroy(base_pattern);
-                FcFontSetDestroy(set);
-                break;
-            }
+    /*
+     * Position refers to the line's center, thus we need to take the
+     * thickness into account to determine the line top.
+     *
+     * Since a *negative* number means the position is *under* the
+     * baseline, we need to *add* half the width to adjust the
+     * position "upwards".
+     *
+     * When rounding the thickness, take care not go below 1.0 as that
+     * would make it invisible.
+     */
+    font->underline.position = trunc(underline_position + underline_thickness / 2.);
+    font->underline.thickness = round(max(1., underline_thickness));
 
-            font->ref_counter = 1;
-            font->lock = lock;
-            font->glyph_cache_lock = glyph_cache_lock;
-            font->glyph_cache.size = glyph_cache_initial_size;
-            font->glyph_cache.count = 0;
-            font->glyph_cache.table = glyph_cache_table;
-            font->emoji_presentation = FCFT_EMOJI_PRESENTATION_DEFAULT;
-            font->public = primary->metrics;
+    LOG_DBG("underline: pos=%f, thick=%f -> pos=%f, pos=%d, thick=%d",
+            underline_position, underline_thickness,
+            underline_position + underline_thickness / 2.,
+            font->underline.position, font->underline.thickness);
 
-#if defined(FCFT_HAVE_HARFBUZZ)
-            font->grapheme_cache_lock = grapheme_cache_lock;
-            font->grapheme_cache.size = grapheme_cache_initial_size;
-            font->grapheme_cache.count = 0;
-            font->grapheme_cache.table = grapheme_cache_table;
-#endif
+    double strikeout_position = 0., strikeout_thickness = 0.;
+    TT_OS2 *os2 = FT_Get_Sfnt_Table(ft_face, ft_sfnt_os2);
+    if (os2 != NULL) {
+        strikeout_position = os2->yStrikeoutPosition * y_scale / 64.;
+        strikeout_thickness = os2->yStrikeoutSize * y_scale / 64.;
+    }
 
-            tll_push_back(font->fallbacks, ((struct fallback){
-                        .pattern = pattern,
-                        .charset = FcCharSetCopy(charset),
-                        .langset = langset != NULL ? FcLangSetCopy(langset) : NULL,
-                        .font = primary,
-                        .req_px_size = req_px_size,
-                        .req_pt_size = req_pt_size}));
+    if (strikeout_position == 0.) {
+        LOG_DBG("estimating strikeout position and thickness");
+        strikeout_thickness = underline_thickness;
 
-            for (size_t i = 1; i < set->nfont; i++) {
-                FcPattern *fallback_pattern = pattern_from_font_set(base_pattern, set, i);
-                if (fallback_pattern == NULL)
-                    continue;
+        //strikeout_position = height / 2. + descent;                     /* Alacritty's algorithm */
+        strikeout_position = 3. * ascent / 8. - underline_thickness / 2.; /* xterm's algorithm */
+    }
 
-                FcCharSet *fallback_charset;
-                if (FcPatternGetCharSet(base_pattern, FC_CHARSET, 0, &fallback_charset) != FcResultMatch &&
-                    FcPatternGetCharSet(fallback_pattern, FC_CHARSET, 0, &fallback_charset) != FcResultMatch)
-                {
-                    LOG_ERR("%s: failed to get charset", name);
-                    FcPatternDestroy(fallback_pattern);
-                    continue;
-                }
+    font->strikeout.position = trunc(strikeout_position + strikeout_thickness / 2.);
+    font->strikeout.thickness = round(max(1., strikeout_thickness));
 
-                FcLangSet *fallback_langset;
-                if (FcPatternGetLangSet(fallback_pattern, FC_LANG, 0, &fallback_langset) != FcResultMatch)
-                    fallback_langset = NULL;
+    LOG_DBG("strikeout: pos=%f, thick=%f -> pos=%f, pos=%d, thick=%d",
+            strikeout_position, strikeout_thickness,
+            strikeout_position + strikeout_thickness / 2.,
+            font->strikeout.position, font->strikeout.thickness);
+}
 
-                FcPatternGetDouble(base_pattern, FC_PIXEL_SIZE, 0, &req_px_size);
-                FcPatternGetDouble(base_pattern, FC_SIZE, 0, &req_pt_size);
+/*
+ * Persistent font set cache (see fcft_set_disk_cache()).
+ *
+ * FcFontSort() is by far the most expensive part of instantiating a
+ * font. Its result only depends on the (substituted) pattern, and on
+ * the set of available fonts. We store the sorted list of fonts, as
+ * (file, face index) pairs, keyed on the pattern, and on a
+ * fingerprint of fontconfig’s configuration.
+ *
+ * On a hit, the font set is rebuilt from fontconfig’s own font
+ * patterns, i.e. exactly the patterns FcFontSort() would have
+ * returned.
+ */
+struct disk_font_set_header {
+    char magic[8];
+    uint32_t byte_order;  /* disk_glyph_byte_order, in native byte order */
+    uint32_t key_len;     /* Key follows header */
+    uint64_t count;       /* Number of fonts, following the key */
+};
 
-                tll_push_back(fc_fallbacks, ((struct fallback){
-                            .pattern = fallback_pattern,
-                            .charset = FcCharSetCopy(fallback_charset),
-                            .langset = fallback_langset != NULL ? FcLangSetCopy(fallback_langset) : NULL,
-                            .req_px_size = req_px_size,
-                            .req_pt_size = req_pt_size}));
-            }
+struct disk_font_set_entry {
+    int32_t index;        /* Face index */
+    uint32_t path_len;    /* Path follows, padded to 8 bytes */
+};
 
-        } else {
-            assert(font != NULL);
-            tll_push_back(font->fallbacks, ((struct fallback){
-                        .pattern = pattern,
-                        .charset = FcCharSetCopy(charset),
-                        .langset = langset != NULL ? FcLangSetCopy(langset) : NULL,
-                        .req_px_size = req_px_size,
-                        .req_pt_size = req_pt_size}));
-        }
+static const char disk_font_set_magic[8] = "fcftset1";
 
-        FcFontSetDestroy(set);
-        FcPatternDestroy(base_pattern);
-    }
+static void
+hash_stat(uint64_t *hash, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) < 0)
+        memset(&st, 0, sizeof(st));
 
-    /* Append fontconfig-based fallbacks at the end of our fallback list */
-    if (font != NULL) {
-        tll_foreach(fc_fallbacks, it)
-            tll_push_back(font->fallbacks, it->item);
-        tll_free(fc_fallbacks);
-    }
+    const int64_t values[] = {
+        st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size, st.st_ino};
 
-    mtx_lock(&font_cache_lock);
-    cache_entry->font = font;
-    if (cache_entry->font != NULL)
-        cache_entry->font->ref_counter += cache_entry->waiters;
-    cnd_broadcast(&cache_entry->cond);
-    mtx_unlock(&font_cache_lock);
+    *hash = disk_cache_hash(*hash, path, strlen(path));
+    *hash = disk_cache_hash(*hash, values, sizeof(values));
+}
 
-    assert(font == NULL || (void *)&font->public == (void *)font);
-    return font != NULL ? &font->public : NULL;
+/*
+ * Fingerprint of fontconfig’s configuration; its version, the
+ * configuration files, the font directories (a directory’s mtime
+ * changes when fonts are added to, or removed from, it), and the
+ * number of fonts.
+ */
+static uint64_t
+fontconfig_fingerprint(void)
+{
+    uint64_t hash = DISK_CACHE_HASH_INIT;
+
+    const int version = FcGetVersion();
+    hash = disk_cache_hash(hash, FCFT_VERSION, strlen(FCFT_VERSION));
+    hash = disk_cache_hash(hash, &version, sizeof(version));
+
+    FcStrList *files = FcConfigGetConfigFiles(NULL);
+    for (FcChar8 *f = FcStrListNext(files); f != NULL; f = FcStrListNext(files))
+        hash_stat(&hash, (const char *)f);
+    FcStrListDone(files);
+
+    FcStrList *dirs = FcConfigGetFontDirs(NULL);
+    for (FcChar8 *d = FcStrListNext(dirs); d != NULL; d = FcStrListNext(dirs))
+        hash_stat(&hash, (const char *)d);
+    FcStrListDone(dirs);
+
+    const FcSetName set_names[] = {FcSetSystem, FcSetApplication};
+    for (size_t i = 0; i < ALEN(set_names); i++) {
+        const FcFontSet *set = FcConfigGetFonts(NULL, set_names[i]);
+        const int nfont = set != NULL ? set->nfont : 0;
+        hash = disk_cache_hash(hash, &nfont, sizeof(nfont));
+    }
+
+    return hash;
 }
 
-FCFT_EXPORT struct fcft_font *
-fcft_clone(const struct fcft_font *_font)
+/*
+ * The cache key is the fully substituted pattern; the cache file
+ * name is a hash of the key and the configuration fingerprint.
+ * Returns NULL on error. Free with free()
+ */
+static char *
+font_set_key(FcPattern *pattern, char name[static 32])
 {
-    if (_font == NULL)
+    FcChar8 *unparsed = FcNameUnparse(pattern);
+    if (unparsed == NULL)
         return NULL;
 
-    struct font_priv *font = (struct font_priv *)_font;
+    const size_t len = strlen((const char *)unparsed);
+    const uint64_t fingerprint = fontconfig_fingerprint();
 
-    mtx_lock(&font->lock);
-    {
-        assert(font->ref_counter >= 1);
-        font->ref_counter++;
-    }
-    mtx_unlock(&font->lock);
+    uint64_t hash = disk_cache_hash(
+        DISK_CACHE_HASH_INIT, &fingerprint, sizeof(fingerprint));
+    hash = disk_cache_hash(hash, unparsed, len);
 
-    return &font->public;
+    snprintf(name, 32, "fontset-%016llx", (unsigned long long)hash);
+
+    /* Not FcStrFree():d by the caller */
+    char *key = strdup((const char *)unparsed);
+    FcStrFree(unparsed);
+    return key;
 }
 
-static bool
-glyph_for_index(const struct instance *inst, uint32_t index,
-                enum fcft_subpixel subpixel, struct glyph_priv *glyph)
+/*
+ * Returns the font set FcFontSort() returned for ‘pattern’ in an
+ * earlier process, or NULL if it is not cached (or no longer valid).
+ */
+static FcFontSet *
+font_set_from_disk_cache(const char *name, const char *key)
 {
-    glyph->valid = false;
-    glyph->subpixel = subpixel;
+    FcFontSet *set = NULL;
+    struct disk_cache_map *map = disk_cache_open(name);
+    if (map == NULL)
+        goto out;
+
+    const size_t key_len = strlen(key);
+    const struct disk_font_set_header *hdr = map->data;
+
+    if (map->size < sizeof(*hdr) ||
+        memcmp(hdr->magic, disk_font_set_magic, sizeof(hdr->magic)) != 0 ||
+        hdr->byte_order != disk_glyph_byte_order ||
+        hdr->key_len != key_len ||
+        map->size - sizeof(*hdr) < key_len ||
+        memcmp(hdr + 1, key, key_len) != 0 ||
+        hdr->count == 0 || hdr->count > map->size)
+    {
+        goto out;
+    }
 
-    pixman_image_t *pix = NULL;
-    uint8_t *data = NULL;
+    const size_t count = hdr->count;
+    struct cached_font {
+        const char *path;
+        size_t path_len;
+        uint64_t hash;
+        int index;
+        FcPattern *pattern;
+        struct cached_font *next;  /* Hash chain */
+    } *fonts = calloc(count, sizeof(fonts[0]));
+
+    size_t buckets_count = 1;
+    while (buckets_count < count)
+        buckets_count *= 2;
+
+    struct cached_font **buckets = calloc(buckets_count, sizeof(buckets[0]));
+
+    if (fonts == NULL || buckets == NULL) {
+        free(fonts);
+        free(buckets);
+        goto out;
+    }
 
-    FT_Error err;
-    if ((err = FT_Load_Glyph(inst->face, index, inst->load_flags)) != FT_Err_Ok) {
-        LOG_ERR("%s: failed to load glyph #%d: %s",
-                inst->path, index, ft_error_string(err));
-        goto err;
+    size_t offset = align_up(sizeof(*hdr) + key_len, 8);
+    for (size_t i = 0; i < count; i++) {
+        if (offset > map->size ||
+            map->size - offset < sizeof(struct disk_font_set_entry))
+        {
+            goto invalid;
+        }
+
+        const struct disk_font_set_entry *e =
+            (const void *)((const char *)map->data + offset);
+        offset += sizeof(*e);
+
+        if (e->path_len == 0 || map->size - offset < e->path_len)
+            goto invalid;
+
+        struct cached_font *font = &fonts[i];
+        font->path = (const char *)map->data + offset;
+        font->path_len = e->path_len;
+        font->hash = disk_cache_hash(
+            DISK_CACHE_HASH_INIT, font->path, font->path_len);
+        font->index = e->index;
+        offset = align_up(offset + e->path_len, 8);
+
+        struct cached_font **bucket =
+            &buckets[font->hash & (buckets_count - 1)];
+        font->next = *bucket;
+        *bucket = font;
     }
 
-    if (inst->embolden && inst->face->glyph->format == FT_GLYPH_FORMAT_OUTLINE)
-        FT_GlyphSlot_Embolden(inst->face->glyph);
+    /* Find fontconfig’s patterns for the cached fonts */
+    size_t found = 0;
+    const FcSetName set_names[] = {FcSetSystem, FcSetApplication};
 
-    int render_flags;
-    bool bgr;
+    for (size_t i = 0; i < ALEN(set_names) && found < count; i++) {
+        const FcFontSet *fc_set = FcConfigGetFonts(NULL, set_names[i]);
+        if (fc_set == NULL)
+            continue;
 
-    if (inst->antialias) {
-        switch (subpixel) {
-        case FCFT_SUBPIXEL_NONE:
-            render_flags = inst->render_flags_normal;
-            bgr = false;
-            break;
+        for (int j = 0; j < fc_set->nfont && found < count; j++) {
+            FcPattern *font = fc_set->fonts[j];
 
-        case FCFT_SUBPIXEL_HORIZONTAL_RGB:
-        case FCFT_SUBPIXEL_HORIZONTAL_BGR:
-            render_flags = FT_RENDER_MODE_LCD;
-            bgr = subpixel == FCFT_SUBPIXEL_HORIZONTAL_BGR;
-            break;
+            FcChar8 *file;
+            int index;
+            if (FcPatternGetString(font, FC_FILE, 0, &file) != FcResultMatch ||
+                FcPatternGetInteger(font, FC_INDEX, 0, &index) != FcResultMatch)
+            {
+                continue;
+            }
 
-        case FCFT_SUBPIXEL_VERTICAL_RGB:
-        case FCFT_SUBPIXEL_VERTICAL_BGR:
-            render_flags = FT_RENDER_MODE_LCD_V;
-            bgr = subpixel == FCFT_SUBPIXEL_VERTICAL_BGR;
-            break;
+            const size_t file_len = strlen((const char *)file);
+            const uint64_t hash = disk_cache_hash(
+                DISK_CACHE_HASH_INIT, file, file_len);
 
-        case FCFT_SUBPIXEL_DEFAULT:
-        default:
-            render_flags = inst->render_flags_subpixel;
-            bgr = inst->bgr;
-            break;
+            for (struct cached_font *f = buckets[hash & (buckets_count - 1)];
+                 f != NULL; f = f->next)
+            {
+                if (f->pattern == NULL &&
+                    f->hash == hash &&
+                    f->index == index &&
+                    f->path_len == file_len &&
+                    memcmp(f->path, file, file_len) == 0)
+                {
+                    f->pattern = font;
+                    found++;
+                    break;
+                }
+            }
         }
-    } else {
-        render_flags = inst->render_flags_normal;
-        bgr = false;
     }
 
-#if FREETYPE_MAJOR >= 3 || (FREETYPE_MAJOR >= 2 && FREETYPE_MINOR >= 12)
-    if (inst->face->glyph->format == FT_GLYPH_FORMAT_SVG) {
-        /* Up to, and include, 2.12.1, FreeType rejects everything
-         * else with “bad argument” */
-        render_flags = FT_RENDER_MODE_NORMAL;
-    }
-#endif
+    free(buckets);
+    buckets = NULL;
 
-    /*
-     * LCD filter is per library instance, hence we need to re-set it
-     * every time. But only if we need it, and only if we _can_, to
-     * avoid locking a global mutex. See init().
-     */
-    bool unlock_ft_lock = false;
-    if (can_set_lcd_filter &&
-        ((render_flags & FT_RENDER_MODE_LCD) ||
-         (render_flags & FT_RENDER_MODE_LCD_V)))
-    {
-        mtx_lock(&ft_lock);
-        unlock_ft_lock = true;
+    if (found != count) {
+        LOG_DBG("%s: cached font set refers to removed fonts", name);
+        free(fonts);
+        goto out;
+    }
 
-        FT_Error err = FT_Library_SetLcdFilter(ft_lib, inst->lcd_filter);
+    if ((set = FcFontSetCreate()) == NULL) {
+        free(fonts);
+        goto out;
+    }
 
-        if (err != FT_Err_Ok) {
-            LOG_ERR("failed to set LCD filter: %s", ft_error_string(err));
-            mtx_unlock(&ft_lock);
-            goto err;
+    for (size_t i = 0; i < count; i++) {
+        FcPatternReference(fonts[i].pattern);
+        if (!FcFontSetAdd(set, fonts[i].pattern)) {
+            FcPatternDestroy(fonts[i].pattern);
+            FcFontSetDestroy(set);
+            set = NULL;
+            break;
         }
     }
 
-    if (inst->face->glyph->format != FT_GLYPH_FORMAT_BITMAP) {
-        if ((err = FT_Render_Glyph(inst->face->glyph, render_flags)) != FT_Err_Ok) {
-            LOG_ERR("%s: failed to render glyph: %s",
-                    inst->path, ft_error_string(err));
-            if (unlock_ft_lock)
-                mtx_unlock(&ft_lock);
-            goto err;
+    free(fonts);
+    goto out;
+
+invalid:
+    LOG_WARN("%s: ignoring invalid font set cache file", name);
+    free(buckets);
+    free(fonts);
+
+out:
+    disk_cache_map_unref(map);
+    return set;
+}
+
+static void
+font_set_to_disk_cache(const char *name, const char *key, const FcFontSet *set)
+{
+    struct disk_cache_writer *writer = disk_cache_writer_create(name);
+    if (writer == NULL)
+        return;
+
+    const size_t key_len = strlen(key);
+    struct disk_font_set_header hdr = {
+        .byte_order = disk_glyph_byte_order,
+        .key_len = key_len,
+        .count = 0,
+    };
+    memcpy(hdr.magic, disk_font_set_magic, sizeof(hdr.magic));
+
+    for (int i = 0; i < set->nfont; i++) {
+        FcChar8 *file;
+        int index;
+        if (FcPatternGetString(set->fonts[i], FC_FILE, 0, &file) != FcResultMatch ||
+            FcPatternGetInteger(set->fonts[i], FC_INDEX, 0, &index) != FcResultMatch)
+        {
+            /* Can’t be re-created from fontconfig’s font list */
+            disk_cache_writer_abort(writer);
+            return;
         }
+
+        hdr.count++;
     }
 
-    if (unlock_ft_lock)
-        mtx_unlock(&ft_lock);
+    disk_cache_write(writer, &hdr, sizeof(hdr));
+    disk_cache_write(writer, key, key_len);
+    disk_cache_write_align(writer, 8);
 
-    if (inst->face->glyph->format != FT_GLYPH_FORMAT_BITMAP) {
-        LOG_ERR("%s: rasterized glyph is not a bitmap", inst->path);
-        goto err;
+    for (int i = 0; i < set->nfont; i++) {
+        FcChar8 *file;
+        int index;
+        FcPatternGetString(set->fonts[i], FC_FILE, 0, &file);
+        FcPatternGetInteger(set->fonts[i], FC_INDEX, 0, &index);
+
+        const struct disk_font_set_entry entry = {
+            .index = index,
+            .path_len = strlen((const char *)file),
+        };
+
+        disk_cache_write(writer, &entry, sizeof(entry));
+        disk_cache_write(writer, file, entry.path_len);
+        disk_cache_write_align(writer, 8);
     }
 
-    const FT_Bitmap *bitmap = &inst->face->glyph->bitmap;
-    pixman_format_code_t pix_format;
+    disk_cache_writer_commit(writer);
+}
+
+static FcPattern *
+base_pattern_from_name(const char *name, FcFontSet **set)
+{
+    /* Fontconfig fails to parse floating point values unless locale
+     * is e.g C, or en_US.UTF-8 */
+    assert(strcmp(setlocale(LC_NUMERIC, NULL), "C") == 0);
+    FcPattern *pattern = FcNameParse((const unsigned char *)name);
+
+    if (pattern == NULL) {
+        LOG_ERR("%s: failed to lookup font", name);
+        return NULL;
+    }
+
+    if (!FcConfigSubstitute(NULL, pattern, FcMatchPattern)) {
+        LOG_ERR("%s: failed to do config substitution", name);
+        FcPatternDestroy(pattern);
+        return NULL;
+    }
+
+    FcDefaultSubstitute(pattern);
+
+    char cache_name[32];
+    char *cache_key = disk_cache_enabled
+        ? font_set_key(pattern, cache_name) : NULL;
+
+    *set = cache_key != NULL
+        ? font_set_from_disk_cache(cache_name, cache_key) : NULL;
+
+    if (*set == NULL) {
+        FcResult result;
+        *set = FcFontSort(NULL, pattern, FcTrue, NULL, &result);
+        if (result != FcResultMatch) {
+            LOG_ERR("%s: failed to match font", name);
+            FcPatternDestroy(pattern);
+            free(cache_key);
+            return NULL;
+        }
+
+        if (cache_key != NULL)
+            font_set_to_disk_cache(cache_name, cache_key, *set);
+    } else
+        LOG_DBG("%s: font set loaded from disk cache", name);
+
+    free(cache_key);
+    return pattern;
+}
+
+static FcPattern *
+pattern_from_font_set(FcPattern *base_pattern, FcFontSet *set, size_t idx)
+{
+    FcPattern *pattern = FcFontRenderPrepare(NULL, base_pattern, set->fonts[idx]);
+    if (pattern == NULL) {
+        LOG_ERR("failed to prepare 'final' pattern");
+        return NULL;
+    }
+
+    return pattern;
+}
+
+static bool
+instantiate_pattern(FcPattern *pattern, double req_pt_size, double req_px_size,
+                    struct instance *font)
+{
+    FcChar8 *face_file = NULL;
+    if (FcPatternGetString(pattern, FC_FT_FACE, 0, &face_file) != FcResultMatch &&
+        FcPatternGetString(pattern, FC_FILE, 0, &face_file) != FcResultMatch)
+    {
+        LOG_ERR("no face file path in pattern");
+        return false;
+    }
+
+    double dpi;
+    if (FcPatternGetDouble(pattern, FC_DPI, 0, &dpi) != FcResultMatch)
+        dpi = 75;
+
+    double size;
+    if (FcPatternGetDouble(pattern, FC_SIZE, 0, &size) != FcResultMatch)
+        LOG_WARN("%s: failed to get size", face_file);
+
+    double pixel_size;
+    if (FcPatternGetDouble(pattern, FC_PIXEL_SIZE, 0, &pixel_size) != FcResultMatch) {
+        LOG_ERR("%s: failed to get pixel size", face_file);
+        return false;
+    }
+
+    int face_index;
+    if (FcPatternGetInteger(pattern, FC_INDEX, 0, &face_index) != FcResultMatch) {
+        LOG_WARN("%s: failed to get face index", face_file);
+        face_index = 0;
+    }
+
+    FcChar8 *full_name = NULL;
+    if (FcPatternGetString(pattern, FC_FULLNAME, face_index, &full_name) != FcResultMatch)
+        LOG_WARN("failed to get full font name");
+
+    mtx_lock(&ft_lock);
+    FT_Face ft_face;
+    FT_Error ft_err = FT_New_Face(ft_lib, (const char *)face_file, face_index, &ft_face);
+    mtx_unlock(&ft_lock);
+    if (ft_err != FT_Err_Ok) {
+        LOG_ERR("%s: failed to create FreeType face; %s",
+                face_file, ft_error_string(ft_err));
+        return false;
+    }
+
+    if (mtx_init(&font->faces.lock, mtx_plain) != thrd_success) {
+        LOG_ERR("%s: failed to instantiate mutex", face_file);
+        mtx_lock(&ft_lock);
+        FT_Done_Face(ft_face);
+        mtx_unlock(&ft_lock);
+        return false;
+    }
+
+    font->faces.idle = NULL;
+    font->faces.count = font->faces.size = 0;
+    font->faces.index = face_index;
+    font->faces.pixel_size = round(pixel_size);
+    font->faces.has_matrix = false;
+
+    if ((ft_err = FT_Set_Pixel_Sizes(ft_face, 0, font->faces.pixel_size)) != FT_Err_Ok) {
+        LOG_ERR("%s: failed to set character size: %s",
+                face_file, ft_error_string(ft_err));
+        goto err_done_face;
+    }
+
+    FcBool scalable;
+    if (FcPatternGetBool(pattern, FC_SCALABLE, 0, &scalable) != FcResultMatch)
+        scalable = FcTrue;
+
+    FcBool outline;
+    if (FcPatternGetBool(pattern, FC_OUTLINE, 0, &outline) != FcResultMatch)
+        outline = FcTrue;
+
+    FcBool is_color;
+    if (FcPatternGetBool(pattern, FC_COLOR, 0, &is_color) != FcResultMatch)
+        is_color = FcFalse;
+
+    double pixel_fixup = 1.;
+    bool fixup_estimated = false;
+    if (FcPatternGetDouble(pattern, "pixelsizefixupfactor", 0, &pixel_fixup) != FcResultMatch) {
+        /*
+         * Force a fixup factor on scalable bitmap fonts (typically
+         * emoji fonts). The fixup factor is
+         *   requested-pixel-size / actual-pixels-size
+         */
+        if (scalable && !outline) {
+            if (req_px_size < 0.)
+                req_px_size = req_pt_size * dpi / 72.;
+
+            pixel_fixup = req_px_size / ft_face->size->metrics.y_ppem;
+            fixup_estimated = true;
+            LOG_DBG("estimated pixel fixup factor to %f (from pixel size: %f)",
+                    pixel_fixup, req_px_size);
+        } else
+            pixel_fixup = 1.;
+    }
+
+#if 0
+    LOG_DBG("FIXED SIZES: %d", ft_face->num_fixed_sizes);
+    for (int i = 0; i < ft_face->num_fixed_sizes; i++)
+        LOG_DBG("  #%d: height=%d, y_ppem=%f", i, ft_face->available_sizes[i].height, ft_face->available_sizes[i].y_ppem / 64.);
+#endif
+
+    FcBool fc_hinting;
+    if (FcPatternGetBool(pattern, FC_HINTING,0,  &fc_hinting) != FcResultMatch)
+        fc_hinting = FcTrue;
+
+    FcBool fc_antialias;
+    if (FcPatternGetBool(pattern, FC_ANTIALIAS, 0, &fc_antialias) != FcResultMatch)
+        fc_antialias = FcTrue;
+
+    int fc_hintstyle;
+    if (FcPatternGetInteger(pattern, FC_HINT_STYLE, 0, &fc_hintstyle) != FcResultMatch)
+        fc_hintstyle = FC_HINT_SLIGHT;
+
+    int fc_rgba;
+    if (FcPatternGetInteger(pattern, FC_RGBA, 0, &fc_rgba) != FcResultMatch)
+        fc_rgba = FC_RGBA_UNKNOWN;
+
+    int load_flags = FT_LOAD_DEFAULT;
+    int load_target = FT_LOAD_TARGET_NORMAL;
+
+    if (!fc_antialias) {
+        if (!fc_hinting || fc_hintstyle == FC_HINT_NONE)
+            load_flags |= FT_LOAD_NO_HINTING;
+        else
+            load_target = FT_LOAD_TARGET_MONO;
+
+        load_flags |= FT_LOAD_MONOCHROME;
+    }
+
+    else {
+        if (!fc_hinting || fc_hintstyle == FC_HINT_NONE)
+            load_flags |= FT_LOAD_NO_HINTING;
+
+        else if (fc_hintstyle == FC_HINT_SLIGHT)
+            load_target = FT_LOAD_TARGET_LIGHT;
+
+        else if (fc_hintstyle == FC_HINT_MEDIUM)
+            ;
+
+        else if (fc_rgba == FC_RGBA_RGB || fc_rgba == FC_RGBA_BGR)
+            load_target = FT_LOAD_TARGET_LCD;
+
+        else if (fc_rgba == FC_RGBA_VRGB || fc_rgba == FC_RGBA_VBGR)
+            load_target = FT_LOAD_TARGET_LCD_V;
+    }
+
+    FcBool fc_embeddedbitmap;
+    if (FcPatternGetBool(pattern, FC_EMBEDDED_BITMAP, 0, &fc_embeddedbitmap) != FcResultMatch)
+        fc_embeddedbitmap = FcTrue;
+
+    if (!fc_embeddedbitmap && outline)
+        load_flags |= FT_LOAD_NO_BITMAP;
+
+    FcBool fc_autohint;
+    if (FcPatternGetBool(pattern, FC_AUTOHINT, 0, &fc_autohint) != FcResultMatch)
+        fc_autohint = FcFalse;
+
+    if (fc_autohint)
+        load_flags |= FT_LOAD_FORCE_AUTOHINT;
+
+    int render_flags_normal, render_flags_subpixel;
+    if (!fc_antialias)
+        render_flags_normal = render_flags_subpixel = FT_RENDER_MODE_MONO;
+
+    else {
+        if (fc_rgba == FC_RGBA_RGB || fc_rgba == FC_RGBA_BGR) {
+            render_flags_subpixel = FT_RENDER_MODE_LCD;
+            render_flags_normal = FT_RENDER_MODE_NORMAL;
+        }
+
+        else if (fc_rgba == FC_RGBA_VRGB || fc_rgba == FC_RGBA_VBGR) {
+            render_flags_subpixel = FT_RENDER_MODE_LCD_V;
+            render_flags_normal = FT_RENDER_MODE_NORMAL;
+        }
+
+        else
+            render_flags_normal = render_flags_subpixel = FT_RENDER_MODE_NORMAL;
+    }
+
+    int fc_lcdfilter;
+    if (FcPatternGetInteger(pattern, FC_LCD_FILTER, 0, &fc_lcdfilter) != FcResultMatch)
+        fc_lcdfilter = FC_LCD_DEFAULT;
+
+    switch (fc_lcdfilter) {
+    case FC_LCD_NONE:    font->lcd_filter = FT_LCD_FILTER_NONE; break;
+    case FC_LCD_DEFAULT: font->lcd_filter = FT_LCD_FILTER_DEFAULT; break;
+    case FC_LCD_LIGHT:   font->lcd_filter = FT_LCD_FILTER_LIGHT; break;
+    case FC_LCD_LEGACY:  font->lcd_filter = FT_LCD_FILTER_LEGACY; break;
+    }
+
+    FcBool fc_embolden;
+    if (FcPatternGetBool(pattern, FC_EMBOLDEN, 0, &fc_embolden) != FcResultMatch)
+        fc_embolden = FcFalse;
+
+    FcMatrix *fc_matrix;
+    if (FcPatternGetMatrix(pattern, FC_MATRIX, 0, &fc_matrix) == FcResultMatch) {
+        FT_Matrix m = {
+            .xx = fc_matrix->xx * 0x10000,
+            .xy = fc_matrix->xy * 0x10000,
+            .yx = fc_matrix->yx * 0x10000,
+            .yy = fc_matrix->yy * 0x10000,
+        };
+        FT_Set_Transform(ft_face, &m, NULL);
+
+        font->faces.has_matrix = true;
+        font->faces.matrix = m;
+    }
+
+    font->name = full_name != NULL ? strdup((char *)full_name) : NULL;
+    font->path = strdup((char *)face_file);
+    if (font->path == NULL) {
+        free(font->name);
+        free(font->path);
+        goto err_done_face;
+    }
+
+    font->face = ft_face;
+    font->load_flags = load_target | load_flags | FT_LOAD_COLOR;
+    font->antialias = fc_antialias;
+    font->embolden = fc_embolden;
+    font->is_color = is_color;
+    font->render_flags_normal = render_flags_normal;
+    font->render_flags_subpixel = render_flags_subpixel;
+    font->pixel_size_fixup = pixel_fixup;
+    font->pixel_fixup_estimated = fixup_estimated;
+    font->bgr = fc_rgba == FC_RGBA_BGR || fc_rgba == FC_RGBA_VBGR;
+
+    /* For logging: e.g. "+ss01 -dlig" */
+    char features[256] = {0};
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+    font->hb_font = hb_ft_font_create_referenced(ft_face);
+    if (font->hb_font == NULL) {
+        LOG_ERR("%s: failed to instantiate harfbuzz font", face_file);
+        goto err_free_path;
+    }
+
+    font->hb_buf = hb_buffer_create();
+    if (font->hb_buf == NULL) {
+        LOG_ERR("%s: failed to instantiate harfbuzz buffer", face_file);
+        goto err_hb_font_destroy;
+    }
+
+    for (font->hb_feats_count = 0; font->hb_feats_count < ALEN(font->hb_feats); ) {
+        FcChar8 *fc_feat;
+        if (FcPatternGetString(
+                pattern, FC_FONT_FEATURES,
+                font->hb_feats_count, &fc_feat) != FcResultMatch)
+        {
+            break;
+        }
+
+        hb_feature_t *feat = &font->hb_feats[font->hb_feats_count];
+
+        if (hb_feature_from_string((const char *)fc_feat, -1, feat)) {
+            const char tag[4] = {
+                (feat->tag >> 24) & 0xff,
+                (feat->tag >> 16) & 0xff,
+                (feat->tag >> 8) & 0xff,
+                (feat->tag >> 0) & 0xff,
+            };
+
+            size_t ofs = font->hb_feats_count * 6;
+            snprintf(&features[ofs], sizeof(features) - ofs,
+                     " %c%.4s", feat->value ? '+' : '-', tag);
+
+            LOG_DBG("feature: %.4s=%s", tag, feat->value ? "on" : "off");
+            font->hb_feats_count++;
+        }
+    }
+#endif
+
+    double max_x_advance = ft_face->size->metrics.max_advance / 64.;
+    double max_y_advance = ft_face->size->metrics.height / 64.;
+    double height = ft_face->size->metrics.height / 64.;
+    double descent = ft_face->size->metrics.descender / 64.;
+    double ascent = ft_face->size->metrics.ascender / 64.;
+
+    font->metrics.height = ceil(height * font->pixel_size_fixup);
+    font->metrics.descent = ceil(-descent * font->pixel_size_fixup);
+    font->metrics.ascent = ceil(ascent * font->pixel_size_fixup);
+    font->metrics.max_advance.x = ceil(max_x_advance * font->pixel_size_fixup);
+    font->metrics.max_advance.y = ceil(max_y_advance * font->pixel_size_fixup);
+    font->metrics.antialias = fc_antialias;
+    font->metrics.subpixel = !fc_antialias
+        ? FCFT_SUBPIXEL_NONE
+        : (fc_rgba == FC_RGBA_RGB ? FCFT_SUBPIXEL_HORIZONTAL_RGB :
+           fc_rgba == FC_RGBA_BGR ? FCFT_SUBPIXEL_HORIZONTAL_BGR :
+           fc_rgba == FC_RGBA_VRGB ? FCFT_SUBPIXEL_VERTICAL_RGB :
+           fc_rgba == FC_RGBA_VBGR ? FCFT_SUBPIXEL_VERTICAL_BGR :
+           FCFT_SUBPIXEL_NONE);
+    font->metrics.name = font->name;
+
+    underline_strikeout_metrics(ft_face, &font->metrics);
+
+#if defined(LOG_ENABLE_DBG) && LOG_ENABLE_DBG
+    LOG_DBG("%s: size=%.2fpt/%.2fpx, dpi=%.2f, fixup-factor: %.4f, "
+            "line-height: %dpx, ascent: %dpx, descent: %dpx, "
+            "x-advance (max): %dpx, features:%s",
+            font->path, size, pixel_size, dpi, font->pixel_size_fixup,
+            font->metrics.height, font->metrics.ascent, font->metrics.descent,
+            font->metrics.max_advance.x, features);
+#else
+    LOG_INFO("%s: size=%.2fpt/%dpx, dpi=%.2f%s",
+             font->path, size, (int)round(pixel_size), dpi, features);
+#endif
+
+    glyph_disk_cache_open(font);
+    return true;
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+err_hb_font_destroy:
+    hb_font_destroy(font->hb_font);
+err_free_path:
+    free(font->path);
+    free(font->name);
+#endif
+
+err_done_face:
+    mtx_destroy(&font->faces.lock);
+    mtx_lock(&ft_lock);
+    FT_Done_Face(ft_face);
+    mtx_unlock(&ft_lock);
+    return false;
+}
+
+/*
+ * Appends a fallback to the font’s fallback list. The list takes
+ * ownership of the fallback’s pattern, charset and langset (which are
+ * destroyed on failure)
+ */
+static bool
+fallback_push(struct font_priv *font, struct fallback fallback)
+{
+    static const FcChar8 *const lang_emoji = (const FcChar8 *)"und-zsye";
+
+    if (font->fallbacks.count >= font->fallbacks.size) {
+        size_t size = font->fallbacks.size * 2;
+        struct fallback *arr = realloc(
+            font->fallbacks.arr, size * sizeof(arr[0]));
+
+        if (arr == NULL) {
+            fallback_destroy(&fallback);
+            return false;
+        }
+
+        font->fallbacks.arr = arr;
+        font->fallbacks.size = size;
+    }
+
+    fallback.has_lang_emoji = fallback.langset != NULL &&
+        FcLangSetHasLang(fallback.langset, lang_emoji) == FcLangEqual;
+
+    font->fallbacks.arr[font->fallbacks.count++] = fallback;
+    return true;
+}
+
+/*
+ * Instantiates a fallback. Fallbacks added by fallbacks_extend() hold
+ * fontconfig’s (un-prepared) pattern; these are prepared first.
+ *
+ * On failure, the caller should mark the fallback as failed, so that
+ * we don’t have to keep trying to instantiate it.
+ *
+ * Must only be called while font->lock is held
+ */
+static struct instance *
+fallback_instantiate(struct font_priv *font, struct fallback *fallback)
+{
+    assert(fallback->font == NULL);
+
+    if (!fallback->prepared) {
+        FcPattern *pattern = FcFontRenderPrepare(
+            NULL, font->fc_fallbacks.base_pattern, fallback->pattern);
+
+        if (pattern == NULL) {
+            LOG_ERR("failed to prepare 'final' pattern");
+            return NULL;
+        }
+
+        FcPatternDestroy(fallback->pattern);
+        fallback->pattern = pattern;
+        fallback->prepared = true;
+    }
+
+    struct instance *inst = malloc(sizeof(*inst));
+    if (inst == NULL)
+        return NULL;
+
+    if (!instantiate_pattern(
+            fallback->pattern,
+            fallback->req_pt_size, fallback->req_px_size,
+            inst))
+    {
+        free(inst);
+        return NULL;
+    }
+
+    fallback->font = inst;
+    font->stats.fallbacks_instantiated++;
+    return inst;
+}
+
+/*
+ * Appends fonts from the primary font’s font set to the fallback
+ * list, in fontconfig’s order, up to (and including) the first one
+ * that has all of the codepoints (ignoring ZWJ and variation
+ * selectors). The appended fallbacks are not instantiated.
+ *
+ * Returns false if there are no more fonts in the set, and none of
+ * the appended ones has the codepoints.
+ *
+ * Must only be called while font->lock is held
+ */
+static bool
+fallbacks_extend(struct font_priv *font, size_t len, const uint32_t cps[static len])
+{
+    FcFontSet *set = font->fc_fallbacks.set;
+    FcPattern *base_pattern = font->fc_fallbacks.base_pattern;
+
+    if (set == NULL)
+        return false;
+
+    double req_px_size = -1., req_pt_size = -1.;
+    FcPatternGetDouble(base_pattern, FC_PIXEL_SIZE, 0, &req_px_size);
+    FcPatternGetDouble(base_pattern, FC_SIZE, 0, &req_pt_size);
+
+    while (font->fc_fallbacks.next < (size_t)set->nfont) {
+        FcPattern *pattern = set->fonts[font->fc_fallbacks.next++];
+
+        FcCharSet *charset;
+        if (FcPatternGetCharSet(base_pattern, FC_CHARSET, 0, &charset) != FcResultMatch &&
+            FcPatternGetCharSet(pattern, FC_CHARSET, 0, &charset) != FcResultMatch)
+        {
+            FcChar8 *file = NULL;
+            FcPatternGetString(pattern, FC_FILE, 0, &file);
+            LOG_ERR("%s: failed to get charset", file != NULL ? (const char *)file : "<unknown>");
+            continue;
+        }
+
+        FcLangSet *langset;
+        if (FcPatternGetLangSet(pattern, FC_LANG, 0, &langset) != FcResultMatch)
+            langset = NULL;
+
+        FcPatternReference(pattern);
+        if (!fallback_push(font, (struct fallback){
+                    .pattern = pattern,
+                    .prepared = false,
+                    .charset = FcCharSetCopy(charset),
+                    .langset = langset != NULL ? FcLangSetCopy(langset) : NULL,
+                    .req_px_size = req_px_size,
+                    .req_pt_size = req_pt_size}))
+        {
+            return false;
+        }
+
+        bool has_all_code_points = true;
+        for (size_t i = 0; i < len && has_all_code_points; i++) {
+            if (cps[i] == 0x200d || cps[i] == 0xfe0e || cps[i] == 0xfe0f)
+                continue;
+            has_all_code_points = FcCharSetHasChar(charset, cps[i]);
+        }
+
+        if (has_all_code_points)
+            return true;
+    }
+
+    return false;
+}
+
+static bool
+fallback_has_codepoint(const struct fallback *fallback, uint32_t cp,
+                       enum coverage_kind kind)
+{
+    if (fallback->failed || !FcCharSetHasChar(fallback->charset, cp))
+        return false;
+
+    /* Fonts without a language set are assumed to be good for both */
+    if (kind == COVERAGE_ANY || fallback->langset == NULL)
+        return true;
+
+    return fallback->has_lang_emoji == (kind == COVERAGE_EMOJI);
+}
+
+/* Must only be called while font->lock is held */
+static void
+coverage_reset(struct font_priv *font)
+{
+    if (font->coverage == NULL)
+        return;
+
+    for (size_t i = 0; i < 0x110000 / 256; i++)
+        free(font->coverage[i]);
+
+    free(font->coverage);
+    font->coverage = NULL;
+}
+
+/*
+ * Returns the index of the first fallback that has ‘cp’, or -1 if no
+ * font has it. Fallbacks are added from fontconfig’s font set as
+ * needed.
+ *
+ * Results are cached in the coverage index. A result remains valid
+ * until a fallback fails to instantiate (since later fallbacks are
+ * appended, the first fallback that has a codepoint never changes).
+ *
+ * Must only be called while font->lock is held
+ */
+static ssize_t
+coverage_lookup(struct font_priv *font, uint32_t cp, enum coverage_kind kind)
+{
+    uint16_t *entry = NULL;
+
+    if (cp < 0x110000) {
+        if (font->coverage == NULL)
+            font->coverage = calloc(0x110000 / 256, sizeof(font->coverage[0]));
+
+        if (font->coverage != NULL) {
+            struct coverage_page **page = &font->coverage[cp / 256];
+            if (*page == NULL)
+                *page = calloc(1, sizeof(**page));
+            if (*page != NULL)
+                entry = &(*page)->entries[cp % 256][kind];
+        }
+    }
+
+    if (entry != NULL && *entry != COVERAGE_UNKNOWN)
+        return *entry == COVERAGE_MISSING ? -1 : (ssize_t)*entry - 1;
+
+    ssize_t idx = -1;
+    size_t searched = 0;
+
+    do {
+        for (size_t i = searched; i < font->fallbacks.count; i++) {
+            if (fallback_has_codepoint(&font->fallbacks.arr[i], cp, kind)) {
+                idx = i;
+                break;
+            }
+        }
+
+        searched = font->fallbacks.count;
+    } while (idx < 0 && fallbacks_extend(font, 1, &cp));
+
+    /* Too many fallbacks to be represented in the index */
+    if (idx + 1 >= COVERAGE_MISSING)
+        return idx;
+
+    if (entry != NULL)
+        *entry = idx < 0 ? COVERAGE_MISSING : idx + 1;
+
+    return idx;
+}
+
+
+/*
+ * Lock-free (with respect to font->lock).
+ *
+ * Returns a FreeType face for ‘inst’ that no other thread is using,
+ * creating a new one if all existing faces are busy. Return it with
+ * instance_face_put() when done.
+ *
+ * Returns NULL if a new face could not be created.
+ */
+static FT_Face
+instance_face_get(struct instance *inst)
+{
+    FT_Face face = NULL;
+
+    mtx_lock(&inst->faces.lock);
+    if (inst->faces.count > 0)
+        face = inst->faces.idle[--inst->faces.count];
+    mtx_unlock(&inst->faces.lock);
+
+    if (face != NULL)
+        return face;
+
+    mtx_lock(&ft_lock);
+    FT_Error ft_err = FT_New_Face(ft_lib, inst->path, inst->faces.index, &face);
+    mtx_unlock(&ft_lock);
+    if (ft_err != FT_Err_Ok) {
+        LOG_ERR("%s: failed to create FreeType face; %s",
+                inst->path, ft_error_string(ft_err));
+        return NULL;
+    }
+
+    if ((ft_err = FT_Set_Pixel_Sizes(face, 0, inst->faces.pixel_size)) != FT_Err_Ok) {
+        LOG_ERR("%s: failed to set character size: %s",
+                inst->path, ft_error_string(ft_err));
+        mtx_lock(&ft_lock);
+        FT_Done_Face(face);
+        mtx_unlock(&ft_lock);
+        return NULL;
+    }
+
+    if (inst->faces.has_matrix)
+        FT_Set_Transform(face, &inst->faces.matrix, NULL);
+
+    return face;
+}
+
+/* Lock-free (with respect to font->lock). See instance_face_get() */
+static void
+instance_face_put(struct instance *inst, FT_Face face)
+{
+    mtx_lock(&inst->faces.lock);
+
+    if (inst->faces.count == inst->faces.size) {
+        size_t new_size = inst->faces.size > 0 ? inst->faces.size * 2 : 4;
+        FT_Face *new_idle = realloc(
+            inst->faces.idle, new_size * sizeof(new_idle[0]));
+
+        if (new_idle == NULL) {
+            mtx_unlock(&inst->faces.lock);
+            mtx_lock(&ft_lock);
+            FT_Done_Face(face);
+            mtx_unlock(&ft_lock);
+            return;
+        }
+
+        inst->faces.idle = new_idle;
+        inst->faces.size = new_size;
+    }
+
+    inst->faces.idle[inst->faces.count++] = face;
+    mtx_unlock(&inst->faces.lock);
+}
+
+static struct glyph_cache_table *
+glyph_cache_table_create(size_t size)
+{
+    struct glyph_cache_table *table = malloc(
+        sizeof(*table) + size * sizeof(table->entries[0]));
+    if (table == NULL)
+        return NULL;
+
+    table->size = size;
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&table->entries[i], NULL);
+    return table;
+}
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+static struct grapheme_cache_table *
+grapheme_cache_table_create(size_t size)
+{
+    struct grapheme_cache_table *table = malloc(
+        sizeof(*table) + size * sizeof(table->entries[0]));
+    if (table == NULL)
+        return NULL;
+
+    table->size = size;
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&table->entries[i], NULL);
+    return table;
+}
+#endif
+
+/* Must only be called while font->lock is held */
+static void
+cache_retire(struct font_priv *font, void *ptr, void (*destroy)(void *ptr))
+{
+    const uint64_t epoch = atomic_load_explicit(
+        &font->cache.epoch, memory_order_relaxed);
+
+    tll_push_back(font->cache.retired, ((struct retired_entry){
+        .ptr = ptr, .destroy = destroy, .epoch = epoch + 1}));
+}
+
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Starts a new epoch, making everything retired so far unreachable
+ * for readers entering the new epoch, and free:s the retired memory
+ * no reader can be referencing anymore.
+ */
+static void
+cache_reclaim(struct font_priv *font)
+{
+    const uint64_t epoch = atomic_load_explicit(
+        &font->cache.epoch, memory_order_relaxed) + 1;
+    atomic_store_explicit(&font->cache.epoch, epoch, memory_order_release);
+
+    /* Pairs with the fence in cache_quiescent(), for readers coming
+     * back online */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    /* Readers only announce their epochs when there’s a budget */
+    if (atomic_load_explicit(&font->cache.budget, memory_order_relaxed) == 0)
+        return;
+
+    uint64_t min_epoch = UINT64_MAX;
+
+    mtx_lock(&readers_lock);
+    tll_foreach(readers, it) {
+        if (it->item->font_id != font->id)
+            continue;
+
+        const uint64_t reader_epoch = atomic_load_explicit(
+            &it->item->epoch, memory_order_acquire);
+
+        if (reader_epoch < min_epoch)
+            min_epoch = reader_epoch;
+    }
+    mtx_unlock(&readers_lock);
+
+    tll_foreach(font->cache.retired, it) {
+        if (it->item.epoch > min_epoch)
+            continue;
+
+        it->item.destroy(it->item.ptr);
+        tll_remove(font->cache.retired, it);
+    }
+}
+
+static struct reader *
+reader_register(struct font_priv *font)
+{
+    struct reader *reader = NULL;
+
+    mtx_lock(&readers_lock);
+    tll_foreach(readers, it) {
+        if (it->item->owner == reader_tls && it->item->font_id == font->id) {
+            /* Evicted from reader_tls by another font */
+            reader = it->item;
+            break;
+        }
+    }
+
+    if (reader == NULL) {
+        reader = calloc(1, sizeof(*reader));
+        if (reader != NULL) {
+            reader->owner = reader_tls;
+            reader->font = font;
+            reader->font_id = font->id;
+            atomic_init(&reader->epoch, atomic_load_explicit(
+                            &font->cache.epoch, memory_order_relaxed));
+
+            tll_push_back(readers, reader);
+            tss_set(readers_tss, reader_tls);
+        } else
+            LOG_ERR("failed to allocate cache reader");
+    }
+    mtx_unlock(&readers_lock);
+
+    return reader;
+}
+
+/*
+ * Lock-free (except the first time a thread calls it for a font).
+ *
+ * Returns the calling thread’s reader for ‘font’, and, with a cache
+ * budget, announces that the thread no longer references any cached
+ * glyphs or graphemes it got from ‘font’ in earlier calls. See
+ * struct reader.
+ *
+ * Returns NULL if the thread could not be registered as a reader.
+ */
+static struct reader *
+cache_quiescent(struct font_priv *font, uint64_t *epoch)
+{
+    *epoch = atomic_load_explicit(&font->cache.epoch, memory_order_acquire);
+
+    struct reader_tls_entry *tls =
+        &reader_tls[font->id & (ALEN(reader_tls) - 1)];
+
+    if (tls->font_id != font->id) {
+        struct reader *reader = reader_register(font);
+        if (reader == NULL)
+            return NULL;
+
+        tls->font_id = font->id;
+        tls->reader = reader;
+    }
+
+    struct reader *reader = tls->reader;
+
+    if (atomic_load_explicit(&font->cache.budget, memory_order_relaxed) != 0) {
+        if (atomic_load_explicit(&reader->epoch, memory_order_relaxed) == UINT64_MAX) {
+            /*
+             * Coming back online (see cache_offline()). Make sure
+             * either the reclaimer sees our epoch, or we see any
+             * epoch it has started (and thus cannot reach anything
+             * retired before it).
+             */
+            atomic_store_explicit(&reader->epoch, *epoch, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            *epoch = atomic_load_explicit(&font->cache.epoch, memory_order_acquire);
+        }
+
+        atomic_store_explicit(&reader->epoch, *epoch, memory_order_release);
+    }
+
+    return reader;
+}
+
+/*
+ * Lock-free.
+ *
+ * Announces that the calling thread references *nothing* from the
+ * font’s caches, until its next call to cache_quiescent(). Threads
+ * that may stay idle for a long time (e.g. thread pool workers) must
+ * call this, or they would hold back the reclamation of evicted
+ * glyphs and graphemes.
+ */
+static void
+cache_offline(struct font_priv *font)
+{
+    struct reader_tls_entry *tls =
+        &reader_tls[font->id & (ALEN(reader_tls) - 1)];
+
+    if (tls->font_id == font->id) {
+        atomic_store_explicit(
+            &tls->reader->epoch, UINT64_MAX, memory_order_release);
+    }
+}
+
+static void
+cache_count_probes(struct cache_counters *counters, size_t probes)
+{
+    counter_inc(&counters->probe_lengths[
+                    min(probes, ALEN(counters->probe_lengths) - 1)]);
+}
+
+/*
+ * The font cache key: all names, in order, followed by the
+ * attributes. Each one NUL terminated, which makes the key
+ * unambiguous (names cannot contain NULs).
+ */
+static char *
+font_cache_key(size_t count, const char *names[static count],
+               const char *attributes, size_t *len)
+{
+    if (attributes == NULL)
+        attributes = "";
+
+    size_t total = strlen(attributes) + 1;
+    for (size_t i = 0; i < count; i++)
+        total += strlen(names[i]) + 1;
+
+    char *key = malloc(total);
+    if (key == NULL)
+        return NULL;
+
+    char *p = key;
+    for (size_t i = 0; i < count; i++) {
+        size_t name_len = strlen(names[i]) + 1;
+        memcpy(p, names[i], name_len);
+        p += name_len;
+    }
+
+    memcpy(p, attributes, strlen(attributes) + 1);
+
+    *len = total;
+    return key;
+}
+
+/* FNV-1a */
+static uint64_t
+font_cache_hash(const char *key, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+FCFT_EXPORT struct fcft_font *
+fcft_from_name(size_t count, const char *names[static count],
+               const char *attributes)
+{
+    if (ft_lib == NULL) {
+        LOG_ERR("fcft_init() not called");
+        return NULL;
+    }
+
+    log_version_information();
+
+    if (count == 0)
+        return NULL;
+
+    size_t key_len;
+    char *key = font_cache_key(count, names, attributes, &key_len);
+    if (key == NULL)
+        return NULL;
+
+    uint64_t hash = font_cache_hash(key, key_len);
+    struct font_cache_bucket *bucket = font_cache_bucket_for(hash);
+    struct font_cache_entry *cache_entry = NULL;
+
+    mtx_lock(&bucket->lock);
+    for (struct font_cache_entry *e = bucket->entries; e != NULL; e = e->next) {
+        if (e->hash != hash ||
+            e->key_len != key_len ||
+            memcmp(e->key, key, key_len) != 0)
+        {
+            continue;
+        }
+
+        free(key);
+
+        if (e->font != (void *)(uintptr_t)-1) {
+            /* Font has already been fully initialized */
+
+            if (e->font != NULL) {
+                mtx_lock(&e->font->lock);
+                e->font->ref_counter++;
+                mtx_unlock(&e->font->lock);
+            }
+
+            mtx_unlock(&bucket->lock);
+            return e->font != NULL ? &e->font->public : NULL;
+        }
+
+        /*
+         * Cache entry is only a reservation - font hasn't yet
+         * been initialized.
+         */
+
+        /* Let instantiating thread know (yet) another thread
+         * wants a reference to it */
+        e->waiters++;
+
+        while (e->font == (void *)(uintptr_t)-1)
+            cnd_wait(&e->cond, &bucket->lock);
+        mtx_unlock(&bucket->lock);
+        return e->font == NULL ? NULL : &e->font->public;
+    }
+
+    /* Pre-allocate entry */
+    cache_entry = malloc(sizeof(*cache_entry));
+    if (cache_entry == NULL) {
+        mtx_unlock(&bucket->lock);
+        free(key);
+        return NULL;
+    }
+
+    if (cnd_init(&cache_entry->cond) != thrd_success) {
+        LOG_ERR("%s: failed to instantiate font cache condition variable", names[0]);
+        mtx_unlock(&bucket->lock);
+        free(cache_entry);
+        free(key);
+        return NULL;
+    }
+
+    cache_entry->next = bucket->entries;
+    cache_entry->hash = hash;
+    cache_entry->key = key;
+    cache_entry->key_len = key_len;
+    cache_entry->font = (void *)(uintptr_t)-1;
+    cache_entry->waiters = 0;
+    bucket->entries = cache_entry;
+    atomic_fetch_add(&font_cache_count, 1);
+    mtx_unlock(&bucket->lock);
+
+    struct font_priv *font = NULL;
+
+    bool have_attrs = attributes != NULL && strlen(attributes) > 0;
+    size_t attr_len = have_attrs ? strlen(attributes) + 1 : 0;
+
+    bool first = true;
+    for (size_t i = 0; i < count; i++) {
+        const char *base_name = names[i];
+
+        char name[strlen(base_name) + attr_len + 1];
+        strcpy(name, base_name);
+        if (have_attrs) {
+            strcat(name, ":");
+            strcat(name, attributes);
+        }
+
+        FcFontSet *set;
+        FcPattern *base_pattern = base_pattern_from_name(name, &set);
+        if (base_pattern == NULL)
+            break;
+
+        FcPattern *pattern = pattern_from_font_set(base_pattern, set, 0);
+        if (pattern == NULL)
+            break;
+
+        FcCharSet *charset;
+        if (FcPatternGetCharSet(base_pattern, FC_CHARSET, 0, &charset) != FcResultMatch &&
+            FcPatternGetCharSet(pattern, FC_CHARSET, 0, &charset) != FcResultMatch)
+        {
+            LOG_ERR("%s: failed to get charset", name);
+            FcPatternDestroy(pattern);
+            FcPatternDestroy(base_pattern);
+            FcFontSetDestroy(set);
+            break;
+        }
+
+        FcLangSet *langset;
+        if (FcPatternGetLangSet(pattern, FC_LANG, 0, &langset) != FcResultMatch)
+            langset = NULL;
+
+        double req_px_size = -1., req_pt_size = -1.;
+        FcPatternGetDouble(base_pattern, FC_PIXEL_SIZE, 0, &req_px_size);
+        FcPatternGetDouble(base_pattern, FC_SIZE, 0, &req_pt_size);
+
+        if (first) {
+            first = false;
+
+            bool lock_failed = true;
+            bool pattern_failed = true;
+
+            mtx_t lock;
+            mtx_t slab_lock;
+            cnd_t reservations_done;
+            if (mtx_init(&lock, mtx_plain) != thrd_success)
+                LOG_WARN("%s: failed to instantiate mutex", name);
+            else if (mtx_init(&slab_lock, mtx_plain) != thrd_success) {
+                LOG_WARN("%s: failed to instantiate mutex", name);
+                mtx_destroy(&lock);
+            } else if (cnd_init(&reservations_done) != thrd_success) {
+                LOG_WARN("%s: failed to instantiate condition variable", name);
+                mtx_destroy(&slab_lock);
+                mtx_destroy(&lock);
+            } else
+                lock_failed = false;
+
+            struct instance *primary = malloc(sizeof(*primary));
+            if (primary == NULL ||
+                !instantiate_pattern(pattern, req_pt_size, req_px_size, primary))
+            {
+                ;
+            } else
+                pattern_failed = false;
+
+            font = calloc(1, sizeof(*font));
+            struct fallback *fallbacks = calloc(8, sizeof(fallbacks[0]));
+            struct glyph_cache_table *glyph_cache_table =
+                glyph_cache_table_create(glyph_cache_initial_size);
+            struct glyph_cache_table *glyph_index_cache_table =
+                glyph_cache_table_create(glyph_cache_initial_size);
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+            struct grapheme_cache_table *grapheme_cache_table =
+                grapheme_cache_table_create(grapheme_cache_initial_size);
+#else
+            struct grapheme_cache_table *grapheme_cache_table = NULL;
+#endif
+
+            /* Handle failure(s) */
+            if (lock_failed || pattern_failed ||
+                font == NULL || fallbacks == NULL || glyph_cache_table == NULL ||
+                glyph_index_cache_table == NULL
+#if defined(FCFT_HAVE_HARFBUZZ)
+                || grapheme_cache_table == NULL
+#endif
+                )
+            {
+                if (!lock_failed) {
+                    mtx_destroy(&lock);
+                    mtx_destroy(&slab_lock);
+                    cnd_destroy(&reservations_done);
+                }
+                if (!pattern_failed)
+                    free(primary);
+                free(font);
+                free(fallbacks);
+                free(glyph_cache_table);
+                free(glyph_index_cache_table);
+                free(grapheme_cache_table);
+                if (langset != NULL)
+                    FcLangSetDestroy(langset);
+                FcCharSetDestroy(charset);
+                FcPatternDestroy(pattern);
+                FcPatternDestroy(base_pattern);
+                FcFontSetDestroy(set);
+                break;
+            }
+
+            font->ref_counter = 1;
+            font->id = atomic_fetch_add_explicit(
+                &next_font_id, 1, memory_order_relaxed);
+            font->lock = lock;
+            font->slab_lock = slab_lock;
+            font->glyph_reservations.done = reservations_done;
+            font->glyph_cache.count = 0;
+            atomic_init(&font->glyph_cache.table, glyph_cache_table);
+            font->glyph_index_cache.table = glyph_index_cache_table;
+            font->emoji_presentation = FCFT_EMOJI_PRESENTATION_DEFAULT;
+            font->public = primary->metrics;
+            font->kerning.supported = FT_HAS_KERNING(primary->face);
+            atomic_init(&font->kerning.ascii, NULL);
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+            font->grapheme_cache.count = 0;
+            atomic_init(&font->grapheme_cache.table, grapheme_cache_table);
+#endif
+
+            for (size_t i = 0; i < ALEN(font->glyph_direct); i++) {
+                for (size_t j = 0; j < ALEN(font->glyph_direct[i]); j++)
+                    atomic_init(&font->glyph_direct[i][j], NULL);
+            }
+
+            atomic_init(&font->cache.budget, 0);
+            atomic_init(&font->cache.epoch, 0);
+
+            font->fallbacks.arr = fallbacks;
+            font->fallbacks.size = 8;
+
+            /* Cannot fail; there’s room for it */
+            fallback_push(font, (struct fallback){
+                        .pattern = pattern,
+                        .prepared = true,
+                        .charset = FcCharSetCopy(charset),
+                        .langset = langset != NULL ? FcLangSetCopy(langset) : NULL,
+                        .font = primary,
+                        .req_px_size = req_px_size,
+                        .req_pt_size = req_pt_size});
+
+            /*
+             * The remaining fonts in the set are fontconfig’s
+             * fallbacks. These are added to the fallback list on
+             * demand, after the explicitly named fonts, since most of
+             * them are never used.
+             */
+            font->fc_fallbacks.base_pattern = base_pattern;
+            font->fc_fallbacks.set = set;
+            font->fc_fallbacks.next = 1;
+            continue;
+        } else {
+            assert(font != NULL);
+            fallback_push(font, (struct fallback){
+                        .pattern = pattern,
+                        .prepared = true,
+                        .charset = FcCharSetCopy(charset),
+                        .langset = langset != NULL ? FcLangSetCopy(langset) : NULL,
+                        .req_px_size = req_px_size,
+                        .req_pt_size = req_pt_size});
+        }
+
+        FcFontSetDestroy(set);
+        FcPatternDestroy(base_pattern);
+    }
+
+    if (font != NULL)
+        font->cache_entry = cache_entry;
+
+    mtx_lock(&bucket->lock);
+    cache_entry->font = font;
+    if (cache_entry->font != NULL)
+        cache_entry->font->ref_counter += cache_entry->waiters;
+    cnd_broadcast(&cache_entry->cond);
+    mtx_unlock(&bucket->lock);
+
+    assert(font == NULL || (void *)&font->public == (void *)font);
+    return font != NULL ? &font->public : NULL;
+}
+
+struct fcft_font_request {
+    size_t count;
+    char **names;
+    char *attributes;
+
+    void (*done)(struct fcft_font_request *request, void *data);
+    void *data;
+
+    _Atomic size_t ref_counter;  /* The caller, and the loader */
+    int fd;                      /* eventfd, signalled when completed */
+
+    mtx_t lock;
+    cnd_t cond;
+    bool completed;
+    struct fcft_font *font;
+};
+
+static void
+font_requests_running_add(int delta)
+{
+    mtx_lock(&font_requests_lock);
+    font_requests_running += delta;
+    if (font_requests_running == 0)
+        cnd_broadcast(&font_requests_cond);
+    mtx_unlock(&font_requests_lock);
+}
+
+static void
+font_request_unref(struct fcft_font_request *req)
+{
+    if (atomic_fetch_sub_explicit(&req->ref_counter, 1, memory_order_acq_rel) > 1)
+        return;
+
+    for (size_t i = 0; i < req->count; i++)
+        free(req->names[i]);
+    free(req->names);
+    free(req->attributes);
+
+    close(req->fd);
+    cnd_destroy(&req->cond);
+    mtx_destroy(&req->lock);
+    free(req);
+}
+
+static void
+font_request_load(void *_req)
+{
+    struct fcft_font_request *req = _req;
+
+    /* Concurrent requests for the same font are handled by the font
+     * cache; only one thread instantiates it, the others wait */
+    struct fcft_font *font = fcft_from_name(
+        req->count, (const char **)req->names, req->attributes);
+
+    mtx_lock(&req->lock);
+    req->font = font;
+    req->completed = true;
+    cnd_broadcast(&req->cond);
+    mtx_unlock(&req->lock);
+
+    if (eventfd_write(req->fd, 1) < 0)
+        LOG_ERRNO("failed to signal font request completion");
+
+    if (req->done != NULL)
+        req->done(req, req->data);
+
+    font_request_unref(req);
+
+    /* Last; fcft_fini() may tear down everything after this */
+    font_requests_running_add(-1);
+}
+
+static int
+font_request_thread(void *req)
+{
+    font_request_load(req);
+    return 0;
+}
+
+FCFT_EXPORT struct fcft_font_request *
+fcft_from_name_async(size_t count, const char *names[static count],
+                     const char *attributes,
+                     void (*done)(struct fcft_font_request *request, void *data),
+                     void *data)
+{
+    if (ft_lib == NULL) {
+        LOG_ERR("fcft_init() not called");
+        return NULL;
+    }
+
+    if (count == 0)
+        return NULL;
+
+    struct fcft_font_request *req = calloc(1, sizeof(*req));
+    if (req == NULL)
+        return NULL;
+
+    req->fd = -1;
+    req->count = count;
+    req->done = done;
+    req->data = data;
+    atomic_init(&req->ref_counter, 2);
+
+    if ((req->names = calloc(count, sizeof(req->names[0]))) == NULL)
+        goto err_free;
+
+    for (size_t i = 0; i < count; i++) {
+        if ((req->names[i] = strdup(names[i])) == NULL)
+            goto err_free;
+    }
+
+    if (attributes != NULL && (req->attributes = strdup(attributes)) == NULL)
+        goto err_free;
+
+    if ((req->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        LOG_ERRNO("failed to create eventfd");
+        goto err_free;
+    }
+
+    if (mtx_init(&req->lock, mtx_plain) != thrd_success) {
+        LOG_ERR("failed to instantiate mutex");
+        goto err_free;
+    }
+
+    if (cnd_init(&req->cond) != thrd_success) {
+        LOG_ERR("failed to instantiate condition variable");
+        goto err_destroy_lock;
+    }
+
+    font_requests_running_add(1);
+
+    /* The pool may have no threads; use a thread of our own then */
+    struct thread_pool *pool = get_thread_pool();
+    if (pool == NULL || !thread_pool_submit(pool, &font_request_load, req)) {
+        thrd_t thrd;
+        if (thrd_create(&thrd, &font_request_thread, req) != thrd_success) {
+            LOG_ERR("%s: failed to create font loader thread", names[0]);
+            font_requests_running_add(-1);
+            goto err_destroy_cond;
+        }
+
+        thrd_detach(thrd);
+    }
+
+    return req;
+
+err_destroy_cond:
+    cnd_destroy(&req->cond);
+err_destroy_lock:
+    mtx_destroy(&req->lock);
+err_free:
+    if (req->fd >= 0)
+        close(req->fd);
+    if (req->names != NULL) {
+        for (size_t i = 0; i < count; i++)
+            free(req->names[i]);
+    }
+    free(req->names);
+    free(req->attributes);
+    free(req);
+    return NULL;
+}
+
+FCFT_EXPORT int
+fcft_font_request_fd(const struct fcft_font_request *req)
+{
+    return req->fd;
+}
+
+FCFT_EXPORT struct fcft_font *
+fcft_font_request_finish(struct fcft_font_request *req)
+{
+    if (req == NULL)
+        return NULL;
+
+    mtx_lock(&req->lock);
+    while (!req->completed)
+        cnd_wait(&req->cond, &req->lock);
+    struct fcft_font *font = req->font;
+    mtx_unlock(&req->lock);
+
+    font_request_unref(req);
+    return font;
+}
+
+FCFT_EXPORT struct fcft_font *
+fcft_clone(const struct fcft_font *_font)
+{
+    if (_font == NULL)
+        return NULL;
+
+    struct font_priv *font = (struct font_priv *)_font;
+
+    mtx_lock(&font->lock);
+    {
+        assert(font->ref_counter >= 1);
+        font->ref_counter++;
+    }
+    mtx_unlock(&font->lock);
+
+    return &font->public;
+}
+
+/*
+ * ‘face’ is one of ‘inst’:s FreeType faces, that must not be used by
+ * any other thread while we’re rasterizing. I.e. either face,
+ * with font->lock held, or a face from instance_face_get().
+ */
+static bool
+glyph_for_index(struct font_priv *font, const struct instance *inst,
+                FT_Face face, uint32_t index, enum fcft_subpixel subpixel,
+                struct glyph_priv *glyph)
+{
+    glyph->valid = false;
+    glyph->subpixel = subpixel;
+
+    pixman_image_t *pix = NULL;
+    uint8_t *data = NULL;
+
+    FT_Error err;
+    if ((err = FT_Load_Glyph(face, index, inst->load_flags)) != FT_Err_Ok) {
+        LOG_ERR("%s: failed to load glyph #%d: %s",
+                inst->path, index, ft_error_string(err));
+        goto err;
+    }
+
+    if (inst->embolden && face->glyph->format == FT_GLYPH_FORMAT_OUTLINE)
+        FT_GlyphSlot_Embolden(face->glyph);
+
+    int render_flags;
+    bool bgr;
+
+    if (inst->antialias) {
+        switch (subpixel) {
+        case FCFT_SUBPIXEL_NONE:
+            render_flags = inst->render_flags_normal;
+            bgr = false;
+            break;
+
+        case FCFT_SUBPIXEL_HORIZONTAL_RGB:
+        case FCFT_SUBPIXEL_HORIZONTAL_BGR:
+            render_flags = FT_RENDER_MODE_LCD;
+            bgr = subpixel == FCFT_SUBPIXEL_HORIZONTAL_BGR;
+            break;
+
+        case FCFT_SUBPIXEL_VERTICAL_RGB:
+        case FCFT_SUBPIXEL_VERTICAL_BGR:
+            render_flags = FT_RENDER_MODE_LCD_V;
+            bgr = subpixel == FCFT_SUBPIXEL_VERTICAL_BGR;
+            break;
+
+        case FCFT_SUBPIXEL_DEFAULT:
+        default:
+            render_flags = inst->render_flags_subpixel;
+            bgr = inst->bgr;
+            break;
+        }
+    } else {
+        render_flags = inst->render_flags_normal;
+        bgr = false;
+    }
+
+#if FREETYPE_MAJOR >= 3 || (FREETYPE_MAJOR >= 2 && FREETYPE_MINOR >= 12)
+    if (face->glyph->format == FT_GLYPH_FORMAT_SVG) {
+        /* Up to, and include, 2.12.1, FreeType rejects everything
+         * else with “bad argument” */
+        render_flags = FT_RENDER_MODE_NORMAL;
+    }
+#endif
+
+    /*
+     * LCD filter is per library instance, hence we need to re-set it
+     * every time. But only if we need it, and only if we _can_, to
+     * avoid locking a global mutex. See init().
+     */
+    bool unlock_ft_lock = false;
+    if (can_set_lcd_filter &&
+        ((render_flags & FT_RENDER_MODE_LCD) ||
+         (render_flags & FT_RENDER_MODE_LCD_V)))
+    {
+        mtx_lock(&ft_lock);
+        unlock_ft_lock = true;
+
+        FT_Error err = FT_Library_SetLcdFilter(ft_lib, inst->lcd_filter);
+
+        if (err != FT_Err_Ok) {
+            LOG_ERR("failed to set LCD filter: %s", ft_error_string(err));
+            mtx_unlock(&ft_lock);
+            goto err;
+        }
+    }
+
+    if (face->glyph->format != FT_GLYPH_FORMAT_BITMAP) {
+        if ((err = FT_Render_Glyph(face->glyph, render_flags)) != FT_Err_Ok) {
+            LOG_ERR("%s: failed to render glyph: %s",
+                    inst->path, ft_error_string(err));
+            if (unlock_ft_lock)
+                mtx_unlock(&ft_lock);
+            goto err;
+        }
+    }
+
+    if (unlock_ft_lock)
+        mtx_unlock(&ft_lock);
+
+    if (face->glyph->format != FT_GLYPH_FORMAT_BITMAP) {
+        LOG_ERR("%s: rasterized glyph is not a bitmap", inst->path);
+        goto err;
+    }
+
+    const FT_Bitmap *bitmap = &face->glyph->bitmap;
+    pixman_format_code_t pix_format;
     int width;
     int rows;
 
-    switch (bitmap->pixel_mode) {
-    case FT_PIXEL_MODE_MONO:
-        pix_format = PIXMAN_a1;
-        width = bitmap->width;
-        rows = bitmap->rows;
-        break;
+    switch (bitmap->pixel_mode) {
+    case FT_PIXEL_MODE_MONO:
+        pix_format = PIXMAN_a1;
+        width = bitmap->width;
+        rows = bitmap->rows;
+        break;
+
+    case FT_PIXEL_MODE_GRAY:
+        pix_format = PIXMAN_a8;
+        width = bitmap->width;
+        rows = bitmap->rows;
+        break;
+
+    case FT_PIXEL_MODE_LCD:
+        pix_format = PIXMAN_x8r8g8b8;
+        width = bitmap->width / 3;
+        rows = bitmap->rows;
+        break;
+
+    case FT_PIXEL_MODE_LCD_V:
+        pix_format = PIXMAN_x8r8g8b8;
+        width = bitmap->width;
+        rows = bitmap->rows / 3;
+        break;
+
+    case FT_PIXEL_MODE_BGRA:
+        pix_format = PIXMAN_a8r8g8b8;
+        width = bitmap->width;
+        rows = bitmap->rows;
+        break;
+
+    default:
+        LOG_ERR("unimplemented: FT pixel mode: %d", bitmap->pixel_mode);
+        goto err;
+        break;
+    }
+
+    int stride = stride_for_format_and_width(pix_format, width);
+    assert(stride >= bitmap->pitch);
+
+    assert(bitmap->buffer != NULL || rows * stride == 0);
+    if ((pix = slab_image_create(font, pix_format, width, rows, stride)) == NULL)
+        goto err;
+
+    data = (uint8_t *)pixman_image_get_data(pix);
+
+    /* Convert FT bitmap to pixman image */
+    switch (bitmap->pixel_mode) {
+    case FT_PIXEL_MODE_MONO:  /* PIXMAN_a1 */
+        /*
+         * FreeType: left-most pixel is stored in MSB  ABCDEFGH IJKLMNOP
+         * Pixman: LE: left-most pixel in LSB          HGFEDCBA PONMLKJI
+         *         BE: left-most pixel in MSB          ABCDEFGH IJKLMNOP
+         *
+         * Thus, we need to reverse each byte on little-endian systems.
+         */
+        for (size_t r = 0; r < bitmap->rows; r++) {
+            for (size_t c = 0; c < (bitmap->width + 7) / 8; c++) {
+                uint8_t v = bitmap->buffer[r * bitmap->pitch + c];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                uint8_t reversed = 0;
+                for (size_t i = 0; i < min(8, bitmap->width - c * 8); i++)
+                    reversed |= ((v >> (7 - i)) & 1) << i;
+
+                data[r * stride + c] = reversed;
+#else
+                data[r * stride + c] = v;
+#endif
+            }
+        }
+        break;
+
+    case FT_PIXEL_MODE_GRAY: /* PIXMAN_a8 */
+        /*
+         * One pixel, one byte. No endianness to worry about
+         */
+        if (stride == bitmap->pitch) {
+            if (bitmap->buffer != NULL)
+                memcpy(data, bitmap->buffer, rows * stride);
+        } else {
+            for (size_t r = 0; r < bitmap->rows; r++) {
+                for (size_t c = 0; c < bitmap->width; c++)
+                    data[r * stride + c] = bitmap->buffer[r * bitmap->pitch + c];
+            }
+        }
+        break;
+
+    case FT_PIXEL_MODE_BGRA: /* PIXMAN_a8r8g8b8 */
+        /*
+         * FreeType: blue comes *first* in memory
+         * Pixman: LE: blue comes *first* in memory
+         *         BE: alpha comes *first* in memory
+         *
+         * Pixman is ARGB *when loaded into a register*, assuming
+         * machine native 32-bit loads. Thus, it’s in-memory layout
+         * depends on the host’s endianness.
+         */
+        assert(stride == bitmap->pitch);
+        for (size_t r = 0; r < bitmap->rows; r++) {
+            for (size_t c = 0; c < bitmap->width * 4; c += 4) {
+                unsigned char _b = bitmap->buffer[r * bitmap->pitch + c + 0];
+                unsigned char _g = bitmap->buffer[r * bitmap->pitch + c + 1];
+                unsigned char _r = bitmap->buffer[r * bitmap->pitch + c + 2];
+                unsigned char _a = bitmap->buffer[r * bitmap->pitch + c + 3];
+
+                uint32_t *p = (uint32_t *)&data[r * stride + c];
+                *p = (uint32_t)_a << 24 | _r << 16 | _g << 8 | _b;
+            }
+        }
+        break;
+
+    case FT_PIXEL_MODE_LCD: /* PIXMAN_x8r8g8b8 */
+        /*
+         * FreeType: red comes *first* in memory
+         * Pixman: LE: blue comes *first* in memory
+         *         BE: x comes *first* in memory
+         *
+         * Same as above, except that the FreeType data is now RGBx
+         * instead of BGRA.
+         */
+        for (size_t r = 0; r < bitmap->rows; r++) {
+            for (size_t c = 0; c < bitmap->width; c += 3) {
+                unsigned char _r = bitmap->buffer[r * bitmap->pitch + c + (bgr ? 2 : 0)];
+                unsigned char _g = bitmap->buffer[r * bitmap->pitch + c + 1];
+                unsigned char _b = bitmap->buffer[r * bitmap->pitch + c + (bgr ? 0 : 2)];
+
+                uint32_t *p = (uint32_t *)&data[r * stride + 4 * (c / 3)];
+                *p = _r << 16 | _g << 8 | _b;
+            }
+        }
+        break;
+
+    case FT_PIXEL_MODE_LCD_V: /* PIXMAN_x8r8g8b8 */
+        /*
+         * FreeType: red comes *first* in memory
+         * Pixman: LE: blue comes *first* in memory
+         *         BE: x comes *first* in memory
+         *
+         * Same as above, except that the FreeType data is now RGBx
+         * instead of BGRA.
+         */
+        for (size_t r = 0; r < bitmap->rows; r += 3) {
+            for (size_t c = 0; c < bitmap->width; c++) {
+                unsigned char _r = bitmap->buffer[(r + (bgr ? 2 : 0)) * bitmap->pitch + c];
+                unsigned char _g = bitmap->buffer[(r + 1) * bitmap->pitch + c];
+                unsigned char _b = bitmap->buffer[(r + (bgr ? 0 : 2)) * bitmap->pitch + c];
+
+                uint32_t *p = (uint32_t *)&data[r / 3 * stride + 4 * c];
+                *p =  _r << 16 | _g << 8 | _b;
+            }
+        }
+        break;
+
+    default:
+        abort();
+        break;
+    }
+
+    pixman_image_set_component_alpha(
+        pix,
+        bitmap->pixel_mode == FT_PIXEL_MODE_LCD ||
+        bitmap->pixel_mode == FT_PIXEL_MODE_LCD_V);
+
+    int x = face->glyph->bitmap_left;
+    int y = face->glyph->bitmap_top;
+
+    if (inst->pixel_size_fixup == 0.)
+        x = y = width = rows = 0;
+
+    else if (inst->pixel_size_fixup != 1.) {
+        struct pixman_f_transform scale;
+        pixman_f_transform_init_scale(
+            &scale,
+            1. / inst->pixel_size_fixup,
+            1. / inst->pixel_size_fixup);
+
+        struct pixman_transform _scale;
+        pixman_transform_from_pixman_f_transform(&_scale, &scale);
+        pixman_image_set_transform(pix, &_scale);
+
+        const enum fcft_scaling_filter filter_to_use = inst->is_color
+            ? scaling_filter
+            : FCFT_SCALING_FILTER_BILINEAR;
+
+        switch (filter_to_use) {
+        case FCFT_SCALING_FILTER_NONE:
+            break;
+
+        case FCFT_SCALING_FILTER_NEAREST:
+            pixman_image_set_filter(pix, PIXMAN_FILTER_NEAREST, NULL, 0);
+            break;
+
+        case FCFT_SCALING_FILTER_BILINEAR:
+            pixman_image_set_filter(pix, PIXMAN_FILTER_BILINEAR, NULL, 0);
+            break;
+
+        case FCFT_SCALING_FILTER_CUBIC:
+        case FCFT_SCALING_FILTER_LANCZOS3: {
+            /*
+             * TODO:
+             *   - find out how the subsample_bit_{x,y} parameters should be set
+             */
+            int param_count = 0;
+            pixman_kernel_t kernel = filter_to_use == FCFT_SCALING_FILTER_CUBIC
+                ? PIXMAN_KERNEL_CUBIC
+                : PIXMAN_KERNEL_LANCZOS3;
+
+            pixman_fixed_t *params = pixman_filter_create_separable_convolution(
+                &param_count,
+                pixman_double_to_fixed(1. / inst->pixel_size_fixup),
+                pixman_double_to_fixed(1. / inst->pixel_size_fixup),
+                kernel, kernel,
+                kernel, kernel,
+                pixman_int_to_fixed(1),
+                pixman_int_to_fixed(1));
+
+            pixman_image_set_filter(
+                pix, PIXMAN_FILTER_SEPARABLE_CONVOLUTION,
+                params, param_count);
+            free(params);
+            break;
+        }
+        }
+
+        int scaled_width = width / (1. / inst->pixel_size_fixup);
+        int scaled_rows = rows / (1. / inst->pixel_size_fixup);
+        int scaled_stride = stride_for_format_and_width(pix_format, scaled_width);
+
+        if (pix_format == PIXMAN_a8r8g8b8) {
+            pixman_image_t *scaled_pix = slab_image_create(
+                font, pix_format, scaled_width, scaled_rows, scaled_stride);
+
+            if (scaled_pix == NULL)
+                goto err;
+
+            pixman_image_composite32(
+                PIXMAN_OP_SRC, pix, NULL, scaled_pix, 0, 0, 0, 0,
+                0, 0, scaled_width, scaled_rows);
+
+            pixman_image_unref(pix);
+            pix = scaled_pix;
+        }
+
+        rows = scaled_rows;
+        width = scaled_width;
+        stride = scaled_stride;
+
+        x *= inst->pixel_size_fixup;
+        y *= inst->pixel_size_fixup;
+    }
+
+    glyph->public = (struct fcft_glyph){
+        .font_name = inst->name,
+        .pix = pix,
+        .x = x,
+        .y = y,
+        .advance = {
+            .x = (face->glyph->advance.x / 64. *
+                  (inst->pixel_fixup_estimated ? inst->pixel_size_fixup : 1.)),
+            .y = (face->glyph->advance.y / 64. *
+                  (inst->pixel_fixup_estimated ? inst->pixel_size_fixup : 1.)),
+        },
+        .width = width,
+        .height = rows,
+    };
+    glyph->valid = true;
+    atomic_fetch_add_explicit(
+        &font->stats.glyphs_rasterized, 1, memory_order_relaxed);
+
+    return true;
+
+err:
+    if (pix != NULL)
+        pixman_image_unref(pix);
+    assert(!glyph->valid);
+    return false;
+}
+
+/* Must only be called while font->lock is held */
+static FT_UInt
+glyph_index_for_codepoint(const struct instance *inst, uint32_t cp)
+{
+    FT_UInt idx = -1;
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+    /*
+     * Use HarfBuzz if we have any font features. If we don’t, there’s
+     * no point in using HarfBuzz since it only slows things down, and
+     * we can just lookup the glyph index directly using FreeType’s
+     * API.x
+     */
+    if (inst->hb_feats_count > 0) {
+        hb_buffer_add_utf32(inst->hb_buf, &cp, 1, 0, 1);
+        hb_buffer_guess_segment_properties(inst->hb_buf);
+        hb_shape(inst->hb_font, inst->hb_buf, inst->hb_feats, inst->hb_feats_count);
+
+        unsigned count = hb_buffer_get_length(inst->hb_buf);
+        if (count == 1) {
+            const hb_glyph_info_t *info = hb_buffer_get_glyph_infos(inst->hb_buf, NULL);
+            idx = info[0].codepoint;
+        }
+
+        hb_buffer_clear_contents(inst->hb_buf);
+    }
+#endif
+
+    if (idx == (FT_UInt)-1)
+        idx = FT_Get_Char_Index(inst->face, cp);
+
+    return idx;
+}
+
+static size_t
+hash_index_for_size(size_t size, size_t v)
+{
+    return (v * 2654435761) & (size - 1);
+}
+
+static uint32_t
+hash_value_for_cp(uint32_t cp, enum fcft_subpixel subpixel)
+{
+    return subpixel << 29 | cp;
+}
+
+/*
+ * Lock-free. Returns the cached glyph, or NULL if not cached. If
+ * ‘slot’ is non-NULL, it is set to the entry that holds the glyph, or
+ * to the empty entry where it should be inserted.
+ */
+static struct glyph_priv *
+glyph_cache_lookup(struct glyph_cache_table *table, uint32_t cp,
+                   enum fcft_subpixel subpixel,
+                   _Atomic(struct glyph_priv *) **slot, size_t *probes)
+{
+    size_t collisions = 0;
+    size_t idx = hash_index_for_size(
+        table->size, hash_value_for_cp(cp, subpixel));
+    _Atomic(struct glyph_priv *) *entry = &table->entries[idx];
+    struct glyph_priv *glyph;
+
+    while ((glyph = atomic_load_explicit(entry, memory_order_acquire)) != NULL &&
+           (glyph == GLYPH_TOMBSTONE ||
+            !(glyph->public.cp == cp && glyph->subpixel == subpixel)))
+    {
+        idx = (idx + 1) & (table->size - 1);
+        entry = &table->entries[idx];
+        collisions++;
+    }
+
+    if (slot != NULL)
+        *slot = entry;
+    if (probes != NULL)
+        *probes = collisions;
+    return glyph;
+}
+
+static _Atomic(struct glyph_priv *) *
+glyph_direct_entry(struct font_priv *font, uint32_t cp,
+                   enum fcft_subpixel subpixel)
+{
+    if (cp >= GLYPH_DIRECT_CACHE_SIZE || subpixel >= ALEN(font->glyph_direct))
+        return NULL;
+    return &font->glyph_direct[subpixel][cp];
+}
+
+static struct glyph_tls_entry *
+glyph_tls_cache_entry(const struct font_priv *font, uint32_t key)
+{
+    size_t idx = hash_index_for_size(
+        ALEN(glyph_tls_cache), key ^ (font->id * 0x9e3779b97f4a7c15ull));
+    return &glyph_tls_cache[idx];
+}
+
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Tombstones are dropped when rehashing. If they make up most of the
+ * used entries, the table is rehashed without growing it.
+ */
+static bool
+glyph_cache_resize(struct font_priv *font)
+{
+    struct glyph_cache_table *old = atomic_load_explicit(
+        &font->glyph_cache.table, memory_order_relaxed);
+
+    const size_t used = font->glyph_cache.count + font->glyph_cache.tombstones;
+    if (used * 100 / old->size < 75)
+        return false;
+
+    size_t size = font->glyph_cache.count * 100 / old->size < 37
+        ? old->size : 2 * old->size;
+    assert(__builtin_popcount(size) == 1);
+
+    struct glyph_cache_table *table = glyph_cache_table_create(size);
+    if (table == NULL)
+        return false;
+
+    for (size_t i = 0; i < old->size; i++) {
+        struct glyph_priv *entry = atomic_load_explicit(
+            &old->entries[i], memory_order_relaxed);
+
+        if (entry == NULL || entry == GLYPH_TOMBSTONE)
+            continue;
+
+        size_t idx = hash_index_for_size(
+            size, hash_value_for_cp(entry->public.cp, entry->subpixel));
+
+        while (atomic_load_explicit(&table->entries[idx], memory_order_relaxed) != NULL)
+            idx = (idx + 1) & (size - 1);
+
+        atomic_store_explicit(&table->entries[idx], entry, memory_order_relaxed);
+    }
+
+    /* Readers may still be probing the old table; see glyph_cache_table */
+    atomic_store_explicit(&font->glyph_cache.table, table, memory_order_release);
+    font->glyph_cache.tombstones = 0;
+    cache_retire(font, old, &free);
+    cache_reclaim(font);
+
+    LOG_DBG("resized glyph cache from %zu to %zu", old->size, size);
+    return true;
+}
+
+/* The kind of font a codepoint should be rendered with */
+static enum coverage_kind
+coverage_kind_for_codepoint(const struct font_priv *font, uint32_t cp)
+{
+    const struct unicode_props *props = unicode_props_lookup(cp);
+
+    if (!props->emoji)
+        return COVERAGE_ANY;
+
+    switch (font->emoji_presentation) {
+    case FCFT_EMOJI_PRESENTATION_TEXT:
+        return COVERAGE_TEXT;
+
+    case FCFT_EMOJI_PRESENTATION_EMOJI:
+        return COVERAGE_EMOJI;
+
+    case FCFT_EMOJI_PRESENTATION_DEFAULT:
+        break;
+    }
+
+    return props->emoji_presentation ? COVERAGE_EMOJI : COVERAGE_TEXT;
+}
+
+/*
+ * Returns the index of the fallback ‘cp’ would be rasterized with, or
+ * -1 if no font has it (in which case the primary font is used).
+ *
+ * Must only be called while font->lock is held
+ */
+static ssize_t
+fallback_for_codepoint(struct font_priv *font, uint32_t cp)
+{
+    const enum coverage_kind kind = coverage_kind_for_codepoint(font, cp);
+
+    ssize_t idx = -1;
+    if (kind != COVERAGE_ANY)
+        idx = coverage_lookup(font, cp, kind);
+    if (idx < 0)
+        idx = coverage_lookup(font, cp, COVERAGE_ANY);
+    return idx;
+}
+
+/* Must only be called while font->lock is held */
+static struct instance *
+instance_for_codepoint(struct font_priv *font, uint32_t cp)
+{
+    while (true) {
+        ssize_t idx = fallback_for_codepoint(font, cp);
+
+        if (idx < 0) {
+            /* No font claimed this glyph - use the primary font anyway */
+            assert(font->fallbacks.count > 0);
+            return font->fallbacks.arr[0].font;
+        }
+
+        struct fallback *fallback = &font->fallbacks.arr[idx];
+        if (fallback->font != NULL || fallback_instantiate(font, fallback) != NULL)
+            return fallback->font;
+
+        fallback->failed = true;
+        coverage_reset(font);
+    }
+}
+
+#if defined(_DEBUG)
+static void __attribute__((constructor))
+test_unicode_props(void)
+{
+    /* WHITE SMILING FACE */
+    const struct unicode_props *p = unicode_props_lookup(0x263a);
+    assert(p->width == 1);
+    assert(!p->emoji_presentation);
+    assert(!p->grapheme_base);
+#if defined(FCFT_HAVE_HARFBUZZ)
+    assert(p->emoji);
+#else
+    assert(!p->emoji);
+#endif
+
+    p = unicode_props_lookup(U'a');
+    assert(p->width == 1);
+    assert(!p->emoji);
+    assert(p->grapheme_base);
+
+    assert(unicode_props_lookup(0)->width == 0);
+    assert(unicode_props_lookup(0x7f)->width == -1);
+    assert(unicode_props_lookup(0x0301)->width == 0);  /* COMBINING ACUTE ACCENT */
+    assert(unicode_props_lookup(0x4e00)->width == 2);  /* CJK ideograph */
+    assert(unicode_props_lookup(0x1f600)->width == 2); /* GRINNING FACE */
+    assert(unicode_props_lookup(0x110000)->width == -1);
+}
+#endif
+
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Adds a cached glyph’s memory usage to the cache size (and bitmap
+ * statistics), or, if ‘remove’ is true, subtracts it.
+ */
+static void
+cache_account_glyph(struct font_priv *font, const struct glyph_priv *glyph,
+                    bool remove)
+{
+    size_t bytes = sizeof(*glyph);
+
+    /* Shared bitmaps are accounted for by the glyph index cache */
+    if (glyph->valid && glyph->bitmap == NULL) {
+        pixman_image_t *pix = glyph->public.pix;
+        size_t bitmap_bytes =
+            (size_t)pixman_image_get_stride(pix) * pixman_image_get_height(pix);
+        size_t *stat =
+            &font->stats.bitmap_bytes[slab_kind(pixman_image_get_format(pix))];
+
+        if (remove)
+            *stat -= bitmap_bytes;
+        else
+            *stat += bitmap_bytes;
+
+        bytes += bitmap_bytes;
+    }
+
+    if (remove)
+        font->cache.bytes -= bytes;
+    else
+        font->cache.bytes += bytes;
+}
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+/* Must only be called while font->lock is held. See cache_account_glyph() */
+static void
+cache_account_grapheme(struct font_priv *font,
+                       const struct grapheme_priv *grapheme, bool remove)
+{
+    size_t bytes = sizeof(*grapheme) +
+        grapheme->len * sizeof(grapheme->cluster[0]) +
+        grapheme->public.count * sizeof(grapheme->public.glyphs[0]);
+
+    if (remove)
+        font->cache.bytes -= bytes;
+    else
+        font->cache.bytes += bytes;
+
+    for (size_t i = 0; i < grapheme->public.count; i++) {
+        cache_account_glyph(
+            font, (const struct glyph_priv *)grapheme->public.glyphs[i],
+            remove);
+    }
+}
+#endif
+
+/* Lock-free */
+static void
+cache_touch(_Atomic bool *referenced)
+{
+    /* Avoid dirtying the cache line when already set (e.g. no budget) */
+    if (!atomic_load_explicit(referenced, memory_order_relaxed))
+        atomic_store_explicit(referenced, true, memory_order_relaxed);
+}
+
+/* Must only be called while font->lock is held */
+static void
+glyph_cache_clock_step(struct font_priv *font)
+{
+    struct glyph_cache_table *table = atomic_load_explicit(
+        &font->glyph_cache.table, memory_order_relaxed);
+
+    size_t idx = font->glyph_cache.hand++ & (table->size - 1);
+    struct glyph_priv *glyph = atomic_load_explicit(
+        &table->entries[idx], memory_order_relaxed);
+
+    if (glyph == NULL || glyph == GLYPH_TOMBSTONE)
+        return;
+
+    /* Second chance */
+    if (atomic_exchange_explicit(&glyph->referenced, false, memory_order_relaxed))
+        return;
+
+    _Atomic(struct glyph_priv *) *direct = glyph_direct_entry(
+        font, glyph->public.cp, glyph->subpixel);
+    if (direct != NULL)
+        atomic_store_explicit(direct, NULL, memory_order_relaxed);
+
+    atomic_store_explicit(&table->entries[idx], GLYPH_TOMBSTONE, memory_order_release);
+    font->glyph_cache.count--;
+    font->glyph_cache.tombstones++;
+    font->stats.glyph_evictions++;
+    cache_account_glyph(font, glyph, true);
+    cache_retire(font, glyph, &glyph_destroy_retired);
+}
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+/* Must only be called while font->lock is held */
+static void
+grapheme_cache_clock_step(struct font_priv *font)
+{
+    struct grapheme_cache_table *table = atomic_load_explicit(
+        &font->grapheme_cache.table, memory_order_relaxed);
+
+    size_t idx = font->grapheme_cache.hand++ & (table->size - 1);
+    struct grapheme_priv *grapheme = atomic_load_explicit(
+        &table->entries[idx], memory_order_relaxed);
+
+    if (grapheme == NULL || grapheme == GRAPHEME_TOMBSTONE)
+        return;
+
+    if (atomic_exchange_explicit(&grapheme->referenced, false, memory_order_relaxed))
+        return;
+
+    atomic_store_explicit(&table->entries[idx], GRAPHEME_TOMBSTONE, memory_order_release);
+    font->grapheme_cache.count--;
+    font->grapheme_cache.tombstones++;
+    font->stats.grapheme_evictions++;
+    cache_account_grapheme(font, grapheme, true);
+    cache_retire(font, grapheme, &grapheme_destroy_retired);
+}
+#endif
+
+static uint64_t
+hash_value_for_index(const struct instance *inst, uint32_t index,
+                     enum fcft_subpixel subpixel)
+{
+    return ((uintptr_t)inst >> 4) * 0x9e3779b97f4a7c15ull ^
+        ((uint64_t)subpixel << 32 | index);
+}
+
+/* Must only be called while font->lock is held. See glyph_cache_lookup() */
+static struct glyph_priv *
+glyph_index_cache_lookup(struct font_priv *font, const struct instance *inst,
+                         uint32_t index, enum fcft_subpixel subpixel,
+                         _Atomic(struct glyph_priv *) **slot, size_t *probes)
+{
+    struct glyph_cache_table *table = font->glyph_index_cache.table;
+
+    size_t collisions = 0;
+    size_t idx = hash_index_for_size(
+        table->size, hash_value_for_index(inst, index, subpixel));
+    _Atomic(struct glyph_priv *) *entry = &table->entries[idx];
+    struct glyph_priv *glyph;
+
+    while ((glyph = atomic_load_explicit(entry, memory_order_relaxed)) != NULL &&
+           (glyph == GLYPH_TOMBSTONE ||
+            !(glyph->inst == inst &&
+              glyph->index == index &&
+              glyph->subpixel == subpixel)))
+    {
+        idx = (idx + 1) & (table->size - 1);
+        entry = &table->entries[idx];
+        collisions++;
+    }
+
+    if (slot != NULL)
+        *slot = entry;
+    if (probes != NULL)
+        *probes = collisions;
+    return glyph;
+}
+
+/* Must only be called while font->lock is held. See glyph_cache_resize() */
+static bool
+glyph_index_cache_resize(struct font_priv *font)
+{
+    struct glyph_cache_table *old = font->glyph_index_cache.table;
+
+    const size_t used =
+        font->glyph_index_cache.count + font->glyph_index_cache.tombstones;
+    if (used * 100 / old->size < 75)
+        return false;
+
+    size_t size = font->glyph_index_cache.count * 100 / old->size < 37
+        ? old->size : 2 * old->size;
+    assert(__builtin_popcount(size) == 1);
+
+    struct glyph_cache_table *table = glyph_cache_table_create(size);
+    if (table == NULL)
+        return false;
+
+    for (size_t i = 0; i < old->size; i++) {
+        struct glyph_priv *entry = atomic_load_explicit(
+            &old->entries[i], memory_order_relaxed);
+
+        if (entry == NULL || entry == GLYPH_TOMBSTONE)
+            continue;
+
+        size_t idx = hash_index_for_size(
+            size, hash_value_for_index(entry->inst, entry->index, entry->subpixel));
+
+        while (atomic_load_explicit(&table->entries[idx], memory_order_relaxed) != NULL)
+            idx = (idx + 1) & (size - 1);
+
+        atomic_store_explicit(&table->entries[idx], entry, memory_order_relaxed);
+    }
+
+    /* No lock-free readers; the old table can be free:d right away */
+    font->glyph_index_cache.table = table;
+    font->glyph_index_cache.tombstones = 0;
+    free(old);
+
+    LOG_DBG("resized glyph index cache from %zu to %zu", old->size, size);
+    return true;
+}
+
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Returns the cached bitmap for glyph ‘index’ in ‘inst’, with its
+ * reference counter incremented. Glyphs not yet in the cache are
+ * loaded from the disk cache, if possible. Returns NULL if the glyph
+ * has not been rasterized.
+ */
+static struct glyph_priv *glyph_index_cache_insert(
+    struct font_priv *font, const struct instance *inst,
+    uint32_t index, struct glyph_priv *glyph);
+
+static struct glyph_priv *
+glyph_index_cache_ref(struct font_priv *font, const struct instance *inst,
+                      uint32_t index, enum fcft_subpixel subpixel)
+{
+    size_t probes;
+    struct glyph_priv *glyph = glyph_index_cache_lookup(
+        font, inst, index, subpixel, NULL, &probes);
+
+    cache_count_probes(&font->stats.glyph_index_cache, probes);
+
+    if (glyph == NULL) {
+        counter_inc(&font->stats.glyph_index_cache.misses);
+
+        /* Not rasterized by us; maybe by an earlier process */
+        if (inst->disk.count > 0 &&
+            (glyph = glyph_disk_cache_load(font, inst, index, subpixel)) != NULL)
+        {
+            font->stats.glyphs_loaded++;
+            return glyph_index_cache_insert(font, inst, index, glyph);
+        }
+
+        return NULL;
+    }
+
+    counter_inc(&font->stats.glyph_index_cache.hits);
+    cache_touch(&glyph->referenced);
+    atomic_fetch_add_explicit(&glyph->ref_counter, 1, memory_order_relaxed);
+    return glyph;
+}
+
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Inserts a newly rasterized glyph (glyph_for_index()) in the glyph
+ * index cache, and returns it, with a reference for the caller.
+ *
+ * If another thread has already inserted the same glyph, ‘glyph’ is
+ * free:d, and the cached glyph is returned instead.
+ */
+static struct glyph_priv *
+glyph_index_cache_insert(struct font_priv *font, const struct instance *inst,
+                         uint32_t index, struct glyph_priv *glyph)
+{
+    assert(glyph->valid);
+    assert(glyph->bitmap == NULL);
+
+    glyph_index_cache_resize(font);
+
+    _Atomic(struct glyph_priv *) *entry;
+    struct glyph_priv *cached = glyph_index_cache_lookup(
+        font, inst, index, glyph->subpixel, &entry, NULL);
+
+    if (cached != NULL) {
+        glyph_destroy_private(glyph);
+        atomic_fetch_add_explicit(&cached->ref_counter, 1, memory_order_relaxed);
+        return cached;
+    }
+
+    glyph->inst = inst;
+    glyph->index = index;
+    atomic_init(&glyph->referenced, true);
+    atomic_init(&glyph->ref_counter, 2);  /* The cache, and the caller */
+
+    atomic_store_explicit(entry, glyph, memory_order_relaxed);
+    font->glyph_index_cache.count++;
+    cache_account_glyph(font, glyph, false);
+    return glyph;
+}
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Like glyph_index_cache_ref(), but rasterizes (using inst->face) and
+ * caches the glyph if it has not already been rasterized. Returns
+ * NULL if the glyph could not be rasterized.
+ */
+static struct glyph_priv *
+glyph_index_cache_get(struct font_priv *font, const struct instance *inst,
+                      uint32_t index, enum fcft_subpixel subpixel)
+{
+    struct glyph_priv *glyph = glyph_index_cache_ref(
+        font, inst, index, subpixel);
+
+    if (glyph != NULL)
+        return glyph;
+
+    if ((glyph = glyph_alloc(font)) == NULL)
+        return NULL;
+
+    if (!glyph_for_index(font, inst, inst->face, index, subpixel, glyph)) {
+        glyph_destroy_private(glyph);
+        return NULL;
+    }
+
+    return glyph_index_cache_insert(font, inst, index, glyph);
+}
+#endif
+
+/* Must only be called while font->lock is held */
+static void
+glyph_index_cache_clock_step(struct font_priv *font)
+{
+    struct glyph_cache_table *table = font->glyph_index_cache.table;
+
+    size_t idx = font->glyph_index_cache.hand++ & (table->size - 1);
+    struct glyph_priv *glyph = atomic_load_explicit(
+        &table->entries[idx], memory_order_relaxed);
+
+    if (glyph == NULL || glyph == GLYPH_TOMBSTONE)
+        return;
+
+    if (atomic_exchange_explicit(&glyph->referenced, false, memory_order_relaxed))
+        return;
+
+    /*
+     * Evicting a glyph that is still used by e.g. a cached glyph, or
+     * a text-run, would not free its bitmap. Wait until it is only
+     * referenced by us.
+     */
+    if (atomic_load_explicit(&glyph->ref_counter, memory_order_acquire) > 1)
+        return;
+
+    atomic_store_explicit(&table->entries[idx], GLYPH_TOMBSTONE, memory_order_relaxed);
+    font->glyph_index_cache.count--;
+    font->glyph_index_cache.tombstones++;
+    font->stats.glyph_index_evictions++;
+    cache_account_glyph(font, glyph, true);
+
+    /* May have been returned by fcft_rasterize_glyph_index() */
+    cache_retire(font, glyph, &glyph_unref_retired);
+}
+
+/*
+ * Must only be called while font->lock is held.
+ *
+ * If the font’s cached glyphs and graphemes use more memory than the
+ * budget allows, evict entries until we’re at 3/4 of the budget
+ * (to avoid evicting on every insertion once the budget has been
+ * reached).
+ *
+ * Entries are selected with the “clock” algorithm: the clock hand
+ * sweeps over the cache tables, evicting entries that have not been
+ * referenced since the last time the hand passed them, and clearing
+ * the referenced flag of those that have.
+ */
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+static void shaped_word_cache_clock_step(struct font_priv *font);
+#endif
+
+static void
+cache_evict(struct font_priv *font)
+{
+    const size_t budget = atomic_load_explicit(
+        &font->cache.budget, memory_order_relaxed);
+
+    if (budget == 0 || font->cache.bytes <= budget)
+        return;
+
+    const size_t target = budget - budget / 4;
+
+    /* Two full revolutions evicts everything (if necessary) */
+    size_t steps = 2 * atomic_load_explicit(
+        &font->glyph_cache.table, memory_order_relaxed)->size;
+    steps = max(steps, 2 * font->glyph_index_cache.table->size);
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+    steps = max(steps, 2 * atomic_load_explicit(
+        &font->grapheme_cache.table, memory_order_relaxed)->size);
+#endif
+
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+    if (font->shaped_word_cache.table != NULL)
+        steps = max(steps, 2 * font->shaped_word_cache.table->size);
+#endif
+
+    for (size_t i = 0; i < steps && font->cache.bytes > target; i++) {
+        glyph_cache_clock_step(font);
+        glyph_index_cache_clock_step(font);
+#if defined(FCFT_HAVE_HARFBUZZ)
+        grapheme_cache_clock_step(font);
+#endif
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+        shaped_word_cache_clock_step(font);
+#endif
+    }
+
+    LOG_DBG("evicted cache entries: %zu bytes cached (budget: %zu)",
+            font->cache.bytes, budget);
+
+    cache_reclaim(font);
+}
+
+/*
+ * Lock-free.
+ *
+ * Looks up ‘cp’ in the direct table, the thread local cache, and
+ * the glyph cache. Returns NULL on a cache miss. Note that the
+ * returned glyph may be invalid (i.e. a cached rasterization
+ * failure).
+ */
+static struct glyph_priv *
+glyph_cache_find(struct font_priv *font, struct reader *reader,
+                 uint64_t epoch, uint32_t cp, enum fcft_subpixel subpixel)
+{
+    _Atomic(struct glyph_priv *) *direct = glyph_direct_entry(font, cp, subpixel);
+    if (direct != NULL) {
+        struct glyph_priv *glyph = atomic_load_explicit(
+            direct, memory_order_acquire);
+
+        if (glyph != NULL) {
+            cache_touch(&glyph->referenced);
+            counter_inc(&reader->glyph_cache.hits);
+            return glyph;
+        }
+    }
+
+    const uint32_t key = hash_value_for_cp(cp, subpixel);
+    struct glyph_tls_entry *tls = glyph_tls_cache_entry(font, key);
+
+    if (tls->font_id == font->id && tls->key == key && tls->epoch == epoch) {
+        cache_touch(&tls->glyph->referenced);
+        counter_inc(&reader->glyph_cache.hits);
+        return tls->glyph;
+    }
+
+    size_t probes;
+    struct glyph_cache_table *table = atomic_load_explicit(
+        &font->glyph_cache.table, memory_order_acquire);
+    struct glyph_priv *cached = glyph_cache_lookup(
+        table, cp, subpixel, NULL, &probes);
+
+    cache_count_probes(&reader->glyph_cache, probes);
+
+    if (cached != NULL) {
+        cache_touch(&cached->referenced);
+        counter_inc(&reader->glyph_cache.hits);
+        *tls = (struct glyph_tls_entry){
+            .font_id = font->id, .key = key, .epoch = epoch, .glyph = cached};
+    }
+
+    return cached;
+}
+
+/*
+ * Must only be called while font->lock is held. The lock is dropped
+ * while rasterizing, but is held again when this function returns.
+ *
+ * Rasterizes ‘cp’ (unless another thread beat us to it), and inserts
+ * it into the glyph cache. Failures to rasterize are cached as
+ * invalid glyphs. Returns NULL if we ran out of memory.
+ */
+static struct glyph_priv *
+glyph_cache_populate(struct font_priv *font, struct reader *reader,
+                     uint64_t epoch, uint32_t cp, enum fcft_subpixel subpixel)
+{
+    _Atomic(struct glyph_priv *) *direct = glyph_direct_entry(font, cp, subpixel);
+    const uint32_t key = hash_value_for_cp(cp, subpixel);
+    struct glyph_tls_entry *tls = glyph_tls_cache_entry(font, key);
+
+    struct glyph_cache_table *table;
+    struct glyph_priv *cached;
+
+    /* Check again - another thread may have resized the cache, or
+     * populated the entry while we acquired the lock. Or, it may be
+     * rasterizing it right now; if so, wait for it instead of
+     * rasterizing the same glyph twice */
+    while (true) {
+        table = atomic_load_explicit(
+            &font->glyph_cache.table, memory_order_relaxed);
+        cached = glyph_cache_lookup(table, cp, subpixel, NULL, NULL);
+        if (cached != NULL) {
+            cache_touch(&cached->referenced);
+            counter_inc(&reader->glyph_cache.hits);
+            *tls = (struct glyph_tls_entry){
+                .font_id = font->id, .key = key, .epoch = epoch, .glyph = cached};
+            return cached;
+        }
+
+        bool reserved = false;
+        tll_foreach(font->glyph_reservations.keys, it) {
+            if (it->item == key) {
+                reserved = true;
+                break;
+            }
+        }
+
+        if (!reserved)
+            break;
+
+        cnd_wait(&font->glyph_reservations.done, &font->lock);
+    }
+
+    counter_inc(&reader->glyph_cache.misses);
+
+    struct instance *inst = instance_for_codepoint(font, cp);
+
+    assert(inst != NULL);
+    const FT_UInt idx = glyph_index_for_codepoint(inst, cp);
+
+    /* Another codepoint may map to the same glyph (e.g. .notdef) */
+    struct glyph_priv *bitmap = glyph_index_cache_ref(font, inst, idx, subpixel);
+
+    if (bitmap == NULL) {
+        /*
+         * Rasterize without holding the lock, so that threads asking
+         * for other glyphs can proceed. Instances (and thus ‘inst’)
+         * are never destroyed before the font is.
+         */
+        tll_push_back(font->glyph_reservations.keys, key);
+        mtx_unlock(&font->lock);
+
+        bool got_bitmap = false;
+        bitmap = glyph_alloc(font);
+
+        if (bitmap != NULL) {
+            FT_Face face = instance_face_get(inst);
+
+            if (face != NULL) {
+                got_bitmap = glyph_for_index(
+                    font, inst, face, idx, subpixel, bitmap);
+                instance_face_put(inst, face);
+                mtx_lock(&font->lock);
+            } else {
+                /* Fallback to the shared face, and the font lock */
+                mtx_lock(&font->lock);
+                got_bitmap = glyph_for_index(
+                    font, inst, inst->face, idx, subpixel, bitmap);
+            }
+        } else
+            mtx_lock(&font->lock);
+
+        tll_foreach(font->glyph_reservations.keys, it) {
+            if (it->item == key) {
+                tll_remove(font->glyph_reservations.keys, it);
+                break;
+            }
+        }
+
+        /* Wakes all waiters; those waiting for other glyphs go back to sleep */
+        cnd_broadcast(&font->glyph_reservations.done);
+
+        if (bitmap == NULL)
+            return NULL;
+
+        if (got_bitmap)
+            bitmap = glyph_index_cache_insert(font, inst, idx, bitmap);
+        else {
+            glyph_destroy_private(bitmap);
+            bitmap = NULL;
+        }
+    }
+
+    struct glyph_priv *glyph = glyph_alloc(font);
+    if (glyph == NULL) {
+        if (bitmap != NULL)
+            glyph_unref(bitmap);
+        return NULL;
+    }
+
+    /* If we failed to rasterize it, cache an invalid glyph */
+    if (bitmap != NULL)
+        glyph_share_bitmap(glyph, bitmap);
+    else
+        glyph->subpixel = subpixel;
+
+    glyph->public.cp = cp;
+    glyph->public.cols = unicode_props_lookup(cp)->width;
+
+    glyph_cache_resize(font);
+
+    _Atomic(struct glyph_priv *) *entry;
+    table = atomic_load_explicit(&font->glyph_cache.table, memory_order_relaxed);
+    cached = glyph_cache_lookup(table, cp, subpixel, &entry, NULL);
+    assert(cached == NULL);
+
+    atomic_init(&glyph->referenced, true);
+
+    assert(atomic_load_explicit(entry, memory_order_relaxed) == NULL);
+    atomic_store_explicit(entry, glyph, memory_order_release);
+    if (direct != NULL)
+        atomic_store_explicit(direct, glyph, memory_order_release);
+    font->glyph_cache.count++;
+    cache_account_glyph(font, glyph, false);
+
+    /* May evict, and thus retire, ‘glyph’, but it will not be free:d
+     * before this thread’s next call */
+    cache_evict(font);
+
+    *tls = (struct glyph_tls_entry){
+        .font_id = font->id, .key = key, .epoch = epoch, .glyph = glyph};
+    return glyph;
+}
+
+FCFT_EXPORT const struct fcft_glyph *
+fcft_rasterize_char_utf32(struct fcft_font *_font, uint32_t cp,
+                          enum fcft_subpixel subpixel)
+{
+    struct font_priv *font = (struct font_priv *)_font;
+
+    uint64_t epoch;
+    struct reader *reader = cache_quiescent(font, &epoch);
+    if (reader == NULL)
+        return NULL;
+
+    struct glyph_priv *glyph = glyph_cache_find(font, reader, epoch, cp, subpixel);
+
+    if (glyph == NULL) {
+        mtx_lock(&font->lock);
+        glyph = glyph_cache_populate(font, reader, epoch, cp, subpixel);
+        mtx_unlock(&font->lock);
+    }
+
+    return glyph != NULL && glyph->valid ? &glyph->public : NULL;
+}
+
+FCFT_EXPORT void
+fcft_rasterize_chars_utf32(struct fcft_font *_font, size_t count,
+                           const uint32_t cps[static count],
+                           enum fcft_subpixel subpixel,
+                           const struct fcft_glyph *glyphs[static count])
+{
+    struct font_priv *font = (struct font_priv *)_font;
+
+    /*
+     * A single quiescent point for the entire batch; nothing retired
+     * while we’re rasterizing the misses is free:d before this
+     * thread’s next call. Thus, all glyphs stay valid until then.
+     */
+    uint64_t epoch;
+    struct reader *reader = cache_quiescent(font, &epoch);
+    if (reader == NULL) {
+        for (size_t i = 0; i < count; i++)
+            glyphs[i] = NULL;
+        return;
+    }
+
+    /*
+     * First pass: resolve all cache hits, without locking. Cached
+     * failures are stored as-is (and filtered out at the end), so
+     * that only actual misses are NULL
+     */
+    bool have_misses = false;
+    for (size_t i = 0; i < count; i++) {
+        struct glyph_priv *glyph = glyph_cache_find(
+            font, reader, epoch, cps[i], subpixel);
+
+        glyphs[i] = glyph != NULL ? &glyph->public : NULL;
+        have_misses = have_misses || glyph == NULL;
+    }
+
+    /* Second pass: rasterize all misses under a single lock acquisition */
+    if (have_misses) {
+        mtx_lock(&font->lock);
+        for (size_t i = 0; i < count; i++) {
+            if (glyphs[i] != NULL)
+                continue;
+
+            struct glyph_priv *glyph = glyph_cache_populate(
+                font, reader, epoch, cps[i], subpixel);
+
+            glyphs[i] = glyph != NULL ? &glyph->public : NULL;
+        }
+        mtx_unlock(&font->lock);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const struct glyph_priv *glyph = (const struct glyph_priv *)glyphs[i];
+        if (glyph != NULL && !glyph->valid)
+            glyphs[i] = NULL;
+    }
+}
+
+struct prerasterize_job {
+    struct font_priv *font;
+    size_t count;
+    const struct fcft_codepoint_range *ranges;
+    enum fcft_subpixel subpixel;
+    size_t total;  /* Number of codepoints, in all ranges */
+};
+
+static const size_t prerasterize_chunk_size = 32;
+
+static uint64_t
+codepoint_range_length(const struct fcft_codepoint_range *range)
+{
+    return range->last >= range->first
+        ? (uint64_t)range->last - range->first + 1
+        : 0;
+}
+
+static void
+prerasterize_chunk(void *_job, size_t chunk)
+{
+    struct prerasterize_job *job = _job;
+
+    const size_t start = chunk * prerasterize_chunk_size;
+    const size_t end = min(start + prerasterize_chunk_size, job->total);
+
+    /* Find the range, and offset into it, of the first codepoint */
+    size_t range = 0;
+    uint64_t ofs = start;
+
+    while (ofs >= codepoint_range_length(&job->ranges[range]))
+        ofs -= codepoint_range_length(&job->ranges[range++]);
+
+    for (size_t i = start; i < end; i++) {
+        const uint32_t cp = job->ranges[range].first + ofs;
+        fcft_rasterize_char_utf32(&job->font->public, cp, job->subpixel);
+
+        if (++ofs >= codepoint_range_length(&job->ranges[range])) {
+            range++;
+            ofs = 0;
+
+            while (i + 1 < end &&
+                   codepoint_range_length(&job->ranges[range]) == 0)
+            {
+                range++;
+            }
+        }
+    }
+
+    /* We may be a pool thread, that won’t be back for a long time */
+    cache_offline(job->font);
+}
+
+FCFT_EXPORT bool
+fcft_prerasterize(struct fcft_font *_font, size_t count,
+                  const struct fcft_codepoint_range ranges[static count],
+                  enum fcft_subpixel subpixel)
+{
+    struct font_priv *font = (struct font_priv *)_font;
+
+    struct prerasterize_job job = {
+        .font = font,
+        .count = count,
+        .ranges = ranges,
+        .subpixel = subpixel,
+    };
+
+    for (size_t i = 0; i < count; i++)
+        job.total += codepoint_range_length(&ranges[i]);
+
+    LOG_DBG("pre-rasterizing %zu codepoints", job.total);
+
+    const size_t chunks =
+        (job.total + prerasterize_chunk_size - 1) / prerasterize_chunk_size;
+
+    return thread_pool_for(
+        get_thread_pool(), chunks, &prerasterize_chunk, &job);
+}
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+
+static uint64_t
+sdbm_hash_wide(const uint32_t *s, size_t len)
+{
+    uint64_t hash = 0;
+
+    for (size_t i = 0; i < len; i++, s++)
+        hash = (hash << 4) ^ *s;
+    return hash;
+}
+
+static uint64_t
+hash_value_for_grapheme(size_t len, const uint32_t grapheme[static len],
+                        enum fcft_subpixel subpixel)
+{
+    uint64_t hash = sdbm_hash_wide(grapheme, len);
+    hash &= (1ull << 29) - 1;
+    return subpixel << 29 | hash;
+}
+
+/* Lock-free. See glyph_cache_lookup() */
+static struct grapheme_priv *
+grapheme_cache_lookup(struct grapheme_cache_table *table,
+                      size_t len, const uint32_t cluster[static len],
+                      enum fcft_subpixel subpixel,
+                      _Atomic(struct grapheme_priv *) **slot, size_t *probes)
+{
+    size_t collisions = 0;
+    size_t idx = hash_index_for_size(
+        table->size, hash_value_for_grapheme(len, cluster, subpixel));
+    _Atomic(struct grapheme_priv *) *entry = &table->entries[idx];
+    struct grapheme_priv *grapheme;
+
+    while ((grapheme = atomic_load_explicit(entry, memory_order_acquire)) != NULL &&
+           (grapheme == GRAPHEME_TOMBSTONE ||
+            !(grapheme->len == len &&
+              memcmp(grapheme->cluster, cluster, len * sizeof(cluster[0])) == 0 &&
+              grapheme->subpixel == subpixel)))
+    {
+        idx = (idx + 1) & (table->size - 1);
+        entry = &table->entries[idx];
+        collisions++;
+    }
+
+    if (slot != NULL)
+        *slot = entry;
+    if (probes != NULL)
+        *probes = collisions;
+    return grapheme;
+}
+
+/* Must only be called while font->lock is held */
+static bool
+grapheme_cache_resize(struct font_priv *font)
+{
+    struct grapheme_cache_table *old = atomic_load_explicit(
+        &font->grapheme_cache.table, memory_order_relaxed);
+
+    const size_t used = font->grapheme_cache.count + font->grapheme_cache.tombstones;
+    if (used * 100 / old->size < 75)
+        return false;
+
+    size_t size = font->grapheme_cache.count * 100 / old->size < 37
+        ? old->size : 2 * old->size;
+    assert(__builtin_popcount(size) == 1);
+
+    struct grapheme_cache_table *table = grapheme_cache_table_create(size);
+    if (table == NULL)
+        return false;
+
+    for (size_t i = 0; i < old->size; i++) {
+        struct grapheme_priv *entry = atomic_load_explicit(
+            &old->entries[i], memory_order_relaxed);
+
+        if (entry == NULL || entry == GRAPHEME_TOMBSTONE)
+            continue;
+
+        size_t idx = hash_index_for_size(
+            size, hash_value_for_grapheme(
+                entry->len, entry->cluster, entry->subpixel));
+
+        while (atomic_load_explicit(&table->entries[idx], memory_order_relaxed) != NULL)
+            idx = (idx + 1) & (size - 1);
+
+        atomic_store_explicit(&table->entries[idx], entry, memory_order_relaxed);
+    }
+
+    /* Readers may still be probing the old table; see glyph_cache_table */
+    atomic_store_explicit(&font->grapheme_cache.table, table, memory_order_release);
+    font->grapheme_cache.tombstones = 0;
+    cache_retire(font, old, &free);
+    cache_reclaim(font);
+
+    LOG_DBG("resized grapheme cache from %zu to %zu (count: %zu)",
+            old->size, size, font->grapheme_cache.count);
+    return true;
+}
+
+/* Must only be called while font->lock is held */
+static bool
+font_for_grapheme(struct font_priv *font,
+                  size_t len, const uint32_t cluster[static len],
+                  struct instance **inst, bool enforce_presentation_style)
+{
+    /*
+     * No fallback before the first one having each (non-ZWJ,
+     * non-selector) codepoint can have all of them.
+     */
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (cluster[i] == 0x200d || cluster[i] == 0xfe0e || cluster[i] == 0xfe0f)
+            continue;
+
+        ssize_t idx = coverage_lookup(font, cluster[i], COVERAGE_ANY);
+        if (idx < 0)
+            goto no_font;
+
+        start = max(start, (size_t)idx);
+    }
+
+search_fonts:
+
+    for (size_t idx = start; idx < font->fallbacks.count; idx++) {
+        struct fallback *fallback = &font->fallbacks.arr[idx];
+        if (fallback->failed)
+            continue;
+
+        const bool has_lang_emoji = fallback->has_lang_emoji;
+
+        bool has_all_code_points = true;
+        for (size_t i = 0; i < len && has_all_code_points; i++) {
+
+            const struct unicode_props *props = unicode_props_lookup(cluster[i]);
+
+            if (enforce_presentation_style &&
+                props->emoji &&
+                (i + 1 >= len || (cluster[i + 1] != 0xfe0e &&
+                                  cluster[i + 1] != 0xfe0f))) {
+                /*
+                 * We have an emoji, that is either the last codepoint
+                 * in the grapheme, *or* is followed by a codepoint
+                 * that is *not* a presentation selector.
+                 */
+                bool force_text_presentation = false;
+                bool force_emoji_presentation = false;
+
+                switch (font->emoji_presentation) {
+                case FCFT_EMOJI_PRESENTATION_TEXT:
+                    force_text_presentation = true;
+                    force_emoji_presentation = false;
+                    break;
+
+                case FCFT_EMOJI_PRESENTATION_EMOJI:
+                    force_text_presentation = false;
+                    force_emoji_presentation = true;
+                    break;
 
-    case FT_PIXEL_MODE_GRAY:
-        pix_format = PIXMAN_a8;
-        width = bitmap->width;
-        rows = bitmap->rows;
-        break;
+                case FCFT_EMOJI_PRESENTATION_DEFAULT:
+                    force_text_presentation = !props->emoji_presentation;
+                    force_emoji_presentation = props->emoji_presentation;
+                    break;
+                }
 
-    case FT_PIXEL_MODE_LCD:
-        pix_format = PIXMAN_x8r8g8b8;
-        width = bitmap->width / 3;
-        rows = bitmap->rows;
-        break;
+                if (force_text_presentation && has_lang_emoji) {
+                    has_all_code_points = false;
+                    continue;
+                }
 
-    case FT_PIXEL_MODE_LCD_V:
-        pix_format = PIXMAN_x8r8g8b8;
-        width = bitmap->width;
-        rows = bitmap->rows / 3;
-        break;
+                if (force_emoji_presentation && !has_lang_emoji) {
+                    has_all_code_points = false;
+                    continue;
+                }
+            }
 
-    case FT_PIXEL_MODE_BGRA:
-        pix_format = PIXMAN_a8r8g8b8;
-        width = bitmap->width;
-        rows = bitmap->rows;
-        break;
+            if (cluster[i] == 0x200d) {
+                /* ZWJ */
+                continue;
+            }
+
+            if (cluster[i] == 0xfe0f) {
+                /* Explicit emoji selector */
+
+#if 0
+                /* Require colored emoji? */
+                if (!fallback->is_color) {
+                    /* Skip font if it is not a colored font */
+                    has_all_code_points = false;
+                }
+#endif
+                if (!has_lang_emoji) {
+                    /* Skip font if it isn't an emoji font */
+                    has_all_code_points = false;
+                }
+
+                continue;
+            }
+
+            else if (cluster[i] == 0xfe0e) {
+                /* Explicit text selector */
+
+                if (has_lang_emoji) {
+                    /* Skip font if it is an emoji font */
+                    has_all_code_points = false;
+                }
+
+                continue;
+            }
+
+            if (!FcCharSetHasChar(fallback->charset, cluster[i])) {
+                has_all_code_points = false;
+                break;
+            }
+        }
+
+        if (has_all_code_points) {
+            if (fallback->font == NULL &&
+                fallback_instantiate(font, fallback) == NULL)
+            {
+                fallback->failed = true;
+                coverage_reset(font);
+                continue;
+            }
+
+            *inst = fallback->font;
+            return true;
+        }
+    }
+
+    if (fallbacks_extend(font, len, cluster))
+        goto search_fonts;
+
+    if (enforce_presentation_style)
+        return font_for_grapheme(font, len, cluster, inst, false);
+
+no_font:
+    /* No font found, use primary font anyway */
+    *inst = font->fallbacks.arr[0].font;
+    return *inst != NULL;
+}
+
+/*
+ * Lock-free. Returns NULL on a cache miss. Note that the returned
+ * grapheme may be invalid (i.e. a cached failure).
+ */
+static struct grapheme_priv *
+grapheme_cache_find(struct font_priv *font, struct reader *reader,
+                    size_t len, const uint32_t cluster[static len],
+                    enum fcft_subpixel subpixel)
+{
+    size_t probes;
+    struct grapheme_cache_table *table = atomic_load_explicit(
+        &font->grapheme_cache.table, memory_order_acquire);
+    struct grapheme_priv *cached = grapheme_cache_lookup(
+        table, len, cluster, subpixel, NULL, &probes);
+
+    cache_count_probes(&reader->grapheme_cache, probes);
+
+    if (cached != NULL) {
+        cache_touch(&cached->referenced);
+        counter_inc(&reader->grapheme_cache.hits);
+    }
+
+    return cached;
+}
+
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Shapes and rasterizes ‘cluster’ (unless another thread beat us to
+ * it), and inserts it into the grapheme cache. Failures are cached as
+ * invalid graphemes. Returns NULL if we ran out of memory.
+ */
+static struct grapheme_priv *
+grapheme_cache_populate(struct font_priv *font, struct reader *reader,
+                        size_t len, const uint32_t cluster[static len],
+                        enum fcft_subpixel subpixel)
+{
+    struct instance *inst = NULL;
+
+    /* Check again - another thread may have resized the cache, or
+     * populated the entry while we acquired the lock */
+    _Atomic(struct grapheme_priv *) *entry;
+    struct grapheme_cache_table *table = atomic_load_explicit(
+        &font->grapheme_cache.table, memory_order_relaxed);
+    struct grapheme_priv *cached = grapheme_cache_lookup(
+        table, len, cluster, subpixel, &entry, NULL);
+    if (cached != NULL) {
+        cache_touch(&cached->referenced);
+        counter_inc(&reader->grapheme_cache.hits);
+        return cached;
+    }
+
+    if (grapheme_cache_resize(font)) {
+        /* Entry pointer is invalid if the cache was resized */
+        table = atomic_load_explicit(
+            &font->grapheme_cache.table, memory_order_relaxed);
+        grapheme_cache_lookup(table, len, cluster, subpixel, &entry, NULL);
+    }
+
+    counter_inc(&reader->grapheme_cache.misses);
+
+    struct grapheme_priv *grapheme = malloc(sizeof(*grapheme));
+    uint32_t *cluster_copy = malloc(len * sizeof(cluster_copy[0]));
+    if (grapheme == NULL || cluster_copy == NULL) {
+        /* Can’t update cache entry since we can’t store the cluster */
+        free(grapheme);
+        free(cluster_copy);
+        return NULL;
+    }
+
+    size_t glyph_idx = 0;
+    memcpy(cluster_copy, cluster, len * sizeof(cluster[0]));
+    grapheme->valid = false;
+    grapheme->len = len;
+    grapheme->cluster = cluster_copy;
+    grapheme->subpixel = subpixel;
+    grapheme->public.glyphs = NULL;
+    grapheme->public.count = 0;
+
+    /* Find a font that has all codepoints in the grapheme */
+    if (!font_for_grapheme(font, len, cluster, &inst, true))
+        goto err;
+
+    assert(inst->hb_font != NULL);
+
+    hb_buffer_add_utf32(inst->hb_buf, (const uint32_t *)cluster, len, 0, len);
+    hb_buffer_guess_segment_properties(inst->hb_buf);
+
+    hb_shape(inst->hb_font, inst->hb_buf, inst->hb_feats, inst->hb_feats_count);
+
+    unsigned count = hb_buffer_get_length(inst->hb_buf);
+    const hb_glyph_info_t *info = hb_buffer_get_glyph_infos(inst->hb_buf, NULL);
+    const hb_glyph_position_t *pos = hb_buffer_get_glyph_positions(inst->hb_buf, NULL);
+
+    int grapheme_width = 0;
+    int min_grapheme_width = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (cluster[i] == 0xfe0f)
+            min_grapheme_width = 2;
+        grapheme_width += unicode_props_lookup(cluster[i])->width;
+    }
+
+    LOG_DBG("length: %u", hb_buffer_get_length(inst->hb_buf));
+    LOG_DBG("infos: %u", count);
+
+    struct fcft_glyph **glyphs = calloc(count, sizeof(glyphs[0]));
+    if (glyphs == NULL)
+        goto err;
+
+    grapheme->public.cols = max(grapheme_width, min_grapheme_width);
+    grapheme->public.glyphs = (const struct fcft_glyph **)glyphs;
+
+    const unsigned count_from_the_beginning = count;
+
+    for (unsigned i = 0; i < count_from_the_beginning; i++) {
+        LOG_DBG("code point: %04x, cluster: %u", info[i].codepoint, info[i].cluster);
+        LOG_DBG("x-advance: %d, x-offset: %d, y-advance: %d, y-offset: %d",
+                pos[i].x_advance, pos[i].x_offset,
+                pos[i].y_advance, pos[i].y_offset);
+
+        struct glyph_priv *bitmap = glyph_index_cache_get(
+            font, inst, info[i].codepoint, subpixel);
+        if (bitmap == NULL)
+            goto err;
+
+        struct glyph_priv *glyph = glyph_alloc(font);
+        if (glyph == NULL) {
+            glyph_unref(bitmap);
+            goto err;
+        }
+
+        glyph_share_bitmap(glyph, bitmap);
+        assert(glyph->valid);
+
+        assert(info[i].cluster < len);
+        glyph->public.cp = cluster[info[i].cluster];
+        glyph->public.cols = unicode_props_lookup(glyph->public.cp)->width;
+
+#if 0
+        LOG_DBG("grapheme: x: advance: %d -> %d, offset: %d -> %d",
+                glyph->public.advance.x,
+                (int)(pos[i].x_advance / 64. * inst->pixel_size_fixup),
+                glyph->public.x,
+                (int)(pos[i].x_offset / 64. * inst->pixel_size_fixup));
+        LOG_DBG("grapheme: y: advance: %d -> %d, offset: %d -> %d",
+                glyph->public.advance.y,
+                (int)(pos[i].y_advance / 64. * inst->pixel_size_fixup),
+                glyph->public.y,
+                (int)(pos[i].y_offset / 64. * inst->pixel_size_fixup));
+#endif
+
+        glyph->public.x += pos[i].x_offset / 64. * inst->pixel_size_fixup;
+        glyph->public.y += pos[i].y_offset / 64. * inst->pixel_size_fixup;
+        glyph->public.advance.x = pos[i].x_advance / 64. * inst->pixel_size_fixup;
+        glyph->public.advance.y = pos[i].y_advance / 64. * inst->pixel_size_fixup;
+
+        grapheme->public.glyphs[glyph_idx++] = &glyph->public;
+    }
+
+#if defined(_DEBUG)
+    assert(glyph_idx == count);
+    for (size_t i = 0; i < count; i++) {
+        const struct glyph_priv *g
+            = (const struct glyph_priv *)grapheme->public.glyphs[i];
+
+        assert(g != NULL);
+        assert(g->valid);
+    }
+#endif
+
+    hb_buffer_clear_contents(inst->hb_buf);
+
+    assert(atomic_load_explicit(entry, memory_order_relaxed) == NULL);
+    grapheme->public.count = glyph_idx;
+    grapheme->valid = true;
+    atomic_init(&grapheme->referenced, true);
+    atomic_store_explicit(entry, grapheme, memory_order_release);
+    font->grapheme_cache.count++;
+    cache_account_grapheme(font, grapheme, false);
+    cache_evict(font);
+    return grapheme;
+
+err:
+    hb_buffer_clear_contents(inst->hb_buf);
+    for (size_t i = 0; i < glyph_idx; i++)
+        glyph_destroy(grapheme->public.glyphs[i]);
+    free(grapheme->public.glyphs);
+
+    assert(atomic_load_explicit(entry, memory_order_relaxed) == NULL);
+    assert(!grapheme->valid);
+    grapheme->public.count = 0;
+    grapheme->public.glyphs = NULL;
+    atomic_init(&grapheme->referenced, true);
+    atomic_store_explicit(entry, grapheme, memory_order_release);
+    font->grapheme_cache.count++;
+    cache_account_grapheme(font, grapheme, false);
+    cache_evict(font);
+    return grapheme;
+}
+
+FCFT_EXPORT const struct fcft_grapheme *
+fcft_rasterize_grapheme_utf32(struct fcft_font *_font,
+                              size_t len, const uint32_t cluster[static len],
+                              enum fcft_subpixel subpixel)
+{
+    struct font_priv *font = (struct font_priv *)_font;
+
+    uint64_t epoch;
+    struct reader *reader = cache_quiescent(font, &epoch);
+    if (reader == NULL)
+        return NULL;
+
+    struct grapheme_priv *grapheme = grapheme_cache_find(
+        font, reader, len, cluster, subpixel);
+
+    if (grapheme == NULL) {
+        mtx_lock(&font->lock);
+        grapheme = grapheme_cache_populate(font, reader, len, cluster, subpixel);
+        mtx_unlock(&font->lock);
+    }
+
+    return grapheme != NULL && grapheme->valid ? &grapheme->public : NULL;
+}
+
+FCFT_EXPORT void
+fcft_rasterize_graphemes_utf32(struct fcft_font *_font, size_t count,
+                               const size_t lens[static count],
+                               const uint32_t *const clusters[static count],
+                               enum fcft_subpixel subpixel,
+                               const struct fcft_grapheme *graphemes[static count])
+{
+    struct font_priv *font = (struct font_priv *)_font;
 
-    default:
-        LOG_ERR("unimplemented: FT pixel mode: %d", bitmap->pixel_mode);
-        goto err;
-        break;
+    /* See fcft_rasterize_chars_utf32() */
+    uint64_t epoch;
+    struct reader *reader = cache_quiescent(font, &epoch);
+    if (reader == NULL) {
+        for (size_t i = 0; i < count; i++)
+            graphemes[i] = NULL;
+        return;
     }
 
-    int stride = stride_for_format_and_width(pix_format, width);
-    assert(stride >= bitmap->pitch);
+    bool have_misses = false;
+    for (size_t i = 0; i < count; i++) {
+        struct grapheme_priv *grapheme = grapheme_cache_find(
+            font, reader, lens[i], clusters[i], subpixel);
 
-    assert(bitmap->buffer != NULL || rows * stride == 0);
-    data = malloc(rows * stride);
-    if (data == NULL)
-        goto err;
+        graphemes[i] = grapheme != NULL ? &grapheme->public : NULL;
+        have_misses = have_misses || grapheme == NULL;
+    }
 
-    /* Convert FT bitmap to pixman image */
-    switch (bitmap->pixel_mode) {
-    case FT_PIXEL_MODE_MONO:  /* PIXMAN_a1 */
-        /*
-         * FreeType: left-most pixel is stored in MSB  ABCDEFGH IJKLMNOP
-         * Pixman: LE: left-most pixel in LSB          HGFEDCBA PONMLKJI
-         *         BE: left-most pixel in MSB          ABCDEFGH IJKLMNOP
-         *
-         * Thus, we need to reverse each byte on little-endian systems.
-         */
-        for (size_t r = 0; r < bitmap->rows; r++) {
-            for (size_t c = 0; c < (bitmap->width + 7) / 8; c++) {
-                uint8_t v = bitmap->buffer[r * bitmap->pitch + c];
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-                uint8_t reversed = 0;
-                for (size_t i = 0; i < min(8, bitmap->width - c * 8); i++)
-                    reversed |= ((v >> (7 - i)) & 1) << i;
+    if (have_misses) {
+        mtx_lock(&font->lock);
+        for (size_t i = 0; i < count; i++) {
+            if (graphemes[i] != NULL)
+                continue;
 
-                data[r * stride + c] = reversed;
-#else
-                data[r * stride + c] = v;
-#endif
-            }
-        }
-        break;
+            struct grapheme_priv *grapheme = grapheme_cache_populate(
+                font, reader, lens[i], clusters[i], subpixel);
 
-    case FT_PIXEL_MODE_GRAY: /* PIXMAN_a8 */
-        /*
-         * One pixel, one byte. No endianness to worry about
-         */
-        if (stride == bitmap->pitch) {
-            if (bitmap->buffer != NULL)
-                memcpy(data, bitmap->buffer, rows * stride);
-        } else {
-            for (size_t r = 0; r < bitmap->rows; r++) {
-                for (size_t c = 0; c < bitmap->width; c++)
-                    data[r * stride + c] = bitmap->buffer[r * bitmap->pitch + c];
-            }
+            graphemes[i] = grapheme != NULL ? &grapheme->public : NULL;
         }
-        break;
+        mtx_unlock(&font->lock);
+    }
 
-    case FT_PIXEL_MODE_BGRA: /* PIXMAN_a8r8g8b8 */
-        /*
-         * FreeType: blue comes *first* in memory
-         * Pixman: LE: blue comes *first* in memory
-         *         BE: alpha comes *first* in memory
-         *
-         * Pixman is ARGB *when loaded into a register*, assuming
-         * machine native 32-bit loads. Thus, it’s in-memory layout
-         * depends on the host’s endianness.
-         */
-        assert(stride == bitmap->pitch);
-        for (size_t r = 0; r < bitmap->rows; r++) {
-            for (size_t c = 0; c < bitmap->width * 4; c += 4) {
-                unsigned char _b = bitmap->buffer[r * bitmap->pitch + c + 0];
-                unsigned char _g = bitmap->buffer[r * bitmap->pitch + c + 1];
-                unsigned char _r = bitmap->buffer[r * bitmap->pitch + c + 2];
-                unsigned char _a = bitmap->buffer[r * bitmap->pitch + c + 3];
+    for (size_t i = 0; i < count; i++) {
+        const struct grapheme_priv *grapheme =
+            (const struct grapheme_priv *)graphemes[i];
+        if (grapheme != NULL && !grapheme->valid)
+            graphemes[i] = NULL;
+    }
+}
+#else /* !FCFT_HAVE_HARFBUZZ */
 
-                uint32_t *p = (uint32_t *)&data[r * stride + c];
-                *p = (uint32_t)_a << 24 | _r << 16 | _g << 8 | _b;
-            }
-        }
-        break;
+FCFT_EXPORT const struct fcft_grapheme *
+fcft_rasterize_grapheme_utf32(struct fcft_font *_font,
+                              size_t len, const uint32_t cluster[static len],
+                              enum fcft_subpixel subpixel)
+{
+    return NULL;
+}
 
-    case FT_PIXEL_MODE_LCD: /* PIXMAN_x8r8g8b8 */
-        /*
-         * FreeType: red comes *first* in memory
-         * Pixman: LE: blue comes *first* in memory
-         *         BE: x comes *first* in memory
-         *
-         * Same as above, except that the FreeType data is now RGBx
-         * instead of BGRA.
-         */
-        for (size_t r = 0; r < bitmap->rows; r++) {
-            for (size_t c = 0; c < bitmap->width; c += 3) {
-                unsigned char _r = bitmap->buffer[r * bitmap->pitch + c + (bgr ? 2 : 0)];
-                unsigned char _g = bitmap->buffer[r * bitmap->pitch + c + 1];
-                unsigned char _b = bitmap->buffer[r * bitmap->pitch + c + (bgr ? 0 : 2)];
+FCFT_EXPORT void
+fcft_rasterize_graphemes_utf32(struct fcft_font *_font, size_t count,
+                               const size_t lens[static count],
+                               const uint32_t *const clusters[static count],
+                               enum fcft_subpixel subpixel,
+                               const struct fcft_grapheme *graphemes[static count])
+{
+    for (size_t i = 0; i < count; i++)
+        graphemes[i] = NULL;
+}
 
-                uint32_t *p = (uint32_t *)&data[r * stride + 4 * (c / 3)];
-                *p = _r << 16 | _g << 8 | _b;
-            }
-        }
-        break;
+#endif
 
-    case FT_PIXEL_MODE_LCD_V: /* PIXMAN_x8r8g8b8 */
-        /*
-         * FreeType: red comes *first* in memory
-         * Pixman: LE: blue comes *first* in memory
-         *         BE: x comes *first* in memory
-         *
-         * Same as above, except that the FreeType data is now RGBx
-         * instead of BGRA.
-         */
-        for (size_t r = 0; r < bitmap->rows; r += 3) {
-            for (size_t c = 0; c < bitmap->width; c++) {
-                unsigned char _r = bitmap->buffer[(r + (bgr ? 2 : 0)) * bitmap->pitch + c];
-                unsigned char _g = bitmap->buffer[(r + 1) * bitmap->pitch + c];
-                unsigned char _b = bitmap->buffer[(r + (bgr ? 0 : 2)) * bitmap->pitch + c];
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+/* HarfBuzz’ output, for a single glyph. See struct shaped_word */
+struct shaped_glyph {
+    const struct instance *inst;
+    uint32_t index;    /* Glyph index */
+    uint32_t cluster;  /* Offset into the word */
+    hb_position_t x_offset;
+    hb_position_t y_offset;
+    hb_position_t x_advance;
+    hb_position_t y_advance;
+};
 
-                uint32_t *p = (uint32_t *)&data[r / 3 * stride + 4 * c];
-                *p =  _r << 16 | _g << 8 | _b;
-            }
-        }
-        break;
+/*
+ * Converts a shaped glyph’s offset, or advance, to pixels. Offsets
+ * are converted (and truncated) on their own, before being added to
+ * the glyph’s position, so that text-runs and shaped runs (see
+ * fcft_shape_text_run_utf32()) position glyphs identically.
+ */
+static int
+shaped_glyph_px(const struct instance *inst, hb_position_t pos)
+{
+    return pos / 64. * inst->pixel_size_fixup;
+}
 
-    default:
-        abort();
-        break;
-    }
+/*
+ * A shaped text-run “word”; a piece of text, up to, and including,
+ * the whitespace following it. See word_end().
+ *
+ * Text-runs are split into words, and each word is segmented into
+ * graphemes, assigned font instances, and shaped, on its own. The
+ * result is cached, keyed on the text itself, since that, together
+ * with the font (and its emoji presentation setting), determines
+ * the instances, scripts, directions and font features. Thus,
+ * re-rasterizing a line of text mostly hits the cache, even if
+ * parts of it have been edited.
+ */
+struct shaped_word {
+    uint64_t hash;
+    enum fcft_emoji_presentation emoji_presentation;
+    bool referenced;  /* See cache_evict() */
 
-    if ((pix = pixman_image_create_bits_no_clear(
-             pix_format, width, rows, (uint32_t *)data, stride)) == NULL)
-        goto err;
+    size_t len;
+    const uint32_t *text;  /* ‘len’ characters */
 
-    pixman_image_set_component_alpha(
-        pix,
-        bitmap->pixel_mode == FT_PIXEL_MODE_LCD ||
-        bitmap->pixel_mode == FT_PIXEL_MODE_LCD_V);
+    size_t count;
+    struct shaped_glyph glyphs[];  /* Followed by ‘text’ */
+};
 
-    int x = inst->face->glyph->bitmap_left;
-    int y = inst->face->glyph->bitmap_top;
+static struct shaped_word_cache_table *
+shaped_word_cache_table_create(size_t size)
+{
+    struct shaped_word_cache_table *table = calloc(
+        1, sizeof(*table) + size * sizeof(table->entries[0]));
+    if (table == NULL)
+        return NULL;
 
-    if (inst->pixel_size_fixup == 0.)
-        x = y = width = rows = 0;
+    table->size = size;
+    return table;
+}
 
-    else if (inst->pixel_size_fixup != 1.) {
-        struct pixman_f_transform scale;
-        pixman_f_transform_init_scale(
-            &scale,
-            1. / inst->pixel_size_fixup,
-            1. / inst->pixel_size_fixup);
+static uint64_t
+hash_value_for_word(size_t len, const uint32_t text[static len],
+                    enum fcft_emoji_presentation emoji_presentation)
+{
+    /* FNV-1a */
+    uint64_t hash = 0xcbf29ce484222325ull ^ emoji_presentation;
 
-        struct pixman_transform _scale;
-        pixman_transform_from_pixman_f_transform(&_scale, &scale);
-        pixman_image_set_transform(pix, &_scale);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= text[i];
+        hash *= 0x100000001b3ull;
+    }
 
-        const enum fcft_scaling_filter filter_to_use = inst->is_color
-            ? scaling_filter
-            : FCFT_SCALING_FILTER_BILINEAR;
+    return hash;
+}
 
-        switch (filter_to_use) {
-        case FCFT_SCALING_FILTER_NONE:
-            break;
+/* Must only be called while font->lock is held. See glyph_cache_lookup() */
+static struct shaped_word *
+shaped_word_cache_lookup(struct font_priv *font, uint64_t hash,
+                         size_t len, const uint32_t text[static len],
+                         struct shaped_word ***slot)
+{
+    struct shaped_word_cache_table *table = font->shaped_word_cache.table;
+
+    size_t collisions = 0;
+    size_t idx = hash_index_for_size(table->size, hash);
+    struct shaped_word **entry = &table->entries[idx];
+
+    while (*entry != NULL &&
+           (*entry == SHAPED_WORD_TOMBSTONE ||
+            !((*entry)->hash == hash &&
+              (*entry)->emoji_presentation == font->emoji_presentation &&
+              (*entry)->len == len &&
+              memcmp((*entry)->text, text, len * sizeof(text[0])) == 0)))
+    {
+        idx = (idx + 1) & (table->size - 1);
+        entry = &table->entries[idx];
+        collisions++;
+    }
 
-        case FCFT_SCALING_FILTER_NEAREST:
-            pixman_image_set_filter(pix, PIXMAN_FILTER_NEAREST, NULL, 0);
-            break;
+    cache_count_probes(&font->stats.shaped_word_cache, collisions);
 
-        case FCFT_SCALING_FILTER_BILINEAR:
-            pixman_image_set_filter(pix, PIXMAN_FILTER_BILINEAR, NULL, 0);
-            break;
+    if (slot != NULL)
+        *slot = entry;
+    return *entry;
+}
 
-        case FCFT_SCALING_FILTER_CUBIC:
-        case FCFT_SCALING_FILTER_LANCZOS3: {
-            /*
-             * TODO:
-             *   - find out how the subsample_bit_{x,y} parameters should be set
-             */
-            int param_count = 0;
-            pixman_kernel_t kernel = filter_to_use == FCFT_SCALING_FILTER_CUBIC
-                ? PIXMAN_KERNEL_CUBIC
-                : PIXMAN_KERNEL_LANCZOS3;
+/* Must only be called while font->lock is held */
+static void
+cache_account_shaped_word(struct font_priv *font,
+                          const struct shaped_word *word, bool remove)
+{
+    size_t bytes = sizeof(*word) +
+        word->count * sizeof(word->glyphs[0]) +
+        word->len * sizeof(word->text[0]);
+
+    if (remove)
+        font->cache.bytes -= bytes;
+    else
+        font->cache.bytes += bytes;
+}
 
-            pixman_fixed_t *params = pixman_filter_create_separable_convolution(
-                &param_count,
-                pixman_double_to_fixed(1. / inst->pixel_size_fixup),
-                pixman_double_to_fixed(1. / inst->pixel_size_fixup),
-                kernel, kernel,
-                kernel, kernel,
-                pixman_int_to_fixed(1),
-                pixman_int_to_fixed(1));
+/* Must only be called while font->lock is held. See glyph_cache_resize() */
+static bool
+shaped_word_cache_resize(struct font_priv *font)
+{
+    struct shaped_word_cache_table *old = font->shaped_word_cache.table;
 
-            pixman_image_set_filter(
-                pix, PIXMAN_FILTER_SEPARABLE_CONVOLUTION,
-                params, param_count);
-            free(params);
-            break;
-        }
-        }
+    const size_t used =
+        font->shaped_word_cache.count + font->shaped_word_cache.tombstones;
+    if (used * 100 / old->size < 75)
+        return false;
 
-        int scaled_width = width / (1. / inst->pixel_size_fixup);
-        int scaled_rows = rows / (1. / inst->pixel_size_fixup);
-        int scaled_stride = stride_for_format_and_width(pix_format, scaled_width);
+    size_t size = font->shaped_word_cache.count * 100 / old->size < 37
+        ? old->size : 2 * old->size;
+    assert(__builtin_popcount(size) == 1);
 
-        if (pix_format == PIXMAN_a8r8g8b8) {
-            uint8_t *scaled_data = malloc(scaled_rows * scaled_stride);
-            if (scaled_data == NULL)
-                goto err;
+    struct shaped_word_cache_table *table = shaped_word_cache_table_create(size);
+    if (table == NULL)
+        return false;
 
-            pixman_image_t *scaled_pix = pixman_image_create_bits_no_clear(
-                pix_format, scaled_width, scaled_rows,
-                (uint32_t *)scaled_data, scaled_stride);
+    for (size_t i = 0; i < old->size; i++) {
+        struct shaped_word *entry = old->entries[i];
 
-            if (scaled_pix == NULL) {
-                free(scaled_data);
-                goto err;
-            }
+        if (entry == NULL || entry == SHAPED_WORD_TOMBSTONE)
+            continue;
 
-            pixman_image_composite32(
-                PIXMAN_OP_SRC, pix, NULL, scaled_pix, 0, 0, 0, 0,
-                0, 0, scaled_width, scaled_rows);
+        size_t idx = hash_index_for_size(size, entry->hash);
+        while (table->entries[idx] != NULL)
+            idx = (idx + 1) & (size - 1);
 
-            pixman_image_unref(pix);
-            free(data);
+        table->entries[idx] = entry;
+    }
 
-            data = scaled_data;
-            pix = scaled_pix;
-        }
+    LOG_DBG("resized shaped word cache from %zu to %zu", old->size, size);
 
-        rows = scaled_rows;
-        width = scaled_width;
-        stride = scaled_stride;
+    font->shaped_word_cache.table = table;
+    font->shaped_word_cache.tombstones = 0;
+    free(old);
+    return true;
+}
 
-        x *= inst->pixel_size_fixup;
-        y *= inst->pixel_size_fixup;
-    }
+/* Must only be called while font->lock is held */
+static void
+shaped_word_cache_clock_step(struct font_priv *font)
+{
+    struct shaped_word_cache_table *table = font->shaped_word_cache.table;
+    if (table == NULL)
+        return;
 
-    *glyph = (struct glyph_priv){
-        .public = {
-            .font_name = inst->name,
-            .pix = pix,
-            .x = x,
-            .y = y,
-            .advance = {
-                .x = (inst->face->glyph->advance.x / 64. *
-                      (inst->pixel_fixup_estimated ? inst->pixel_size_fixup : 1.)),
-                .y = (inst->face->glyph->advance.y / 64. *
-                      (inst->pixel_fixup_estimated ? inst->pixel_size_fixup : 1.)),
-            },
-            .width = width,
-            .height = rows,
-        },
-        .subpixel = subpixel,
-        .valid = true,
-    };
+    size_t idx = font->shaped_word_cache.hand++ & (table->size - 1);
+    struct shaped_word *word = table->entries[idx];
+
+    if (word == NULL || word == SHAPED_WORD_TOMBSTONE)
+        return;
+
+    if (word->referenced) {
+        word->referenced = false;
+        return;
+    }
 
-    return true;
+    table->entries[idx] = SHAPED_WORD_TOMBSTONE;
+    font->shaped_word_cache.count--;
+    font->shaped_word_cache.tombstones++;
+    font->stats.shaped_word_evictions++;
+    cache_account_shaped_word(font, word, true);
 
-err:
-    if (pix != NULL)
-        pixman_image_unref(pix);
-    free(data);
-    assert(!glyph->valid);
-    return false;
+    /* Only ever referenced with font->lock held */
+    free(word);
 }
 
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Inserts a newly shaped word in the cache. Returns false if the
+ * cache could not be allocated, in which case the caller still owns
+ * ‘word’.
+ */
 static bool
-glyph_for_codepoint(const struct instance *inst, uint32_t cp,
-                    enum fcft_subpixel subpixel, struct glyph_priv *glyph)
+shaped_word_cache_insert(struct font_priv *font, struct shaped_word *word)
 {
-    FT_UInt idx = -1;
+    if (font->shaped_word_cache.table == NULL) {
+        font->shaped_word_cache.table =
+            shaped_word_cache_table_create(shaped_word_cache_initial_size);
+        if (font->shaped_word_cache.table == NULL)
+            return false;
+    }
 
-#if defined(FCFT_HAVE_HARFBUZZ)
-    /*
-     * Use HarfBuzz if we have any font features. If we don’t, there’s
-     * no point in using HarfBuzz since it only slows things down, and
-     * we can just lookup the glyph index directly using FreeType’s
-     * API.x
-     */
-    if (inst->hb_feats_count > 0) {
-        hb_buffer_add_utf32(inst->hb_buf, &cp, 1, 0, 1);
-        hb_buffer_guess_segment_properties(inst->hb_buf);
-        hb_shape(inst->hb_font, inst->hb_buf, inst->hb_feats, inst->hb_feats_count);
+    /* Bound the cache even without a budget; there’s no end to the
+     * number of different words */
+    for (size_t i = 0;
+         i < 2 * font->shaped_word_cache.table->size &&
+             font->shaped_word_cache.count >= shaped_word_cache_max_count;
+         i++)
+    {
+        shaped_word_cache_clock_step(font);
+    }
 
-        unsigned count = hb_buffer_get_length(inst->hb_buf);
-        if (count == 1) {
-            const hb_glyph_info_t *info = hb_buffer_get_glyph_infos(inst->hb_buf, NULL);
-            idx = info[0].codepoint;
-        }
+    shaped_word_cache_resize(font);
 
-        hb_buffer_clear_contents(inst->hb_buf);
+    /* The caller has already checked the word isn’t cached, and the
+     * lock has been held since; re-use the first free slot */
+    struct shaped_word_cache_table *table = font->shaped_word_cache.table;
+    size_t idx = hash_index_for_size(table->size, word->hash);
+
+    while (table->entries[idx] != NULL &&
+           table->entries[idx] != SHAPED_WORD_TOMBSTONE)
+    {
+        idx = (idx + 1) & (table->size - 1);
     }
-#endif
 
-    if (idx == (FT_UInt)-1)
-        idx = FT_Get_Char_Index(inst->face, cp);
+    if (table->entries[idx] == SHAPED_WORD_TOMBSTONE)
+        font->shaped_word_cache.tombstones--;
 
-    bool ret = glyph_for_index(inst, idx, subpixel, glyph);
-    glyph->public.cp = cp;
-    glyph->public.cols = wcwidth(cp);
-    return ret;
+    word->referenced = true;
+    table->entries[idx] = word;
+    font->shaped_word_cache.count++;
+    cache_account_shaped_word(font, word, false);
+    return true;
 }
 
-static size_t
-hash_index_for_size(size_t size, size_t v)
+/*
+ * utf8proc_grapheme_break_stateful(), but without calling utf8proc
+ * for pairs of codepoints that are always separated by a break. Like
+ * our callers, resets ‘state’ on breaks.
+ */
+static bool
+grapheme_break(uint32_t cp1, uint32_t cp2, utf8proc_int32_t *state)
 {
-    return (v * 2654435761) & (size - 1);
-}
+    if (unicode_props_lookup(cp1)->grapheme_base &&
+        unicode_props_lookup(cp2)->grapheme_base)
+    {
+        if (state != NULL)
+            *state = 0;
+        return true;
+    }
 
-static size_t
-glyph_hash_index(const struct font_priv *font, size_t v)
-{
-    return hash_index_for_size(font->glyph_cache.size, v);
+    if (!utf8proc_grapheme_break_stateful(cp1, cp2, state))
+        return false;
+
+    if (state != NULL)
+        *state = 0;
+    return true;
 }
 
-static uint32_t
-hash_value_for_cp(uint32_t cp, enum fcft_subpixel subpixel)
+static bool
+is_word_separator(uint32_t cp)
 {
-    return subpixel << 29 | cp;
+    return cp == U' ' || cp == U'\t' || cp == U'\U00003000';
 }
 
-static struct glyph_priv **
-glyph_cache_lookup(struct font_priv *font, uint32_t cp,
-                   enum fcft_subpixel subpixel)
+/*
+ * Returns the end of the word starting at ‘start’. A word ends where
+ * whitespace is followed by non-whitespace (that is not part of the
+ * same grapheme), or at the end of the text.
+ */
+static size_t
+word_end(const uint32_t *text, size_t len, size_t start)
 {
-    size_t idx = glyph_hash_index(font, hash_value_for_cp(cp, subpixel));
-    struct glyph_priv **glyph = &font->glyph_cache.table[idx];
+    size_t i = start + 1;
 
-    while (*glyph != NULL && !((*glyph)->public.cp == cp &&
-                               (*glyph)->subpixel == subpixel))
+    while (i < len &&
+           !(is_word_separator(text[i - 1]) &&
+             !is_word_separator(text[i]) &&
+             grapheme_break(text[i - 1], text[i], NULL)))
     {
-        idx = (idx + 1) & (font->glyph_cache.size - 1);
-        glyph = &font->glyph_cache.table[idx];
-
-#if defined(_DEBUG)
-        glyph_cache_collisions++;
-#endif
+        i++;
     }
 
-#if defined(_DEBUG)
-    glyph_cache_lookups++;
-#endif
-    return glyph;
+    return i;
 }
 
+/* Shaped glyphs of a partial run, allocated from an arena */
+struct shaped_glyphs {
+    struct arena *arena;
+    struct shaped_glyph *glyphs;
+    size_t count;
+    size_t size;
+};
+
+/*
+ * A piece of a word, where all graphemes use the same font instance,
+ * and belong to the same script. Each partial run is shaped on its
+ * own.
+ */
+struct partial_run {
+    const uint32_t *text;  /* The whole word */
+    size_t text_len;
+
+    size_t start;          /* Offset into the word */
+    size_t len;
+    struct instance *inst;
+    hb_script_t script;    /* Of the run’s first grapheme */
+
+    struct shaped_glyphs glyphs;
+};
+
+/*
+ * Must only be called while font->lock is held (possibly by another
+ * thread, see shape_group()).
+ */
 static bool
-glyph_cache_resize(struct font_priv *font)
+shape_partial_run(const struct instance *inst,
+                  const uint32_t *text, size_t len,
+                  size_t run_start, size_t run_len,
+                  struct shaped_glyphs *out)
 {
-    if (font->glyph_cache.count * 100 / font->glyph_cache.size < 75)
-        return false;
+    hb_buffer_add_utf32(inst->hb_buf, text, len, run_start, run_len);
+    hb_buffer_guess_segment_properties(inst->hb_buf);
 
-    size_t size = 2 * font->glyph_cache.size;
-    assert(__builtin_popcount(size) == 1);
+    hb_segment_properties_t props;
+    hb_buffer_get_segment_properties(inst->hb_buf, &props);
 
-    struct glyph_priv **table = calloc(size, sizeof(table[0]));
-    if (table == NULL)
+    assert(props.direction == HB_DIRECTION_LTR ||
+           props.direction == HB_DIRECTION_RTL);
+
+    if (props.direction != HB_DIRECTION_LTR &&
+        props.direction != HB_DIRECTION_RTL)
+    {
+        LOG_ERR("unimplemented: hb_direction=%d", props.direction);
         return false;
+    }
 
-    for (size_t i = 0; i < font->glyph_cache.size; i++) {
-        struct glyph_priv *entry = font->glyph_cache.table[i];
+    hb_shape(inst->hb_font, inst->hb_buf, inst->hb_feats, inst->hb_feats_count);
 
-        if (entry == NULL)
-            continue;
+    unsigned count = hb_buffer_get_length(inst->hb_buf);
+    const hb_glyph_info_t *infos = hb_buffer_get_glyph_infos(inst->hb_buf, NULL);
+    const hb_glyph_position_t *poss = hb_buffer_get_glyph_positions(inst->hb_buf, NULL);
 
-        size_t idx = hash_index_for_size(
-            size, hash_value_for_cp(entry->public.cp, entry->subpixel));
+    if (out->count + count > out->size) {
+        /* The old array is simply abandoned; it is released with the arena */
+        size_t new_size = max(out->size * 2, out->count + count);
+        struct shaped_glyph *new_glyphs = arena_alloc(
+            out->arena, new_size, sizeof(new_glyphs[0]));
 
-        while (table[idx] != NULL) {
-            assert(!(table[idx]->public.cp == entry->public.cp &&
-                     table[idx]->subpixel == entry->subpixel));
-            idx = (idx + 1) & (size - 1);
-        }
+        if (new_glyphs == NULL)
+            return false;
+
+        if (out->count > 0)
+            memcpy(new_glyphs, out->glyphs, out->count * sizeof(new_glyphs[0]));
 
-        assert(table[idx] == NULL);
-        table[idx] = entry;
+        out->glyphs = new_glyphs;
+        out->size = new_size;
     }
 
-    pthread_rwlock_wrlock(&font->glyph_cache_lock);
-    {
-        free(font->glyph_cache.table);
+    for (int i = 0; i < count; i++) {
+        const hb_glyph_info_t *info = &infos[i];
+        const hb_glyph_position_t *pos = &poss[i];
 
-        LOG_DBG("resized glyph cache from %zu to %zu", font->glyph_cache.size, size);
-        font->glyph_cache.table = table;
-        font->glyph_cache.size = size;
+        LOG_DBG("#%u: codepoint=%04x, cluster=%d", i, info->codepoint, info->cluster);
+
+        assert(info->cluster < len);
+        out->glyphs[out->count++] = (struct shaped_glyph){
+            .inst = inst,
+            .index = info->codepoint,
+            .cluster = info->cluster,
+            .x_offset = pos->x_offset,
+            .y_offset = pos->y_offset,
+            .x_advance = pos->x_advance,
+            .y_advance = pos->y_advance,
+        };
     }
-    pthread_rwlock_unlock(&font->glyph_cache_lock);
+
     return true;
 }
 
-static int
-emoji_compare(const void *_key, const void *_emoji)
+/*
+ * The script (“language”) of a grapheme, as guessed by
+ * hb_buffer_guess_segment_properties(): that of the first codepoint
+ * with a real script, or HB_SCRIPT_INVALID if there is none. Looked
+ * up directly, since creating (or clearing) a buffer for each
+ * grapheme is much more expensive than the lookups themselves.
+ */
+static hb_script_t
+grapheme_script(hb_unicode_funcs_t *ufuncs, size_t len, const uint32_t *cluster)
 {
-    const uint32_t key = *(const uint32_t *)_key;
-    const struct emoji *emoji = _emoji;
+    for (size_t i = 0; i < len; i++) {
+        hb_script_t script = hb_unicode_script(ufuncs, cluster[i]);
 
-    if (key < emoji->cp)
-        return -1;
-    if (key >= emoji->cp + emoji->count)
-        return 1;
-    assert(key >= emoji->cp && key < emoji->cp + emoji->count);
-    return 0;
-}
+        if (script != HB_SCRIPT_COMMON &&
+            script != HB_SCRIPT_INHERITED &&
+            script != HB_SCRIPT_UNKNOWN)
+        {
+            return script;
+        }
+    }
 
-static const struct emoji *
-emoji_lookup(uint32_t cp)
-{
-    return bsearch(&cp, emojis, ALEN(emojis), sizeof(emojis[0]), &emoji_compare);
+    return HB_SCRIPT_INVALID;
 }
 
-#if defined(_DEBUG)
-static void __attribute__((constructor))
-test_emoji_compare(void)
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Splits ‘text’ (a single word) into graphemes, finds a font
+ * instance for each one, and merges consecutive graphemes into
+ * partial runs if:
+ *  - they belong to the same script (“language”)
+ *  - they have the same font instance
+ *
+ * The partial runs are allocated from ‘arena’, and have not been
+ * shaped yet.
+ */
+static bool
+segment_word(struct font_priv *font, struct arena *arena,
+             size_t len, const uint32_t text[static len],
+             struct partial_run **_pruns, size_t *_prun_count)
 {
-#if defined(FCFT_HAVE_HARFBUZZ)
-    /* WHITE SMILING FACE */
-    const struct emoji *e = emoji_lookup(0x263a);
+    /* There are never more runs than characters */
+    struct partial_run *pruns = arena_alloc(arena, len, sizeof(pruns[0]));
+    size_t prun_count = 0;
 
-    assert(e != NULL);
-    assert(0x263a >= e->cp);
-    assert(0x263a < e->cp + e->count);
-    assert(!e->emoji_presentation);
+    if (pruns == NULL)
+        return false;
 
-    e = emoji_lookup(L'a');
-    assert(e == NULL);
-#else
-    assert(ALEN(emojis) == 0);
-#endif
-}
-#endif
+    hb_unicode_funcs_t *ufuncs = hb_unicode_funcs_get_default();
 
-FCFT_EXPORT const struct fcft_glyph *
-fcft_rasterize_char_utf32(struct fcft_font *_font, uint32_t cp,
-                          enum fcft_subpixel subpixel)
-{
-    struct font_priv *font = (struct font_priv *)_font;
+    utf8proc_int32_t state = 0;
+    for (size_t start = 0, i = 1; i <= len; i++) {
+        if (i < len && !grapheme_break(text[i - 1], text[i], &state))
+            continue;
 
-    pthread_rwlock_rdlock(&font->glyph_cache_lock);
-    struct glyph_priv **entry = glyph_cache_lookup(font, cp, subpixel);
+        const size_t grapheme_len = i - start;
+        const uint32_t *grapheme = &text[start];
 
-    if (*entry != NULL) {
-        const struct glyph_priv *glyph = *entry;
-        pthread_rwlock_unlock(&font->glyph_cache_lock);
-        return glyph->valid ? &glyph->public : NULL;
-    }
+        struct instance *inst;
+        if (!font_for_grapheme(font, grapheme_len, grapheme, &inst, true))
+            return false;
 
-    pthread_rwlock_unlock(&font->glyph_cache_lock);
-    mtx_lock(&font->lock);
+        const hb_script_t script = grapheme_script(ufuncs, grapheme_len, grapheme);
 
-    /* Check again - another thread may have resized the cache, or
-     * populated the entry while we acquired the write-lock */
-    entry = glyph_cache_lookup(font, cp, subpixel);
-    if (*entry != NULL) {
-        const struct glyph_priv *glyph = *entry;
-        mtx_unlock(&font->lock);
-        return glyph->valid ? &glyph->public : NULL;
-    }
+        struct partial_run *prev = prun_count > 0 ? &pruns[prun_count - 1] : NULL;
 
-    if (glyph_cache_resize(font)) {
-        /* Entry pointer is invalid if the cache was resized */
-        entry = glyph_cache_lookup(font, cp, subpixel);
-    }
+        if (prev != NULL && prev->inst == inst && prev->script == script)
+            prev->len += grapheme_len;
+        else {
+            pruns[prun_count++] = (struct partial_run){
+                .text = text,
+                .text_len = len,
+                .start = start,
+                .len = grapheme_len,
+                .inst = inst,
+                .script = script,
+            };
+        }
 
-    struct glyph_priv *glyph = malloc(sizeof(*glyph));
-    if (glyph == NULL) {
-        mtx_unlock(&font->lock);
-        return NULL;
+        start = i;
     }
 
-    glyph->public.cp = cp;
-    glyph->valid = false;
+#if defined(_DEBUG) && LOG_ENABLE_DBG
+    LOG_DBG("%zu partial runs:", prun_count);
+    for (size_t i = 0; i < prun_count; i++) {
+        const struct partial_run *prun = &pruns[i];
+        LOG_DBG("  %.*ls (start=%zu, %zu chars), inst=%p",
+                (int)prun->len, &text[prun->start], prun->start,
+                prun->len, prun->inst);
+    }
+#endif
 
-    const struct emoji *emoji = emoji_lookup(cp);
-    assert(emoji == NULL || (cp >= emoji->cp && cp < emoji->cp + emoji->count));
+    *_pruns = pruns;
+    *_prun_count = prun_count;
+    return true;
+}
 
-    bool force_text_presentation = false;
-    bool force_emoji_presentation = false;
-    bool enforce_presentation_style = emoji != NULL;
+/*
+ * Partial runs that use the same font instance. The instance’s
+ * HarfBuzz font and buffer (and thus its FreeType face) may only be
+ * used by one thread at a time, so each group is shaped by a single
+ * thread, with the shaped glyphs allocated from the group’s own
+ * arena.
+ */
+struct shape_group {
+    struct instance *inst;
+    struct arena arena;
+    struct partial_run **pruns;
+    size_t count;
+    bool failed;
+};
 
-    if (emoji != NULL) {
-        switch (font->emoji_presentation) {
-        case FCFT_EMOJI_PRESENTATION_TEXT:
-            force_text_presentation = true;
-            force_emoji_presentation = false;
-            break;
+/*
+ * Shapes all partial runs in a group. Runs in either the thread
+ * holding font->lock, or in a thread pool worker, on behalf of that
+ * thread (see text_run_rasterize()).
+ */
+static void
+shape_group(void *_groups, size_t idx)
+{
+    struct shape_group *group = &((struct shape_group *)_groups)[idx];
 
-        case FCFT_EMOJI_PRESENTATION_EMOJI:
-            force_text_presentation = false;
-            force_emoji_presentation = true;
-            break;
+    for (size_t i = 0; i < group->count && !group->failed; i++) {
+        struct partial_run *prun = group->pruns[i];
+        prun->glyphs = (struct shaped_glyphs){.arena = &group->arena};
 
-        case FCFT_EMOJI_PRESENTATION_DEFAULT:
-            force_text_presentation = !emoji->emoji_presentation;
-            force_emoji_presentation = emoji->emoji_presentation;
-            break;
+        if (!shape_partial_run(prun->inst, prun->text, prun->text_len,
+                               prun->start, prun->len, &prun->glyphs))
+        {
+            group->failed = true;
         }
+
+        hb_buffer_clear_contents(prun->inst->hb_buf);
     }
+}
 
-    assert(tll_length(font->fallbacks) > 0);
+/*
+ * Creates a new shaped word, from the (shaped) partial runs of
+ * ‘text’. Returns NULL on error.
+ */
+static struct shaped_word *
+shaped_word_create(struct font_priv *font, uint64_t hash,
+                   size_t len, const uint32_t text[static len],
+                   const struct partial_run *pruns, size_t prun_count)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < prun_count; i++)
+        count += pruns[i].glyphs.count;
 
-    bool no_one = true;
-    bool got_glyph = false;
+    struct shaped_word *word = malloc(
+        sizeof(*word) +
+        count * sizeof(word->glyphs[0]) +
+        len * sizeof(text[0]));
 
-search_fonts:
+    if (word == NULL)
+        return NULL;
 
-    tll_foreach(font->fallbacks, it) {
-        if (!FcCharSetHasChar(it->item.charset, cp))
-            continue;
+    uint32_t *text_copy = (uint32_t *)&word->glyphs[count];
+    memcpy(text_copy, text, len * sizeof(text[0]));
 
-        static const FcChar8 *const lang_emoji = (const FcChar8 *)"und-zsye";
+    word->hash = hash;
+    word->emoji_presentation = font->emoji_presentation;
+    word->referenced = false;
+    word->len = len;
+    word->text = text_copy;
+    word->count = 0;
 
-        if (enforce_presentation_style && it->item.langset != NULL) {
-            bool has_lang_emoji =
-                FcLangSetHasLang(it->item.langset, lang_emoji) == FcLangEqual;
+    /* The partial runs are in logical order; so are the clusters */
+    for (size_t i = 0; i < prun_count; i++) {
+        const struct shaped_glyphs *glyphs = &pruns[i].glyphs;
 
-            if (force_text_presentation && has_lang_emoji)
-                continue;
-            if (force_emoji_presentation && !has_lang_emoji)
-                continue;
+        if (glyphs->count > 0) {
+            memcpy(&word->glyphs[word->count], glyphs->glyphs,
+                   glyphs->count * sizeof(glyphs->glyphs[0]));
         }
+        word->count += glyphs->count;
+    }
 
-        if (it->item.font == NULL) {
-            struct instance *inst = malloc(sizeof(*inst));
-            if (inst == NULL)
-                continue;
+    return word;
+}
 
-            if (!instantiate_pattern(
-                    it->item.pattern,
-                    it->item.req_pt_size, it->item.req_px_size,
-                    inst))
-            {
-                /* Remove, so that we don't have to keep trying to
-                 * instantiate it */
-                free(inst);
-                fallback_destroy(&it->item);
-                tll_remove(font->fallbacks, it);
-                continue;
-            }
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Segments, and shapes, a single word, in the calling thread. Returns
+ * a new shaped word, or NULL on error.
+ *
+ * All scratch memory is allocated from ‘arena’; the only heap
+ * allocation is the returned word itself.
+ */
+static struct shaped_word *
+shape_word(struct font_priv *font, struct arena *arena, uint64_t hash,
+           size_t len, const uint32_t text[static len])
+{
+    struct partial_run *pruns;
+    size_t prun_count;
 
-            it->item.font = inst;
-        }
+    if (!segment_word(font, arena, len, text, &pruns, &prun_count))
+        return NULL;
 
-        assert(it->item.font != NULL);
-        got_glyph = glyph_for_codepoint(it->item.font, cp, subpixel, glyph);
-        no_one = false;
-        break;
-    }
+    /* Shape each partial run */
+    for (size_t i = 0; i < prun_count; i++) {
+        struct partial_run *prun = &pruns[i];
+        prun->glyphs = (struct shaped_glyphs){.arena = arena};
 
-    if (no_one && enforce_presentation_style) {
-        enforce_presentation_style = false;
-        goto search_fonts;
+        bool ret = shape_partial_run(
+            prun->inst, text, len, prun->start, prun->len, &prun->glyphs);
+
+        hb_buffer_clear_contents(prun->inst->hb_buf);
+        if (!ret)
+            return NULL;
     }
 
-    if (no_one) {
-        /*
-         * No font claimed this glyph - use the primary font anyway.
-         */
-        assert(tll_length(font->fallbacks) > 0);
-        struct instance *inst = tll_front(font->fallbacks).font;
+    return shaped_word_create(font, hash, len, text, pruns, prun_count);
+}
 
-        assert(inst != NULL);
-        got_glyph = glyph_for_codepoint(inst, cp, subpixel, glyph);
-    }
+/* Makes room for (at least) ‘count’ glyphs */
+static bool
+text_run_reserve(struct text_run_priv *run, size_t count)
+{
+    if (count <= run->size)
+        return true;
 
-    assert(*entry == NULL);
-    *entry = glyph;
-    font->glyph_cache.count++;
+    const size_t new_size = max(run->size * 2, count);
 
-    mtx_unlock(&font->lock);
-    return got_glyph ? &glyph->public : NULL;
-}
+    const struct fcft_glyph **new_glyphs = realloc(
+        run->public.glyphs, new_size * sizeof(new_glyphs[0]));
+    if (new_glyphs == NULL)
+        return false;
 
-#if defined(FCFT_HAVE_HARFBUZZ)
+    run->public.glyphs = new_glyphs;
 
-static size_t
-grapheme_hash_index(const struct font_priv *font, size_t v)
-{
-    return hash_index_for_size(font->grapheme_cache.size, v);
+    int *new_cluster = realloc(
+        run->public.cluster, new_size * sizeof(new_cluster[0]));
+    if (new_cluster == NULL)
+        return false;
+
+    run->public.cluster = new_cluster;
+    run->size = new_size;
+    return true;
 }
 
-static uint64_t
-sdbm_hash_wide(const uint32_t *s, size_t len)
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Rasterizes the glyphs of a shaped word (starting at offset ‘start’
+ * in ‘text’), and appends them to the text-run.
+ */
+static bool
+rasterize_shaped_word(struct font_priv *font, struct text_run_priv *run,
+                      const struct shaped_word *word,
+                      const uint32_t *text, size_t start,
+                      enum fcft_subpixel subpixel)
 {
-    uint64_t hash = 0;
+    for (size_t i = 0; i < word->count; i++) {
+        const struct shaped_glyph *shaped = &word->glyphs[i];
+        const struct instance *inst = shaped->inst;
 
-    for (size_t i = 0; i < len; i++, s++)
-        hash = (hash << 4) ^ *s;
-    return hash;
-}
+        struct glyph_priv *bitmap = glyph_index_cache_get(
+            font, inst, shaped->index, subpixel);
+        if (bitmap == NULL)
+            continue;
 
-static uint64_t
-hash_value_for_grapheme(size_t len, const uint32_t grapheme[static len],
-                        enum fcft_subpixel subpixel)
-{
-    uint64_t hash = sdbm_hash_wide(grapheme, len);
-    hash &= (1ull << 29) - 1;
-    return subpixel << 29 | hash;
+        if (!text_run_reserve(run, run->public.count + 1)) {
+            glyph_unref(bitmap);
+            return false;
+        }
+
+        /* Re-use a glyph record from an earlier rasterization, if possible */
+        const size_t idx = run->public.count;
+        struct glyph_priv *glyph = idx < run->records
+            ? (struct glyph_priv *)run->public.glyphs[idx]
+            : glyph_alloc(font);
+
+        if (glyph == NULL) {
+            glyph_unref(bitmap);
+            return false;
+        }
+
+        glyph_share_bitmap(glyph, bitmap);
+
+        const size_t cluster = start + shaped->cluster;
+        glyph->public.cp = text[cluster];
+        glyph->public.cols = unicode_props_lookup(glyph->public.cp)->width;
+
+        /* TODO: can’t reference font data, since the font may be
+         * free:d before the text-run (and thus all the text-run’s
+         * glyphs) */
+        glyph->public.font_name = NULL;
+        glyph->public.x += shaped_glyph_px(inst, shaped->x_offset);
+        glyph->public.y += shaped_glyph_px(inst, shaped->y_offset);
+        glyph->public.advance.x = shaped_glyph_px(inst, shaped->x_advance);
+        glyph->public.advance.y = shaped_glyph_px(inst, shaped->y_advance);
+
+        run->public.cluster[idx] = cluster;
+        run->public.glyphs[idx] = &glyph->public;
+        run->public.count++;
+        run->records = max(run->records, run->public.count);
+    }
+
+    return true;
 }
 
-static struct grapheme_priv **
-grapheme_cache_lookup(struct font_priv *font,
-                      size_t len, const uint32_t cluster[static len],
-                      enum fcft_subpixel subpixel)
+/* A word of a text-run. See text_run_rasterize() */
+struct run_word {
+    size_t start;  /* Offset into the text-run */
+    size_t len;
+    uint64_t hash;
+
+    /* Only valid until the first shaped word cache insertion */
+    struct shaped_word *cached;
+
+    /* Non-NULL if the word was not cached (then, ‘cached’ is NULL) */
+    struct pending_word *pending;
+};
+
+/*
+ * A word that was not in the shaped word cache. Each distinct word is
+ * only shaped once, even if it occurs multiple times in the text-run.
+ */
+struct pending_word {
+    size_t len;
+    const uint32_t *text;
+    uint64_t hash;
+    struct partial_run *pruns;
+    size_t prun_count;
+};
+
+/* Returns the slot of the pending word ‘text’, in an open addressing table */
+static struct pending_word **
+pending_word_lookup(struct pending_word **table, size_t size, uint64_t hash,
+                    size_t len, const uint32_t text[static len])
 {
-    size_t idx = grapheme_hash_index(
-        font, hash_value_for_grapheme(len, cluster, subpixel));
-    struct grapheme_priv **entry = &font->grapheme_cache.table[idx];
+    size_t idx = hash_index_for_size(size, hash);
 
-    while (*entry != NULL && !(
-               (*entry)->len == len &&
-               memcmp((*entry)->cluster, cluster, len * sizeof(cluster[0])) == 0 &&
-               (*entry)->subpixel == subpixel))
+    while (table[idx] != NULL &&
+           !(table[idx]->hash == hash &&
+             table[idx]->len == len &&
+             memcmp(table[idx]->text, text, len * sizeof(text[0])) == 0))
     {
-        idx = (idx + 1) & (font->grapheme_cache.size - 1);
-        entry = &font->grapheme_cache.table[idx];
-
-#if defined(_DEBUG)
-        grapheme_cache_collisions++;
-#endif
+        idx = (idx + 1) & (size - 1);
     }
 
-#if defined(_DEBUG)
-    grapheme_cache_lookups++;
-#endif
-    return entry;
+    return &table[idx];
 }
 
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Shapes the partial runs of all pending words. Partial runs are
+ * grouped by font instance, and for long enough texts, with more
+ * than one instance (e.g. a mix of Latin, CJK and emoji), the groups
+ * are shaped in parallel, by the thread pool.
+ *
+ * On success, ‘*_groups’ must be free:d with shape_groups_destroy()
+ * once the shaped glyphs are no longer needed.
+ */
 static bool
-grapheme_cache_resize(struct font_priv *font)
+shape_pending_words(struct arena *arena, struct pending_word **table,
+                    size_t size, size_t pending_len,
+                    struct shape_group **_groups, size_t *_group_count)
 {
-    if (font->grapheme_cache.count * 100 / font->grapheme_cache.size < 75)
-        return false;
+    size_t prun_count = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (table[i] != NULL)
+            prun_count += table[i]->prun_count;
+    }
 
-    size_t size = 2 * font->grapheme_cache.size;
-    assert(__builtin_popcount(size) == 1);
+    /* There are never more groups than partial runs */
+    struct shape_group *groups = arena_alloc(arena, prun_count, sizeof(groups[0]));
+    size_t group_count = 0;
 
-    struct grapheme_priv **table = calloc(size, sizeof(table[0]));
-    if (table == NULL)
+    if (groups == NULL)
         return false;
 
-    for (size_t i = 0; i < font->grapheme_cache.size; i++) {
-        struct grapheme_priv *entry = font->grapheme_cache.table[i];
-
-        if (entry == NULL)
+    /* First, count the partial runs of each group... */
+    for (size_t i = 0; i < size; i++) {
+        const struct pending_word *pw = table[i];
+        if (pw == NULL)
             continue;
 
-        size_t idx = hash_index_for_size(
-            size, hash_value_for_grapheme(
-                entry->len, entry->cluster, entry->subpixel));
+        for (size_t j = 0; j < pw->prun_count; j++) {
+            struct instance *inst = pw->pruns[j].inst;
 
-        while (table[idx] != NULL) {
-            assert(
-                !(table[idx]->len == entry->len &&
-                  memcmp(table[idx]->cluster, entry->cluster,
-                         entry->len * sizeof(entry->cluster[0])) == 0 &&
-                  table[idx]->subpixel == entry->subpixel));
-            idx = (idx + 1) & (size - 1);
+            size_t g = 0;
+            while (g < group_count && groups[g].inst != inst)
+                g++;
+
+            if (g == group_count)
+                groups[group_count++] = (struct shape_group){.inst = inst};
+
+            groups[g].count++;
         }
+    }
+
+    /* ... then, collect them */
+    for (size_t g = 0; g < group_count; g++) {
+        groups[g].pruns = arena_alloc(
+            arena, groups[g].count, sizeof(groups[g].pruns[0]));
 
-        assert(table[idx] == NULL);
-        table[idx] = entry;
+        if (groups[g].pruns == NULL)
+            return false;
+
+        groups[g].count = 0;
     }
 
-    pthread_rwlock_wrlock(&font->grapheme_cache_lock);
-    {
-        free(font->grapheme_cache.table);
+    for (size_t i = 0; i < size; i++) {
+        struct pending_word *pw = table[i];
+        if (pw == NULL)
+            continue;
+
+        for (size_t j = 0; j < pw->prun_count; j++) {
+            struct partial_run *prun = &pw->pruns[j];
+
+            size_t g = 0;
+            while (groups[g].inst != prun->inst)
+                g++;
+
+            groups[g].pruns[groups[g].count++] = prun;
+        }
+    }
+
+    *_groups = groups;
+    *_group_count = group_count;
+
+    LOG_DBG("shaping %zu partial runs (%zu characters), in %zu groups",
+            prun_count, pending_len, group_count);
+
+    /*
+     * Handing off work to the thread pool isn’t free; only do it when
+     * it’s likely to pay off. Note that the workers don’t need
+     * font->lock; we hold it on their behalf.
+     */
+    struct thread_pool *pool =
+        group_count > 1 && pending_len >= parallel_shaping_min_length
+            ? get_thread_pool()
+            : NULL;
+
+    if (!thread_pool_for(pool, group_count, &shape_group, groups)) {
+        for (size_t g = 0; g < group_count; g++)
+            shape_group(groups, g);
+    }
 
-        LOG_DBG("resized grapheme cache from %zu to %zu (count: %zu)", font->grapheme_cache.size, size, font->grapheme_cache.count);
-        font->grapheme_cache.table = table;
-        font->grapheme_cache.size = size;
+    for (size_t g = 0; g < group_count; g++) {
+        if (groups[g].failed)
+            return false;
     }
-    pthread_rwlock_unlock(&font->grapheme_cache_lock);
+
     return true;
 }
 
-/* Must only be called while font->lock is held */
+static void
+shape_groups_destroy(struct shape_group *groups, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        arena_destroy(&groups[i].arena);
+}
+
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Shapes ‘text’, and calls ‘word_cb’ for each shaped word, in order.
+ * ‘start’ is the word’s offset in ‘text’, and the word itself is only
+ * valid during the callback. Returns false if shaping failed, or if
+ * ‘word_cb’ returned false.
+ *
+ * This is done in three steps:
+ *  1. Split the text into words, and look them up in the shaped word
+ *     cache. Words that aren’t cached are segmented into partial
+ *     runs.
+ *  2. Shape all partial runs (possibly in parallel).
+ *  3. Insert the newly shaped words in the cache, and pass all
+ *     words, in order, to ‘word_cb’.
+ */
 static bool
-font_for_grapheme(struct font_priv *font,
-                  size_t len, const uint32_t cluster[static len],
-                  struct instance **inst, bool enforce_presentation_style)
+text_run_shape(struct font_priv *font, size_t len, const uint32_t text[static len],
+               bool (*word_cb)(struct font_priv *font,
+                               const struct shaped_word *word,
+                               size_t start, void *data),
+               void *data)
 {
-    static const FcChar8 *const lang_emoji = (const FcChar8 *)"und-zsye";
+    struct arena *arena = &font->text_run_arena;
+    struct arena scratch = {0};  /* Only used while shaping a single word */
+
+    struct shape_group *groups = NULL;
+    size_t group_count = 0;
+    bool ret = false;
+
+    size_t word_count = 0;
+    for (size_t start = 0; start < len; start = word_end(text, len, start))
+        word_count++;
+
+    struct run_word *words = arena_alloc(arena, word_count, sizeof(words[0]));
+    if (words == NULL && word_count > 0)
+        goto out;
+
+    /* Allocated on the first cache miss */
+    struct pending_word **pending = NULL;
+    size_t pending_size = 0;
+    size_t pending_len = 0;  /* Total length of all pending words */
+
+    for (size_t i = 0, start = 0; i < word_count; start += words[i].len, i++) {
+        const size_t word_len = word_end(text, len, start) - start;
+        const uint32_t *word_text = &text[start];
+        const uint64_t hash = hash_value_for_word(
+            word_len, word_text, font->emoji_presentation);
+
+        struct run_word *rw = &words[i];
+        *rw = (struct run_word){.start = start, .len = word_len, .hash = hash};
+
+        rw->cached = font->shaped_word_cache.table != NULL
+            ? shaped_word_cache_lookup(font, hash, word_len, word_text, NULL)
+            : NULL;
+
+        if (rw->cached != NULL) {
+            counter_inc(&font->stats.shaped_word_cache.hits);
+            rw->cached->referenced = true;
+            continue;
+        }
 
-    tll_foreach(font->fallbacks, it) {
-        const bool has_lang_emoji = it->item.langset != NULL &&
-            FcLangSetHasLang(it->item.langset, lang_emoji) == FcLangEqual;
+        if (pending == NULL) {
+            pending_size = 1;
+            while (pending_size < 2 * word_count)
+                pending_size *= 2;
 
-        bool has_all_code_points = true;
-        for (size_t i = 0; i < len && has_all_code_points; i++) {
+            pending = arena_alloc(arena, pending_size, sizeof(pending[0]));
+            if (pending == NULL)
+                goto out;
 
-            const struct emoji *emoji = emoji_lookup(cluster[i]);
-            assert(emoji == NULL || (cluster[i] >= emoji->cp &&
-                                     cluster[i] < emoji->cp + emoji->count));
+            memset(pending, 0, pending_size * sizeof(pending[0]));
+        }
 
-            if (enforce_presentation_style &&
-                emoji != NULL &&
-                (i + 1 >= len || (cluster[i + 1] != 0xfe0e &&
-                                  cluster[i + 1] != 0xfe0f))) {
-                /*
-                 * We have an emoji, that is either the last codepoint
-                 * in the grapheme, *or* is followed by a codepoint
-                 * that is *not* a presentation selector.
-                 */
-                bool force_text_presentation = false;
-                bool force_emoji_presentation = false;
+        struct pending_word **slot = pending_word_lookup(
+            pending, pending_size, hash, word_len, word_text);
 
-                switch (font->emoji_presentation) {
-                case FCFT_EMOJI_PRESENTATION_TEXT:
-                    force_text_presentation = true;
-                    force_emoji_presentation = false;
-                    break;
+        if (*slot != NULL) {
+            /* Same as an earlier word, that we’re already shaping */
+            counter_inc(&font->stats.shaped_word_cache.hits);
+            rw->pending = *slot;
+            continue;
+        }
 
-                case FCFT_EMOJI_PRESENTATION_EMOJI:
-                    force_text_presentation = false;
-                    force_emoji_presentation = true;
-                    break;
+        counter_inc(&font->stats.shaped_word_cache.misses);
 
-                case FCFT_EMOJI_PRESENTATION_DEFAULT:
-                    force_text_presentation = !emoji->emoji_presentation;
-                    force_emoji_presentation = emoji->emoji_presentation;
-                    break;
-                }
+        struct pending_word *pw = arena_alloc(arena, 1, sizeof(*pw));
+        if (pw == NULL)
+            goto out;
 
-                if (force_text_presentation && has_lang_emoji) {
-                    has_all_code_points = false;
-                    continue;
-                }
+        *pw = (struct pending_word){
+            .len = word_len,
+            .text = word_text,
+            .hash = hash,
+        };
 
-                if (force_emoji_presentation && !has_lang_emoji) {
-                    has_all_code_points = false;
-                    continue;
-                }
-            }
+        if (!segment_word(font, arena, word_len, word_text,
+                          &pw->pruns, &pw->prun_count))
+        {
+            goto out;
+        }
 
-            if (cluster[i] == 0x200d) {
-                /* ZWJ */
-                continue;
-            }
+        *slot = pw;
+        rw->pending = pw;
+        pending_len += word_len;
+    }
 
-            if (cluster[i] == 0xfe0f) {
-                /* Explicit emoji selector */
+    if (pending != NULL &&
+        !shape_pending_words(arena, pending, pending_size, pending_len,
+                             &groups, &group_count))
+    {
+        goto out;
+    }
 
-#if 0
-                /* Require colored emoji? */
-                if (!it->item.is_color) {
-                    /* Skip font if it is not a colored font */
-                    has_all_code_points = false;
-                }
-#endif
-                if (!has_lang_emoji) {
-                    /* Skip font if it isn't an emoji font */
-                    has_all_code_points = false;
-                }
+    /* Inserting words may evict others, including words in this run */
+    bool inserted = false;
 
-                continue;
-            }
+    for (size_t i = 0; i < word_count; i++) {
+        const struct run_word *rw = &words[i];
+        const uint32_t *word_text = &text[rw->start];
 
-            else if (cluster[i] == 0xfe0e) {
-                /* Explicit text selector */
+        struct shaped_word *word = rw->pending == NULL && !inserted
+            ? rw->cached
+            : font->shaped_word_cache.table != NULL
+                ? shaped_word_cache_lookup(
+                    font, rw->hash, rw->len, word_text, NULL)
+                : NULL;
 
-                if (has_lang_emoji) {
-                    /* Skip font if it is an emoji font */
-                    has_all_code_points = false;
-                }
+        bool cached = word != NULL;
 
-                continue;
+        if (cached)
+            word->referenced = true;
+        else {
+            if (rw->pending != NULL) {
+                word = shaped_word_create(
+                    font, rw->hash, rw->len, word_text,
+                    rw->pending->pruns, rw->pending->prun_count);
+            } else {
+                /* Was cached, but has been evicted since */
+                arena_reset(&scratch);
+                word = shape_word(font, &scratch, rw->hash, rw->len, word_text);
             }
 
-            if (!FcCharSetHasChar(it->item.charset, cluster[i])) {
-                has_all_code_points = false;
-                break;
-            }
-        }
+            if (word == NULL)
+                goto out;
 
-        if (has_all_code_points) {
-            if (it->item.font == NULL) {
-                *inst = malloc(sizeof(**inst));
-                if (*inst == NULL)
-                    return false;
-
-                if (!instantiate_pattern(
-                        it->item.pattern,
-                        it->item.req_pt_size, it->item.req_px_size,
-                        *inst))
-                {
-                    /* Remove, so that we don't have to keep trying to
-                     * instantiate it */
-                    free(*inst);
-                    fallback_destroy(&it->item);
-                    tll_remove(font->fallbacks, it);
-                    continue;
-                }
+            cached = shaped_word_cache_insert(font, word);
+            inserted = true;
+        }
 
-                it->item.font = *inst;
-            } else
-                *inst = it->item.font;
+        bool word_ok = word_cb(font, word, rw->start, data);
 
-            return true;
-        }
+        if (!cached)
+            free(word);
+        if (!word_ok)
+            goto out;
     }
 
-    if (enforce_presentation_style)
-        return font_for_grapheme(font, len, cluster, inst, false);
+    ret = true;
 
-    /* No font found, use primary font anyway */
-    *inst = tll_front(font->fallbacks).font;
-    return *inst != NULL;
+out:
+    shape_groups_destroy(groups, group_count);
+    arena_destroy(&scratch);
+    arena_reset(arena);
+    return ret;
 }
 
-FCFT_EXPORT const struct fcft_grapheme *
-fcft_rasterize_grapheme_utf32(struct fcft_font *_font,
-                              size_t len, const uint32_t cluster[static len],
-                              enum fcft_subpixel subpixel)
+struct text_run_rasterize_ctx {
+    struct text_run_priv *run;
+    const uint32_t *text;
+    enum fcft_subpixel subpixel;
+};
+
+static bool
+text_run_rasterize_word(struct font_priv *font, const struct shaped_word *word,
+                        size_t start, void *data)
 {
-    struct font_priv *font = (struct font_priv *)_font;
-    struct instance *inst = NULL;
+    const struct text_run_rasterize_ctx *ctx = data;
+    return rasterize_shaped_word(
+        font, ctx->run, word, ctx->text, start, ctx->subpixel);
+}
 
-    pthread_rwlock_rdlock(&font->grapheme_cache_lock);
-    struct grapheme_priv **entry = grapheme_cache_lookup(
-        font, len, cluster, subpixel);
+/*
+ * Shapes, and rasterizes, ‘text’ into ‘run’, which must be empty
+ * (see text_run_reset()). On error, the run is left empty.
+ */
+static bool
+text_run_rasterize(struct font_priv *font, struct text_run_priv *run,
+                   size_t len, const uint32_t text[static len],
+                   enum fcft_subpixel subpixel)
+{
+    assert(run->public.count == 0);
 
-    if (*entry != NULL) {
-        const struct grapheme_priv *grapheme = *entry;
-        pthread_rwlock_unlock(&font->grapheme_cache_lock);
-        return grapheme->valid ? &grapheme->public : NULL;
-    }
+    struct text_run_rasterize_ctx ctx = {
+        .run = run,
+        .text = text,
+        .subpixel = subpixel,
+    };
 
-    pthread_rwlock_unlock(&font->grapheme_cache_lock);
     mtx_lock(&font->lock);
 
-    /* Check again - another thread may have resized the cache, or
-     * populated the entry while we acquired the write-lock */
-    entry = grapheme_cache_lookup(font, len, cluster, subpixel);
-    if (*entry != NULL) {
-        const struct grapheme_priv *grapheme = *entry;
-        mtx_unlock(&font->lock);
-        return grapheme->valid ? &grapheme->public : NULL;
-    }
+    LOG_DBG("rasterizing a %zu character text run", len);
 
-    if (grapheme_cache_resize(font)) {
-        /* Entry pointer is invalid if the cache was resized */
-        entry = grapheme_cache_lookup(font, len, cluster, subpixel);
+    bool ret = text_run_reserve(run, max(len, 1)) &&
+        text_run_shape(font, len, text, &text_run_rasterize_word, &ctx);
+
+    if (ret) {
+        LOG_DBG("glyph count: %zu", run->public.count);
+
+        /* We may have added glyphs, and words, to the caches */
+        cache_evict(font);
     }
 
-    struct grapheme_priv *grapheme = malloc(sizeof(*grapheme));
-    uint32_t *cluster_copy = malloc(len * sizeof(cluster_copy[0]));
-    if (grapheme == NULL || cluster_copy == NULL) {
-        /* Can’t update cache entry since we can’t store the cluster */
-        free(grapheme);
-        free(cluster_copy);
-        mtx_unlock(&font->lock);
+    mtx_unlock(&font->lock);
+
+    if (!ret)
+        text_run_reset(run);
+    return ret;
+}
+
+FCFT_EXPORT struct fcft_text_run *
+fcft_rasterize_text_run_utf32(
+    struct fcft_font *_font, size_t len, const uint32_t text[static len],
+    enum fcft_subpixel subpixel)
+{
+    struct font_priv *font = (struct font_priv *)_font;
+
+    struct text_run_priv *run = calloc(1, sizeof(*run));
+    if (run == NULL)
         return NULL;
+
+    if (!text_run_rasterize(font, run, len, text, subpixel))
+        goto err;
+
+    /* Re-alloc glyphs/cluster arrays */
+    {
+        const struct fcft_glyph **final_glyphs = realloc(
+            run->public.glyphs, run->public.count * sizeof(final_glyphs[0]));
+        int *final_cluster = realloc(
+            run->public.cluster, run->public.count * sizeof(final_cluster[0]));
+
+        if ((final_glyphs == NULL || final_cluster == NULL) &&
+            run->public.count > 0)
+        {
+            if (final_glyphs != NULL)
+                run->public.glyphs = final_glyphs;
+            if (final_cluster != NULL)
+                run->public.cluster = final_cluster;
+            goto err;
+        }
+
+        run->public.glyphs = final_glyphs;
+        run->public.cluster = final_cluster;
+        run->size = run->public.count;
     }
 
-    size_t glyph_idx = 0;
-    memcpy(cluster_copy, cluster, len * sizeof(cluster[0]));
-    grapheme->valid = false;
-    grapheme->len = len;
-    grapheme->cluster = cluster_copy;
-    grapheme->subpixel = subpixel;
-    grapheme->public.glyphs = NULL;
-    grapheme->public.count = 0;
+    return &run->public;
 
-    /* Find a font that has all codepoints in the grapheme */
-    if (!font_for_grapheme(font, len, cluster, &inst, true))
-        goto err;
+err:
+    fcft_text_run_destroy(&run->public);
+    return NULL;
+}
 
-    assert(inst->hb_font != NULL);
+FCFT_EXPORT bool
+fcft_rasterize_text_run_utf32_into(
+    struct fcft_font *_font, size_t len, const uint32_t text[static len],
+    enum fcft_subpixel subpixel, struct fcft_text_run *_run)
+{
+    struct font_priv *font = (struct font_priv *)_font;
+    struct text_run_priv *run = (struct text_run_priv *)_run;
 
-    hb_buffer_add_utf32(inst->hb_buf, (const uint32_t *)cluster, len, 0, len);
-    hb_buffer_guess_segment_properties(inst->hb_buf);
+    text_run_reset(run);
+    return text_run_rasterize(font, run, len, text, subpixel);
+}
 
-    hb_shape(inst->hb_font, inst->hb_buf, inst->hb_feats, inst->hb_feats_count);
+struct shaped_run_ctx {
+    struct fcft_shaped_run *run;
+    struct fcft_shaped_glyph *glyphs;
+    size_t size;
+};
 
-    unsigned count = hb_buffer_get_length(inst->hb_buf);
-    const hb_glyph_info_t *info = hb_buffer_get_glyph_infos(inst->hb_buf, NULL);
-    const hb_glyph_position_t *pos = hb_buffer_get_glyph_positions(inst->hb_buf, NULL);
+static bool
+shaped_run_add_word(struct font_priv *font, const struct shaped_word *word,
+                    size_t start, void *data)
+{
+    struct shaped_run_ctx *ctx = data;
+    struct fcft_shaped_run *run = ctx->run;
 
-    int grapheme_width = 0;
-    int min_grapheme_width = 0;
-    for (size_t i = 0; i < len; i++) {
-        if (cluster[i] == 0xfe0f)
-            min_grapheme_width = 2;
-        grapheme_width += wcwidth(cluster[i]);
+    if (run->count + word->count > ctx->size) {
+        const size_t new_size = max(ctx->size * 2, run->count + word->count);
+        struct fcft_shaped_glyph *new_glyphs = realloc(
+            ctx->glyphs, new_size * sizeof(new_glyphs[0]));
+
+        if (new_glyphs == NULL)
+            return false;
+
+        ctx->glyphs = new_glyphs;
+        ctx->size = new_size;
+        run->glyphs = new_glyphs;
     }
 
-    LOG_DBG("length: %u", hb_buffer_get_length(inst->hb_buf));
-    LOG_DBG("infos: %u", count);
+    for (size_t i = 0; i < word->count; i++) {
+        const struct shaped_glyph *shaped = &word->glyphs[i];
+        const struct instance *inst = shaped->inst;
 
-    struct fcft_glyph **glyphs = calloc(count, sizeof(glyphs[0]));
-    if (glyphs == NULL)
-        goto err;
+        ctx->glyphs[run->count++] = (struct fcft_shaped_glyph){
+            .face = (const struct fcft_face *)inst,
+            .index = shaped->index,
+            .cluster = start + shaped->cluster,
+            .x_offset = shaped_glyph_px(inst, shaped->x_offset),
+            .y_offset = shaped_glyph_px(inst, shaped->y_offset),
+            .advance = {
+                .x = shaped_glyph_px(inst, shaped->x_advance),
+                .y = shaped_glyph_px(inst, shaped->y_advance),
+            },
+        };
+    }
 
-    grapheme->public.cols = max(grapheme_width, min_grapheme_width);
-    grapheme->public.glyphs = (const struct fcft_glyph **)glyphs;
+    return true;
+}
 
-    const unsigned count_from_the_beginning = count;
+FCFT_EXPORT struct fcft_shaped_run *
+fcft_shape_text_run_utf32(
+    struct fcft_font *_font, size_t len, const uint32_t text[static len])
+{
+    struct font_priv *font = (struct font_priv *)_font;
 
-    for (unsigned i = 0; i < count_from_the_beginning; i++) {
-        LOG_DBG("code point: %04x, cluster: %u", info[i].codepoint, info[i].cluster);
-        LOG_DBG("x-advance: %d, x-offset: %d, y-advance: %d, y-offset: %d",
-                pos[i].x_advance, pos[i].x_offset,
-                pos[i].y_advance, pos[i].y_offset);
+    struct fcft_shaped_run *run = calloc(1, sizeof(*run));
+    if (run == NULL)
+        return NULL;
+
+    /* Most text has (at most) one glyph per character */
+    struct shaped_run_ctx ctx = {
+        .run = run,
+        .glyphs = malloc(max(len, 1) * sizeof(ctx.glyphs[0])),
+        .size = max(len, 1),
+    };
+
+    if (ctx.glyphs == NULL) {
+        free(run);
+        return NULL;
+    }
+
+    run->glyphs = ctx.glyphs;
 
-        struct glyph_priv *glyph = malloc(sizeof(*glyph));
-        if (glyph == NULL ||
-            !glyph_for_index(inst, info[i].codepoint, subpixel, glyph))
-        {
-            assert(glyph == NULL || !glyph->valid);
-            free(glyph);
-            goto err;
-        }
+    mtx_lock(&font->lock);
 
-        assert(glyph->valid);
+    LOG_DBG("shaping a %zu character text run", len);
 
-        assert(info[i].cluster < len);
-        glyph->public.cp = cluster[info[i].cluster];
-        glyph->public.cols = wcwidth(glyph->public.cp);
+    bool ret = text_run_shape(font, len, text, &shaped_run_add_word, &ctx);
 
-#if 0
-        LOG_DBG("grapheme: x: advance: %d -> %d, offset: %d -> %d",
-                glyph->public.advance.x,
-                (int)(pos[i].x_advance / 64. * inst->pixel_size_fixup),
-                glyph->public.x,
-                (int)(pos[i].x_offset / 64. * inst->pixel_size_fixup));
-        LOG_DBG("grapheme: y: advance: %d -> %d, offset: %d -> %d",
-                glyph->public.advance.y,
-                (int)(pos[i].y_advance / 64. * inst->pixel_size_fixup),
-                glyph->public.y,
-                (int)(pos[i].y_offset / 64. * inst->pixel_size_fixup));
-#endif
+    /* We may have added words to the cache */
+    cache_evict(font);
+    mtx_unlock(&font->lock);
 
-        glyph->public.x += pos[i].x_offset / 64. * inst->pixel_size_fixup;
-        glyph->public.y += pos[i].y_offset / 64. * inst->pixel_size_fixup;
-        glyph->public.advance.x = pos[i].x_advance / 64. * inst->pixel_size_fixup;
-        glyph->public.advance.y = pos[i].y_advance / 64. * inst->pixel_size_fixup;
+    if (!ret) {
+        fcft_shaped_run_destroy(run);
+        return NULL;
+    }
 
-        grapheme->public.glyphs[glyph_idx++] = &glyph->public;
+    if (run->count < ctx.size && run->count > 0) {
+        struct fcft_shaped_glyph *final_glyphs = realloc(
+            ctx.glyphs, run->count * sizeof(final_glyphs[0]));
+        if (final_glyphs != NULL)
+            run->glyphs = final_glyphs;
     }
 
-#if defined(_DEBUG)
-    assert(glyph_idx == count);
-    for (size_t i = 0; i < count; i++) {
-        const struct glyph_priv *g
-            = (const struct glyph_priv *)grapheme->public.glyphs[i];
+    return run;
+}
 
-        assert(g != NULL);
-        assert(g->valid);
-    }
-#endif
+FCFT_EXPORT const struct fcft_glyph *
+fcft_rasterize_glyph_index(struct fcft_font *_font,
+                           const struct fcft_face *face, uint32_t index,
+                           enum fcft_subpixel subpixel)
+{
+    struct font_priv *font = (struct font_priv *)_font;
+    const struct instance *inst = (const struct instance *)face;
 
-    hb_buffer_clear_contents(inst->hb_buf);
+    /*
+     * Glyph index cache entries evicted after this are retired, and
+     * thus stay valid until our next call.
+     */
+    uint64_t epoch;
+    if (cache_quiescent(font, &epoch) == NULL)
+        return NULL;
 
-    assert(*entry == NULL);
-    grapheme->public.count = glyph_idx;
-    grapheme->valid = true;
-    *entry = grapheme;
-    font->grapheme_cache.count++;
+    mtx_lock(&font->lock);
 
-    mtx_unlock(&font->lock);
-    return &grapheme->public;
+    struct glyph_priv *glyph = glyph_index_cache_get(font, inst, index, subpixel);
 
-err:
-    hb_buffer_clear_contents(inst->hb_buf);
-    for (size_t i = 0; i < glyph_idx; i++)
-        glyph_destroy(grapheme->public.glyphs[i]);
-    free(grapheme->public.glyphs);
+    if (glyph != NULL) {
+        /* The cache has its own reference */
+        glyph_unref(glyph);
+        cache_evict(font);
+    }
 
-    assert(*entry == NULL);
-    assert(!grapheme->valid);
-    grapheme->public.count = 0;
-    grapheme->public.glyphs = NULL;
-    *entry = grapheme;
-    font->grapheme_cache.count++;
     mtx_unlock(&font->lock);
+    return glyph != NULL ? &glyph->public : NULL;
+}
+
+#else /* !FCFT_HAVE_HARFBUZZ || !FCFT_HAVE_UTF8PROC */
+
+FCFT_EXPORT struct fcft_text_run *
+fcft_rasterize_text_run_utf32(
+    struct fcft_font *font, size_t len, const uint32_t text[static len],
+    enum fcft_subpixel subpixel)
+{
     return NULL;
 }
-#else /* !FCFT_HAVE_HARFBUZZ */
 
-FCFT_EXPORT const struct fcft_grapheme *
-fcft_rasterize_grapheme_utf32(struct fcft_font *_font,
-                              size_t len, const uint32_t cluster[static len],
-                              enum fcft_subpixel subpixel)
+FCFT_EXPORT bool
+fcft_rasterize_text_run_utf32_into(
+    struct fcft_font *font, size_t len, const uint32_t text[static len],
+    enum fcft_subpixel subpixel, struct fcft_text_run *run)
+{
+    text_run_reset((struct text_run_priv *)run);
+    return false;
+}
+
+FCFT_EXPORT struct fcft_shaped_run *
+fcft_shape_text_run_utf32(
+    struct fcft_font *font, size_t len, const uint32_t text[static len])
 {
     return NULL;
 }
 
-#endif
+FCFT_EXPORT const struct fcft_glyph *
+fcft_rasterize_glyph_index(struct fcft_font *font,
+                           const struct fcft_face *face, uint32_t index,
+                           enum fcft_subpixel subpixel)
+{
+    return NULL;
+}
 
-#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
-struct text_run {
-    struct fcft_text_run *public;
-    size_t size;
-};
+#endif /* !FCFT_HAVE_HARFBUZZ */
 
-static bool
-rasterize_partial_run(struct text_run *run, const struct instance *inst,
-                      const uint32_t *text, size_t len,
-                      size_t run_start, size_t run_len,
-                      enum fcft_subpixel subpixel)
+FCFT_EXPORT const struct fcft_grapheme *
+fcft_rasterize_grapheme_utf8(struct fcft_font *font,
+                             size_t len, const char cluster[static len],
+                             enum fcft_subpixel subpixel)
 {
-    hb_buffer_add_utf32(inst->hb_buf, text, len, run_start, run_len);
-    hb_buffer_guess_segment_properties(inst->hb_buf);
+    if (len == 0)
+        return NULL;
 
-    hb_segment_properties_t props;
-    hb_buffer_get_segment_properties(inst->hb_buf, &props);
+    /* Grapheme clusters are almost always short */
+    uint32_t stack_buf[32];
+    uint32_t *cps = len <= ALEN(stack_buf)
+        ? stack_buf
+        : malloc(len * sizeof(cps[0]));
 
-    assert(props.direction == HB_DIRECTION_LTR ||
-           props.direction == HB_DIRECTION_RTL);
+    if (cps == NULL)
+        return NULL;
 
-    if (props.direction != HB_DIRECTION_LTR &&
-        props.direction != HB_DIRECTION_RTL)
-    {
-        LOG_ERR("unimplemented: hb_direction=%d", props.direction);
-        return false;
-    }
+    const size_t count = utf8_decode(len, cluster, cps, NULL);
+    const struct fcft_grapheme *grapheme =
+        fcft_rasterize_grapheme_utf32(font, count, cps, subpixel);
 
-    hb_shape(inst->hb_font, inst->hb_buf, inst->hb_feats, inst->hb_feats_count);
+    if (cps != stack_buf)
+        free(cps);
+    return grapheme;
+}
 
-    unsigned count = hb_buffer_get_length(inst->hb_buf);
-    const hb_glyph_info_t *infos = hb_buffer_get_glyph_infos(inst->hb_buf, NULL);
-    const hb_glyph_position_t *poss = hb_buffer_get_glyph_positions(inst->hb_buf, NULL);
+/* Maps the run’s clusters from codepoint offsets to byte offsets */
+static void
+text_run_clusters_to_byte_offsets(struct fcft_text_run *run,
+                                  size_t count, const uint32_t *offsets)
+{
+    for (size_t i = 0; i < run->count; i++) {
+        assert(run->cluster[i] >= 0 && (size_t)run->cluster[i] < count);
+        run->cluster[i] = offsets[run->cluster[i]];
+    }
+}
 
-    for (int i = 0; i < count; i++) {
-        const hb_glyph_info_t *info = &infos[i];
-        const hb_glyph_position_t *pos = &poss[i];
+FCFT_EXPORT struct fcft_text_run *
+fcft_rasterize_text_run_utf8(
+    struct fcft_font *font, size_t len, const char text[static len],
+    enum fcft_subpixel subpixel)
+{
+    /*
+     * Shaped words are cached, and graphemes segmented, by codepoint,
+     * so we still need to decode the text. But it is done in a single
+     * pass, with a fast path for ASCII, and the clusters are mapped
+     * back to byte offsets in ‘text’.
+     */
+    uint32_t *cps = malloc(max(len, 1) * sizeof(cps[0]));
+    uint32_t *offsets = malloc(max(len, 1) * sizeof(offsets[0]));
+    struct fcft_text_run *run = NULL;
 
-        LOG_DBG("#%u: codepoint=%04x, cluster=%d", i, info->codepoint, info->cluster);
+    if (cps == NULL || offsets == NULL)
+        goto out;
 
-        struct glyph_priv *glyph = malloc(sizeof(*glyph));
-        if (glyph == NULL)
-            return false;
+    const size_t count = utf8_decode(len, text, cps, offsets);
 
-        if (!glyph_for_index(inst, info->codepoint, subpixel, glyph)) {
-            free(glyph);
-            continue;
-        }
+    run = fcft_rasterize_text_run_utf32(font, count, cps, subpixel);
+    if (run != NULL)
+        text_run_clusters_to_byte_offsets(run, count, offsets);
 
-        assert(info->cluster < len);
-        glyph->public.cp = text[info->cluster];
-        glyph->public.cols = wcwidth(glyph->public.cp);
+out:
+    free(cps);
+    free(offsets);
+    return run;
+}
 
-        /* TODO: can’t reference font data, since the font may be
-         * free:d before the text-run (and thus all the text-run’s
-         * glyphs) */
-        glyph->public.font_name = NULL;
-        glyph->public.x += pos->x_offset / 64. * inst->pixel_size_fixup;
-        glyph->public.y += pos->y_offset / 64. * inst->pixel_size_fixup;
-        glyph->public.advance.x = pos->x_advance / 64. * inst->pixel_size_fixup;
-        glyph->public.advance.y = pos->y_advance / 64. * inst->pixel_size_fixup;
-
-        if (run->public->count >= run->size) {
-            size_t new_glyphs_size = run->size * 2;
-            const struct fcft_glyph **new_glyphs = realloc(
-                run->public->glyphs, new_glyphs_size * sizeof(new_glyphs[0]));
-            int *new_cluster = realloc(
-                run->public->cluster, new_glyphs_size * sizeof(new_cluster[0]));
-
-            if (new_glyphs == NULL || new_cluster == NULL) {
-                free(new_glyphs);
-                free(new_cluster);
-                return false;
-            }
+FCFT_EXPORT bool
+fcft_rasterize_text_run_utf8_into(
+    struct fcft_font *font, size_t len, const char text[static len],
+    enum fcft_subpixel subpixel, struct fcft_text_run *_run)
+{
+    struct text_run_priv *run = (struct text_run_priv *)_run;
 
-            run->public->glyphs = new_glyphs;
-            run->public->cluster = new_cluster;
-            run->size = new_glyphs_size;
+    /* Decode into the run’s scratch buffer; codepoints, then offsets */
+    if (run->utf8_scratch_size < 2 * max(len, 1)) {
+        const size_t new_size = 2 * max(len, 1);
+        uint32_t *new_scratch = realloc(
+            run->utf8_scratch, new_size * sizeof(new_scratch[0]));
+
+        if (new_scratch == NULL) {
+            text_run_reset(run);
+            return false;
         }
 
-        assert(run->public->count < run->size);
-        run->public->cluster[run->public->count] = info->cluster;
-        run->public->glyphs[run->public->count] = &glyph->public;
-        run->public->count++;
+        run->utf8_scratch = new_scratch;
+        run->utf8_scratch_size = new_size;
     }
 
+    uint32_t *cps = run->utf8_scratch;
+    uint32_t *offsets = &run->utf8_scratch[max(len, 1)];
+    const size_t count = utf8_decode(len, text, cps, offsets);
+
+    if (!fcft_rasterize_text_run_utf32_into(font, count, cps, subpixel, _run))
+        return false;
+
+    text_run_clusters_to_byte_offsets(_run, count, offsets);
     return true;
 }
 
 FCFT_EXPORT struct fcft_text_run *
-fcft_rasterize_text_run_utf32(
-    struct fcft_font *_font, size_t len, const uint32_t text[static len],
-    enum fcft_subpixel subpixel)
+fcft_text_run_create(void)
+{
+    struct text_run_priv *run = calloc(1, sizeof(*run));
+    return run != NULL ? &run->public : NULL;
+}
+
+FCFT_EXPORT void
+fcft_text_run_destroy(struct fcft_text_run *_run)
+{
+    if (_run == NULL)
+        return;
+
+    struct text_run_priv *run = (struct text_run_priv *)_run;
+
+    text_run_reset(run);
+    for (size_t i = 0; i < run->records; i++) {
+        assert(run->public.glyphs[i] != NULL);
+        glyph_destroy(run->public.glyphs[i]);
+    }
+
+    free(run->public.glyphs);
+    free(run->public.cluster);
+    free(run->utf8_scratch);
+    free(run);
+}
+
+FCFT_EXPORT void
+fcft_shaped_run_destroy(struct fcft_shaped_run *run)
+{
+    if (run == NULL)
+        return;
+
+    free((struct fcft_shaped_glyph *)run->glyphs);
+    free(run);
+}
+
+FCFT_EXPORT void
+fcft_destroy(struct fcft_font *_font)
 {
+    if (_font == NULL)
+        return;
+
     struct font_priv *font = (struct font_priv *)_font;
+
+    struct font_cache_entry *cache_entry = font->cache_entry;
+    struct font_cache_bucket *bucket = cache_entry != NULL
+        ? font_cache_bucket_for(cache_entry->hash) : NULL;
+
+    /* The bucket lock prevents fcft_from_name() from finding the font
+     * while we're destroying it */
+    if (bucket != NULL)
+        mtx_lock(&bucket->lock);
+
     mtx_lock(&font->lock);
+    if (--font->ref_counter > 0) {
+        mtx_unlock(&font->lock);
+        if (bucket != NULL)
+            mtx_unlock(&bucket->lock);
+        return;
+    }
+    mtx_unlock(&font->lock);
 
-    LOG_DBG("rasterizing a %zu character text run", len);
+    if (bucket != NULL) {
+        for (struct font_cache_entry **e = &bucket->entries;
+             *e != NULL; e = &(*e)->next)
+        {
+            if (*e == cache_entry) {
+                *e = cache_entry->next;
+                break;
+            }
+        }
 
-    struct partial_run {
-        size_t start;
-        size_t len;
-        struct instance *inst;
-    };
+        font_cache_entry_destroy(cache_entry);
+        mtx_unlock(&bucket->lock);
+    }
 
-    tll(struct partial_run) pruns = tll_init();
+    for (size_t i = 0; i < font->fallbacks.count; i++) {
+        if (font->fallbacks.arr[i].font != NULL)
+            glyph_disk_cache_save(font, font->fallbacks.arr[i].font);
+    }
 
-    struct text_run run = {
-        .size = len,
-        .public = malloc(sizeof(*run.public)),
-    };
+    for (size_t i = 0; i < font->fallbacks.count; i++)
+        fallback_destroy(&font->fallbacks.arr[i]);
 
-    if (run.public == NULL)
-        goto err;
+    free(font->fallbacks.arr);
+    coverage_reset(font);
 
-    run.public->glyphs = malloc(len * sizeof(run.public->glyphs[0]));
-    run.public->cluster = malloc(len * sizeof(run.public->cluster[0]));
-    run.public->count = 0;
+    free(atomic_load_explicit(&font->kerning.ascii, memory_order_relaxed));
+    free(font->kerning.table);
 
-    if (run.public->glyphs == NULL || run.public->cluster == NULL)
-        goto err;
+    if (font->fc_fallbacks.set != NULL)
+        FcFontSetDestroy(font->fc_fallbacks.set);
+    if (font->fc_fallbacks.base_pattern != NULL)
+        FcPatternDestroy(font->fc_fallbacks.base_pattern);
+
+    mtx_destroy(&font->lock);
+    mtx_destroy(&font->slab_lock);
+    cnd_destroy(&font->glyph_reservations.done);
+    assert(tll_length(font->glyph_reservations.keys) == 0);
 
+    struct glyph_cache_table *glyph_table = atomic_load_explicit(
+        &font->glyph_cache.table, memory_order_relaxed);
 
-    tll_push_back(pruns, ((struct partial_run){.start = 0}));
+    for (size_t i = 0; i < glyph_table->size; i++) {
+        struct glyph_priv *entry = atomic_load_explicit(
+            &glyph_table->entries[i], memory_order_relaxed);
 
-    /* Split run into graphemes */
-    utf8proc_int32_t state = 0;
-    for (size_t i = 1; i < len; i++) {
-        if (utf8proc_grapheme_break_stateful(text[i - 1], text[i], &state)) {
-            state = 0;
+        if (entry == NULL || entry == GLYPH_TOMBSTONE)
+            continue;
 
-            struct partial_run *prun = &tll_back(pruns);
+        glyph_destroy_private(entry);
+    }
+    free(glyph_table);
 
-            assert(i > prun->start);
-            prun->len = i - prun->start;
+#if defined(FCFT_HAVE_HARFBUZZ)
+    struct grapheme_cache_table *grapheme_table = atomic_load_explicit(
+        &font->grapheme_cache.table, memory_order_relaxed);
 
-            if (!font_for_grapheme(
-                    font, prun->len, &text[prun->start], &prun->inst, true))
-            {
-                goto err;
-            }
+    for (size_t i = 0; i < grapheme_table->size; i++) {
+        struct grapheme_priv *entry = atomic_load_explicit(
+            &grapheme_table->entries[i], memory_order_relaxed);
 
-            tll_push_back(pruns, ((struct partial_run){.start = i}));
-        }
+        if (entry == NULL || entry == GRAPHEME_TOMBSTONE)
+            continue;
+
+        grapheme_destroy_private(entry);
     }
+    free(grapheme_table);
+#endif
+
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+    struct shaped_word_cache_table *shaped_word_table =
+        font->shaped_word_cache.table;
 
-    /* “Close” that last run */
+    for (size_t i = 0;
+         shaped_word_table != NULL && i < shaped_word_table->size;
+         i++)
     {
-        struct partial_run *prun = &tll_back(pruns);
+        struct shaped_word *entry = shaped_word_table->entries[i];
 
-        assert(prun->len == 0);
-        prun->len = len - prun->start;
+        if (entry == NULL || entry == SHAPED_WORD_TOMBSTONE)
+            continue;
 
-        if (!font_for_grapheme(
-                font, prun->len, &text[prun->start], &prun->inst, true))
-        {
-            goto err;
-        }
+        free(entry);
     }
+    free(shaped_word_table);
+    arena_destroy(&font->text_run_arena);
+#endif
 
-#if defined(_DEBUG) && LOG_ENABLE_DBG
-    LOG_DBG("%zu partial runs (before merge):", tll_length(pruns));
-    tll_foreach(pruns, it) {
-        const struct partial_run *prun = &it->item;
-        LOG_DBG("  %.*ls (start=%zu, %zu chars), inst=%p",
-                (int)prun->len, &text[prun->start], prun->start,
-                prun->len, prun->inst);
+    tll_foreach(font->cache.retired, it)
+        it->item.destroy(it->item.ptr);
+    tll_free(font->cache.retired);
+
+    /* Bitmaps still used by text-runs are free:d with them */
+    struct glyph_cache_table *glyph_index_table = font->glyph_index_cache.table;
+
+    for (size_t i = 0; i < glyph_index_table->size; i++) {
+        struct glyph_priv *entry = atomic_load_explicit(
+            &glyph_index_table->entries[i], memory_order_relaxed);
+
+        if (entry == NULL || entry == GLYPH_TOMBSTONE)
+            continue;
+
+        glyph_unref(entry);
     }
-#endif
+    free(glyph_index_table);
 
-    /*
-     * Merge consecutive graphemes if:
-     *  - they belong to the same script (“language”)
-     *  - they have the same font instance
-     */
+    /* Slabs still referenced by e.g. text-runs are free:d with them */
+    for (size_t i = 0; i < ALEN(font->slabs); i++) {
+        if (font->slabs[i] != NULL)
+            slab_unref(font->slabs[i]);
+    }
+
+    mtx_lock(&readers_lock);
+    tll_foreach(readers, it) {
+        if (it->item->font_id == font->id) {
+            free(it->item);
+            tll_remove(readers, it);
+        }
+    }
+    mtx_unlock(&readers_lock);
+
+    free(font);
+}
+
+#define KERNING_CACHED (1ull << 63)
+#define KERNING_VALID (1ull << 62)
+
+/*
+ * Packs a kerning value into a single word, for the lock-free ASCII
+ * matrix: ‘x’ in the low 32 bits, ‘y’ in the next 16 (vertical
+ * kerning is at most a few pixels), and the flags at the top. A
+ * zero word means “not yet looked up”.
+ */
+static uint64_t
+kerning_pack(bool valid, long x, long y)
+{
+    const int32_t x32 = max(min(x, INT32_MAX), INT32_MIN);
+    const int16_t y16 = max(min(y, INT16_MAX), INT16_MIN);
+
+    return KERNING_CACHED | (valid ? KERNING_VALID : 0) |
+        (uint64_t)(uint16_t)y16 << 32 | (uint32_t)x32;
+}
+
+static bool
+kerning_unpack(uint64_t packed, long *x, long *y)
+{
+    assert(packed & KERNING_CACHED);
+
+    *x = (int32_t)(uint32_t)packed;
+    *y = (int16_t)(uint16_t)(packed >> 32);
+    return (packed & KERNING_VALID) != 0;
+}
+
+static _Atomic uint64_t *
+kerning_ascii_entry(struct kerning_ascii_table *ascii,
+                    uint32_t left, uint32_t right)
+{
+    if (ascii == NULL ||
+        left - KERNING_ASCII_FIRST >= KERNING_ASCII_COUNT ||
+        right - KERNING_ASCII_FIRST >= KERNING_ASCII_COUNT)
     {
-        hb_buffer_t *hb_buf = hb_buffer_create();
-        if (hb_buf == NULL)
-            goto err;
+        return NULL;
+    }
 
-        struct partial_run *prev = NULL;
-        hb_script_t prev_script = HB_SCRIPT_INVALID;
+    return &ascii->pairs[left - KERNING_ASCII_FIRST][right - KERNING_ASCII_FIRST];
+}
+
+static bool
+is_kerning_ascii_pair(uint32_t left, uint32_t right)
+{
+    return left - KERNING_ASCII_FIRST < KERNING_ASCII_COUNT &&
+        right - KERNING_ASCII_FIRST < KERNING_ASCII_COUNT;
+}
 
-        tll_foreach(pruns, it) {
-            struct partial_run *prun = &it->item;
+/* Must only be called while font->lock is held */
+static bool
+kerning_from_face(struct font_priv *font, uint32_t left, uint32_t right,
+                  long *x, long *y)
+{
+    assert(font->fallbacks.count > 0);
+    const struct instance *primary = font->fallbacks.arr[0].font;
 
-            /* Get script (“language”) of grapheme */
-            hb_buffer_add_utf32(
-                hb_buf, (const uint32_t *)text, len, prun->start, prun->len);
-            hb_buffer_guess_segment_properties(hb_buf);
+    *x = *y = 0;
 
-            hb_script_t script = hb_buffer_get_script(hb_buf);
-            hb_buffer_clear_contents(hb_buf);
+    FT_UInt left_idx = FT_Get_Char_Index(primary->face, left);
+    if (left_idx == 0)
+        return false;
 
-            if (prev == NULL) {
-                prev = prun;
-                prev_script = script;
-                continue;
-            }
+    FT_UInt right_idx = FT_Get_Char_Index(primary->face, right);
+    if (right_idx == 0)
+        return false;
 
-            if (prev->inst == prun->inst && prev_script == script) {
-                prev->len += prun->len;
-                tll_remove(pruns, it);
-            } else {
-                prev = prun;
-                prev_script = script;
-            }
-        }
+    FT_Vector kerning;
+    FT_Error err = FT_Get_Kerning(
+        primary->face, left_idx, right_idx, FT_KERNING_DEFAULT, &kerning);
 
-        hb_buffer_destroy(hb_buf);
+    if (err != FT_Err_Ok) {
+        LOG_WARN("%s: failed to get kerning for %lc -> %lc: %s",
+                 primary->path, (int)left, (int)right, ft_error_string(err));
+        return false;
     }
 
-#if defined(_DEBUG) && LOG_ENABLE_DBG
-    LOG_DBG("%zu partial runs (after merge):", tll_length(pruns));
-    tll_foreach(pruns, it) {
-        const struct partial_run *prun = &it->item;
-        LOG_DBG("  %.*ls (start=%zu, %zu chars), inst=%p",
-                (int)prun->len, &text[prun->start], prun->start,
-                prun->len, prun->inst);
-    }
-#endif
+    *x = kerning.x / 64. * primary->pixel_size_fixup;
+    *y = kerning.y / 64. * primary->pixel_size_fixup;
 
-    /* Shape each partial run */
-    tll_foreach(pruns, it) {
-        const struct partial_run *prun = &it->item;
+    LOG_DBG("%s: kerning: %lc -> %lc: x=%ld 26.6, y=%ld 26.6",
+            primary->path, (int)left, (int)right,
+            kerning.x, kerning.y);
+    return true;
+}
 
-        bool ret = rasterize_partial_run(
-            &run, prun->inst, (const uint32_t *)text, len,
-            prun->start, prun->len, subpixel);
+static uint32_t
+hash_value_for_kerning_pair(uint32_t left, uint32_t right)
+{
+    return left * 2654435761u ^ right;
+}
 
-        hb_buffer_clear_contents(prun->inst->hb_buf);
-        if (!ret)
-            goto err;
-    }
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Returns the (possibly empty) slot for the pair, or NULL if the
+ * table doesn’t exist.
+ */
+static struct kerning_pair *
+kerning_cache_lookup(struct font_priv *font, uint32_t left, uint32_t right)
+{
+    struct kerning_cache_table *table = font->kerning.table;
+    if (table == NULL)
+        return NULL;
 
-    /* Re-alloc glyphs/cluster arrays */
+    for (size_t i = hash_value_for_kerning_pair(left, right) & (table->size - 1);
+         ;
+         i = (i + 1) & (table->size - 1))
     {
-        const struct fcft_glyph **final_glyphs = realloc(
-            run.public->glyphs, run.public->count * sizeof(final_glyphs[0]));
-        int *final_cluster = realloc(
-            run.public->cluster, run.public->count * sizeof(final_cluster[0]));
+        struct kerning_pair *pair = &table->entries[i];
 
-        if ((final_glyphs == NULL || final_cluster == NULL) &&
-            run.public->count > 0)
+        if (pair->left == KERNING_EMPTY ||
+            (pair->left == left && pair->right == right))
         {
-            free(final_glyphs);
-            free(final_cluster);
-            goto err;
+            return pair;
         }
-
-        run.public->glyphs = final_glyphs;
-        run.public->cluster = final_cluster;
     }
+}
 
-    LOG_DBG("glyph count: %zu", run.public->count);
+static struct kerning_cache_table *
+kerning_cache_table_create(size_t size)
+{
+    struct kerning_cache_table *table = malloc(
+        sizeof(*table) + size * sizeof(table->entries[0]));
+    if (table == NULL)
+        return NULL;
 
-    tll_free(pruns);
-    mtx_unlock(&font->lock);
-    return run.public;
+    table->size = size;
+    table->count = 0;
+    for (size_t i = 0; i < size; i++)
+        table->entries[i].left = KERNING_EMPTY;
+    return table;
+}
 
-err:
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Makes room for one more pair. The table grows up to
+ * KERNING_CACHE_MAX_SIZE entries; after that, it is simply cleared
+ * when full. Returns false if the table could not be allocated.
+ */
+static bool
+kerning_cache_reserve(struct font_priv *font)
+{
+    struct kerning_cache_table *old = font->kerning.table;
 
-    if (run.public != NULL) {
-        for (size_t i = 0; i < run.public->count; i++) {
-            assert(run.public->glyphs[i] != NULL);
-            glyph_destroy(run.public->glyphs[i]);
-        }
+    if (old != NULL && (old->count + 1) * 4 <= old->size * 3)
+        return true;
 
-        free(run.public->glyphs);
-        free(run.public->cluster);
-        free(run.public);
+    if (old != NULL && old->size >= KERNING_CACHE_MAX_SIZE) {
+        /* Full, at max size; start over */
+        for (size_t i = 0; i < old->size; i++)
+            old->entries[i].left = KERNING_EMPTY;
+        old->count = 0;
+        return true;
     }
 
-    tll_free(pruns);
-    mtx_unlock(&font->lock);
-    return NULL;
-}
-
-#else /* !FCFT_HAVE_HARFBUZZ || !FCFT_HAVE_UTF8PROC */
+    const size_t size = old == NULL
+        ? 256 : min(old->size * 2, KERNING_CACHE_MAX_SIZE);
 
-FCFT_EXPORT struct fcft_text_run *
-fcft_rasterize_text_run_utf32(
-    struct fcft_font *font, size_t len, const uint32_t text[static len],
-    enum fcft_subpixel subpixel)
-{
-    return NULL;
-}
+    struct kerning_cache_table *table = kerning_cache_table_create(size);
+    if (table == NULL)
+        return false;
 
-#endif /* !FCFT_HAVE_HARFBUZZ */
+    font->kerning.table = table;
 
-FCFT_EXPORT void
-fcft_text_run_destroy(struct fcft_text_run *run)
-{
-    if (run == NULL)
-        return;
+    if (old != NULL) {
+        for (size_t i = 0; i < old->size; i++) {
+            const struct kerning_pair *pair = &old->entries[i];
+            if (pair->left == KERNING_EMPTY)
+                continue;
 
-    for (size_t i = 0; i < run->count; i++) {
-        assert(run->glyphs[i] != NULL);
-        glyph_destroy(run->glyphs[i]);
+            *kerning_cache_lookup(font, pair->left, pair->right) = *pair;
+            table->count++;
+        }
     }
 
-    free(run->glyphs);
-    free(run->cluster);
-    free(run);
+    free(old);
+    return true;
 }
 
-FCFT_EXPORT void
-fcft_destroy(struct fcft_font *_font)
+/*
+ * Must only be called while font->lock is held.
+ *
+ * Looks up the kerning for a pair in the caches, and populates the
+ * caches on a miss.
+ */
+static bool
+kerning_for_pair(struct font_priv *font, uint32_t left, uint32_t right,
+                 long *x, long *y)
 {
-    if (_font == NULL)
-        return;
-
-    struct font_priv *font = (struct font_priv *)_font;
+    if (is_kerning_ascii_pair(left, right)) {
+        struct kerning_ascii_table *ascii = atomic_load_explicit(
+            &font->kerning.ascii, memory_order_relaxed);
 
-    bool in_cache = false;
-    mtx_lock(&font_cache_lock);
-    tll_foreach(font_cache, it) {
-        if (it->item.font == font) {
+        if (ascii == NULL) {
+            ascii = calloc(1, sizeof(*ascii));
+            if (ascii == NULL)
+                return kerning_from_face(font, left, right, x, y);
 
-            in_cache = true;
+            atomic_store_explicit(&font->kerning.ascii, ascii, memory_order_release);
+        }
 
-            mtx_lock(&font->lock);
-            if (--font->ref_counter > 0) {
-                mtx_unlock(&font->lock);
-                mtx_unlock(&font_cache_lock);
-                return;
-            }
-            mtx_unlock(&font->lock);
+        _Atomic uint64_t *entry = kerning_ascii_entry(ascii, left, right);
+        uint64_t packed = atomic_load_explicit(entry, memory_order_relaxed);
 
-            cnd_destroy(&it->item.cond);
-            tll_remove(font_cache, it);
-            break;
+        if (packed == 0) {
+            const bool valid = kerning_from_face(font, left, right, x, y);
+            packed = kerning_pack(valid, *x, *y);
+            atomic_store_explicit(entry, packed, memory_order_relaxed);
         }
-    };
-    mtx_unlock(&font_cache_lock);
 
-    if (!in_cache) {
-        mtx_lock(&font->lock);
-        if (--font->ref_counter > 0) {
-            mtx_unlock(&font->lock);
-            return;
-        }
-        mtx_unlock(&font->lock);
+        return kerning_unpack(packed, x, y);
     }
 
-    tll_foreach(font->fallbacks, it)
-        fallback_destroy(&it->item);
-
-    tll_free(font->fallbacks);
-    mtx_destroy(&font->lock);
+    struct kerning_pair *pair = kerning_cache_lookup(font, left, right);
+    if (pair != NULL && pair->left != KERNING_EMPTY) {
+        *x = pair->x;
+        *y = pair->y;
+        return pair->valid;
+    }
 
-    for (size_t i = 0;
-         i < font->glyph_cache.size && font->glyph_cache.table != NULL;
-         i++)
-    {
-        struct glyph_priv *entry = font->glyph_cache.table[i];
+    const bool valid = kerning_from_face(font, left, right, x, y);
 
-        if (entry == NULL)
-            continue;
+    if (!kerning_cache_reserve(font))
+        return valid;
 
-        glyph_destroy_private(entry);
-    }
-    free(font->glyph_cache.table);
-    pthread_rwlock_destroy(&font->glyph_cache_lock);
+    struct kerning_cache_table *table = font->kerning.table;
+    pair = kerning_cache_lookup(font, left, right);
+    assert(pair != NULL && pair->left == KERNING_EMPTY);
 
-#if defined(FCFT_HAVE_HARFBUZZ)
-    for (size_t i = 0;
-         i < font->grapheme_cache.size && font->grapheme_cache.table != NULL;
-         i++)
-    {
-        struct grapheme_priv *entry = font->grapheme_cache.table[i];
+    *pair = (struct kerning_pair){
+        .left = left,
+        .right = right,
+        .x = max(min(*x, INT32_MAX), INT32_MIN),
+        .y = max(min(*y, INT32_MAX), INT32_MIN),
+        .valid = valid,
+    };
+    table->count++;
+    return valid;
+}
 
-        if (entry == NULL)
-            continue;
+/*
+ * Lock-free. Returns false (and doesn’t touch ‘x’ and ‘y’) if the pair
+ * is not in the ASCII matrix. Otherwise, ‘*valid’ is set to whether
+ * the font has kerning for the pair.
+ */
+static bool
+kerning_ascii_lookup(struct font_priv *font, uint32_t left, uint32_t right,
+                     bool *valid, long *x, long *y)
+{
+    _Atomic uint64_t *entry = kerning_ascii_entry(
+        atomic_load_explicit(&font->kerning.ascii, memory_order_acquire),
+        left, right);
 
-        for (size_t j = 0; j < entry->public.count; j++) {
-            assert(entry->public.glyphs[j] != NULL);
-            glyph_destroy(entry->public.glyphs[j]);
-        }
+    if (entry == NULL)
+        return false;
 
-        free(entry->public.glyphs);
-        free(entry->cluster);
-        free(entry);
-    }
-    free(font->grapheme_cache.table);
-    pthread_rwlock_destroy(&font->grapheme_cache_lock);
-#endif
+    const uint64_t packed = atomic_load_explicit(entry, memory_order_relaxed);
+    if (packed == 0)
+        return false;
 
-    free(font);
+    *valid = kerning_unpack(packed, x, y);
+    return true;
 }
 
 FCFT_EXPORT bool
@@ -2698,68 +7277,94 @@ fcft_kerning(struct fcft_font *_font, uint32_t left, uint32_t right,
     if (y != NULL)
         *y = 0;
 
-    mtx_lock(&font->lock);
+    if (!font->kerning.supported)
+        return false;
 
-    assert(tll_length(font->fallbacks) > 0);
-    const struct instance *primary = tll_front(font->fallbacks).font;
+    bool valid;
+    long kern_x, kern_y;
 
-    if (!FT_HAS_KERNING(primary->face))
-        goto err;
+    if (!kerning_ascii_lookup(font, left, right, &valid, &kern_x, &kern_y)) {
+        mtx_lock(&font->lock);
+        valid = kerning_for_pair(font, left, right, &kern_x, &kern_y);
+        mtx_unlock(&font->lock);
+    }
 
-    FT_UInt left_idx = FT_Get_Char_Index(primary->face, left);
-    if (left_idx == 0)
-        goto err;
+    if (!valid)
+        return false;
 
-    FT_UInt right_idx = FT_Get_Char_Index(primary->face, right);
-    if (right_idx == 0)
-        goto err;
+    if (x != NULL)
+        *x = kern_x;
+    if (y != NULL)
+        *y = kern_y;
+    return true;
+}
 
-    FT_Vector kerning;
-    FT_Error err = FT_Get_Kerning(
-        primary->face, left_idx, right_idx, FT_KERNING_DEFAULT, &kerning);
+FCFT_EXPORT bool
+fcft_kerning_run(struct fcft_font *_font, size_t count,
+                 const uint32_t cps[static count], long x[static count])
+{
+    struct font_priv *font = (struct font_priv *)_font;
 
-    if (err != FT_Err_Ok) {
-        LOG_WARN("%s: failed to get kerning for %lc -> %lc: %s",
-                 primary->path, (int)left, (int)right, ft_error_string(err));
-        goto err;
+    if (count == 0)
+        return font->kerning.supported;
+
+    x[0] = 0;
+
+    if (!font->kerning.supported) {
+        for (size_t i = 1; i < count; i++)
+            x[i] = 0;
+        return false;
     }
 
-    if (x != NULL)
-        *x = kerning.x / 64. * primary->pixel_size_fixup;
-    if (y != NULL)
-        *y = kerning.y / 64. * primary->pixel_size_fixup;
+    /* First pass: lock-free lookups. Misses are marked with LONG_MIN */
+    bool have_misses = false;
+    for (size_t i = 1; i < count; i++) {
+        bool valid;
+        long kern_y;
 
-    LOG_DBG("%s: kerning: %lc -> %lc: x=%ld 26.6, y=%ld 26.6",
-            primary->path, (int)left, (int)right,
-            kerning.x, kerning.y);
+        if (kerning_ascii_lookup(font, cps[i - 1], cps[i], &valid, &x[i], &kern_y)) {
+            if (!valid)
+                x[i] = 0;
+        } else {
+            x[i] = LONG_MIN;
+            have_misses = true;
+        }
+    }
 
-    mtx_unlock(&font->lock);
-    return true;
+    if (!have_misses)
+        return true;
 
-err:
+    /* Second pass: everything else, under a single lock acquisition */
+    mtx_lock(&font->lock);
+    for (size_t i = 1; i < count; i++) {
+        if (x[i] != LONG_MIN)
+            continue;
+
+        long kern_y;
+        if (!kerning_for_pair(font, cps[i - 1], cps[i], &x[i], &kern_y))
+            x[i] = 0;
+    }
     mtx_unlock(&font->lock);
-    return false;
+
+    return true;
 }
 
 #if defined(_DEBUG)
 static void __attribute__((constructor))
-verify_precompose_table_is_sorted(void)
+verify_precompose_table_is_perfect(void)
 {
-    uint32_t last_base = 0, last_comb = 0;
-
     for (size_t i = 0; i < ALEN(precompose_table); i++) {
         uint32_t base = precompose_table[i].base;
         uint32_t comb = precompose_table[i].comb;
 
-        assert(base >= last_base);
-        if (base != last_base)
-            last_comb = 0;
+        assert(precompose_lookup(base, comb) == precompose_table[i].replacement);
+    }
 
-        assert(comb >= last_comb);
+    assert(precompose_lookup(U'X', U'Y') == (uint32_t)-1);
 
-        last_base = base;
-        last_comb = comb;
-    }
+    /* Composition exclusion (U+0958) */
+    assert(precompose_lookup(0x0915, 0x093c) == 0x0958);
+    assert(precompose_lookup_canonical(0x0915, 0x093c) == (uint32_t)-1);
 }
 #endif /* _DEBUG */
 
@@ -2774,8 +7379,8 @@ fcft_precompose(const struct fcft_font *_font, uint32_t base, uint32_t comb,
 
     const struct font_priv *font = (const struct font_priv *)_font;
 
-    assert(tll_length(font->fallbacks) > 0);
-    const struct fallback *primary = &tll_front(font->fallbacks);
+    assert(font->fallbacks.count > 0);
+    const struct fallback *primary = &font->fallbacks.arr[0];
 
     if (font != NULL) {
         if (base_is_from_primary != NULL)
@@ -2784,34 +7389,104 @@ fcft_precompose(const struct fcft_font *_font, uint32_t base, uint32_t comb,
             *comb_is_from_primary = FcCharSetHasChar(primary->charset, comb);
     }
 
-    const uint64_t match = (uint64_t)base << 32 | comb;
+    const uint32_t composed = precompose_lookup(base, comb);
+
+    if (composed == (uint32_t)-1) {
+        if (composed_is_from_primary != NULL)
+            *composed_is_from_primary = false;
+        return (uint32_t)-1;
+    }
+
+    if (font != NULL && composed_is_from_primary != NULL) {
+        *composed_is_from_primary = FcCharSetHasChar(
+            primary->charset, composed);
+    }
+    return composed;
+}
 
-    ssize_t start = 0;
-    ssize_t end = (sizeof(precompose_table) / sizeof(precompose_table[0])) - 1;
+/*
+ * Canonical composition of a single pair. Returns (uint32_t)-1 if
+ * they do not compose. Hangul syllables are composed algorithmically
+ * (see “Hangul Syllable Composition”, in chapter 3 of the Unicode
+ * standard), everything else with the table.
+ */
+static uint32_t
+compose_canonical(uint32_t first, uint32_t second)
+{
+    static const uint32_t s_base = 0xac00;
+    static const uint32_t l_base = 0x1100, l_count = 19;
+    static const uint32_t v_base = 0x1161, v_count = 21;
+    static const uint32_t t_base = 0x11a7, t_count = 28;
+    static const uint32_t s_count = l_count * v_count * t_count;
+
+    /* L + V -> LV */
+    if (first - l_base < l_count && second - v_base < v_count) {
+        return s_base +
+            ((first - l_base) * v_count + (second - v_base)) * t_count;
+    }
 
-    while (start <= end) {
-        size_t middle = (start + end) / 2;
+    /* LV + T -> LVT */
+    if (first - s_base < s_count && (first - s_base) % t_count == 0 &&
+        second - t_base - 1 < t_count - 1)
+    {
+        return first + (second - t_base);
+    }
 
-        const uint64_t maybe =
-            (uint64_t)precompose_table[middle].base << 32 | precompose_table[middle].comb;
+    return precompose_lookup_canonical(first, second);
+}
 
-        if (maybe < match)
-            start = middle + 1;
-        else if (maybe > match)
-            end = middle - 1;
-        else {
-            uint32_t composed = precompose_table[middle].replacement;
-            if (font != NULL && composed_is_from_primary != NULL) {
-                *composed_is_from_primary = FcCharSetHasChar(
-                    primary->charset, composed);
+FCFT_EXPORT size_t
+fcft_precompose_run(const struct fcft_font *_font,
+                    size_t len, const uint32_t text[static len],
+                    uint32_t composed[static len], bool *is_from_primary)
+{
+    const struct font_priv *font = (const struct font_priv *)_font;
+
+    /*
+     * Canonical composition (see UAX #15). Each codepoint is composed
+     * with the last starter, unless blocked; that is, unless there’s
+     * a codepoint in between with a combining class of 0, or greater
+     * than or equal to its own. Composition exclusions are not
+     * composed.
+     */
+    size_t count = 0;
+    ssize_t starter = -1;
+    uint8_t last_class = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        const uint32_t cp = text[i];
+        const uint8_t class = unicode_props_lookup(cp)->combining_class;
+
+        if (starter >= 0) {
+            const bool adjacent = (size_t)starter + 1 == count;
+            const bool blocked =
+                !adjacent && (last_class == 0 || last_class >= class);
+
+            if (!blocked) {
+                uint32_t c = compose_canonical(composed[starter], cp);
+                if (c != (uint32_t)-1) {
+                    composed[starter] = c;
+                    continue;
+                }
             }
-            return composed;
         }
+
+        if (class == 0)
+            starter = count;
+        last_class = class;
+
+        composed[count++] = cp;
+    }
+
+    if (is_from_primary != NULL) {
+        assert(font->fallbacks.count > 0);
+        const struct fallback *primary = &font->fallbacks.arr[0];
+
+        for (size_t i = 0; i < count; i++)
+            is_from_primary[i] = FcCharSetHasChar(primary->charset, composed[i]);
     }
 
-    if (composed_is_from_primary != NULL)
-        *composed_is_from_primary = false;
-    return (uint32_t)-1;
+    return count;
 }
 
 FCFT_EXPORT void
@@ -2821,3 +7496,116 @@ fcft_set_emoji_presentation(struct fcft_font *_font,
     struct font_priv *font = (struct font_priv *)_font;
     font->emoji_presentation = presentation;
 }
+
+FCFT_EXPORT void
+fcft_set_cache_budget(struct fcft_font *_font, size_t max_bytes)
+{
+    struct font_priv *font = (struct font_priv *)_font;
+
+    mtx_lock(&font->lock);
+    atomic_store_explicit(&font->cache.budget, max_bytes, memory_order_relaxed);
+    cache_evict(font);
+    mtx_unlock(&font->lock);
+}
+
+static void
+cache_counters_get(struct fcft_cache_stats *stats,
+                   struct cache_counters *counters)
+{
+    _Static_assert(ALEN(stats->probe_lengths) == ALEN(counters->probe_lengths),
+                   "probe length histogram size mismatch");
+
+    stats->hits += atomic_load_explicit(&counters->hits, memory_order_relaxed);
+    stats->misses += atomic_load_explicit(&counters->misses, memory_order_relaxed);
+
+    for (size_t i = 0; i < ALEN(stats->probe_lengths); i++) {
+        stats->probe_lengths[i] += atomic_load_explicit(
+            &counters->probe_lengths[i], memory_order_relaxed);
+    }
+}
+
+FCFT_EXPORT void
+fcft_font_stats(struct fcft_font *_font, struct fcft_font_stats *stats)
+{
+    struct font_priv *font = (struct font_priv *)_font;
+
+    *stats = (struct fcft_font_stats){0};
+
+    mtx_lock(&font->lock);
+
+    const struct glyph_cache_table *glyph_table = atomic_load_explicit(
+        &font->glyph_cache.table, memory_order_relaxed);
+    stats->glyph_cache.size = glyph_table->size;
+    stats->glyph_cache.count = font->glyph_cache.count;
+    stats->glyph_cache.evictions = font->stats.glyph_evictions;
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+    const struct grapheme_cache_table *grapheme_table = atomic_load_explicit(
+        &font->grapheme_cache.table, memory_order_relaxed);
+    stats->grapheme_cache.size = grapheme_table->size;
+    stats->grapheme_cache.count = font->grapheme_cache.count;
+    stats->grapheme_cache.evictions = font->stats.grapheme_evictions;
+#endif
+
+    stats->glyph_index_cache.size = font->glyph_index_cache.table->size;
+    stats->glyph_index_cache.count = font->glyph_index_cache.count;
+    stats->glyph_index_cache.evictions = font->stats.glyph_index_evictions;
+    cache_counters_get(
+        &stats->glyph_index_cache, &font->stats.glyph_index_cache);
+
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+    if (font->shaped_word_cache.table != NULL)
+        stats->shaped_word_cache.size = font->shaped_word_cache.table->size;
+    stats->shaped_word_cache.count = font->shaped_word_cache.count;
+#endif
+    stats->shaped_word_cache.evictions = font->stats.shaped_word_evictions;
+    cache_counters_get(
+        &stats->shaped_word_cache, &font->stats.shaped_word_cache);
+
+    stats->cache_bytes = font->cache.bytes;
+    stats->bitmap_bytes.a1 = font->stats.bitmap_bytes[SLAB_A1];
+    stats->bitmap_bytes.a8 = font->stats.bitmap_bytes[SLAB_A8];
+    stats->bitmap_bytes.x8r8g8b8 = font->stats.bitmap_bytes[SLAB_X8R8G8B8];
+    stats->bitmap_bytes.a8r8g8b8 = font->stats.bitmap_bytes[SLAB_A8R8G8B8];
+    stats->fallbacks_instantiated = font->stats.fallbacks_instantiated;
+    stats->glyphs_rasterized = atomic_load_explicit(
+        &font->stats.glyphs_rasterized, memory_order_relaxed);
+    stats->glyphs_loaded = font->stats.glyphs_loaded;
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+    stats->scratch_bytes = arena_size(&font->text_run_arena);
+#endif
+
+    mtx_lock(&readers_lock);
+    cache_counters_get(&stats->glyph_cache, &font->stats.glyph_cache);
+    cache_counters_get(&stats->grapheme_cache, &font->stats.grapheme_cache);
+
+    tll_foreach(readers, it) {
+        if (it->item->font_id != font->id)
+            continue;
+
+        cache_counters_get(&stats->glyph_cache, &it->item->glyph_cache);
+        cache_counters_get(&stats->grapheme_cache, &it->item->grapheme_cache);
+    }
+    mtx_unlock(&readers_lock);
+
+    mtx_unlock(&font->lock);
+}
+
+FCFT_EXPORT void
+fcft_font_coverage(struct fcft_font *_font,
+                   size_t count, const uint32_t cps[static count],
+                   struct fcft_coverage coverage[static count])
+{
+    struct font_priv *font = (struct font_priv *)_font;
+
+    mtx_lock(&font->lock);
+    for (size_t i = 0; i < count; i++) {
+        ssize_t idx = fallback_for_codepoint(font, cps[i]);
+
+        coverage[i] = (struct fcft_coverage){
+            .font = idx,
+            .emoji = idx >= 0 && font->fallbacks.arr[idx].has_lang_emoji,
+        };
+    }
+    mtx_unlock(&font->lock);
+}
@@ -97,6 +97,24 @@ enum fcft_capabilities fcft_capabilities(void);
 struct fcft_font *fcft_from_name(
     size_t count, const char *names[static count], const char *attributes);
 struct fcft_font *fcft_clone(const struct fcft_font *font);
+
+/*
+ * Asynchronous font loading. Like fcft_from_name(), but the font is
+ * instantiated in a background thread. Completion is signalled by
+ * calling ‘done’ (if not NULL, from the background thread), *and* by
+ * making the request’s file descriptor readable.
+ *
+ * fcft_font_request_finish() must always be called; it waits for the
+ * request to complete (if it hasn’t already), frees the request, and
+ * returns the font (or NULL, on error)
+ */
+struct fcft_font_request;
+
+struct fcft_font_request *fcft_from_name_async(
+    size_t count, const char *names[static count], const char *attributes,
+    void (*done)(struct fcft_font_request *request, void *data), void *data);
+int fcft_font_request_fd(const struct fcft_font_request *request);
+struct fcft_font *fcft_font_request_finish(struct fcft_font_request *request);
 void fcft_destroy(struct fcft_font *font);
 
 struct fcft_glyph {
@@ -122,6 +140,24 @@ struct fcft_glyph {
 const struct fcft_glyph *fcft_rasterize_char_utf32(
     struct fcft_font *font, uint32_t cp, enum fcft_subpixel subpixel);
 
+/* Like fcft_rasterize_char_utf32(), for 'count' codepoints. Cache
+ * misses are rasterized under a single lock acquisition */
+void fcft_rasterize_chars_utf32(
+    struct fcft_font *font, size_t count, const uint32_t cps[static count],
+    enum fcft_subpixel subpixel, const struct fcft_glyph *glyphs[static count]);
+
+struct fcft_codepoint_range {
+    uint32_t first;
+    uint32_t last;  /* Inclusive */
+};
+
+/* Fills the glyph cache with all codepoints in 'ranges', using the
+ * thread pool. Returns when done */
+bool fcft_prerasterize(
+    struct fcft_font *font, size_t count,
+    const struct fcft_codepoint_range ranges[static count],
+    enum fcft_subpixel subpixel);
+
 struct fcft_grapheme {
     int cols;  /* wcswidth(grapheme) */
 
@@ -134,6 +170,22 @@ const struct fcft_grapheme *fcft_rasterize_grapheme_utf32(
     size_t len, const uint32_t grapheme_cluster[static len],
     enum fcft_subpixel subpixel);
 
+/* UTF-8 encoded variant of fcft_rasterize_grapheme_utf32(). 'len' is
+ * in bytes */
+const struct fcft_grapheme *fcft_rasterize_grapheme_utf8(
+    struct fcft_font *font,
+    size_t len, const char grapheme_cluster[static len],
+    enum fcft_subpixel subpixel);
+
+/* Like fcft_rasterize_grapheme_utf32(), for 'count' graphemes, where
+ * 'lens[i]' is the length of 'clusters[i]' */
+void fcft_rasterize_graphemes_utf32(
+    struct fcft_font *font, size_t count,
+    const size_t lens[static count],
+    const uint32_t *const clusters[static count],
+    enum fcft_subpixel subpixel,
+    const struct fcft_grapheme *graphemes[static count]);
+
 struct fcft_text_run {
     const struct fcft_glyph **glyphs;
     int *cluster;
@@ -144,18 +196,90 @@ struct fcft_text_run *fcft_rasterize_text_run_utf32(
     struct fcft_font *font, size_t len, const uint32_t text[static len],
     enum fcft_subpixel subpixel);
 
+/* UTF-8 encoded variant of fcft_rasterize_text_run_utf32(). 'len' is
+ * in bytes, and so are the run's 'cluster' offsets */
+struct fcft_text_run *fcft_rasterize_text_run_utf8(
+    struct fcft_font *font, size_t len, const char text[static len],
+    enum fcft_subpixel subpixel);
+
+/* An empty text-run, for use with the *_into() variants below */
+struct fcft_text_run *fcft_text_run_create(void);
+
+/* Like fcft_rasterize_text_run_utf32() and
+ * fcft_rasterize_text_run_utf8(), but re-uses 'run' (from
+ * fcft_text_run_create(), or an earlier call). Its previous glyphs
+ * are released, and its memory recycled. On error, 'run' is left
+ * empty */
+bool fcft_rasterize_text_run_utf32_into(
+    struct fcft_font *font, size_t len, const uint32_t text[static len],
+    enum fcft_subpixel subpixel, struct fcft_text_run *run);
+bool fcft_rasterize_text_run_utf8_into(
+    struct fcft_font *font, size_t len, const char text[static len],
+    enum fcft_subpixel subpixel, struct fcft_text_run *run);
+
 void fcft_text_run_destroy(struct fcft_text_run *run);
 
+/* Opaque handle for one of a font's faces; the primary font, or one of
+ * its fallback fonts. Valid until the font is destroyed */
+struct fcft_face;
+
+struct fcft_shaped_glyph {
+    const struct fcft_face *face;
+    uint32_t index;  /* Glyph index, in 'face' */
+    int cluster;     /* Character offset, in the original string */
+
+    int x_offset;
+    int y_offset;
+
+    struct {
+        int x;
+        int y;
+    } advance;
+};
+
+struct fcft_shaped_run {
+    const struct fcft_shaped_glyph *glyphs;
+    size_t count;
+};
+
+/* Shapes 'text' like fcft_rasterize_text_run_utf32(), but does not
+ * rasterize any glyphs */
+struct fcft_shaped_run *fcft_shape_text_run_utf32(
+    struct fcft_font *font, size_t len, const uint32_t text[static len]);
+void fcft_shaped_run_destroy(struct fcft_shaped_run *run);
+
+/* Rasterizes glyph 'index' in 'face' (from a shaped run of 'font').
+ * The glyph's 'cp' and 'cols' members are 0 */
+const struct fcft_glyph *fcft_rasterize_glyph_index(
+    struct fcft_font *font, const struct fcft_face *face, uint32_t index,
+    enum fcft_subpixel subpixel);
+
 bool fcft_kerning(
     struct fcft_font *font, uint32_t left, uint32_t right,
     long *restrict x, long *restrict y);
 
+/* Horizontal kerning between each pair of adjacent codepoints; 'x[i]'
+ * is the kerning between 'cps[i - 1]' and 'cps[i]' ('x[0]' is always
+ * 0). Returns false if the font has no kerning information at all */
+bool fcft_kerning_run(
+    struct fcft_font *font, size_t count,
+    const uint32_t cps[static count], long x[static count]);
+
 uint32_t fcft_precompose(const struct fcft_font *font,
                          uint32_t base, uint32_t comb,
                          bool *base_is_from_primary,
                          bool *comb_is_from_primary,
                          bool *composed_is_from_primary);
 
+/* Composes all of ‘text’ (canonical composition; unlike
+ * fcft_precompose(), composition exclusions are not composed, and
+ * Hangul syllables are). Returns the number of codepoints written to
+ * ‘composed’, which may be ‘text’ itself. ‘is_from_primary’, if
+ * non-NULL, must have room for ‘len’ elements */
+size_t fcft_precompose_run(
+    const struct fcft_font *font, size_t len, const uint32_t text[static len],
+    uint32_t composed[static len], bool *is_from_primary);
+
 enum fcft_scaling_filter {
     FCFT_SCALING_FILTER_NONE,
     FCFT_SCALING_FILTER_NEAREST,
@@ -168,6 +292,16 @@ enum fcft_scaling_filter {
  * rasterizing any glyphs! */
 bool fcft_set_scaling_filter(enum fcft_scaling_filter filter);
 
+/* Persists rasterized glyphs in $XDG_CACHE_HOME/fcft, and re-uses
+ * them in later processes. Disabled by default. Must be called
+ * before instantiating fonts */
+bool fcft_set_disk_cache(bool enable);
+
+/* Number of worker threads used by e.g. fcft_prerasterize(). Default
+ * is one less than the number of CPUs. Must be called before the
+ * pool is first used */
+bool fcft_set_thread_pool_size(size_t count);
+
 /*
  * Emoji presentation
  *
@@ -194,3 +328,85 @@ enum fcft_emoji_presentation {
 
 void fcft_set_emoji_presentation(
     struct fcft_font *font, enum fcft_emoji_presentation presentation);
+
+/*
+ * Cache budget
+ *
+ * Limits the amount of memory (in bytes) used by the font’s glyph
+ * and grapheme caches. When exceeded, glyphs and graphemes that
+ * have not been used recently are evicted. 0 (the default) means
+ * unlimited.
+ *
+ * With a budget, glyphs and graphemes returned by
+ * fcft_rasterize_char_utf32() and fcft_rasterize_grapheme_utf32() are
+ * only guaranteed to be valid until the calling thread’s next call to
+ * either of those functions, with the same font.
+ *
+ * Note: call *before* rasterizing any glyphs!
+ */
+void fcft_set_cache_budget(struct fcft_font *font, size_t max_bytes);
+
+/*
+ * Cache statistics
+ *
+ * Counters are cumulative, since the font was instantiated.
+ */
+struct fcft_cache_stats {
+    size_t hits;
+    size_t misses;
+
+    /* Number of hash table lookups that had to probe ‘n’ additional
+     * entries, where ‘n’ is the index. The last element counts all
+     * lookups with 7, or more, additional probes */
+    size_t probe_lengths[8];
+
+    size_t size;       /* Number of hash table entries */
+    size_t count;      /* Number of cached glyphs/graphemes */
+    size_t evictions;  /* See fcft_set_cache_budget() */
+};
+
+struct fcft_font_stats {
+    struct fcft_cache_stats glyph_cache;
+    struct fcft_cache_stats grapheme_cache;
+    struct fcft_cache_stats glyph_index_cache;  /* Rasterized bitmaps */
+    struct fcft_cache_stats shaped_word_cache;  /* Text-runs */
+
+    size_t cache_bytes;  /* Total memory used by the caches */
+
+    /* Memory used by cached bitmaps, per pixel format */
+    struct {
+        size_t a1;
+        size_t a8;
+        size_t x8r8g8b8;
+        size_t a8r8g8b8;
+    } bitmap_bytes;
+
+    size_t fallbacks_instantiated;
+    size_t glyphs_rasterized;
+    size_t glyphs_loaded;  /* From the disk cache */
+
+    size_t scratch_bytes;  /* Kept for shaping text-runs */
+};
+
+void fcft_font_stats(struct fcft_font *font, struct fcft_font_stats *stats);
+
+/*
+ * Codepoint coverage
+ *
+ * Looks up the font each codepoint would be rasterized with by
+ * fcft_rasterize_char_utf32(), without rasterizing anything. Fonts
+ * are identified by their index in the font’s fallback list, where 0
+ * is the primary font, and -1 means no font has the codepoint (the
+ * primary font’s “missing glyph” is used).
+ *
+ * Indices do not change during the font’s lifetime, but the font
+ * used for a codepoint may, if a fallback font fails to load.
+ */
+struct fcft_coverage {
+    int font;
+    bool emoji;  /* Font is an emoji font (and likely colored) */
+};
+
+void fcft_font_coverage(
+    struct fcft_font *font, size_t count, const uint32_t cps[static count],
+    struct fcft_coverage coverage[static count]);
@@ -0,0 +1,194 @@
+#!/usr/bin/env python3
+
+import argparse
+
+parser = argparse.ArgumentParser()
+parser.add_argument('input', type=argparse.FileType('r'))
+parser.add_argument('output', type=argparse.FileType('w'))
+opts = parser.parse_args()
+
+MASK64 = (1 << 64) - 1
+
+# Average number of keys per bucket
+BUCKET_LOAD = 4
+
+
+def hash64(key, seed):
+    """Must match precompose_hash() in the generated header"""
+    x = (key + seed * 0x9e3779b97f4a7c15) & MASK64
+    x = ((x ^ (x >> 30)) * 0xbf58476d1ce4e5b9) & MASK64
+    x = ((x ^ (x >> 27)) * 0x94d049bb133111eb) & MASK64
+    return x ^ (x >> 31)
+
+
+#
+# Script specific, and post composition version, composition
+# exclusions. From CompositionExclusions.txt; these cannot be derived
+# from UnicodeData.txt.
+#
+COMPOSITION_EXCLUSIONS = [
+    *range(0x0958, 0x095f + 1), 0x09dc, 0x09dd, 0x09df, 0x0a33, 0x0a36,
+    *range(0x0a59, 0x0a5b + 1), 0x0a5e, 0x0b5c, 0x0b5d, 0x0f43, 0x0f4d,
+    0x0f52, 0x0f57, 0x0f5c, 0x0f69, 0x0f76, 0x0f78, 0x0f93, 0x0f9d,
+    0x0fa2, 0x0fa7, 0x0fac, 0x0fb9, 0xfb1d, 0xfb1f,
+    *range(0xfb2a, 0xfb36 + 1), *range(0xfb38, 0xfb3c + 1), 0xfb3e,
+    0xfb40, 0xfb41, 0xfb43, 0xfb44, *range(0xfb46, 0xfb4e + 1),
+
+    0x2adc, *range(0x1d15e, 0x1d164 + 1), *range(0x1d1bb, 0x1d1c0 + 1),
+]
+
+#
+# Extract canonical decompositions, of exactly two codepoints, from
+# UnicodeData.txt. Compatibility decompositions (“<tag> ...”) are
+# skipped.
+#
+# Originally “borrowed” from xterm/unicode/make-precompose.sh
+#
+entries = {}
+combining_class = {}
+decompositions = {}  # All canonical decompositions
+
+for line in opts.input:
+    fields = line.rstrip().split(';')
+    if len(fields) < 6:
+        continue
+
+    cp = int(fields[0], 16)
+    combining_class[cp] = int(fields[3])
+
+    decomposition = fields[5].split()
+    if not decomposition or decomposition[0].startswith('<'):
+        continue
+
+    decompositions[cp] = [int(c, 16) for c in decomposition]
+    if len(decomposition) != 2:
+        continue
+
+    base, comb = decompositions[cp]
+
+    key = base << 32 | comb
+    assert key not in entries, f'duplicate decomposition: {base:x} {comb:x}'
+    entries[key] = cp
+
+
+def first_decomposed(cp):
+    while cp in decompositions:
+        cp = decompositions[cp][0]
+    return cp
+
+
+#
+# Full composition exclusions; these are composed by fcft_precompose(),
+# but not in canonical composition (see fcft_precompose_run()). Besides
+# the list above, this is characters that are not starters, or whose
+# (full) decomposition begins with a non-starter. Singleton
+# decompositions are not in the table to begin with.
+#
+excluded = set()
+for key, replacement in entries.items():
+    if replacement in COMPOSITION_EXCLUSIONS or \
+       combining_class.get(replacement, 0) != 0 or \
+       combining_class.get(first_decomposed(key >> 32), 0) != 0:
+        excluded.add(key)
+
+#
+# Minimal perfect hash (“hash, displace and compress”). Keys are first
+# distributed over a number of buckets. Then, starting with the
+# largest bucket, a seed (“displacement”) is searched for, that maps
+# all the bucket’s keys to free slots.
+#
+count = len(entries)
+bucket_count = (count + BUCKET_LOAD - 1) // BUCKET_LOAD
+
+buckets = [[] for _ in range(bucket_count)]
+for key in entries:
+    buckets[hash64(key, 0) % bucket_count].append(key)
+
+slots = [None] * count
+displacements = [0] * bucket_count
+
+for idx in sorted(range(bucket_count), key=lambda i: -len(buckets[i])):
+    bucket = buckets[idx]
+    if not bucket:
+        continue
+
+    seed = 1
+    while True:
+        candidate = [hash64(key, seed) % count for key in bucket]
+        if len(set(candidate)) == len(candidate) and \
+           all(slots[slot] is None for slot in candidate):
+            break
+        seed += 1
+        assert seed < 1 << 16, 'failed to find a displacement'
+
+    displacements[idx] = seed
+    for key, slot in zip(bucket, candidate):
+        slots[slot] = key
+
+assert all(slot is not None for slot in slots)
+
+out = opts.output
+out.write('#pragma once\n')
+out.write('\n')
+out.write('#include <stdbool.h>\n')
+out.write('#include <stdint.h>\n')
+out.write('\n')
+out.write('static const struct {\n')
+out.write('    uint32_t replacement;\n')
+out.write('    uint32_t base;\n')
+out.write('    uint32_t comb;\n')
+out.write('    bool excluded;  /* Composition exclusion */\n')
+out.write(f'}} precompose_table[{count}] = {{\n')
+for key in slots:
+    out.write(f'    {{ 0x{entries[key]:04X}, 0x{key >> 32:04X}, 0x{key & 0xffffffff:04X}, '
+              f'{"true" if key in excluded else "false"} }},\n')
+out.write('};\n')
+out.write('\n')
+out.write(f'static const uint16_t precompose_displacements[{bucket_count}] = {{\n')
+for i in range(0, bucket_count, 16):
+    out.write('    ' + ' '.join(f'{d},' for d in displacements[i:i + 16]) + '\n')
+out.write('};\n')
+out.write('\n')
+out.write('static inline uint64_t\n')
+out.write('precompose_hash(uint64_t key, uint64_t seed)\n')
+out.write('{\n')
+out.write('    uint64_t x = key + seed * 0x9e3779b97f4a7c15ull;\n')
+out.write('    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;\n')
+out.write('    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;\n')
+out.write('    return x ^ (x >> 31);\n')
+out.write('}\n')
+out.write('\n')
+out.write('/* Returns -1 if ‘base’ and ‘comb’ are not in the table */\n')
+out.write('static inline int64_t\n')
+out.write('precompose_slot(uint32_t base, uint32_t comb)\n')
+out.write('{\n')
+out.write('    const uint64_t key = (uint64_t)base << 32 | comb;\n')
+out.write(f'    const uint16_t seed = precompose_displacements[precompose_hash(key, 0) % {bucket_count}];\n')
+out.write(f'    const uint64_t slot = precompose_hash(key, seed) % {count};\n')
+out.write('\n')
+out.write('    if (precompose_table[slot].base != base ||\n')
+out.write('        precompose_table[slot].comb != comb)\n')
+out.write('    {\n')
+out.write('        return -1;\n')
+out.write('    }\n')
+out.write('\n')
+out.write('    return slot;\n')
+out.write('}\n')
+out.write('\n')
+out.write('/* Returns (uint32_t)-1 if ‘base’ and ‘comb’ do not compose */\n')
+out.write('static inline uint32_t\n')
+out.write('precompose_lookup(uint32_t base, uint32_t comb)\n')
+out.write('{\n')
+out.write('    const int64_t slot = precompose_slot(base, comb);\n')
+out.write('    return slot < 0 ? (uint32_t)-1 : precompose_table[slot].replacement;\n')
+out.write('}\n')
+out.write('\n')
+out.write('/* Like precompose_lookup(), but composition exclusions do not\n')
+out.write(' * compose. Hangul syllables are not in the table */\n')
+out.write('static inline uint32_t\n')
+out.write('precompose_lookup_canonical(uint32_t base, uint32_t comb)\n')
+out.write('{\n')
+out.write('    const int64_t slot = precompose_slot(base, comb);\n')
+out.write('    return slot < 0 || precompose_table[slot].excluded\n')
+out.write('        ? (uint32_t)-1 : precompose_table[slot].replacement;\n')
+out.write('}\n')
@@ -0,0 +1,314 @@
+#!/usr/bin/env python3
+
+import argparse
+
+from dataclasses import dataclass, astuple
+
+parser = argparse.ArgumentParser()
+parser.add_argument('unicode_data', type=argparse.FileType('r'))
+parser.add_argument('emoji_data', type=argparse.FileType('r'))
+parser.add_argument('output', type=argparse.FileType('w'))
+opts = parser.parse_args()
+
+MAX_CODEPOINT = 0x10ffff
+BLOCK_SHIFT = 7
+BLOCK_SIZE = 1 << BLOCK_SHIFT
+
+
+@dataclass(frozen=True)
+class Props:
+    width: int = -1
+    combining_class: int = 0
+    emoji: bool = False
+    emoji_presentation: bool = False
+    emoji_modifier: bool = False
+    emoji_modifier_base: bool = False
+    emoji_component: bool = False
+    extended_pictographic: bool = False
+    grapheme_base: bool = False
+
+
+def parse_ranges(f):
+    for line in f:
+        line = line.rstrip()
+        if not line:
+            continue
+        if line[0] == '#':
+            continue
+
+        codepoint_or_range, props_and_trash = line.split(';', maxsplit=1)
+        props = props_and_trash.split('#', maxsplit=1)[0].strip()
+
+        codepoint_range = tuple(
+            map(lambda s: int(s.strip(), 16), codepoint_or_range.split('..')))
+        assert len(codepoint_range) in [1, 2]
+
+        if len(codepoint_range) == 1:
+            codepoint_range = codepoint_range[0], codepoint_range[0]
+
+        assert codepoint_range[1] <= MAX_CODEPOINT, \
+            f'codepoint is outside range: 0x{codepoint_range[1]:x}'
+
+        yield range(codepoint_range[0], codepoint_range[1] + 1), props
+
+
+#
+# General category, from UnicodeData.txt. Ranges are specified as
+# “<name, First>” and “<name, Last>” pairs.
+#
+category = {}
+combining_class = {}
+range_start = None
+
+for line in opts.unicode_data:
+    fields = line.rstrip().split(';')
+    if len(fields) < 3:
+        continue
+
+    cp = int(fields[0], 16)
+    name = fields[1]
+
+    if name.endswith(', First>'):
+        range_start = cp
+        continue
+
+    if name.endswith(', Last>'):
+        assert range_start is not None
+        for c in range(range_start, cp + 1):
+            category[c] = fields[2]
+        range_start = None
+        continue
+
+    category[cp] = fields[2]
+    combining_class[cp] = int(fields[3])
+
+#
+# Emoji properties, from emoji-data.txt
+#
+emoji = set()
+emoji_presentation = set()
+emoji_modifier = set()
+emoji_modifier_base = set()
+emoji_component = set()
+extended_pictographic = set()
+
+for cps, prop in parse_ranges(opts.emoji_data):
+    {
+        'Emoji': emoji,
+        'Emoji_Presentation': emoji_presentation,
+        'Emoji_Modifier': emoji_modifier,
+        'Emoji_Modifier_Base': emoji_modifier_base,
+        'Emoji_Component': emoji_component,
+        'Extended_Pictographic': extended_pictographic,
+    }[prop].update(cps)
+
+#
+# East Asian Wide (W) and Fullwidth (F) codepoints. EastAsianWidth.txt
+# is not part of our Unicode data; these are the blocks that are wide
+# (in their entirety, or for all assigned codepoints). Emojis with
+# emoji presentation are also wide.
+#
+wide_ranges = [
+    (0x1100, 0x115f),    # Hangul Jamo initial consonants
+    (0x2329, 0x232a),    # Angle brackets
+    (0x2e80, 0x303e),    # CJK radicals, Kangxi radicals, CJK symbols
+    (0x3041, 0x33ff),    # Hiragana ... CJK compatibility
+    (0x3400, 0x4dff),    # CJK unified ideographs extension A, Yijing
+    (0x4e00, 0x9fff),    # CJK unified ideographs
+    (0xa000, 0xa4cf),    # Yi
+    (0xa960, 0xa97f),    # Hangul Jamo extended A
+    (0xac00, 0xd7a3),    # Hangul syllables
+    (0xf900, 0xfaff),    # CJK compatibility ideographs
+    (0xfe10, 0xfe19),    # Vertical forms
+    (0xfe30, 0xfe6f),    # CJK compatibility forms, small form variants
+    (0xff00, 0xff60),    # Fullwidth forms
+    (0xffe0, 0xffe6),    # Fullwidth signs
+    (0x16fe0, 0x16fe4),  # Ideographic symbols and punctuation
+    (0x16ff0, 0x16ff1),
+    (0x17000, 0x18cff),  # Tangut, Khitan
+    (0x18d00, 0x18d08),  # Tangut supplement
+    (0x1aff0, 0x1b2ff),  # Kana extended B ... Nushu
+    (0x1f200, 0x1f2ff),  # Enclosed ideographic supplement
+    (0x20000, 0x2fffd),  # Supplementary ideographic plane
+    (0x30000, 0x3fffd),  # Tertiary ideographic plane
+]
+
+wide = set(emoji_presentation)
+for first, last in wide_ranges:
+    wide.update(range(first, last + 1))
+
+# Regional indicators have emoji presentation, but are narrow
+wide.difference_update(range(0x1f1e6, 0x1f200))
+
+# Prepended concatenation marks (Cf) are visible
+prepended_concatenation_marks = set(range(0x0600, 0x0606))
+prepended_concatenation_marks.update([
+    0x06dd, 0x070f, 0x0890, 0x0891, 0x08e2, 0x110bd, 0x110cd])
+
+
+def width(cp, cat):
+    """Column width, matching wcwidth() in a UTF-8 locale"""
+    if cp == 0:
+        return 0
+    if cat is None or cat in ('Cc', 'Cs', 'Zl', 'Zp'):
+        return -1
+    if cat in ('Mn', 'Me'):
+        return 0
+    if cat == 'Cf' and cp != 0x00ad and cp not in prepended_concatenation_marks:
+        return 0
+    if 0x1160 <= cp <= 0x11ff or 0xd7b0 <= cp <= 0xd7ff:
+        # Hangul Jamo medial vowels and final consonants
+        return 0
+    if cp in wide:
+        return 2
+    return 1
+
+
+#
+# Codepoints whose grapheme cluster break property is “Other”, and
+# that are not part of any grapheme break rule other than GB999. The
+# grapheme break between two such codepoints is always a break.
+#
+# GraphemeBreakProperty.txt is not part of our Unicode data; this is a
+# conservative approximation derived from the general category.
+#
+not_grapheme_base = set()
+not_grapheme_base.update(range(0x1100, 0x1200))    # Hangul Jamo (L, V, T)
+not_grapheme_base.update(range(0xa960, 0xa980))    # Hangul Jamo extended A
+not_grapheme_base.update(range(0xac00, 0xd7a4))    # Hangul syllables (LV, LVT)
+not_grapheme_base.update(range(0xd7b0, 0xd800))    # Hangul Jamo extended B
+not_grapheme_base.update(range(0x1f1e6, 0x1f200))  # Regional indicators
+not_grapheme_base.update([0x0e33, 0x0eb3])         # SpacingMark (Lo)
+not_grapheme_base.update([0xff9e, 0xff9f])         # Extend (Lm)
+not_grapheme_base.update([                         # Prepend (Lo)
+    0x0d4e, 0x111c2, 0x111c3, 0x1193f, 0x11941, 0x11a3a,
+    0x11a84, 0x11a85, 0x11a86, 0x11a87, 0x11a88, 0x11a89, 0x11d46,
+])
+
+
+def grapheme_base(cp, cat):
+    if cat is None or cat[0] in ('M', 'C', 'Z') and cat != 'Zs':
+        return False
+    if cp in not_grapheme_base:
+        return False
+    if cp in emoji or cp in extended_pictographic:
+        return False
+    return True
+
+
+def props_for(cp):
+    cat = category.get(cp)
+    return Props(
+        width=width(cp, cat),
+        combining_class=combining_class.get(cp, 0),
+        emoji=cp in emoji,
+        emoji_presentation=cp in emoji and cp in emoji_presentation,
+        emoji_modifier=cp in emoji and cp in emoji_modifier,
+        emoji_modifier_base=cp in emoji and cp in emoji_modifier_base,
+        emoji_component=cp in emoji and cp in emoji_component,
+        extended_pictographic=cp in extended_pictographic,
+        grapheme_base=grapheme_base(cp, cat))
+
+
+#
+# Two-stage table: the first stage maps a block of codepoints to a
+# (de-duplicated) block in the second stage, which maps codepoints to
+# indices into the list of unique property combinations.
+#
+unique_props = {Props(): 0}
+blocks = {}
+stage1 = []
+stage2 = []
+
+for block_start in range(0, MAX_CODEPOINT + 1, BLOCK_SIZE):
+    block = []
+    for cp in range(block_start, block_start + BLOCK_SIZE):
+        props = props_for(cp)
+        block.append(unique_props.setdefault(props, len(unique_props)))
+
+    block = tuple(block)
+    if block not in blocks:
+        blocks[block] = len(blocks)
+        stage2.extend(block)
+
+    stage1.append(blocks[block])
+
+assert len(unique_props) <= 256
+assert len(blocks) <= 65536
+
+
+def c_bool(b):
+    return 'true' if b else 'false'
+
+
+def write_props(out, props, with_emoji):
+    out.write('    {')
+    out.write(f'.width = {props.width}, ')
+    out.write(f'.combining_class = {props.combining_class}, ')
+    if with_emoji:
+        out.write(f'.emoji = {c_bool(props.emoji)}, ')
+        out.write(f'.emoji_presentation = {c_bool(props.emoji_presentation)}, ')
+        out.write(f'.emoji_modifier = {c_bool(props.emoji_modifier)}, ')
+        out.write(f'.emoji_modifier_base = {c_bool(props.emoji_modifier_base)}, ')
+        out.write(f'.emoji_component = {c_bool(props.emoji_component)}, ')
+        out.write(f'.extended_pictographic = {c_bool(props.extended_pictographic)}, ')
+    out.write(f'.grapheme_base = {c_bool(props.grapheme_base)}')
+    out.write('},\n')
+
+
+out = opts.output
+out.write('#pragma once\n')
+out.write('#include <stdint.h>\n')
+out.write('#include <stdbool.h>\n')
+out.write('\n')
+out.write('struct unicode_props {\n')
+out.write('    int8_t width;  /* Like wcwidth(), in a UTF-8 locale */\n')
+out.write('    uint8_t combining_class;  /* Canonical_Combining_Class */\n')
+out.write('    bool emoji:1;\n')
+out.write('    bool emoji_presentation:1;\n')
+out.write('    bool emoji_modifier:1;\n')
+out.write('    bool emoji_modifier_base:1;\n')
+out.write('    bool emoji_component:1;\n')
+out.write('    bool extended_pictographic:1;\n')
+out.write('\n')
+out.write('    /* Always a grapheme break between two grapheme_base codepoints */\n')
+out.write('    bool grapheme_base:1;\n')
+out.write('};\n')
+out.write('\n')
+
+# Emoji properties are only used with grapheme shaping
+out.write('#if defined(FCFT_HAVE_HARFBUZZ)\n')
+out.write(f'static const struct unicode_props unicode_props[{len(unique_props)}] = {{\n')
+for props in unique_props:
+    write_props(out, props, True)
+out.write('};\n')
+out.write('#else  /* !FCFT_HAVE_HARFBUZZ */\n')
+out.write(f'static const struct unicode_props unicode_props[{len(unique_props)}] = {{\n')
+for props in unique_props:
+    write_props(out, props, False)
+out.write('};\n')
+out.write('#endif  /* !FCFT_HAVE_HARFBUZZ */\n')
+out.write('\n')
+
+index_type = 'uint8_t' if len(blocks) <= 256 else 'uint16_t'
+out.write(f'static const {index_type} unicode_props_stage1[{len(stage1)}] = {{\n')
+for i in range(0, len(stage1), 16):
+    out.write('    ' + ' '.join(f'{x},' for x in stage1[i:i + 16]) + '\n')
+out.write('};\n')
+out.write('\n')
+
+out.write(f'static const uint8_t unicode_props_stage2[{len(stage2)}] = {{\n')
+for i in range(0, len(stage2), 16):
+    out.write('    ' + ' '.join(f'{x},' for x in stage2[i:i + 16]) + '\n')
+out.write('};\n')
+out.write('\n')
+
+out.write('static inline const struct unicode_props *\n')
+out.write('unicode_props_lookup(uint32_t cp)\n')
+out.write('{\n')
+out.write(f'    if (cp > 0x{MAX_CODEPOINT:x})\n')
+out.write('        return &unicode_props[0];\n')
+out.write('\n')
+out.write(f'    size_t block = unicode_props_stage1[cp >> {BLOCK_SHIFT}];\n')
+out.write(f'    return &unicode_props[unicode_props_stage2[(block << {BLOCK_SHIFT}) + (cp & {BLOCK_SIZE - 1})]];\n')
+out.write('}\n')
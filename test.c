@@ -1,6 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <getopt.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
 
 #include <check.h>
 #include <fcft/fcft.h>
@@ -57,6 +63,38 @@ START_TEST(test_from_name)
 }
 END_TEST
 
+START_TEST(test_font_cache)
+{
+    /* Same names and attributes: the cached font */
+    struct fcft_font *same = fcft_from_name(1, (const char *[]){"Serif"}, NULL);
+    ck_assert_ptr_eq(same, font);
+    fcft_destroy(same);
+
+    /* Same names, in a different order: a different font */
+    struct fcft_font *a = fcft_from_name(
+        2, (const char *[]){"Serif", "Sans"}, NULL);
+    struct fcft_font *b = fcft_from_name(
+        2, (const char *[]){"Sans", "Serif"}, NULL);
+    ck_assert_ptr_nonnull(a);
+    ck_assert_ptr_nonnull(b);
+    ck_assert_ptr_ne(a, b);
+
+    /* Same concatenated strings, split differently */
+    struct fcft_font *c = fcft_from_name(
+        1, (const char *[]){"Serif"}, ":size=12");
+    struct fcft_font *d = fcft_from_name(
+        1, (const char *[]){"Serif:size=12"}, NULL);
+    ck_assert_ptr_nonnull(c);
+    ck_assert_ptr_nonnull(d);
+    ck_assert_ptr_ne(c, d);
+
+    fcft_destroy(a);
+    fcft_destroy(b);
+    fcft_destroy(c);
+    fcft_destroy(d);
+}
+END_TEST
+
 START_TEST(test_glyph_rasterize)
 {
     const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(
@@ -71,6 +109,804 @@ START_TEST(test_glyph_rasterize)
 }
 END_TEST
 
+START_TEST(test_glyph_cached)
+{
+    const uint32_t cps[] = {U'A', U'é', U'€'};
+
+    for (size_t i = 0; i < ALEN(cps); i++) {
+        const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(
+            font, cps[i], FCFT_SUBPIXEL_NONE);
+        ck_assert_ptr_nonnull(glyph);
+        ck_assert_int_eq(glyph->cp, cps[i]);
+
+        /* Verify glyph was cached */
+        const struct fcft_glyph *glyph2 = fcft_rasterize_char_utf32(
+            font, cps[i], FCFT_SUBPIXEL_NONE);
+        ck_assert_ptr_eq(glyph, glyph2);
+
+        /* Different subpixel mode, different glyph */
+        const struct fcft_glyph *glyph3 = fcft_rasterize_char_utf32(
+            font, cps[i], FCFT_SUBPIXEL_HORIZONTAL_RGB);
+        ck_assert_ptr_nonnull(glyph3);
+        ck_assert_ptr_ne(glyph, glyph3);
+        ck_assert_int_eq(glyph3->cp, cps[i]);
+    }
+}
+END_TEST
+
+START_TEST(test_glyph_cached_font_recreated)
+{
+    /* Outside the directly indexed range; cached per thread */
+    const uint32_t cp = U'€';
+
+    struct fcft_font *large = fcft_from_name(
+        1, (const char *[]){"Serif:pixelsize=40"}, NULL);
+    ck_assert_ptr_nonnull(large);
+
+    const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(
+        large, cp, FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(glyph);
+    const int large_advance = glyph->advance.x;
+    fcft_destroy(large);
+
+    /*
+     * New fonts may well be allocated at the same address as the
+     * destroyed one, and must never hit its thread local cache
+     * entry. Font IDs are hashed into the cache index; create enough
+     * fonts for the index to wrap around.
+     */
+    int small_advance = -1;
+    for (size_t i = 0; i < 300; i++) {
+        struct fcft_font *small = fcft_from_name(
+            1, (const char *[]){"Serif:pixelsize=10"}, NULL);
+        ck_assert_ptr_nonnull(small);
+
+        glyph = fcft_rasterize_char_utf32(small, cp, FCFT_SUBPIXEL_NONE);
+        ck_assert_ptr_nonnull(glyph);
+        ck_assert_int_eq(glyph->cp, cp);
+        ck_assert_int_lt(glyph->advance.x, large_advance);
+
+        if (small_advance < 0)
+            small_advance = glyph->advance.x;
+        ck_assert_int_eq(glyph->advance.x, small_advance);
+
+        fcft_destroy(small);
+    }
+}
+END_TEST
+
+START_TEST(test_glyph_batch)
+{
+    const uint32_t cps[] = {U'A', U'é', U'€', U'A', U'x', U'é'};
+    const struct fcft_glyph *glyphs[ALEN(cps)];
+
+    /* Mix of cache hits, misses, and duplicates */
+    fcft_rasterize_char_utf32(font, U'x', FCFT_SUBPIXEL_NONE);
+    fcft_rasterize_chars_utf32(font, ALEN(cps), cps, FCFT_SUBPIXEL_NONE, glyphs);
+
+    for (size_t i = 0; i < ALEN(cps); i++) {
+        ck_assert_ptr_nonnull(glyphs[i]);
+        ck_assert_int_eq(glyphs[i]->cp, cps[i]);
+
+        /* Same, cached, glyphs as the single-codepoint variant */
+        ck_assert_ptr_eq(
+            glyphs[i],
+            fcft_rasterize_char_utf32(font, cps[i], FCFT_SUBPIXEL_NONE));
+    }
+
+    ck_assert_ptr_eq(glyphs[0], glyphs[3]);
+    ck_assert_ptr_eq(glyphs[1], glyphs[5]);
+}
+END_TEST
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+START_TEST(test_grapheme_batch)
+{
+    const uint32_t *const clusters[] = {
+        U"e\u0301", U"A", U"o\u0308\u0301", U"e\u0301", U"x",
+    };
+    size_t lens[ALEN(clusters)];
+    const struct fcft_grapheme *graphemes[ALEN(clusters)];
+
+    for (size_t i = 0; i < ALEN(clusters); i++) {
+        lens[i] = 0;
+        while (clusters[i][lens[i]] != U'\0')
+            lens[i]++;
+    }
+
+    /* Mix of cache hits, misses, and duplicates */
+    fcft_rasterize_grapheme_utf32(font, lens[4], clusters[4], FCFT_SUBPIXEL_NONE);
+    fcft_rasterize_graphemes_utf32(
+        font, ALEN(clusters), lens, clusters, FCFT_SUBPIXEL_NONE, graphemes);
+
+    for (size_t i = 0; i < ALEN(clusters); i++) {
+        ck_assert_ptr_nonnull(graphemes[i]);
+        ck_assert_int_gt(graphemes[i]->count, 0);
+
+        /* Same, cached, graphemes as the single-grapheme variant */
+        const struct fcft_grapheme *grapheme = fcft_rasterize_grapheme_utf32(
+            font, lens[i], clusters[i], FCFT_SUBPIXEL_NONE);
+        ck_assert_ptr_eq(graphemes[i], grapheme);
+    }
+
+    ck_assert_ptr_eq(graphemes[0], graphemes[3]);
+}
+END_TEST
+#endif
+
+START_TEST(test_kerning_run)
+{
+    const uint32_t text[] = U"AVATAR Wa, Tö. «ŁŻ»";
+    const size_t len = ALEN(text) - 1;
+    long x[len];
+
+    const bool supported = fcft_kerning_run(font, len, text, x);
+    ck_assert_int_eq(x[0], 0);
+
+    for (size_t i = 1; i < len; i++) {
+        /* Twice; the second lookup is cached */
+        for (int j = 0; j < 2; j++) {
+            long kern_x;
+            if (!fcft_kerning(font, text[i - 1], text[i], &kern_x, NULL))
+                kern_x = 0;
+
+            ck_assert_int_eq(x[i], kern_x);
+            if (!supported)
+                ck_assert_int_eq(kern_x, 0);
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_cache_budget)
+{
+    /* Room for a handful of glyphs only */
+    fcft_set_cache_budget(font, 4096);
+
+    for (int round = 0; round < 2; round++) {
+        for (uint32_t cp = U'!'; cp <= U'~'; cp++) {
+            const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(
+                font, cp, FCFT_SUBPIXEL_NONE);
+            ck_assert_ptr_nonnull(glyph);
+            ck_assert_ptr_nonnull(glyph->pix);
+            ck_assert_int_eq(glyph->cp, cp);
+            ck_assert_int_gt(glyph->advance.x, 0);
+
+            struct fcft_font_stats stats;
+            fcft_font_stats(font, &stats);
+            ck_assert_int_le(stats.cache_bytes, 4096);
+        }
+    }
+
+    struct fcft_font_stats stats;
+    fcft_font_stats(font, &stats);
+    ck_assert_int_gt(stats.glyph_cache.evictions, 0);
+    ck_assert_int_lt(stats.glyph_cache.count, U'~' - U'!' + 1);
+}
+END_TEST
+
+START_TEST(test_cache_budget_churn)
+{
+    const size_t budget = 16 * 1024;
+    fcft_set_cache_budget(font, budget);
+
+    /* Latin Extended-A/B; far more glyphs than fits in the budget */
+    const uint32_t first = 0x100;
+    const uint32_t last = 0x24f;
+
+    for (int round = 0; round < 4; round++) {
+        for (uint32_t cp = first; cp <= last; cp++) {
+            const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(
+                font, cp, FCFT_SUBPIXEL_NONE);
+            ck_assert_ptr_nonnull(glyph);
+            ck_assert_int_eq(glyph->cp, cp);
+
+            struct fcft_font_stats stats;
+            fcft_font_stats(font, &stats);
+            ck_assert_int_le(stats.cache_bytes, budget);
+        }
+    }
+
+    struct fcft_font_stats stats;
+    fcft_font_stats(font, &stats);
+    ck_assert_int_gt(stats.glyph_cache.evictions, 3 * (last - first + 1));
+    ck_assert_int_lt(stats.glyph_cache.count, last - first + 1);
+}
+END_TEST
+
+START_TEST(test_font_stats)
+{
+    const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(
+        font, U'A', FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(glyph);
+    glyph = fcft_rasterize_char_utf32(font, U'A', FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(glyph);
+
+    struct fcft_font_stats stats;
+    fcft_font_stats(font, &stats);
+
+    ck_assert_int_eq(stats.glyph_cache.misses, 1);
+    ck_assert_int_eq(stats.glyph_cache.hits, 1);
+    ck_assert_int_eq(stats.glyph_cache.count, 1);
+    ck_assert_int_ge(stats.glyph_cache.size, stats.glyph_cache.count);
+    ck_assert_int_eq(stats.glyph_cache.evictions, 0);
+    ck_assert_int_eq(stats.glyphs_rasterized, 1);
+
+    size_t bitmap_bytes =
+        stats.bitmap_bytes.a1 + stats.bitmap_bytes.a8 +
+        stats.bitmap_bytes.x8r8g8b8 + stats.bitmap_bytes.a8r8g8b8;
+    ck_assert_int_gt(bitmap_bytes, 0);
+    ck_assert_int_gt(stats.cache_bytes, bitmap_bytes);
+}
+END_TEST
+
+START_TEST(test_font_coverage)
+{
+    const uint32_t cps[] = {U'A', U'a', 0x10fffd};
+    struct fcft_coverage coverage[ALEN(cps)];
+
+    fcft_font_coverage(font, ALEN(cps), cps, coverage);
+
+    ck_assert_int_eq(coverage[0].font, 0);
+    ck_assert(!coverage[0].emoji);
+    ck_assert_int_eq(coverage[1].font, 0);
+    ck_assert_int_eq(coverage[2].font, -1);
+    ck_assert(!coverage[2].emoji);
+
+    /* Fonts are not instantiated, and nothing is rasterized */
+    struct fcft_font_stats stats;
+    fcft_font_stats(font, &stats);
+    ck_assert_int_eq(stats.fallbacks_instantiated, 0);
+    ck_assert_int_eq(stats.glyphs_rasterized, 0);
+
+    /* Cached results */
+    fcft_font_coverage(font, ALEN(cps), cps, coverage);
+    ck_assert_int_eq(coverage[0].font, 0);
+    ck_assert_int_eq(coverage[2].font, -1);
+}
+END_TEST
+
+START_TEST(test_lazy_fallbacks)
+{
+    for (uint32_t cp = U' '; cp <= U'~'; cp++) {
+        const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(
+            font, cp, FCFT_SUBPIXEL_NONE);
+        ck_assert_ptr_nonnull(glyph);
+    }
+
+    /* The primary font has all of ASCII; no fallbacks needed */
+    struct fcft_font_stats stats;
+    fcft_font_stats(font, &stats);
+    ck_assert_int_eq(stats.fallbacks_instantiated, 0);
+
+    /* Find a codepoint only available in a fallback font */
+    const uint32_t candidates[] = {
+        0x0100, 0x03b1, 0x0416, 0x05d0, 0x2500, 0x25cf, 0x3042, 0x4e00,
+    };
+    struct fcft_coverage coverage[ALEN(candidates)];
+    fcft_font_coverage(font, ALEN(candidates), candidates, coverage);
+
+    uint32_t cp = 0;
+    for (size_t i = 0; i < ALEN(candidates) && cp == 0; i++) {
+        if (coverage[i].font > 0)
+            cp = candidates[i];
+    }
+
+    if (cp == 0)
+        return;
+
+    const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(
+        font, cp, FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(glyph);
+    ck_assert_int_eq(glyph->cp, cp);
+
+    fcft_font_stats(font, &stats);
+    ck_assert_int_eq(stats.fallbacks_instantiated, 1);
+}
+END_TEST
+
+START_TEST(test_glyph_index_cache)
+{
+    const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(
+        font, U'A', FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(glyph);
+
+    struct fcft_font_stats stats;
+    fcft_font_stats(font, &stats);
+    ck_assert_int_eq(stats.glyph_index_cache.count, 1);
+    ck_assert_int_eq(stats.glyph_index_cache.misses, 1);
+    ck_assert_int_eq(stats.glyphs_rasterized, 1);
+
+#if defined(FCFT_HAVE_HARFBUZZ)
+    /* Graphemes should re-use the bitmap rasterized above */
+    const struct fcft_grapheme *grapheme = fcft_rasterize_grapheme_utf32(
+        font, 1, (const uint32_t []){U'A'}, FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(grapheme);
+    ck_assert_int_eq(grapheme->count, 1);
+    ck_assert_ptr_eq(grapheme->glyphs[0]->pix, glyph->pix);
+#endif
+
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+    /* As should text-runs */
+    struct fcft_text_run *run = fcft_rasterize_text_run_utf32(
+        font, 3, U"AAA", FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(run);
+    ck_assert_int_eq(run->count, 3);
+
+    for (size_t i = 0; i < run->count; i++)
+        ck_assert_ptr_eq(run->glyphs[i]->pix, glyph->pix);
+
+    fcft_text_run_destroy(run);
+#endif
+
+    fcft_font_stats(font, &stats);
+    ck_assert_int_eq(stats.glyph_index_cache.count, 1);
+    ck_assert_int_eq(stats.glyphs_rasterized, 1);
+}
+END_TEST
+
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+START_TEST(test_shaped_word_cache)
+{
+    /* Three words; “foo ”, “bar ” and “foo ” */
+    const uint32_t text[] = U"foo bar foo ";
+    const size_t len = ALEN(text) - 1;
+
+    struct fcft_text_run *run = fcft_rasterize_text_run_utf32(
+        font, len, text, FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(run);
+    ck_assert_int_eq(run->count, len);
+
+    for (size_t i = 0; i < run->count; i++) {
+        ck_assert_int_eq(run->cluster[i], i);
+        ck_assert_int_eq(run->glyphs[i]->cp, text[i]);
+    }
+
+    struct fcft_font_stats stats;
+    fcft_font_stats(font, &stats);
+    ck_assert_int_eq(stats.shaped_word_cache.count, 2);
+    ck_assert_int_eq(stats.shaped_word_cache.misses, 2);
+    ck_assert_int_eq(stats.shaped_word_cache.hits, 1);
+
+    /* Re-rasterizing the text-run should not shape anything */
+    struct fcft_text_run *run2 = fcft_rasterize_text_run_utf32(
+        font, len, text, FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(run2);
+    ck_assert_int_eq(run2->count, run->count);
+
+    for (size_t i = 0; i < run->count; i++) {
+        ck_assert_int_eq(run2->cluster[i], run->cluster[i]);
+        ck_assert_ptr_eq(run2->glyphs[i]->pix, run->glyphs[i]->pix);
+        ck_assert_int_eq(run2->glyphs[i]->advance.x, run->glyphs[i]->advance.x);
+    }
+
+    fcft_font_stats(font, &stats);
+    ck_assert_int_eq(stats.shaped_word_cache.count, 2);
+    ck_assert_int_eq(stats.shaped_word_cache.misses, 2);
+    ck_assert_int_eq(stats.shaped_word_cache.hits, 4);
+
+    fcft_text_run_destroy(run);
+    fcft_text_run_destroy(run2);
+}
+END_TEST
+
+START_TEST(test_text_run_reuse)
+{
+    const uint32_t text[] = U"foo bar foo ";
+    const size_t len = ALEN(text) - 1;
+
+    struct fcft_text_run *run = fcft_text_run_create();
+    ck_assert_ptr_nonnull(run);
+    ck_assert_int_eq(run->count, 0);
+
+    ck_assert(fcft_rasterize_text_run_utf32_into(
+                  font, len, text, FCFT_SUBPIXEL_NONE, run));
+    ck_assert_int_eq(run->count, len);
+
+    const struct fcft_glyph *glyphs[len];
+    memcpy(glyphs, run->glyphs, len * sizeof(glyphs[0]));
+
+    /* Glyph objects are re-used */
+    ck_assert(fcft_rasterize_text_run_utf8_into(
+                  font, strlen("foo bar foo "), "foo bar foo ",
+                  FCFT_SUBPIXEL_NONE, run));
+    ck_assert_int_eq(run->count, len);
+
+    for (size_t i = 0; i < run->count; i++) {
+        ck_assert_ptr_eq(run->glyphs[i], glyphs[i]);
+        ck_assert_int_eq(run->glyphs[i]->cp, text[i]);
+        ck_assert_int_eq(run->cluster[i], i);
+    }
+
+    /* Re-rasterizing cached text doesn’t allocate */
+    struct fcft_font_stats before;
+    fcft_font_stats(font, &before);
+    ck_assert_int_gt(before.scratch_bytes, 0);
+
+    for (int i = 0; i < 3; i++) {
+        ck_assert(fcft_rasterize_text_run_utf32_into(
+                      font, len, text, FCFT_SUBPIXEL_NONE, run));
+        ck_assert_int_eq(run->count, len);
+        ck_assert_ptr_eq(run->glyphs[0], glyphs[0]);
+    }
+
+    struct fcft_font_stats after;
+    fcft_font_stats(font, &after);
+    ck_assert_int_eq(after.scratch_bytes, before.scratch_bytes);
+    ck_assert_int_eq(after.shaped_word_cache.misses,
+                     before.shaped_word_cache.misses);
+    ck_assert_int_eq(after.glyphs_rasterized, before.glyphs_rasterized);
+
+    /* A run from fcft_rasterize_text_run_utf32() can also be re-used */
+    struct fcft_text_run *run2 = fcft_rasterize_text_run_utf32(
+        font, len, text, FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(run2);
+    ck_assert(fcft_rasterize_text_run_utf32_into(
+                  font, 3, text, FCFT_SUBPIXEL_NONE, run2));
+    ck_assert_int_eq(run2->count, 3);
+
+    fcft_text_run_destroy(run);
+    fcft_text_run_destroy(run2);
+}
+END_TEST
+
+START_TEST(test_text_run_utf8)
+{
+    /* Multi-byte characters, on both sides of a SIMD-sized ASCII run */
+    const char text8[] = "héllo wörld, abcdefghijklmnopqrstuvwxyz €uro";
+    const uint32_t text32[] = U"héllo wörld, abcdefghijklmnopqrstuvwxyz €uro";
+
+    struct fcft_text_run *run8 = fcft_rasterize_text_run_utf8(
+        font, strlen(text8), text8, FCFT_SUBPIXEL_NONE);
+    struct fcft_text_run *run32 = fcft_rasterize_text_run_utf32(
+        font, ALEN(text32) - 1, text32, FCFT_SUBPIXEL_NONE);
+
+    ck_assert_ptr_nonnull(run8);
+    ck_assert_ptr_nonnull(run32);
+    ck_assert_int_eq(run8->count, run32->count);
+
+    /* Same glyphs, but clusters are byte offsets */
+    size_t byte_ofs = 0;
+    for (size_t i = 0, cp_ofs = 0; i < run8->count; i++) {
+        ck_assert_int_eq(run8->glyphs[i]->cp, run32->glyphs[i]->cp);
+        ck_assert_ptr_eq(run8->glyphs[i]->pix, run32->glyphs[i]->pix);
+
+        for (; cp_ofs < run32->cluster[i]; cp_ofs++) {
+            const uint32_t cp = text32[cp_ofs];
+            byte_ofs += cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+        }
+
+        ck_assert_int_eq(run8->cluster[i], byte_ofs);
+    }
+
+    fcft_text_run_destroy(run8);
+    fcft_text_run_destroy(run32);
+}
+END_TEST
+
+START_TEST(test_text_run_long)
+{
+    /*
+     * 50 different words, each repeated 8 times, mixing scripts (and
+     * thus, possibly, fonts). Long enough to be shaped in parallel.
+     */
+    const uint32_t special[] = {U'x', U'α', U'日', U'😀'};
+    const size_t word_count = 400;
+    const size_t word_len = 4;
+    const size_t len = word_count * word_len;
+
+    uint32_t text[len];
+    for (size_t i = 0; i < word_count; i++) {
+        const size_t j = i % 50;
+        uint32_t *word = &text[i * word_len];
+
+        word[0] = U'a' + j % 26;
+        word[1] = U'a' + j / 26;
+        word[2] = special[j % ALEN(special)];
+        word[3] = U' ';
+    }
+
+    struct fcft_text_run *run = fcft_rasterize_text_run_utf32(
+        font, len, text, FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(run);
+
+    /* Each word is only shaped once */
+    struct fcft_font_stats stats;
+    fcft_font_stats(font, &stats);
+    ck_assert_int_eq(stats.shaped_word_cache.misses, 50);
+    ck_assert_int_eq(stats.shaped_word_cache.hits, word_count - 50);
+
+    /* Same result as when shaping the words one by one */
+    size_t idx = 0;
+    for (size_t i = 0; i < word_count; i++) {
+        struct fcft_text_run *word = fcft_rasterize_text_run_utf32(
+            font, word_len, &text[i * word_len], FCFT_SUBPIXEL_NONE);
+        ck_assert_ptr_nonnull(word);
+
+        for (size_t j = 0; j < word->count; j++, idx++) {
+            ck_assert_int_lt(idx, run->count);
+            ck_assert_int_eq(run->cluster[idx], i * word_len + word->cluster[j]);
+            ck_assert_int_eq(run->glyphs[idx]->cp, word->glyphs[j]->cp);
+            ck_assert_ptr_eq(run->glyphs[idx]->pix, word->glyphs[j]->pix);
+            ck_assert_int_eq(run->glyphs[idx]->advance.x, word->glyphs[j]->advance.x);
+        }
+
+        fcft_text_run_destroy(word);
+    }
+
+    ck_assert_int_eq(idx, run->count);
+    fcft_text_run_destroy(run);
+}
+END_TEST
+
+/* Verifies a shaped run has the same glyphs as a rasterized text-run */
+static void
+check_shaped_run(size_t len, const uint32_t text[static len],
+                 const struct fcft_shaped_run *shaped)
+{
+    struct fcft_text_run *run = fcft_rasterize_text_run_utf32(
+        font, len, text, FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(run);
+    ck_assert_int_eq(run->count, shaped->count);
+
+    for (size_t i = 0; i < shaped->count; i++) {
+        const struct fcft_shaped_glyph *sg = &shaped->glyphs[i];
+        ck_assert_int_eq(sg->cluster, run->cluster[i]);
+        ck_assert_int_eq(sg->advance.x, run->glyphs[i]->advance.x);
+
+        const struct fcft_glyph *glyph = fcft_rasterize_glyph_index(
+            font, sg->face, sg->index, FCFT_SUBPIXEL_NONE);
+        ck_assert_ptr_nonnull(glyph);
+        ck_assert_ptr_eq(glyph->pix, run->glyphs[i]->pix);
+        ck_assert_int_eq(glyph->x + sg->x_offset, run->glyphs[i]->x);
+        ck_assert_int_eq(glyph->y + sg->y_offset, run->glyphs[i]->y);
+    }
+
+    fcft_text_run_destroy(run);
+}
+
+START_TEST(test_shape_text_run)
+{
+    const uint32_t text[] = U"foo bar foo ";
+    const size_t len = ALEN(text) - 1;
+
+    struct fcft_shaped_run *shaped = fcft_shape_text_run_utf32(font, len, text);
+    ck_assert_ptr_nonnull(shaped);
+    ck_assert_int_eq(shaped->count, len);
+
+    /* Shaping alone doesn’t rasterize anything */
+    struct fcft_font_stats stats;
+    fcft_font_stats(font, &stats);
+    ck_assert_int_eq(stats.glyphs_rasterized, 0);
+    ck_assert_int_eq(stats.shaped_word_cache.count, 2);
+
+    check_shaped_run(len, text, shaped);
+    fcft_shaped_run_destroy(shaped);
+
+    /* Combining marks are positioned with (fractional) offsets */
+    const uint32_t marks[] = U"q\u0301 j\u0308\u0301 g\u0323\u0302 x\u0327\u0306";
+    const size_t marks_len = ALEN(marks) - 1;
+
+    shaped = fcft_shape_text_run_utf32(font, marks_len, marks);
+    ck_assert_ptr_nonnull(shaped);
+    check_shaped_run(marks_len, marks, shaped);
+    fcft_shaped_run_destroy(shaped);
+}
+END_TEST
+#endif
+
+static void
+font_request_done(struct fcft_font_request *request, void *data)
+{
+    atomic_bool *called = data;
+    atomic_store(called, true);
+}
+
+START_TEST(test_from_name_async)
+{
+    atomic_bool called = false;
+
+    struct fcft_font_request *req = fcft_from_name_async(
+        1, (const char *[]){"Sans:size=17"}, NULL, &font_request_done, &called);
+    ck_assert_ptr_nonnull(req);
+
+    struct pollfd fds[] = {{.fd = fcft_font_request_fd(req), .events = POLLIN}};
+    ck_assert_int_eq(poll(fds, 1, 30000), 1);
+    ck_assert(fds[0].revents & POLLIN);
+
+    struct fcft_font *async_font = fcft_font_request_finish(req);
+    ck_assert_ptr_nonnull(async_font);
+    ck_assert_int_gt(async_font->height, 0);
+
+    /* Same font, from the font cache */
+    struct fcft_font *sync_font = fcft_from_name(
+        1, (const char *[]){"Sans:size=17"}, NULL);
+    ck_assert_ptr_eq(sync_font, async_font);
+
+    fcft_destroy(sync_font);
+    fcft_destroy(async_font);
+
+    /* Without waiting for completion */
+    req = fcft_from_name_async(1, (const char *[]){"Serif"}, NULL, NULL, NULL);
+    ck_assert_ptr_nonnull(req);
+    async_font = fcft_font_request_finish(req);
+    ck_assert_ptr_eq(async_font, font);
+    fcft_destroy(async_font);
+
+    /* The callback is called after the request has completed */
+    for (int i = 0; i < 3000 && !atomic_load(&called); i++)
+        thrd_sleep(&(struct timespec){.tv_nsec = 10 * 1000 * 1000}, NULL);
+    ck_assert(atomic_load(&called));
+}
+END_TEST
+
+START_TEST(test_disk_cache)
+{
+    /* Fonts must not be instantiated when enabling the disk cache */
+    fcft_destroy(font);
+    font = NULL;
+
+    char cache_dir[] = "/tmp/fcft-test-XXXXXX";
+    ck_assert_ptr_nonnull(mkdtemp(cache_dir));
+    setenv("XDG_CACHE_HOME", cache_dir, 1);
+
+    ck_assert(fcft_set_disk_cache(true));
+
+    struct fcft_font *font1 = fcft_from_name(1, (const char *[]){"Serif"}, NULL);
+    ck_assert_ptr_nonnull(font1);
+    ck_assert(!fcft_set_disk_cache(false));
+
+    const struct fcft_glyph *glyph1 = fcft_rasterize_char_utf32(
+        font1, U'A', FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(glyph1);
+
+    const struct fcft_glyph expected = *glyph1;
+    const pixman_format_code_t format = pixman_image_get_format(glyph1->pix);
+    const int stride = pixman_image_get_stride(glyph1->pix);
+    const size_t size = (size_t)stride * glyph1->height;
+    void *expected_data = malloc(size);
+    ck_assert_ptr_nonnull(expected_data);
+    memcpy(expected_data, pixman_image_get_data(glyph1->pix), size);
+
+    const int height = font1->height;
+    char *name = font1->name != NULL ? strdup(font1->name) : NULL;
+
+    /* Writes the glyph cache file */
+    fcft_destroy(font1);
+
+    /* Font set, and glyphs, loaded from the disk cache */
+    struct fcft_font *font2 = fcft_from_name(1, (const char *[]){"Serif"}, NULL);
+    ck_assert_ptr_nonnull(font2);
+    ck_assert_int_eq(font2->height, height);
+    if (name != NULL)
+        ck_assert_str_eq(font2->name, name);
+    free(name);
+
+    const struct fcft_glyph *glyph2 = fcft_rasterize_char_utf32(
+        font2, U'A', FCFT_SUBPIXEL_NONE);
+    ck_assert_ptr_nonnull(glyph2);
+
+    struct fcft_font_stats stats;
+    fcft_font_stats(font2, &stats);
+    ck_assert_int_eq(stats.glyphs_rasterized, 0);
+    ck_assert_int_eq(stats.glyphs_loaded, 1);
+
+    ck_assert_int_eq(glyph2->x, expected.x);
+    ck_assert_int_eq(glyph2->y, expected.y);
+    ck_assert_int_eq(glyph2->width, expected.width);
+    ck_assert_int_eq(glyph2->height, expected.height);
+    ck_assert_int_eq(glyph2->advance.x, expected.advance.x);
+    ck_assert_int_eq(glyph2->advance.y, expected.advance.y);
+    ck_assert_int_eq(pixman_image_get_format(glyph2->pix), format);
+    ck_assert_int_eq(pixman_image_get_stride(glyph2->pix), stride);
+    ck_assert_int_eq(
+        memcmp(pixman_image_get_data(glyph2->pix), expected_data, size), 0);
+
+    /* Not in the cache file; rasterized as usual */
+    ck_assert_ptr_nonnull(
+        fcft_rasterize_char_utf32(font2, U'B', FCFT_SUBPIXEL_NONE));
+    fcft_font_stats(font2, &stats);
+    ck_assert_int_eq(stats.glyphs_rasterized, 1);
+
+    fcft_destroy(font2);
+    free(expected_data);
+
+    /* Clean up */
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/fcft", cache_dir);
+
+    DIR *dir = opendir(path);
+    ck_assert_ptr_nonnull(dir);
+
+    size_t file_count = 0;
+    for (struct dirent *e = readdir(dir); e != NULL; e = readdir(dir)) {
+        if (e->d_name[0] == '.')
+            continue;
+
+        ck_assert_int_eq(unlinkat(dirfd(dir), e->d_name, 0), 0);
+        file_count++;
+    }
+    closedir(dir);
+
+    ck_assert_int_ge(file_count, 2);  /* Glyphs, and the font set */
+    ck_assert_int_eq(rmdir(path), 0);
+    ck_assert_int_eq(rmdir(cache_dir), 0);
+}
+END_TEST
+
+START_TEST(test_prerasterize)
+{
+    const struct fcft_codepoint_range ranges[] = {
+        {U' ', U'~'},
+        {U'€', U'€'},
+        {U'\U00002500', U'\U0000257f'},  /* Box drawing */
+    };
+
+    ck_assert(fcft_prerasterize(
+                  font, ALEN(ranges), ranges, FCFT_SUBPIXEL_NONE));
+
+    struct fcft_font_stats stats;
+    fcft_font_stats(font, &stats);
+
+    const size_t count = (U'~' - U' ' + 1) + 1 + 0x80;
+    ck_assert_int_eq(stats.glyph_cache.count, count);
+    ck_assert_int_eq(stats.glyph_cache.misses, count);
+
+    /* Everything should now be cached */
+    for (size_t i = 0; i < ALEN(ranges); i++) {
+        for (uint32_t cp = ranges[i].first; cp <= ranges[i].last; cp++)
+            fcft_rasterize_char_utf32(font, cp, FCFT_SUBPIXEL_NONE);
+    }
+
+    fcft_font_stats(font, &stats);
+    ck_assert_int_eq(stats.glyph_cache.misses, count);
+}
+END_TEST
+
+#define CONCURRENT_FIRST_CP U'\U00000100'
+#define CONCURRENT_COUNT 0x180
+
+static int
+rasterize_concurrent_thread(void *data)
+{
+    const struct fcft_glyph **glyphs = data;
+
+    for (size_t i = 0; i < CONCURRENT_COUNT; i++) {
+        glyphs[i] = fcft_rasterize_char_utf32(
+            font, CONCURRENT_FIRST_CP + i, FCFT_SUBPIXEL_NONE);
+    }
+
+    return 0;
+}
+
+START_TEST(test_rasterize_concurrent)
+{
+    static const struct fcft_glyph *glyphs[4][CONCURRENT_COUNT];
+    thrd_t threads[ALEN(glyphs)];
+
+    for (size_t i = 0; i < ALEN(threads); i++) {
+        ck_assert_int_eq(
+            thrd_create(&threads[i], &rasterize_concurrent_thread, glyphs[i]),
+            thrd_success);
+    }
+
+    for (size_t i = 0; i < ALEN(threads); i++)
+        thrd_join(threads[i], NULL);
+
+    /* All threads should have gotten the same glyphs... */
+    for (size_t i = 1; i < ALEN(glyphs); i++) {
+        for (size_t j = 0; j < CONCURRENT_COUNT; j++)
+            ck_assert_ptr_eq(glyphs[i][j], glyphs[0][j]);
+    }
+
+    /* ...and each one should have been rasterized exactly once */
+    struct fcft_font_stats stats;
+    fcft_font_stats(font, &stats);
+    ck_assert_int_eq(stats.glyph_cache.misses, CONCURRENT_COUNT);
+    ck_assert_int_eq(stats.glyph_cache.count, CONCURRENT_COUNT);
+}
+END_TEST
+
 START_TEST(test_precompose)
 {
     uint32_t ret = fcft_precompose(font, U'a', U'\U00000301', NULL, NULL, NULL);
@@ -83,6 +919,49 @@ START_TEST(test_precompose)
 
     ret = fcft_precompose(font, U'X', U'Y', NULL, NULL, NULL);
     ck_assert_int_eq(ret, (uint32_t)-1);
+
+    /* Composition exclusions are composed by fcft_precompose() */
+    ret = fcft_precompose(font, 0x0915, 0x093c, NULL, NULL, NULL);
+    ck_assert_int_eq(ret, 0x0958);
+}
+END_TEST
+
+START_TEST(test_precompose_run)
+{
+    const uint32_t text[] = {
+        U'a', 0x0301,          /* á */
+        U'e', 0x0323, 0x0302,  /* ẹ + circumflex -> ệ */
+        U'a', 0x0316, 0x0301,  /* Not blocked by the grave accent below */
+        U'X', U'Y',
+        0x0915, 0x093c,        /* Composition exclusion (U+0958) */
+        0x05e9, 0x05c1,        /* Composition exclusion (U+FB2A) */
+        0x1112, 0x1161, 0x11ab,  /* Hangul LVT: 한 */
+        0x1100, 0x1161,        /* Hangul LV: 가 */
+    };
+    const uint32_t expected[] = {
+        0xe1, 0x1ec7, 0xe1, 0x0316, U'X', U'Y',
+        0x0915, 0x093c, 0x05e9, 0x05c1, 0xd55c, 0xac00,
+    };
+
+    uint32_t composed[ALEN(text)];
+    bool is_from_primary[ALEN(text)];
+
+    size_t count = fcft_precompose_run(
+        font, ALEN(text), text, composed, is_from_primary);
+
+    ck_assert_int_eq(count, ALEN(expected));
+    for (size_t i = 0; i < count; i++)
+        ck_assert_int_eq(composed[i], expected[i]);
+
+    ck_assert(is_from_primary[4]);
+    ck_assert(is_from_primary[5]);
+
+    /* In-place */
+    uint32_t buf[] = {U'a', 0x0301, U'b'};
+    count = fcft_precompose_run(font, ALEN(buf), buf, buf, NULL);
+    ck_assert_int_eq(count, 2);
+    ck_assert_int_eq(buf[0], 0xe1);
+    ck_assert_int_eq(buf[1], U'b');
 }
 END_TEST
 
@@ -131,6 +1010,12 @@ START_TEST(test_emoji_zwj)
     const struct fcft_grapheme *grapheme2 = fcft_rasterize_grapheme_utf32(
         emoji_font, ALEN(emoji) - 1, emoji, FCFT_SUBPIXEL_DEFAULT);
     ck_assert_ptr_eq(grapheme, grapheme2);
+
+    /* UTF-8 variant should hit the same cache entry */
+    const char emoji8[] = "🤚🏿";
+    const struct fcft_grapheme *grapheme3 = fcft_rasterize_grapheme_utf8(
+        emoji_font, strlen(emoji8), emoji8, FCFT_SUBPIXEL_DEFAULT);
+    ck_assert_ptr_eq(grapheme, grapheme3);
 }
 END_TEST
 #endif
@@ -148,8 +1033,34 @@ fcft_suite(bool run_text_shaping_tests)
 
     tcase_add_test(core, test_capabilities);
     tcase_add_test(core, test_from_name);
+    tcase_add_test(core, test_font_cache);
     tcase_add_test(core, test_glyph_rasterize);
+    tcase_add_test(core, test_glyph_cached);
+    tcase_add_test(core, test_glyph_cached_font_recreated);
+    tcase_add_test(core, test_glyph_batch);
+#if defined(FCFT_HAVE_HARFBUZZ)
+    tcase_add_test(core, test_grapheme_batch);
+#endif
+    tcase_add_test(core, test_kerning_run);
+    tcase_add_test(core, test_cache_budget);
+    tcase_add_test(core, test_cache_budget_churn);
+    tcase_add_test(core, test_font_stats);
+    tcase_add_test(core, test_font_coverage);
+    tcase_add_test(core, test_lazy_fallbacks);
+    tcase_add_test(core, test_glyph_index_cache);
+#if defined(FCFT_HAVE_HARFBUZZ) && defined(FCFT_HAVE_UTF8PROC)
+    tcase_add_test(core, test_shaped_word_cache);
+    tcase_add_test(core, test_text_run_utf8);
+    tcase_add_test(core, test_text_run_reuse);
+    tcase_add_test(core, test_text_run_long);
+    tcase_add_test(core, test_shape_text_run);
+#endif
+    tcase_add_test(core, test_from_name_async);
+    tcase_add_test(core, test_disk_cache);
+    tcase_add_test(core, test_prerasterize);
+    tcase_add_test(core, test_rasterize_concurrent);
     tcase_add_test(core, test_precompose);
+    tcase_add_test(core, test_precompose_run);
     tcase_add_test(core, test_set_scaling_filter);
     suite_add_tcase(suite, core);
 
@@ -0,0 +1,246 @@
+#include "thread-pool.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <threads.h>
+
+#include <tllist.h>
+
+#define LOG_MODULE "fcft/thread-pool"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+#define min(x, y) ((x) < (y) ? (x) : (y))
+
+struct task {
+    void (*fn)(void *data);
+    void *data;
+};
+
+struct thread_pool {
+    mtx_t lock;
+    cnd_t cond;
+    tll(struct task) queue;
+    bool stop;
+
+    size_t thread_count;
+    thrd_t threads[];
+};
+
+/*
+ * Shared by all participants of a thread_pool_for() call.
+ *
+ * Reference counted, since worker tasks may start *after*
+ * thread_pool_for() has returned (when the calling thread, or other
+ * workers, have already processed all items). Such tasks find
+ * nothing to do, and just drop their reference.
+ */
+struct parallel_for {
+    void (*fn)(void *data, size_t idx);
+    void *data;
+    size_t count;
+
+    _Atomic size_t next;     /* Next item to claim */
+    _Atomic size_t pending;  /* Items not yet completed */
+    _Atomic size_t ref_counter;
+
+    mtx_t lock;
+    cnd_t done;
+};
+
+static int
+worker_thread(void *_pool)
+{
+    struct thread_pool *pool = _pool;
+
+    mtx_lock(&pool->lock);
+
+    while (true) {
+        while (tll_length(pool->queue) == 0 && !pool->stop)
+            cnd_wait(&pool->cond, &pool->lock);
+
+        if (tll_length(pool->queue) == 0) {
+            assert(pool->stop);
+            break;
+        }
+
+        struct task task = tll_pop_front(pool->queue);
+
+        mtx_unlock(&pool->lock);
+        task.fn(task.data);
+        mtx_lock(&pool->lock);
+    }
+
+    mtx_unlock(&pool->lock);
+    return 0;
+}
+
+struct thread_pool *
+thread_pool_create(size_t thread_count)
+{
+    struct thread_pool *pool = calloc(
+        1, sizeof(*pool) + thread_count * sizeof(pool->threads[0]));
+
+    if (pool == NULL)
+        return NULL;
+
+    if (mtx_init(&pool->lock, mtx_plain) != thrd_success) {
+        LOG_ERR("failed to instantiate mutex");
+        free(pool);
+        return NULL;
+    }
+
+    if (cnd_init(&pool->cond) != thrd_success) {
+        LOG_ERR("failed to instantiate condition variable");
+        mtx_destroy(&pool->lock);
+        free(pool);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < thread_count; i++) {
+        if (thrd_create(&pool->threads[i], &worker_thread, pool) != thrd_success) {
+            LOG_ERR("failed to create worker thread");
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+
+        pool->thread_count++;
+    }
+
+    LOG_DBG("created thread pool with %zu threads", thread_count);
+    return pool;
+}
+
+void
+thread_pool_destroy(struct thread_pool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    mtx_lock(&pool->lock);
+    pool->stop = true;
+    cnd_broadcast(&pool->cond);
+    mtx_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->thread_count; i++)
+        thrd_join(pool->threads[i], NULL);
+
+    assert(tll_length(pool->queue) == 0);
+
+    cnd_destroy(&pool->cond);
+    mtx_destroy(&pool->lock);
+    free(pool);
+}
+
+size_t
+thread_pool_thread_count(const struct thread_pool *pool)
+{
+    return pool != NULL ? pool->thread_count : 0;
+}
+
+bool
+thread_pool_submit(struct thread_pool *pool, void (*fn)(void *data), void *data)
+{
+    mtx_lock(&pool->lock);
+
+    if (pool->stop || pool->thread_count == 0) {
+        mtx_unlock(&pool->lock);
+        return false;
+    }
+
+    tll_push_back(pool->queue, ((struct task){.fn = fn, .data = data}));
+    cnd_signal(&pool->cond);
+    mtx_unlock(&pool->lock);
+    return true;
+}
+
+static void
+parallel_for_unref(struct parallel_for *pf)
+{
+    if (atomic_fetch_sub_explicit(&pf->ref_counter, 1, memory_order_acq_rel) > 1)
+        return;
+
+    cnd_destroy(&pf->done);
+    mtx_destroy(&pf->lock);
+    free(pf);
+}
+
+static void
+parallel_for_run(struct parallel_for *pf)
+{
+    size_t idx;
+    while ((idx = atomic_fetch_add_explicit(
+                &pf->next, 1, memory_order_relaxed)) < pf->count)
+    {
+        pf->fn(pf->data, idx);
+
+        if (atomic_fetch_sub_explicit(&pf->pending, 1, memory_order_acq_rel) == 1) {
+            mtx_lock(&pf->lock);
+            cnd_signal(&pf->done);
+            mtx_unlock(&pf->lock);
+        }
+    }
+}
+
+static void
+parallel_for_task(void *_pf)
+{
+    struct parallel_for *pf = _pf;
+    parallel_for_run(pf);
+    parallel_for_unref(pf);
+}
+
+bool
+thread_pool_for(struct thread_pool *pool, size_t count,
+                void (*fn)(void *data, size_t idx), void *data)
+{
+    if (count == 0)
+        return true;
+
+    const size_t helpers = min(thread_pool_thread_count(pool), count - 1);
+
+    if (helpers == 0) {
+        for (size_t i = 0; i < count; i++)
+            fn(data, i);
+        return true;
+    }
+
+    struct parallel_for *pf = malloc(sizeof(*pf));
+    if (pf == NULL)
+        return false;
+
+    if (mtx_init(&pf->lock, mtx_plain) != thrd_success) {
+        free(pf);
+        return false;
+    }
+
+    if (cnd_init(&pf->done) != thrd_success) {
+        mtx_destroy(&pf->lock);
+        free(pf);
+        return false;
+    }
+
+    pf->fn = fn;
+    pf->data = data;
+    pf->count = count;
+    atomic_init(&pf->next, 0);
+    atomic_init(&pf->pending, count);
+    atomic_init(&pf->ref_counter, 1 + helpers);
+
+    for (size_t i = 0; i < helpers; i++) {
+        if (!thread_pool_submit(pool, &parallel_for_task, pf))
+            parallel_for_unref(pf);
+    }
+
+    /* Participate; this also guarantees progress if all workers are busy */
+    parallel_for_run(pf);
+
+    mtx_lock(&pf->lock);
+    while (atomic_load_explicit(&pf->pending, memory_order_acquire) > 0)
+        cnd_wait(&pf->done, &pf->lock);
+    mtx_unlock(&pf->lock);
+
+    parallel_for_unref(pf);
+    return true;
+}
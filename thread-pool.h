@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct thread_pool;
+
+/* A pool with zero threads is valid; thread_pool_for() then runs
+ * everything in the calling thread */
+struct thread_pool *thread_pool_create(size_t thread_count);
+
+/* Runs all queued tasks, then joins the worker threads */
+void thread_pool_destroy(struct thread_pool *pool);
+
+size_t thread_pool_thread_count(const struct thread_pool *pool);
+
+/* Queues ‘fn(data)’ to be run by one of the worker threads */
+bool thread_pool_submit(
+    struct thread_pool *pool, void (*fn)(void *data), void *data);
+
+/*
+ * Runs ‘fn(data, idx)’, for all ‘idx’ in [0, count), in parallel, in
+ * the worker threads *and* the calling thread. Returns when all calls
+ * have completed.
+ *
+ * Since the calling thread participates, this is safe to call from a
+ * worker thread, and completes even if all worker threads are busy.
+ */
+bool thread_pool_for(
+    struct thread_pool *pool, size_t count,
+    void (*fn)(void *data, size_t idx), void *data);
@@ -0,0 +1,153 @@
+#include "utf8.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+ #include <emmintrin.h>
+#endif
+
+/*
+ * Widens a run of ASCII bytes, starting at src[*i]. Stops at the
+ * first chunk containing a non-ASCII byte, leaving the remainder to
+ * the scalar decoder.
+ */
+static size_t
+decode_ascii(size_t len, const uint8_t *src, size_t *i,
+             uint32_t *dst, uint32_t *offsets)
+{
+    size_t n = 0;
+    size_t pos = *i;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+
+    while (pos + 16 <= len) {
+        const __m128i bytes = _mm_loadu_si128((const __m128i *)&src[pos]);
+        if (_mm_movemask_epi8(bytes) != 0)
+            break;
+
+        const __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+        const __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+
+        _mm_storeu_si128((__m128i *)&dst[n + 0], _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)&dst[n + 4], _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)&dst[n + 8], _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i *)&dst[n + 12], _mm_unpackhi_epi16(hi, zero));
+
+        if (offsets != NULL) {
+            for (size_t j = 0; j < 16; j++)
+                offsets[n + j] = pos + j;
+        }
+
+        pos += 16;
+        n += 16;
+    }
+#endif
+
+    while (pos + 8 <= len) {
+        uint64_t word;
+        memcpy(&word, &src[pos], sizeof(word));
+        if ((word & 0x8080808080808080ull) != 0)
+            break;
+
+        for (size_t j = 0; j < 8; j++) {
+            dst[n + j] = src[pos + j];
+            if (offsets != NULL)
+                offsets[n + j] = pos + j;
+        }
+
+        pos += 8;
+        n += 8;
+    }
+
+    *i = pos;
+    return n;
+}
+
+static inline bool
+is_continuation(uint8_t b)
+{
+    return (b & 0xc0) == 0x80;
+}
+
+/*
+ * Decodes a single, non-ASCII, sequence starting at src[*i], and
+ * advances *i past it (or past its maximal subpart, if ill-formed)
+ */
+static uint32_t
+decode_one(size_t len, const uint8_t *src, size_t *i)
+{
+    const uint8_t b0 = src[*i];
+    size_t count;
+    uint32_t cp;
+    uint8_t lo = 0x80, hi = 0xbf;  /* Valid range of the second byte */
+
+    if (b0 >= 0xc2 && b0 <= 0xdf) {
+        count = 2;
+        cp = b0 & 0x1f;
+    } else if (b0 >= 0xe0 && b0 <= 0xef) {
+        count = 3;
+        cp = b0 & 0x0f;
+        if (b0 == 0xe0)
+            lo = 0xa0;  /* Overlong */
+        else if (b0 == 0xed)
+            hi = 0x9f;  /* Surrogates */
+    } else if (b0 >= 0xf0 && b0 <= 0xf4) {
+        count = 4;
+        cp = b0 & 0x07;
+        if (b0 == 0xf0)
+            lo = 0x90;  /* Overlong */
+        else if (b0 == 0xf4)
+            hi = 0x8f;  /* Above U+10FFFF */
+    } else {
+        /* Stray continuation byte, or invalid lead byte */
+        (*i)++;
+        return 0xfffd;
+    }
+
+    size_t j = 1;
+    for (; j < count && *i + j < len; j++) {
+        const uint8_t b = src[*i + j];
+
+        if (j == 1 ? (b < lo || b > hi) : !is_continuation(b))
+            break;
+
+        cp = cp << 6 | (b & 0x3f);
+    }
+
+    *i += j;
+    return j == count ? cp : 0xfffd;
+}
+
+size_t
+utf8_decode(size_t len, const char _src[static len],
+            uint32_t dst[static len], uint32_t *offsets)
+{
+    const uint8_t *src = (const uint8_t *)_src;
+    size_t n = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        if (src[i] < 0x80) {
+            n += decode_ascii(
+                len, src, &i, &dst[n], offsets != NULL ? &offsets[n] : NULL);
+
+            /* Tail, or a chunk with non-ASCII in it */
+            const size_t chunk_end = len - i < 16 ? len : i + 16;
+            while (i < chunk_end && src[i] < 0x80) {
+                if (offsets != NULL)
+                    offsets[n] = i;
+                dst[n++] = src[i++];
+            }
+
+            continue;
+        }
+
+        if (offsets != NULL)
+            offsets[n] = i;
+        dst[n++] = decode_one(len, src, &i);
+    }
+
+    return n;
+}
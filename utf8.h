@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Decodes ‘len’ bytes of UTF-8 into ‘dst’, which must have room for
+ * (at least) ‘len’ codepoints. Returns the number of codepoints
+ * written.
+ *
+ * If ‘offsets’ is non-NULL, it must also have room for ‘len’
+ * elements, and is filled with the byte offset (in ‘src’) of each
+ * decoded codepoint.
+ *
+ * Ill-formed sequences (including overlong encodings, surrogates and
+ * codepoints above U+10FFFF) are replaced with U+FFFD, one for each
+ * maximal subpart, as recommended by the Unicode standard.
+ */
+size_t utf8_decode(size_t len, const char src[static len],
+                   uint32_t dst[static len], uint32_t *offsets);